@@ -64,9 +64,11 @@ SOFTWARE.
 #if defined(__cplusplus) && __cplusplus
 #define JATEMPLATE_OBJCPP	1
 #define JATEMPLATE_CPP11	__cplusplus >= 201103L
+#define JATEMPLATE_CPP17	__cplusplus >= 201703L
 #else
 #define JATEMPLATE_OBJCPP	0
 #define JATEMPLATE_CPP11	0
+#define JATEMPLATE_CPP17	0
 #endif
 
 
@@ -74,6 +76,10 @@ SOFTWARE.
 
 #if JATEMPLATE_OBJCPP
 #include <string>
+#include <algorithm>
+#endif
+#if JATEMPLATE_CPP17
+#include <string_view>
 #endif
 
 
@@ -169,13 +175,53 @@ SOFTWARE.
 	void JATAppendFromTableInBundle(NSMutableString *string, NSString *template, NSString *table, NSBundle *bundle, ...)
 		Equivalent to [string appendString:JATExpandFromTableInBundle(template, table, bundle, ...)].
 	
+	The JATAppend*() functions expand directly into the string, without
+	building a temporary string for the result.
+	
+	
+	bool JATWrite(JATSink *sink, NSString *template, ...)
+	bool JATWriteLiteral(JATSink *sink, NSString *template, ...)
+	bool JATWriteFromTable(JATSink *sink, NSString *template, NSString *table, ...)
+	bool JATWriteFromTableInBundle(JATSink *sink, NSString *template, NSString *table, NSBundle *bundle, ...)
+		Like the corresponding JATExpand*() functions, but stream the result
+		to <sink> as it is produced instead of building a string. Returns
+		false if the sink failed. See Sinks below.
+	
+	
+	std::string JATExpandUTF8(NSString *template, ...)
+	std::string JATExpandLiteralUTF8(NSString *template, ...)
+	std::string JATExpandFromTableUTF8(NSString *template, NSString *table, ...)
+	std::string JATExpandFromTableInBundleUTF8(NSString *template, NSString *table, NSBundle *bundle, ...)
+		Objective-C++ only. Like the corresponding JATExpand*() functions, but
+		return the result as UTF-8 in a std::string, without building an
+		NSString. To write into an existing string or an output iterator, use
+		JATWrite() with JATSinkWithStdString() or JATSinkWithOutputIterator().
+	
+	
+	NSString *JATExpandChecked(const char *template, ...)
+	NSString *JATExpandLiteralChecked(const char *template, ...)
+		Objective-C++ (C++17) only. Like JATExpand() and JATExpandLiteral(),
+		but <template> must be a C string literal, which is parsed at compile
+		time. Syntax errors, references to parameters that aren't passed and
+		out-of-range positional references fail a static_assert. The checks
+		are stricter than the run-time scanner: a lone } and stray characters
+		after an operator are errors too. Operator arguments aren't checked.
+		
+		JATExpandLiteralChecked() also resolves parameter references at
+		compile time, so the template isn't parsed at run time at all.
+		JATExpandChecked() checks the development language template, but the
+		localized template is looked up and parsed at run time as usual.
+	
 	
 	void JATLog(NSString *template, ...)
-		Equivalent to NSLog(@"%@", JATExpandLiteral(template, ...)).
+		Equivalent to NSLog(@"%@", JATExpandLiteral(template, ...)). After
+		JATStartAsyncLog() has been called, the expansion and logging are
+		done on a background thread instead; see Asynchronous logging below.
  
 	void JATPrint(NSString *template, ...)
 		Expand template (with localization) and write the result to stdout,
-        like printf().
+        like printf(). The JATPrint*() and JATErrorPrint*() functions stream
+        their output, so no string is built for the whole result.
  
 	void JATPrintLiteral(NSString *template, ...)
 		Expand template (without localization) and write the result to stdout,
@@ -188,12 +234,27 @@ SOFTWARE.
 		Expand template (without localization) and write the result to stderr.
 	
 	
+	void JATLogDebug(NSString *template, ...)
+	void JATLogInfo(NSString *template, ...)
+	void JATLogWarning(NSString *template, ...)
+	void JATLogError(NSString *template, ...)
+	void JATLogAtLevel(JATLogLevel level, NSString *template, ...)
+		Like JATLog(), but only if the level is enabled. If it isn't, nothing
+		past a single comparison is evaluated: no parameters are cast or
+		boxed, and the template isn't expanded. See Log levels below.
+	
+	
 	JATAssert(condition, template, ...)
 		Equivalent to NSAssert1(condition, @"%@", JATExpandLiteral(template, ...)).
 	
 	JATCAssert(condition, template, ...)
 		Equivalent to NSCAssert1(condition, @"%@", JATExpandLiteral(template, ...)).
 	
+	JATDebugAssert(condition, template, ...)
+	JATDebugCAssert(condition, template, ...)
+		Like JATAssert() and JATCAssert(), but only if kJATLogLevelDebug is
+		enabled. Otherwise, the condition is not evaluated.
+	
 	
 	The following operators are defined in JATemplateDefaultOperators. If you
 	don’t want them, JATemplate.m will work without the operators.
@@ -316,6 +377,29 @@ SOFTWARE.
 		debugdesc
 		Calls -debugDescription on the value if implemented, otherwise
 		-description. (Try it on some Foundation collections.)
+		
+		limit:
+		Limits an array, ordered set, set or dictionary to the given number of
+		elements. If any are left out, the formatted collection ends with
+		", …". Other values are passed through unchanged.
+		Example: "Recent files: {files|limit:5}"
+		
+		join:
+		Sets the separator used when formatting a collection, instead of ", ".
+		With no argument, elements are joined without a separator. Other
+		values are passed through unchanged.
+		Example: "{path|join:/}"
+		
+		each:
+		Expands the argument as a template for each element of a collection,
+		with the element as {item} and its index as {index}. For dictionaries,
+		{item} is the value and {key} is the key. Other values are treated as a
+		collection of one.
+		Example: "{tags|limit:3|each:#{item}|join: }"
+		
+		limit:, join: and each: can be combined in any order, and nothing is
+		formatted until the result is used, so each: is only applied to the
+		elements that are kept.
 */
 
 
@@ -348,12 +432,50 @@ SOFTWARE.
 	
 	If no operator implementation is found, the default implementation of
 	-jatemplatePerformOperator:withArgument: returns nil.
+	
+	The default implementation caches the method it finds (or doesn't find)
+	for each combination of receiver class and operator name. The cache is
+	invalidated automatically when code is loaded. If you add operator methods
+	at runtime by other means, such as class_addMethod(), call
+	JATInvalidateOperatorCache() afterwards. Classes that override
+	-respondsToSelector:, -forwardingTargetForSelector: or -forwardInvocation:
+	are not cached; they are asked with -respondsToSelector: and sent the
+	operator message on every use.
+*/
+- (id<JATCoercible>) jatemplatePerformOperator:(NSString *)op withArgument:(NSString *)argument variables:(NSDictionary *)variables;
+
+@end
+
+
+@interface NSProxy (JATOperatorSupport)
+
+/*	Proxies perform operators they implement themselves, and forward the rest
+	like any other message. The result is never cached.
 */
 - (id<JATCoercible>) jatemplatePerformOperator:(NSString *)op withArgument:(NSString *)argument variables:(NSDictionary *)variables;
 
 @end
 
 
+/*	void JATInvalidateOperatorCache(void)
+	
+	Discard all cached operator lookups.
+	
+	JATOperatorCacheStatistics JATGetOperatorCacheStatistics(void)
+	
+	Get the number of operator lookups which were served from the cache (hits)
+	and which had to be resolved through the runtime (misses) since launch.
+*/
+typedef struct
+{
+	NSUInteger			hits;
+	NSUInteger			misses;
+} JATOperatorCacheStatistics;
+
+FOUNDATION_EXTERN void JATInvalidateOperatorCache(void);
+FOUNDATION_EXTERN JATOperatorCacheStatistics JATGetOperatorCacheStatistics(void);
+
+
 /*	NSArray *JATSplitArgumentString(NSString *string, unichar separator)
 	
 	Split a string into components separated by <separator>, but ignore
@@ -368,6 +490,515 @@ SOFTWARE.
 NSArray *JATSplitArgumentString(NSString *string, unichar separator);
 
 
+#pragma mark - Compiled templates
+
+/*	JATCompiledTemplate
+	
+	A template string which has been parsed once into a list of literal
+	segments, substitutions and operator chains. All the JATExpand*()
+	functions compile templates on first use and keep them in a process-wide
+	cache keyed by template string, so expanding the same template again only
+	has to walk the precompiled substitutions.
+	
+	It is not normally necessary to use JATCompiledTemplate directly, but it
+	can be used to hold on to a template which must never be evicted from the
+	cache. Compiled templates are immutable and may be used from any thread.
+	
+	+compiledTemplateWithString: looks up the template in the cache, and
+	compiles and caches it if necessary. -initWithString: always compiles a
+	new template and does not use the cache.
+	
+	-expandWithParameters: is equivalent to JATExpandLiteralWithParameters().
+*/
+@interface JATCompiledTemplate: NSObject
+
++ (instancetype) compiledTemplateWithString:(NSString *)templateString;
+- (instancetype) initWithString:(NSString *)templateString;
+
+@property (readonly, nonatomic) NSString *templateString;
+
+- (NSString *) expandWithParameters:(NSDictionary *)parameters;
+
+@end
+
+
+/*	void JATSetTemplateCacheLimit(NSUInteger limit)
+	
+	Set the maximum number of compiled templates kept in the cache (default:
+	1000). Like all NSCache limits, this is not strict. A limit of 0 disables
+	caching entirely, so every expansion parses its template from scratch.
+	
+	void JATFlushTemplateCache(void)
+	
+	Remove all compiled templates from the cache.
+*/
+FOUNDATION_EXTERN void JATSetTemplateCacheLimit(NSUInteger limit);
+FOUNDATION_EXTERN void JATFlushTemplateCache(void);
+
+
+/*	JATLocalizationCacheStatistics JATGetLocalizationCacheStatistics(void)
+	
+	The localizing JATExpand*() functions cache the localized and compiled
+	template for each combination of bundle, table and key, so the bundle is
+	only consulted on first use. This cache is subject to the same limit as
+	the template cache, is emptied by JATFlushTemplateCache(), and is also
+	emptied when the current locale changes.
+	
+	Returns the number of lookups which were satisfied from the cache and the
+	number which had to go to the bundle.
+*/
+typedef struct
+{
+	NSUInteger			hits;
+	NSUInteger			misses;
+} JATLocalizationCacheStatistics;
+
+FOUNDATION_EXTERN JATLocalizationCacheStatistics JATGetLocalizationCacheStatistics(void);
+
+
+#pragma mark - Template catalogs
+
+/*	JATTemplateCatalog
+	
+	A .strings table compiled ahead of time. A catalog holds the compiled
+	form of each template in the table, including any syntax warnings, and is
+	mapped into memory when loaded, so templates are resolved from it without
+	parsing either the .strings file or the templates. Since the mapping is
+	read-only and backed by the file, its pages are shared between processes.
+	
+	The localizing JATExpand*() functions look for a catalog named
+	<table>.jatcatalog (Localizable.jatcatalog for the default table) using
+	the normal localized resource lookup, and use it in preference to the
+	.strings file. Keys which aren't in the catalog are looked up in the
+	.strings file as usual.
+	
+	Catalogs are built with the jatcatalog tool (the JATemplateCatalogTool
+	target), typically from a Run Script build phase:
+		jatcatalog en.lproj/Localizable.strings en.lproj/Localizable.jatcatalog
+	
+	The program tables are stored in their in-memory form, so a catalog can
+	only be used on the architecture it was built for (and with the same
+	version of JATemplate). +catalogWithContentsOfFile:error: fails for
+	catalogs that don't match.
+	
+	-compiledTemplateForKey: returns a new compiled template each time; the
+	JATExpand*() functions cache them like any other localized template. It
+	returns nil if the key isn't in the catalog.
+	
+	BOOL JATWriteTemplateCatalog(NSDictionary *templates, NSString *path, NSError **error)
+	
+	Compile a dictionary of templates, such as the contents of a .strings file,
+	and write them to a catalog at <path>. All keys and values must be strings.
+	
+	void JATFlushTemplateCatalogs(void)
+	
+	The catalog for each bundle and table is loaded on first use and stays
+	mapped for the life of the process, as does the fact that a table has no
+	catalog. Call this after replacing or adding a catalog file to have the
+	next lookup load it again; it also empties the localization cache.
+	Templates already compiled from a catalog keep its mapping alive until
+	they are released, so don't truncate a catalog file in place.
+*/
+@interface JATTemplateCatalog: NSObject
+
++ (instancetype) catalogWithContentsOfFile:(NSString *)path error:(NSError **)error;
+- (instancetype) initWithContentsOfFile:(NSString *)path error:(NSError **)error;
+
+@property (readonly, nonatomic) NSUInteger count;
+
+- (JATCompiledTemplate *) compiledTemplateForKey:(NSString *)key;
+
+@end
+
+FOUNDATION_EXTERN BOOL JATWriteTemplateCatalog(NSDictionary *templates, NSString *path, NSError **error);
+FOUNDATION_EXTERN void JATFlushTemplateCatalogs(void);
+
+
+#pragma mark - Sinks
+
+/*	JATSink
+	
+	A destination for streamed template expansion with JATWrite() and
+	friends. Literal text and substitutions are passed on to the sink as the
+	template is expanded; for everything except string sinks, they are
+	transcoded to UTF-8 and delivered in chunks of up to a kilobyte.
+	
+	JATSink JATSinkWithFunction(JATSinkFunction function, void *context)
+		Call <function> with each chunk. The function may use sink->context,
+		and should return false to stop the expansion.
+	
+	JATSink JATSinkWithFile(FILE *file)
+		Write to a stdio stream.
+	
+	JATSink JATSinkWithFileDescriptor(int fd)
+		Write to a file descriptor, retrying partial writes.
+	
+	JATSink JATSinkWithMutableString(NSMutableString *string)
+		Append to a mutable string (as UTF-16, with no transcoding). The string
+		is not retained.
+	
+	JATSink JATSinkWithBuffer(char *buffer, size_t size)
+		Write to a caller-provided buffer, which is always kept NUL-terminated.
+		If the output doesn't fit, it is truncated and the sink fails.
+	
+	A sink can be reused for several writes, in which case output accumulates.
+	Once a sink has failed, further writes to it do nothing.
+	
+	bool JATSinkWriteString(JATSink *sink, NSString *string)
+		Write a string to a sink without template expansion.
+*/
+typedef struct JATSink JATSink;
+typedef bool (*JATSinkFunction)(JATSink *sink, const char *bytes, size_t length);
+
+struct JATSink
+{
+	JATSinkFunction							function;
+	void									*context;
+	__unsafe_unretained NSMutableString		*string;	// For string sinks; function is not used.
+	size_t									capacity;	// For buffer sinks.
+	size_t									length;		// Number of bytes delivered so far (not used for string sinks).
+	bool									failed;
+};
+
+FOUNDATION_EXTERN JATSink JATSinkWithFunction(JATSinkFunction function, void *context);
+FOUNDATION_EXTERN JATSink JATSinkWithFile(FILE *file);
+FOUNDATION_EXTERN JATSink JATSinkWithFileDescriptor(int fd);
+FOUNDATION_EXTERN JATSink JATSinkWithMutableString(NSMutableString *string);
+FOUNDATION_EXTERN JATSink JATSinkWithBuffer(char *buffer, size_t size);
+
+FOUNDATION_EXTERN bool JATSinkWriteString(JATSink *sink, NSString *string);
+
+
+#if JATEMPLATE_OBJCPP
+/*	Objective-C++ sinks
+	
+	JATSink JATSinkWithStdString(std::string &string)
+		Append UTF-8 to a std::string.
+	
+	JATSink JATSinkWithOutputIterator(OutputIterator &iterator)
+		Write UTF-8 through an output iterator accepting char, for instance a
+		std::back_insert_iterator. The iterator is advanced in place, and must
+		outlive the sink.
+	
+	The sink fails if the destination throws an exception; exceptions are
+	not propagated through the expansion.
+*/
+inline bool JATSinkWriteToStdString(JATSink *sink, const char *bytes, size_t length)
+{
+	try
+	{
+		static_cast<std::string *>(sink->context)->append(bytes, length);
+	}
+	catch (...)
+	{
+		return false;
+	}
+	return true;
+}
+
+
+inline JATSink JATSinkWithStdString(std::string &string)
+{
+	return JATSinkWithFunction(JATSinkWriteToStdString, &string);
+}
+
+
+template <typename OutputIterator>
+bool JATSinkWriteToOutputIterator(JATSink *sink, const char *bytes, size_t length)
+{
+	OutputIterator &iterator = *static_cast<OutputIterator *>(sink->context);
+	try
+	{
+		iterator = std::copy(bytes, bytes + length, iterator);
+	}
+	catch (...)
+	{
+		return false;
+	}
+	return true;
+}
+
+
+template <typename OutputIterator>
+JATSink JATSinkWithOutputIterator(OutputIterator &iterator)
+{
+	return JATSinkWithFunction(JATSinkWriteToOutputIterator<OutputIterator>, &iterator);
+}
+#endif
+
+
+#pragma mark - Batch expansion
+
+/*	Batch expansion
+	
+	Expand one compiled template for many sets of parameters, such as the
+	rows of a report, and join the results. The template is only looked up
+	and compiled once. Large batches are split into chunks which are
+	expanded in parallel, and the chunks are joined in order, so the output
+	is the same as expanding each row in turn.
+	
+	Parameter sets can be given as rows, an array of dictionaries like those
+	passed to -expandWithParameters:, or as columns, a dictionary mapping
+	each parameter name to an array of values for all rows. The number of
+	rows is the length of the shortest column. Positional parameters refer
+	to the columns in the order of their names, so with columns "count" and
+	"name", {0} is the count.
+	
+	<separator> is written between rows, and may be nil. Operators may be
+	called from several threads at once.
+	
+	Rows which aren't dictionaries, column names which aren't strings and
+	columns which aren't arrays raise NSInvalidArgumentException before
+	anything is expanded.
+	
+	The -write... methods stream the result to a sink, and return false if
+	the sink fails. Rows are expanded a few chunks ahead of the output, so
+	a large batch isn't held in memory all at once.
+*/
+@interface JATCompiledTemplate (JATBatchExpansion)
+
+- (NSString *) expandRows:(NSArray *)rows separator:(NSString *)separator;
+- (NSString *) expandColumns:(NSDictionary *)columns separator:(NSString *)separator;
+
+- (bool) writeRows:(NSArray *)rows separator:(NSString *)separator toSink:(JATSink *)sink;
+- (bool) writeColumns:(NSDictionary *)columns separator:(NSString *)separator toSink:(JATSink *)sink;
+
+@end
+
+
+#pragma mark - Log levels
+
+/*	JATLogLevel
+	
+	The JATLogDebug() family of macros only log if their level is enabled.
+	A level is enabled if it is at least JATEMPLATE_MINIMUM_LOG_LEVEL, which
+	is fixed at compile time, and at least the runtime threshold set with
+	JATSetLogLevel().
+	
+	Levels below JATEMPLATE_MINIMUM_LOG_LEVEL are compiled out entirely. It
+	defaults to kJATLogLevelDebug, since the cost of a disabled level is a
+	single branch; define it (for instance as kJATLogLevelInfo) before
+	including JATemplate.h to remove lower levels from a build.
+	
+	The runtime threshold defaults to kJATLogLevelDebug, or kJATLogLevelInfo
+	if JATemplate is built with NDEBUG. kJATLogLevelNone disables all
+	leveled logging. JATLog() itself is not affected by levels.
+*/
+typedef enum
+{
+	kJATLogLevelDebug,
+	kJATLogLevelInfo,
+	kJATLogLevelWarning,
+	kJATLogLevelError,
+	kJATLogLevelNone
+} JATLogLevel;
+
+#ifndef JATEMPLATE_MINIMUM_LOG_LEVEL
+#define JATEMPLATE_MINIMUM_LOG_LEVEL  kJATLogLevelDebug
+#endif
+
+FOUNDATION_EXTERN void JATSetLogLevel(JATLogLevel level);
+FOUNDATION_EXTERN JATLogLevel JATGetLogLevel(void);
+
+
+#pragma mark - Asynchronous logging
+
+/*	void JATStartAsyncLog(NSUInteger capacity, JATAsyncLogPolicy policy)
+	
+	Make JATLog() asynchronous. Instead of expanding the template on the
+	calling thread, JATLog() captures the template and its already-cast
+	parameters in a lock-free queue, and a background thread expands and
+	logs them. Entries from each thread are logged in order.
+	
+	Parameters are retained, not copied, so mutable objects should not be
+	changed after being logged. Numbers and other values which are boxed by
+	the casting handlers are captured as they were at the time of the call.
+	
+	<capacity> is the number of entries the queue can hold, rounded up to a
+	power of two; it is fixed by the first call. <policy> determines what
+	happens when the queue is full:
+		kJATAsyncLogBlock: wait for the background thread to make room.
+		kJATAsyncLogDrop: discard the entry.
+		kJATAsyncLogSynchronous: expand and log on the calling thread, which
+		may log the entry ahead of older entries still in the queue.
+	
+	void JATStopAsyncLog(void)
+	
+	Make JATLog() synchronous again, and flush the queue.
+	
+	void JATSetAsyncLogPolicy(JATAsyncLogPolicy policy)
+	
+	Change the policy for full queues.
+	
+	void JATFlushAsyncLog(void)
+	
+	Log all queued entries on the calling thread before returning. This is
+	called automatically at exit(), and can be called from crash reporting
+	paths such as uncaught exception handlers (but not signal handlers).
+	
+	JATAsyncLogStatistics JATGetAsyncLogStatistics(void)
+	
+	Returns the number of entries which have been logged asynchronously and
+	the number which were dropped because the queue was full.
+*/
+typedef enum
+{
+	kJATAsyncLogBlock,
+	kJATAsyncLogDrop,
+	kJATAsyncLogSynchronous
+} JATAsyncLogPolicy;
+
+typedef struct
+{
+	NSUInteger			written;
+	NSUInteger			dropped;
+} JATAsyncLogStatistics;
+
+FOUNDATION_EXTERN void JATStartAsyncLog(NSUInteger capacity, JATAsyncLogPolicy policy);
+FOUNDATION_EXTERN void JATStopAsyncLog(void);
+FOUNDATION_EXTERN void JATSetAsyncLogPolicy(JATAsyncLogPolicy policy);
+FOUNDATION_EXTERN void JATFlushAsyncLog(void);
+FOUNDATION_EXTERN JATAsyncLogStatistics JATGetAsyncLogStatistics(void);
+
+
+#pragma mark - Instrumentation
+
+/*	Instrumentation
+	
+	If JATemplate is built with JATEMPLATE_INSTRUMENTATION defined to 1, it
+	can record where expansion time goes. Instrumentation is compiled out by
+	default, in which case the functions below do nothing and snapshots are
+	empty. When it is compiled in but not enabled, the cost is one branch
+	per expansion and per operator call.
+	
+	Counters are kept per thread and merged when a snapshot is taken. The
+	JATemplateTests target is built with instrumentation compiled in.
+	
+	void JATSetInstrumentationEnabled(bool enabled)
+	bool JATGetInstrumentationEnabled(void)
+	
+	Start or stop recording. JATGetInstrumentationEnabled() always returns
+	false if instrumentation is compiled out.
+	
+	NSDictionary *JATGetInstrumentationSnapshot(bool reset)
+	
+	Returns the counters recorded so far, and resets them as
+	JATResetInstrumentation() does if <reset> is true. The result has two keys:
+		templates: an array with a dictionary for each template string,
+		  sorted by total time. Each has the keys template, count,
+		  totalNanoseconds, p50Nanoseconds, p99Nanoseconds, outputBytes and
+		  warnings. The percentiles are approximate, to within 25%.
+		  outputBytes counts UTF-8 for byte sinks and UTF-16 otherwise.
+		  Nested expansions (for instance, from if:) are counted separately
+		  and are included in the time of the enclosing template.
+		operators: an array with a dictionary for each operator name, with
+		  the keys operator, count and totalNanoseconds.
+	
+	void JATResetInstrumentation(void)
+	
+	Zero all counters, and forget the templates and operators seen so far.
+	
+	NSString *JATInstrumentationSnapshotJSON(NSDictionary *snapshot)
+	
+	Format a snapshot as JSON.
+*/
+FOUNDATION_EXTERN void JATSetInstrumentationEnabled(bool enabled);
+FOUNDATION_EXTERN bool JATGetInstrumentationEnabled(void);
+FOUNDATION_EXTERN NSDictionary *JATGetInstrumentationSnapshot(bool reset);
+FOUNDATION_EXTERN void JATResetInstrumentation(void);
+FOUNDATION_EXTERN NSString *JATInstrumentationSnapshotJSON(NSDictionary *snapshot);
+
+
+#pragma mark - Warnings
+
+/*	Syntax warnings
+	
+	In debug builds (or if JATemplate is built with JATEMPLATE_SYNTAX_WARNINGS
+	defined to 1), problems such as unknown parameters or malformed operator
+	arguments are logged. A warning is identified by its template and the
+	kind of problem, and is logged at most once per interval; repeats within
+	the interval are counted, and the count is included with the next report.
+	Messages are only formatted when they are reported.
+	
+	void JATSetWarningInterval(NSTimeInterval interval)
+	NSTimeInterval JATGetWarningInterval(void)
+	
+	Set the minimum time between reports of the same warning. The default is
+	ten seconds. 0 reports every occurrence without keeping track of
+	warnings, and INFINITY reports each warning only once.
+	
+	JATWarningStatistics JATGetWarningStatistics(void)
+	
+	Returns the number of warnings raised and the number of those that were
+	reported. Counters are kept even when reports are suppressed, so this can
+	be used to monitor production builds with a long interval.
+	
+	void JATResetWarningRateLimits(void)
+	
+	Forget which warnings have been reported, so that the next occurrence of
+	each is reported. The statistics are not reset.
+*/
+typedef struct
+{
+	NSUInteger							occurrences;	// Warnings raised.
+	NSUInteger							reported;		// Warnings logged. The others were repeats within the interval.
+} JATWarningStatistics;
+
+FOUNDATION_EXTERN void JATSetWarningInterval(NSTimeInterval interval);
+FOUNDATION_EXTERN NSTimeInterval JATGetWarningInterval(void);
+FOUNDATION_EXTERN JATWarningStatistics JATGetWarningStatistics(void);
+FOUNDATION_EXTERN void JATResetWarningRateLimits(void);
+
+
+#pragma mark - Plural rules
+
+/*	Plural rules
+	
+	The plurals: operator picks a word form using the CLDR plural rules of a
+	language, so translators list the forms their language has rather than
+	choosing a rule number. For example, an English template might use
+	{count|plurals:minute;minutes}, and its Polish translation
+	{count|plurals:minuta;minuty;minut;minuty}.
+	
+	void JATSetPluralLocale(NSString *localeIdentifier)
+	NSString *JATGetPluralLocale(void)
+	
+	Set or get the locale whose rules are used. By default, this is the main
+	bundle's preferred localization, which is the language templates are
+	normally loaded in. Pass nil to restore the default.
+	
+	The plurals: operator is implemented in JATemplateDefaultOperators.m,
+	along with these functions.
+*/
+FOUNDATION_EXTERN void JATSetPluralLocale(NSString *localeIdentifier);
+FOUNDATION_EXTERN NSString *JATGetPluralLocale(void);
+
+
+#pragma mark - Collection formatting
+
+/*	Collection formatting
+	
+	Arrays, ordered sets, sets and dictionaries are coerced to strings by
+	coercing their elements and joining them with ", ". Dictionary entries
+	are formatted as "key: value". The limit:, join: and each: operators
+	change how this is done without formatting anything up front, so
+	{items|limit:10} only looks at ten elements however large items is.
+	
+	void JATSetCollectionOutputLimit(NSUInteger length)
+	NSUInteger JATGetCollectionOutputLimit(void)
+	
+	Set or get the maximum length of a formatted collection. Once it is
+	reached, no more elements are formatted. If the limit falls inside an
+	element, the result is cut there and ends with "…"; otherwise it ends
+	with the separator and "…", as with limit:. The default is
+	NSUIntegerMax, meaning no limit.
+	The trunc: and fit: operators use a tighter limit for collections when
+	they truncate at the end, since the rest would be thrown away.
+*/
+FOUNDATION_EXTERN void JATSetCollectionOutputLimit(NSUInteger length);
+FOUNDATION_EXTERN NSUInteger JATGetCollectionOutputLimit(void);
+
+
 #pragma mark - JATCoercible protocol
 
 @protocol JATCoercible <NSObject>
@@ -381,8 +1012,9 @@ NSArray *JATSplitArgumentString(NSString *string, unichar separator);
 	for insertion in the template.
 	
 	The default implementation calls -description. Overridden for NSNumber to
-	use locale-sensitive NSNumberFormatterDecimalStyle, and for NSNull to
-	return @"(null)".
+	use locale-sensitive NSNumberFormatterDecimalStyle, for NSNull to
+	return @"(null)", and for collections as described under Collection
+	formatting above.
 */
 - (NSString *) jatemplateCoerceToString;
 
@@ -429,17 +1061,137 @@ NSArray *JATSplitArgumentString(NSString *string, unichar separator);
 	{NS|CG}{Point|Size|Rect}. (Note that the struct operators are not
 	internationalized.)
 	
-	In Objective-C++, std::string is also supported.
+	In Objective-C++, std::string and (in C++17) std::string_view are also
+	supported.
+	
+	Handlers defined with JATDefineCast() return an object. Handlers defined
+	with JATDefineValueCast() return a JATParameterValue, which can hold a
+	number, boolean or C string without boxing it; the built-in number and
+	C string handlers work this way. Unboxed integers and booleans are
+	formatted directly when substituted without operators, and are only
+	converted to objects when an operator needs one.
+	
+	A UTF-8 value refers to the caller's bytes, which must stay valid until
+	the expansion is complete; C strings, std::string and std::string_view
+	are not copied when they are cast. When a UTF-8 value is substituted
+	without operators into a sink other than a string sink, its bytes are
+	written straight to the sink. A NULL C string or invalid UTF-8 is
+	treated as nil.
 */
+typedef enum
+{
+	kJATParameterObject,
+	kJATParameterSigned,
+	kJATParameterUnsigned,
+	kJATParameterDouble,
+	kJATParameterBool,
+	kJATParameterUTF8
+} JATParameterKind;
+
+typedef struct
+{
+	JATParameterKind				kind;
+	union
+	{
+		__unsafe_unretained id		object;
+		long long					signedValue;
+		unsigned long long			unsignedValue;
+		double						doubleValue;
+		bool						boolValue;
+		struct
+		{
+			const char				*bytes;
+			size_t					length;
+		}							UTF8;
+	}								value;
+} JATParameterValue;
+
+
 #if JATEMPLATE_OBJCPP
-#define JATDefineCast(TYPE) \
-	inline id<JATCoercible> JATCastParameter(TYPE value)
+#define JATEMPLATE_INLINE  inline
+#define JATEMPLATE_OVERLOADABLE  inline
 #else
-#define JATDefineCast(TYPE) \
-	__attribute__((overloadable)) static inline id<JATCoercible> JATCastParameter(TYPE value)
+#define JATEMPLATE_INLINE  static inline
+#define JATEMPLATE_OVERLOADABLE  __attribute__((overloadable)) static inline
 #endif
 
 
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithObject(id object)
+{
+	// The value doesn't own its object, so keep it alive for the rest of the expression.
+	__autoreleasing id autoreleased = object;
+	JATParameterValue result;
+	result.kind = kJATParameterObject;
+	result.value.object = autoreleased;
+	return result;
+}
+
+
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithSigned(long long value)
+{
+	JATParameterValue result;
+	result.kind = kJATParameterSigned;
+	result.value.signedValue = value;
+	return result;
+}
+
+
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithUnsigned(unsigned long long value)
+{
+	JATParameterValue result;
+	result.kind = kJATParameterUnsigned;
+	result.value.unsignedValue = value;
+	return result;
+}
+
+
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithDouble(double value)
+{
+	JATParameterValue result;
+	result.kind = kJATParameterDouble;
+	result.value.doubleValue = value;
+	return result;
+}
+
+
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithBool(bool value)
+{
+	JATParameterValue result;
+	result.kind = kJATParameterBool;
+	result.value.boolValue = value;
+	return result;
+}
+
+
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithUTF8Bytes(const char *bytes, size_t length)
+{
+	JATParameterValue result;
+	result.kind = kJATParameterUTF8;
+	result.value.UTF8.bytes = bytes;
+	result.value.UTF8.length = length;
+	return result;
+}
+
+
+JATEMPLATE_INLINE JATParameterValue JATParameterValueWithUTF8String(const char *value)
+{
+	return JATParameterValueWithUTF8Bytes(value, (value != NULL) ? strlen(value) : 0);
+}
+
+
+/*	JATDefineCast(TYPE) is followed by the body of a function returning an
+	object, as before. It is wrapped in a JATCastParameter() overload that
+	returns a JATParameterValue.
+*/
+#define JATDefineValueCast(TYPE) \
+	JATEMPLATE_OVERLOADABLE JATParameterValue JATCastParameter(TYPE value)
+
+#define JATDefineCast(TYPE) \
+	JATEMPLATE_OVERLOADABLE id<JATCoercible> JATCastObject(TYPE value); \
+	JATDefineValueCast(TYPE) { return JATParameterValueWithObject(JATCastObject(value)); } \
+	JATEMPLATE_OVERLOADABLE id<JATCoercible> JATCastObject(TYPE value)
+
+
 JATDefineCast(id)
 {
 	return value;
@@ -464,111 +1216,123 @@ JATDefineCast(CFBooleanRef)
 }
 
 
-JATDefineCast(const char *)
+JATDefineValueCast(const char *)
 {
-	return @(value);
+	return JATParameterValueWithUTF8String(value);
 }
 
 
 #if JATEMPLATE_OBJCPP
-JATDefineCast(const std::string &)
+JATDefineValueCast(const std::string &)
+{
+	return JATParameterValueWithUTF8Bytes(value.data(), value.size());
+}
+#endif
+
+
+#if JATEMPLATE_CPP17
+JATDefineValueCast(std::string_view)
 {
-	return @(value.c_str());
+	return JATParameterValueWithUTF8Bytes(value.data(), value.size());
 }
 #endif
 
 
-JATDefineCast(char)
+JATDefineValueCast(char)
 {
-	return @(value);
+	return JATParameterValueWithSigned(value);
 }
 
 
-JATDefineCast(signed char)
+JATDefineValueCast(signed char)
 {
-	return @(value);
+	return JATParameterValueWithSigned(value);
 }
 
 
-JATDefineCast(unsigned char)
+JATDefineValueCast(unsigned char)
 {
-	return @(value);
+	return JATParameterValueWithUnsigned(value);
 }
 
 
-JATDefineCast(signed short)
+JATDefineValueCast(signed short)
 {
-	return @(value);
+	return JATParameterValueWithSigned(value);
 }
 
 
-JATDefineCast(unsigned short)
+JATDefineValueCast(unsigned short)
 {
-	return @(value);
+	return JATParameterValueWithUnsigned(value);
 }
 
 
-JATDefineCast(signed int)
+JATDefineValueCast(signed int)
 {
-	return @(value);
+	return JATParameterValueWithSigned(value);
 }
 
 
-JATDefineCast(unsigned int)
+JATDefineValueCast(unsigned int)
 {
-	return @(value);
+	return JATParameterValueWithUnsigned(value);
 }
 
 
-JATDefineCast(signed long)
+JATDefineValueCast(signed long)
 {
-	return @(value);
+	return JATParameterValueWithSigned(value);
 }
 
 
-JATDefineCast(unsigned long)
+JATDefineValueCast(unsigned long)
 {
-	return @(value);
+	return JATParameterValueWithUnsigned(value);
 }
 
 
-JATDefineCast(signed long long)
+JATDefineValueCast(signed long long)
 {
-	return @(value);
+	return JATParameterValueWithSigned(value);
 }
 
 
-JATDefineCast(unsigned long long)
+JATDefineValueCast(unsigned long long)
 {
-	return @(value);
+	return JATParameterValueWithUnsigned(value);
 }
 
 
-JATDefineCast(float)
+JATDefineValueCast(float)
 {
-	return @(value);
+#if JATEMPLATE_OBJCPP
+	return JATParameterValueWithDouble(static_cast<double>(value));
+#else
+	return JATParameterValueWithDouble((double)value);
+#endif
 }
 
 
-JATDefineCast(double)
+JATDefineValueCast(double)
 {
-	return @(value);
+	return JATParameterValueWithDouble(value);
 }
 
 
-JATDefineCast(long double)
+JATDefineValueCast(long double)
 {
 #if JATEMPLATE_OBJCPP
-	return [NSNumber numberWithDouble:static_cast<double>(value)];
+	return JATParameterValueWithDouble(static_cast<double>(value));
 #else
-	return [NSNumber numberWithDouble:(double)value];
+	return JATParameterValueWithDouble((double)value);
 #endif
 }
 
 
-JATDefineCast(bool)
+JATDefineValueCast(bool)
 {
-	return value ? @YES : @NO;
+	return JATParameterValueWithBool(value);
 }
 
 
@@ -614,9 +1378,9 @@ JATDefineCast(NSRange)
 
 
 #if JATEMPLATE_CPP11
-JATDefineCast(std::nullptr_t)
+JATDefineValueCast(std::nullptr_t)
 {
-	return nil;
+	return JATParameterValueWithObject(nil);
 }
 #endif
 
@@ -629,20 +1393,113 @@ JATDefineCast(std::nullptr_t)
 	JATExpand[Literal]WithParameters() instead.
 */
 typedef __unsafe_unretained NSString *JATNameArray[];
-typedef __autoreleasing id<JATCoercible> JATParameterArray[];
+typedef JATParameterValue JATParameterValueArray[];
+typedef __autoreleasing id<JATCoercible> JATParameterArray[];	// Used by the entry points for older headers.
 
 
-/*	JAT_DoExpandTemplateUsingMacroKeysAndValues()
-	JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues()
+/*	JATCallSite
+	
+	Per-call-site cache used by the JATExpand() family. Each use of one of the
+	macros declares a static JATCallSite, and the first expansion through it
+	stores the parsed parameter names there so later calls don't have to parse
+	them again. The contents are private to JATemplate.
+*/
+typedef struct
+{
+	void						*parsedNames;
+} JATCallSite;
+
+
+/*	JAT_DoExpandTemplateUsingCallSite()
+	JAT_DoLocalizeAndExpandTemplateUsingCallSite()
 	
 	The actual implementations of the JATExpand() family, with and without
-	localization.
+	localization. <names> must be the same each time a given <callSite> is
+	used.
+	
+	JAT_DoExpandTemplateUsingMacroKeysAndValues()
+	JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues()
+	
+	Equivalents without a call site cache, for code compiled against older
+	versions of the header.
+*/
+FOUNDATION_EXTERN NSString *JAT_DoExpandTemplateUsingCallSite(NSString *templateString, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count);
+
+FOUNDATION_EXTERN NSString *JAT_DoLocalizeAndExpandTemplateUsingCallSite(NSString *templateString, NSBundle *bundle, NSString *localizationTable, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count);
+
+/*	JAT_DoExpandTemplateToSinkUsingCallSite()
+	JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite()
+	
+	The actual implementations of the JATWrite() family.
 */
+FOUNDATION_EXTERN bool JAT_DoExpandTemplateToSinkUsingCallSite(JATSink *sink, NSString *templateString, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count);
+
+FOUNDATION_EXTERN bool JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite(JATSink *sink, NSString *templateString, NSBundle *bundle, NSString *localizationTable, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count);
+
+FOUNDATION_EXTERN void JAT_DoLogTemplateUsingCallSite(NSString *templateString, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count);
+
 FOUNDATION_EXTERN NSString *JAT_DoExpandTemplateUsingMacroKeysAndValues(NSString *templateString, JATNameArray names, JATParameterArray objects, NSUInteger count);
 
 FOUNDATION_EXTERN NSString *JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues(NSString *templateString, NSBundle *bundle, NSString *localizationTable, JATNameArray names, JATParameterArray objects, NSUInteger count);
 
 
+/*	JATLoweredTemplate
+	
+	A template parsed at compile time by JATExpandLiteralChecked(). Literal
+	text and substitutions are segments of the template, in order, with
+	offsets in UTF-16 code units. Substitutions refer to their parameter by
+	index and to their operators by range. {{ and }} escapes are folded into
+	the surrounding literal segments.
+*/
+typedef struct
+{
+	uint32_t					start;			// Literal text, or the whole substitution including braces.
+	uint32_t					length;
+	int32_t						parameter;		// Parameter index, or -1 for literal text.
+	uint32_t					firstOperation;
+	uint32_t					operationCount;
+} JATLoweredSegment;
+
+
+typedef struct
+{
+	uint32_t					nameStart;
+	uint32_t					nameLength;
+	uint32_t					argumentStart;
+	uint32_t					argumentLength;
+	bool						hasArgument;
+} JATLoweredOperation;
+
+
+typedef struct
+{
+	const JATLoweredSegment		*segments;
+	NSUInteger					segmentCount;
+	const JATLoweredOperation	*operations;
+	NSUInteger					operationCount;
+} JATLoweredTemplate;
+
+
+/*	JATLoweredCallSite
+	
+	Per-call-site cache for JATExpandLiteralChecked(), holding the parsed
+	names and the run-time form of the lowered template.
+*/
+typedef struct
+{
+	JATCallSite					names;
+	void						*program;
+} JATLoweredCallSite;
+
+
+/*	JAT_DoExpandLoweredTemplateUsingCallSite()
+	
+	The actual implementation of JATExpandLiteralChecked(). <lowered> must
+	have been produced from <templateString> by JATLowerTemplate().
+*/
+FOUNDATION_EXTERN NSString *JAT_DoExpandLoweredTemplateUsingCallSite(NSString *templateString, const JATLoweredTemplate *lowered, JATLoweredCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count);
+
+
 /*	These macros convert an argument list (foo, bar, baz) to a name array
 	{@"foo", @"bar", @"baz"}.
 */
@@ -650,27 +1507,34 @@ FOUNDATION_EXTERN NSString *JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValu
 #define JATEMPLATE_NAMES_FROM_ARGS(...)  (JATNameArray){ JATEMPLATE_MAP(JATEMPLATE_NAME_FROM_ARG, __VA_ARGS__) }
 
 /*	This macro converts an argument list (foo, bar, baz) to a parmeter
-	array with JACastParameter() calls.
+	array with JATCastParameter() calls.
 */
-#define JATEMPLATE_COERCE_PARAMETERS(...) (JATParameterArray){ JATEMPLATE_MAP(JATCastParameter, __VA_ARGS__) }
+#define JATEMPLATE_COERCE_PARAMETERS(...) (JATParameterValueArray){ JATEMPLATE_MAP(JATCastParameter, __VA_ARGS__) }
+
+
+/*	This macro evaluates EXPR (which may refer to jatemplateCallSite) with
+	a static call site cache. Statement expressions are a GNU extension, hence
+	the -Wgnu note above.
+*/
+#define JATEMPLATE_WITH_CALL_SITE(EXPR)  ({ static JATCallSite jatemplateCallSite; EXPR; })
 
 
 // The real API.
 #define JATExpand(TEMPLATE, ...) \
-	JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues(TEMPLATE, nil, nil, \
-	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__))
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLocalizeAndExpandTemplateUsingCallSite(TEMPLATE, nil, nil, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
 
 #define JATExpandLiteral(TEMPLATE, ...) \
-	JAT_DoExpandTemplateUsingMacroKeysAndValues(TEMPLATE, \
-	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__))
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoExpandTemplateUsingCallSite(TEMPLATE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
 
 #define JATExpandFromTable(TEMPLATE, TABLE, ...) \
-	JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues(TEMPLATE, nil, TABLE, \
-	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__))
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLocalizeAndExpandTemplateUsingCallSite(TEMPLATE, nil, TABLE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
 
 #define JATExpandFromTableInBundle(TEMPLATE, TABLE, BUNDLE, ...) \
-	JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues(TEMPLATE, BUNDLE, TABLE, \
-	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__))
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLocalizeAndExpandTemplateUsingCallSite(TEMPLATE, BUNDLE, TABLE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
 
 #define JATExpandWithParameters(TEMPLATE, PARAMETERS) \
 	JATExpandFromTableInBundleWithParameters(TEMPLATE, nil, nil, PARAMETERS)
@@ -683,31 +1547,382 @@ FOUNDATION_EXTERN NSString *JATExpandLiteralWithParameters(NSString *templateStr
 FOUNDATION_EXTERN NSString *JATExpandFromTableInBundleWithParameters(NSString *templateString, NSString *localizationTable, NSBundle *bundle, NSDictionary *parameters);
 
 
+#define JATWrite(SINK, TEMPLATE, ...) \
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite(SINK, TEMPLATE, nil, nil, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
+
+#define JATWriteLiteral(SINK, TEMPLATE, ...) \
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoExpandTemplateToSinkUsingCallSite(SINK, TEMPLATE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
+
+#define JATWriteFromTable(SINK, TEMPLATE, TABLE, ...) \
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite(SINK, TEMPLATE, nil, TABLE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
+
+#define JATWriteFromTableInBundle(SINK, TEMPLATE, TABLE, BUNDLE, ...) \
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite(SINK, TEMPLATE, BUNDLE, TABLE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
+
+
+/*	This macro makes a temporary sink which can be passed to JATWrite().
+*/
+#define JATEMPLATE_TEMPORARY_SINK(SINK)  ((JATSink[]){ SINK })
+
+
 #define JATAppend(MSTRING, TEMPLATE, ...) \
-	[MSTRING appendString:JATExpand(TEMPLATE, __VA_ARGS__)]
+	((void)JATWrite(JATEMPLATE_TEMPORARY_SINK(JATSinkWithMutableString(MSTRING)), TEMPLATE, __VA_ARGS__))
 
 #define JATAppendLiteral(MSTRING, TEMPLATE, ...) \
-	[MSTRING appendString:JATExpandLiteral(TEMPLATE, __VA_ARGS__)]
+	((void)JATWriteLiteral(JATEMPLATE_TEMPORARY_SINK(JATSinkWithMutableString(MSTRING)), TEMPLATE, __VA_ARGS__))
 
 #define JATAppendFromTable(MSTRING, TEMPLATE, TABLE, ...) \
-	[MSTRING appendString:JATExpandFromTable(TEMPLATE, TABLE, __VA_ARGS__)]
+	((void)JATWriteFromTable(JATEMPLATE_TEMPORARY_SINK(JATSinkWithMutableString(MSTRING)), TEMPLATE, TABLE, __VA_ARGS__))
 
 #define JATAppendFromTableInBundle(MSTRING, TEMPLATE, TABLE, BUNDLE, ...) \
-	[MSTRING appendString:JATExpandFromTableInBundle(TEMPLATE, TABLE, BUNDLE, __VA_ARGS__)]
+	((void)JATWriteFromTableInBundle(JATEMPLATE_TEMPORARY_SINK(JATSinkWithMutableString(MSTRING)), TEMPLATE, TABLE, BUNDLE, __VA_ARGS__))
+
+
+#if JATEMPLATE_OBJCPP
+#define JATExpandUTF8(TEMPLATE, ...) \
+	({ std::string jatemplateUTF8; JATWrite(JATEMPLATE_TEMPORARY_SINK(JATSinkWithStdString(jatemplateUTF8)), TEMPLATE, __VA_ARGS__); jatemplateUTF8; })
+
+#define JATExpandLiteralUTF8(TEMPLATE, ...) \
+	({ std::string jatemplateUTF8; JATWriteLiteral(JATEMPLATE_TEMPORARY_SINK(JATSinkWithStdString(jatemplateUTF8)), TEMPLATE, __VA_ARGS__); jatemplateUTF8; })
+
+#define JATExpandFromTableUTF8(TEMPLATE, TABLE, ...) \
+	({ std::string jatemplateUTF8; JATWriteFromTable(JATEMPLATE_TEMPORARY_SINK(JATSinkWithStdString(jatemplateUTF8)), TEMPLATE, TABLE, __VA_ARGS__); jatemplateUTF8; })
+
+#define JATExpandFromTableInBundleUTF8(TEMPLATE, TABLE, BUNDLE, ...) \
+	({ std::string jatemplateUTF8; JATWriteFromTableInBundle(JATEMPLATE_TEMPORARY_SINK(JATSinkWithStdString(jatemplateUTF8)), TEMPLATE, TABLE, BUNDLE, __VA_ARGS__); jatemplateUTF8; })
+#endif
+
+
+#define JATLog(TEMPLATE, ...) \
+	JATEMPLATE_WITH_CALL_SITE(JAT_DoLogTemplateUsingCallSite(TEMPLATE, &jatemplateCallSite, \
+	JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)))
+
+/*	JATLogLevelEnabled() is a constant false for levels below the minimum, so
+	the compiler can remove the whole statement. Otherwise it reads the
+	runtime threshold inline through JAT_LoadLogLevelThreshold(), which
+	behaves like JATGetLogLevel() without a call. JAT_LogLevelThreshold is
+	only exported for that function; change it with JATSetLogLevel().
+*/
+FOUNDATION_EXTERN JATLogLevel JAT_LogLevelThreshold;
+
+JATEMPLATE_INLINE JATLogLevel JAT_LoadLogLevelThreshold(void)
+{
+	return __atomic_load_n(&JAT_LogLevelThreshold, __ATOMIC_RELAXED);
+}
+
+#define JATLogLevelEnabled(LEVEL) \
+	((LEVEL) >= JATEMPLATE_MINIMUM_LOG_LEVEL && (LEVEL) >= JAT_LoadLogLevelThreshold())
 
+#define JATLogAtLevel(LEVEL, TEMPLATE, ...) \
+	do { if (JATLogLevelEnabled(LEVEL))  JATLog(TEMPLATE, __VA_ARGS__); } while (0)
 
-#define JATLog(TEMPLATE, ...)  NSLog(@"%@", JATExpandLiteral(TEMPLATE, __VA_ARGS__))
+#define JATLogDebug(TEMPLATE, ...)  JATLogAtLevel(kJATLogLevelDebug, TEMPLATE, __VA_ARGS__)
+#define JATLogInfo(TEMPLATE, ...)  JATLogAtLevel(kJATLogLevelInfo, TEMPLATE, __VA_ARGS__)
+#define JATLogWarning(TEMPLATE, ...)  JATLogAtLevel(kJATLogLevelWarning, TEMPLATE, __VA_ARGS__)
+#define JATLogError(TEMPLATE, ...)  JATLogAtLevel(kJATLogLevelError, TEMPLATE, __VA_ARGS__)
 
 FOUNDATION_EXTERN void JATPrintToFile(NSString *composedString, FILE *file);
-#define JATPrint(TEMPLATE, ...)  JATPrintToFile(JATExpand(TEMPLATE, __VA_ARGS__), stdout)
-#define JATPrintLiteral(TEMPLATE, ...)  JATPrintToFile(JATExpandLiteral(TEMPLATE, __VA_ARGS__), stdout)
-#define JATErrorPrint(TEMPLATE, ...)  JATPrintToFile(JATExpand(TEMPLATE, __VA_ARGS__), stderr)
-#define JATErrorPrintLiteral(TEMPLATE, ...)  JATPrintToFile(JATExpandLiteral(TEMPLATE, __VA_ARGS__), stderr)
+#define JATPrint(TEMPLATE, ...)  ((void)JATWrite(JATEMPLATE_TEMPORARY_SINK(JATSinkWithFile(stdout)), TEMPLATE, __VA_ARGS__))
+#define JATPrintLiteral(TEMPLATE, ...)  ((void)JATWriteLiteral(JATEMPLATE_TEMPORARY_SINK(JATSinkWithFile(stdout)), TEMPLATE, __VA_ARGS__))
+#define JATErrorPrint(TEMPLATE, ...)  ((void)JATWrite(JATEMPLATE_TEMPORARY_SINK(JATSinkWithFile(stderr)), TEMPLATE, __VA_ARGS__))
+#define JATErrorPrintLiteral(TEMPLATE, ...)  ((void)JATWriteLiteral(JATEMPLATE_TEMPORARY_SINK(JATSinkWithFile(stderr)), TEMPLATE, __VA_ARGS__))
 
 
 #define JATAssert(CONDITION, TEMPLATE, ...)  NSAssert1(CONDITION, @"%@", JATExpandLiteral(TEMPLATE, __VA_ARGS__))
 #define JATCAssert(CONDITION, TEMPLATE, ...)  NSCAssert1(CONDITION, @"%@", JATExpandLiteral(TEMPLATE, __VA_ARGS__))
 
+#define JATDebugAssert(CONDITION, TEMPLATE, ...) \
+	do { if (JATLogLevelEnabled(kJATLogLevelDebug))  JATAssert(CONDITION, TEMPLATE, __VA_ARGS__); } while (0)
+#define JATDebugCAssert(CONDITION, TEMPLATE, ...) \
+	do { if (JATLogLevelEnabled(kJATLogLevelDebug))  JATCAssert(CONDITION, TEMPLATE, __VA_ARGS__); } while (0)
+
+
+#if JATEMPLATE_CPP17
+/*	Compile-time template checking.
+	
+	JATCheckTemplate() follows the scanner in JATemplateCore.m, but anything
+	the scanner would warn about or silently skip is an error. Positions are
+	tracked in UTF-8 bytes while scanning, since every character with a
+	meaning in template syntax is ASCII, and converted to UTF-16 offsets for
+	the segment tables. The same scanner fills in the tables for
+	JATLowerTemplate(), once JATCheckTemplate() has counted them.
+*/
+enum JATCheckedTemplateStatus
+{
+	kJATCheckedTemplateOK,
+	kJATCheckedTemplateSyntaxError,
+	kJATCheckedTemplateUnknownName,
+	kJATCheckedTemplatePositionalOutOfRange
+};
+
+
+struct JATCheckedTemplate
+{
+	JATCheckedTemplateStatus	status;
+	uint32_t					segmentCount;
+	uint32_t					operationCount;
+};
+
+
+template <uint32_t SegmentCount, uint32_t OperationCount>
+struct JATLoweredTables
+{
+	JATLoweredSegment			segments[SegmentCount > 0 ? SegmentCount : 1];
+	JATLoweredOperation			operations[OperationCount > 0 ? OperationCount : 1];
+};
+
+
+constexpr bool JATCheckedIsIdentifierStartChar(char value)
+{
+	return value == '$' || value == '_' || (value >= 'A' && value <= 'Z') || (value >= 'a' && value <= 'z');
+}
+
+
+constexpr bool JATCheckedIsPositionalChar(char value)
+{
+	return value >= '0' && value <= '9';
+}
+
+
+constexpr bool JATCheckedIsIdentifierChar(char value)
+{
+	return JATCheckedIsIdentifierStartChar(value) || JATCheckedIsPositionalChar(value);
+}
+
+
+constexpr bool JATCheckedIsWhitespace(char value)
+{
+	return value == ' ' || value == '\t' || value == '\n' || value == '\r' || value == '\v' || value == '\f';
+}
+
+
+// Returns the end of the identifier starting at <start>, or <start> if there isn't one.
+constexpr size_t JATCheckedScanIdentifier(std::string_view string, size_t start)
+{
+	if (start >= string.size() || !JATCheckedIsIdentifierStartChar(string[start]))  return start;
+
+	size_t end = start + 1;
+	while (end < string.size() && JATCheckedIsIdentifierChar(string[end]))  end++;
+	return end;
+}
+
+
+// Equivalent of JATParseOneName(): "@( foo )" -> "foo", and anything that isn't an identifier has no name.
+constexpr std::string_view JATCheckedParameterName(std::string_view argument)
+{
+	if (argument.size() > 3 && argument[0] == '@' && argument[1] == '(' && argument.back() == ')')
+	{
+		argument = argument.substr(2, argument.size() - 3);
+		while (!argument.empty() && JATCheckedIsWhitespace(argument.front()))  argument.remove_prefix(1);
+		while (!argument.empty() && JATCheckedIsWhitespace(argument.back()))  argument.remove_suffix(1);
+	}
+
+	if (argument.empty() || JATCheckedScanIdentifier(argument, 0) != argument.size())  return std::string_view();
+	return argument;
+}
+
+
+// As at run time, the last of several parameters with the same name wins.
+constexpr int32_t JATCheckedFindParameter(std::string_view name, const std::string_view names[], size_t count)
+{
+	for (size_t idx = count; idx-- > 0; )
+	{
+		if (JATCheckedParameterName(names[idx]) == name)  return static_cast<int32_t>(idx);
+	}
+	return -1;
+}
+
+
+constexpr uint32_t JATCheckedUTF16Offset(std::string_view string, size_t byteOffset)
+{
+	uint32_t result = 0;
+	for (size_t idx = 0; idx < byteOffset; idx++)
+	{
+		unsigned char byte = static_cast<unsigned char>(string[idx]);
+		if ((byte & 0xC0) != 0x80)  result++;	// ASCII or the first byte of a sequence.
+		if (byte >= 0xF0)  result++;			// Four-byte sequences need a surrogate pair.
+	}
+	return result;
+}
+
+
+constexpr void JATCheckedAddSegment(JATCheckedTemplate &result, JATLoweredSegment *segments, std::string_view string, size_t start, size_t end, int32_t parameter, uint32_t firstOperation, uint32_t operationCount)
+{
+	if (segments != nullptr)
+	{
+		uint32_t start16 = JATCheckedUTF16Offset(string, start);
+		segments[result.segmentCount] = JATLoweredSegment{ start16, JATCheckedUTF16Offset(string, end) - start16, parameter, firstOperation, operationCount };
+	}
+	result.segmentCount++;
+}
+
+
+constexpr JATCheckedTemplate JATCheckedFail(JATCheckedTemplateStatus status)
+{
+	return JATCheckedTemplate{ status, 0, 0 };
+}
+
+
+constexpr JATCheckedTemplate JATScanCheckedTemplate(std::string_view string, const std::string_view names[], size_t count, JATLoweredSegment *segments, JATLoweredOperation *operations)
+{
+	JATCheckedTemplate result = { kJATCheckedTemplateOK, 0, 0 };
+	size_t length = string.size();
+	size_t literalStart = 0;
+	size_t cursor = 0;
+
+	for (;;)
+	{
+		// Find the next brace. A brace in the last position is literal text.
+		size_t position = cursor;
+		while (position + 1 < length && string[position] != '{' && string[position] != '}')  position++;
+		if (position + 1 >= length)  break;
+
+		if (string[position] == '}' || string[position + 1] == '{')
+		{
+			/*	{{ or }}. The run-time scanner lets a } escape any character,
+				but a lone } is almost certainly a mistake.
+			*/
+			if (string[position + 1] != string[position])  return JATCheckedFail(kJATCheckedTemplateSyntaxError);
+
+			// Keep the first brace as part of the literal text and skip the second.
+			JATCheckedAddSegment(result, segments, string, literalStart, position + 1, -1, 0, 0);
+			literalStart = cursor = position + 2;
+			continue;
+		}
+
+		// Find the balancing close brace.
+		size_t closing = position + 1;
+		for (size_t balanceCount = 1; ; closing++)
+		{
+			if (closing >= length)  return JATCheckedFail(kJATCheckedTemplateSyntaxError);
+			if (string[closing] == '{')  balanceCount++;
+			if (string[closing] == '}' && --balanceCount == 0)  break;
+		}
+
+		size_t keyStart = position + 1;
+		if (closing == keyStart)  return JATCheckedFail(kJATCheckedTemplateSyntaxError);
+
+		// The key is an identifier or a positional reference.
+		int32_t parameter = -1;
+		size_t keyEnd = JATCheckedScanIdentifier(string, keyStart);
+		if (keyEnd > keyStart)
+		{
+			parameter = JATCheckedFindParameter(string.substr(keyStart, keyEnd - keyStart), names, count);
+			if (parameter < 0)  return JATCheckedFail(kJATCheckedTemplateUnknownName);
+		}
+		else
+		{
+			size_t index = 0;
+			for (; keyEnd < closing && JATCheckedIsPositionalChar(string[keyEnd]); keyEnd++)
+			{
+				// Saturate at count, which is out of range anyway.
+				index = index * 10 + static_cast<size_t>(string[keyEnd] - '0');
+				if (index > count)  index = count;
+			}
+			if (keyEnd == keyStart)  return JATCheckedFail(kJATCheckedTemplateSyntaxError);
+			if (index >= count)  return JATCheckedFail(kJATCheckedTemplatePositionalOutOfRange);
+			parameter = static_cast<int32_t>(index);
+		}
+
+		// Everything else must be operators.
+		uint32_t firstOperation = result.operationCount;
+		size_t operatorCursor = keyEnd;
+		while (operatorCursor < closing)
+		{
+			if (string[operatorCursor] != '|')  return JATCheckedFail(kJATCheckedTemplateSyntaxError);
+
+			size_t nameStart = operatorCursor + 1;
+			size_t nameEnd = JATCheckedScanIdentifier(string, nameStart);
+			if (nameEnd == nameStart)  return JATCheckedFail(kJATCheckedTemplateSyntaxError);
+
+			size_t argumentStart = nameEnd, argumentEnd = nameEnd;
+			bool hasArgument = string[nameEnd] == ':';
+			operatorCursor = nameEnd;
+			if (hasArgument)
+			{
+				// Everything up to the next | or } at nesting level 1 is the argument.
+				argumentStart = ++operatorCursor;
+				for (size_t balanceCount = 1; operatorCursor < length; operatorCursor++)
+				{
+					if (string[operatorCursor] == '{')  balanceCount++;
+					if (balanceCount == 1 && (string[operatorCursor] == '|' || string[operatorCursor] == '}'))  break;
+					if (string[operatorCursor] == '}')  balanceCount--;
+				}
+				argumentEnd = operatorCursor;
+			}
+
+			if (operations != nullptr)
+			{
+				uint32_t name16 = JATCheckedUTF16Offset(string, nameStart);
+				uint32_t argument16 = JATCheckedUTF16Offset(string, argumentStart);
+				operations[result.operationCount] = JATLoweredOperation
+				{
+					name16,
+					JATCheckedUTF16Offset(string, nameEnd) - name16,
+					argument16,
+					JATCheckedUTF16Offset(string, argumentEnd) - argument16,
+					hasArgument
+				};
+			}
+			result.operationCount++;
+		}
+
+		if (position > literalStart)  JATCheckedAddSegment(result, segments, string, literalStart, position, -1, 0, 0);
+		JATCheckedAddSegment(result, segments, string, position, closing + 1, parameter, firstOperation, result.operationCount - firstOperation);
+		literalStart = cursor = closing + 1;
+	}
+
+	if (length > literalStart)  JATCheckedAddSegment(result, segments, string, literalStart, length, -1, 0, 0);
+	return result;
+}
+
+
+constexpr JATCheckedTemplate JATCheckTemplate(std::string_view string, const std::string_view names[], size_t count)
+{
+	return JATScanCheckedTemplate(string, names, count, nullptr, nullptr);
+}
+
+
+template <uint32_t SegmentCount, uint32_t OperationCount>
+constexpr JATLoweredTables<SegmentCount, OperationCount> JATLowerTemplate(std::string_view string, const std::string_view names[], size_t count)
+{
+	JATLoweredTables<SegmentCount, OperationCount> result = {};
+	JATScanCheckedTemplate(string, names, count, result.segments, result.operations);
+	return result;
+}
+
+
+/*	The names are stringized without the @, so they're constant expressions.
+	The leading empty name keeps the array non-empty when there are no
+	parameters.
+*/
+#define JATEMPLATE_CHECKED_NAME_FROM_ARG(ITEM)  #ITEM
+
+#define JATEMPLATE_CHECK_TEMPLATE(TEMPLATE, ...) \
+	static constexpr std::string_view jatemplateCheckedNames[] = { "", JATEMPLATE_MAP(JATEMPLATE_CHECKED_NAME_FROM_ARG, __VA_ARGS__) }; \
+	static constexpr JATCheckedTemplate jatemplateChecked = JATCheckTemplate(TEMPLATE, jatemplateCheckedNames + 1, JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)); \
+	static_assert(jatemplateChecked.status != kJATCheckedTemplateSyntaxError, "Syntax error in template."); \
+	static_assert(jatemplateChecked.status != kJATCheckedTemplateUnknownName, "Template refers to a parameter which isn't passed."); \
+	static_assert(jatemplateChecked.status != kJATCheckedTemplatePositionalOutOfRange, "Template uses an out-of-range positional reference.")
+
+#define JATExpandChecked(TEMPLATE, ...) \
+	({ JATEMPLATE_CHECK_TEMPLATE(TEMPLATE, __VA_ARGS__); JATExpand(@TEMPLATE, ##__VA_ARGS__); })
+
+#define JATExpandLiteralChecked(TEMPLATE, ...) \
+	({ \
+		JATEMPLATE_CHECK_TEMPLATE(TEMPLATE, __VA_ARGS__); \
+		static constexpr auto jatemplateTables = JATLowerTemplate<jatemplateChecked.segmentCount, jatemplateChecked.operationCount>(TEMPLATE, jatemplateCheckedNames + 1, JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)); \
+		static constexpr JATLoweredTemplate jatemplateLowered = { jatemplateTables.segments, jatemplateChecked.segmentCount, jatemplateTables.operations, jatemplateChecked.operationCount }; \
+		static JATLoweredCallSite jatemplateCallSite; \
+		JAT_DoExpandLoweredTemplateUsingCallSite(@TEMPLATE, &jatemplateLowered, &jatemplateCallSite, \
+		JATEMPLATE_NAMES_FROM_ARGS(__VA_ARGS__), JATEMPLATE_COERCE_PARAMETERS(__VA_ARGS__), JATEMPLATE_ARGUMENT_COUNT(__VA_ARGS__)); \
+	})
+#endif
+
 
 /*
 	Evil macro magic.
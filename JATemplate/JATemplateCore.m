@@ -25,6 +25,25 @@ SOFTWARE.
 */
 
 #import "JATemplateInternal.h"
+#import <objc/runtime.h>
+#import <objc/message.h>
+#import <pthread.h>
+#import <unistd.h>
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+
+#if __APPLE__
+#import <mach-o/dyld.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define JATEMPLATE_SCAN_SSE2	1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define JATEMPLATE_SCAN_NEON	1
+#endif
 
 #if !__has_feature(objc_arc)
 #error This file requires ARC.
@@ -36,43 +55,153 @@ enum
 };
 
 
-static NSString *JATExpandInternal(const unichar *stringBuffer, NSUInteger length, NSDictionary *parameters, NSString *template);
-static NSDictionary *JATBuildParameterDictionary(JATNameArray names, JATParameterArray objects, NSUInteger expectedCount);
+/*	JATParsedNames
+	
+	Parsed parameter names cached in a JATCallSite. The names' characters
+	follow the names array in the same allocation.
+*/
+typedef struct
+{
+	NSUInteger					count;
+	JATParameterName			names[];
+} JATParsedNames;
+
+static void JATParseParameterNames(JATNameArray names, NSUInteger count, unichar *buffer, JATParameterName *outNames);
+static JATParameterName JATParseOneName(const unichar *characters, NSUInteger length);
+static NSUInteger JATTotalNameLength(JATNameArray names, NSUInteger count);
+static const JATParsedNames *JATCallSiteParsedNames(JATCallSite *callSite, JATNameArray names, NSUInteger count);
+static JATCompiledTemplate *JATLocalizedTemplate(NSString *key, NSString *table, NSBundle *bundle);
+static NSString *JATExpandUsingCallSite(JATCompiledTemplate *compiled, NSString *template, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count, JATSink *sink);
+static NSString *JATExpandWithParsedNames(JATCompiledTemplate *compiled, NSString *template, const JATParameterName *names, const JATParameterValue values[], NSUInteger count, JATSink *sink);
 
-static bool IsIdentifierStartChar(unichar value);
-static bool IsIdentifierChar(unichar value);
-static bool IsPositionalChar(unichar value);
+static inline bool IsIdentifierStartChar(unichar value);
+static inline bool IsIdentifierChar(unichar value);
+static inline bool IsPositionalChar(unichar value);
+static NSUInteger JATFindBrace(const unichar characters[], NSUInteger start, NSUInteger end);
 static bool ScanIdentifier(const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger *outEnd);
 static NSNumber *ReadPositional(const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger *outLength);
+#if JATEMPLATE_SYNTAX_WARNINGS || JATEMPLATE_INSTRUMENTATION
+static uint64_t JATMonotonicNanoseconds(void);
+#endif
 
 
 #pragma mark - Public
 
 /*
-	JAT_DoExpandTemplateUsingMacroKeysAndValues(template, names, paddedObjectArray, expectedCount)
+	JAT_DoExpandTemplateUsingCallSite(template, callSite, names, values, expectedCount)
 
 		- template is the string to expand - for example, @"foo = {foo}, bar = {bar}".
+		- callSite is a static cache for the parsed names.
 		- names is an array of stringified, preprocessed arguments, for example
 		  { @"foo", @"bar" }. Note that the preprocessor will remove comments
 		  and trime whitespace from the ends for us.
-		- objects is an array of the parameter values.
+		- values is an array of the parameter values.
 		- expectedCount is the number of parameters.
 */
+NSString *JAT_DoExpandTemplateUsingCallSite(NSString *template, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger expectedCount)
+{
+	NSCParameterAssert(template != nil);
+
+	return JATExpandUsingCallSite(nil, template, callSite, names, values, expectedCount, NULL);
+}
+
+
+/*
+	JAT_DoLocalizeAndExpandTemplateUsingCallSite(...)
+
+	Equivalent to using one of the NSLocalizedString macro family before calling
+	JAT_DoExpandTemplateUsingCallSite().
+*/
+NSString *JAT_DoLocalizeAndExpandTemplateUsingCallSite(NSString *template, NSBundle *bundle, NSString *localizationTable, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count)
+{
+	NSCParameterAssert(template != nil);
+
+	JATCompiledTemplate *compiled = JATLocalizedTemplate(template, localizationTable, bundle);
+	if (compiled == nil)  return nil;
+
+	return JATExpandUsingCallSite(compiled, compiled.templateString, callSite, names, values, count, NULL);
+}
+
+
+/*
+	JAT_DoExpandTemplateToSinkUsingCallSite(sink, template, callSite, names, values, expectedCount)
+
+	Like JAT_DoExpandTemplateUsingCallSite(), but streams the result to
+	<sink>.
+*/
+bool JAT_DoExpandTemplateToSinkUsingCallSite(JATSink *sink, NSString *template, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger expectedCount)
+{
+	NSCParameterAssert(sink != NULL);
+	NSCParameterAssert(template != nil);
+
+	if (sink->failed)  return false;
+
+	JATExpandUsingCallSite(nil, template, callSite, names, values, expectedCount, sink);
+	return !sink->failed;
+}
+
+
+/*
+	JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite(...)
+
+	Equivalent to using one of the NSLocalizedString macro family before calling
+	JAT_DoExpandTemplateToSinkUsingCallSite().
+*/
+bool JAT_DoLocalizeAndExpandTemplateToSinkUsingCallSite(JATSink *sink, NSString *template, NSBundle *bundle, NSString *localizationTable, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count)
+{
+	NSCParameterAssert(sink != NULL);
+	NSCParameterAssert(template != nil);
+
+	if (sink->failed)  return false;
+
+	JATCompiledTemplate *compiled = JATLocalizedTemplate(template, localizationTable, bundle);
+	if (compiled == nil)  return false;
+
+	JATExpandUsingCallSite(compiled, compiled.templateString, callSite, names, values, count, sink);
+	return !sink->failed;
+}
+
+
+/*
+	JAT_DoExpandTemplateUsingMacroKeysAndValues(template, names, paddedObjectArray, expectedCount)
+
+	Like JAT_DoExpandTemplateUsingCallSite(), but parses the names on every
+	call.
+*/
 NSString *JAT_DoExpandTemplateUsingMacroKeysAndValues(NSString *template, JATNameArray names, JATParameterArray objects, NSUInteger expectedCount)
 {
 	NSCParameterAssert(template != nil);
 	NSCParameterAssert(names != nil);
 	NSCParameterAssert(objects != NULL || expectedCount == 0);
 
-	/*	Non-optimization: it's tempting to short-circuit here if there are no
-		parameters, but that breaks if there are {{/}} escapes.
-	*/
+	NSUInteger nameLength = JATTotalNameLength(names, expectedCount);
 
-	// Build dictionary of parametes and hand off to Boring Mode.
-	NSDictionary *parameters = JATBuildParameterDictionary(names, objects, expectedCount);
-	if (parameters == nil)  return template;
+	bool useHeapAllocation = nameLength > kStackStringLimit;
+	unichar stackBuffer[useHeapAllocation ? 1 : MAX(nameLength, (NSUInteger)1)];
+	unichar *nameBuffer = stackBuffer;
+	if (useHeapAllocation)
+	{
+		nameBuffer = malloc(sizeof *nameBuffer * nameLength);
+		if (nameBuffer == NULL)  return nil;
+	}
+
+	@try
+	{
+		JATParameterName parsedNames[MAX(expectedCount, (NSUInteger)1)];
+		JATParseParameterNames(names, expectedCount, nameBuffer, parsedNames);
+
+		JATParameterValue values[MAX(expectedCount, (NSUInteger)1)];
+		for (NSUInteger idx = 0; idx < expectedCount; idx++)
+		{
+			values[idx] = (JATParameterValue){ .kind = kJATParameterObject, .value.object = objects[idx] };
+		}
 
-	return JATExpandLiteralWithParameters(template, parameters);
+		return JATExpandWithParsedNames(nil, template, parsedNames, values, expectedCount, NULL);
+	}
+	@finally
+	{
+		if (useHeapAllocation)  free(nameBuffer);
+	}
 }
 
 
@@ -84,9 +213,8 @@ NSString *JAT_DoExpandTemplateUsingMacroKeysAndValues(NSString *template, JATNam
 */
 NSString *JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues(NSString *template, NSBundle *bundle, NSString *localizationTable, JATNameArray names, JATParameterArray objects, NSUInteger count)
 {
-	// Perform the equivalent of NSLocalizedString*().
-	if (bundle == nil)  bundle = [NSBundle mainBundle];
-	template = [bundle localizedStringForKey:template value:@"" table:localizationTable];
+	template = JATLocalizedTemplate(template, localizationTable, bundle).templateString;
+	if (template == nil)  return nil;
 
 	return JAT_DoExpandTemplateUsingMacroKeysAndValues(template, names, objects, count);
 }
@@ -94,31 +222,34 @@ NSString *JAT_DoLocalizeAndExpandTemplateUsingMacroKeysAndValues(NSString *templ
 
 NSString *JATExpandLiteralWithParameters(NSString *template, NSDictionary *parameters)
 {
-	__block NSString *result;
-	JATWithCharacters(template, ^(const unichar characters[], NSUInteger length)
-	{
-		result = JATExpandInternal(characters, length, parameters, template);
-	});
-	return result;
+	if (template == nil)  return nil;
+
+	JATCompiledTemplate *compiled = [JATCompiledTemplate compiledTemplateWithString:template];
+	if (compiled == nil)  return nil;
+
+	JATParameterFrame frame = JATParameterFrameWithDictionary(parameters);
+	return JATExpandCompiledTemplate(compiled, template, &frame);
 }
 
 
 NSString *JATExpandFromTableInBundleWithParameters(NSString *template, NSString *localizationTable, NSBundle *bundle, NSDictionary *parameters)
 {
-	// Perform the equivalent of NSLocalizedString*().
-	if (bundle == nil)  bundle = [NSBundle mainBundle];
-	template = [bundle localizedStringForKey:template value:@"" table:localizationTable];
-	
-	return JATExpandLiteralWithParameters(template, parameters);
+	if (template == nil)  return nil;
+
+	JATCompiledTemplate *compiled = JATLocalizedTemplate(template, localizationTable, bundle);
+	if (compiled == nil)  return nil;
+
+	JATParameterFrame frame = JATParameterFrameWithDictionary(parameters);
+	return JATExpandCompiledTemplate(compiled, compiled.templateString, &frame);
 }
 
 
 NSArray *JATSplitArgumentString(NSString *string, unichar separator)
 {
 	__block NSArray *result;
-	JATWithCharacters(string, ^(const unichar characters[], NSUInteger length)
+	JATWithCharacterSpan(string, ^(JATCharacterSpan span)
 	{
-		result = JATSplitStringInternal(string, separator, '{', '}', characters, length, true);
+		result = JATSplitStringInternal(string, separator, '{', '}', span, true);
 	});
 	return result;	
 }
@@ -126,593 +257,5109 @@ NSArray *JATSplitArgumentString(NSString *string, unichar separator)
 
 void JATPrintToFile(NSString *composedString, FILE *file)
 {
-	fputs([composedString UTF8String], file);
+	JATSink sink = JATSinkWithFile(file);
+	JATSinkWriteString(&sink, composedString);
 }
 
 
-#pragma mark - Template parsing
+#pragma mark - Sinks
 
-static NSString *JATExpandOneSub(const unichar characters[], NSUInteger length, NSUInteger idx, NSUInteger *replaceLength, NSDictionary *parameters);
-static NSString *JATExpandOneSimpleSub(const unichar characters[], NSUInteger length, NSUInteger keyStart, NSUInteger keyLength, NSDictionary *parameters);
-static NSString *JATExpandOnePositionalSub(const unichar characters[], NSUInteger length, NSUInteger keyStart, NSUInteger keyLength, NSDictionary *parameters);
-static NSString *JATExpandOneFancyPantsSub(const unichar characters[], NSUInteger length, NSUInteger keyStart, NSUInteger keyLength, NSDictionary *parameters);
+/*	JATSinkWriter
 
-static void JATAppendCharacters(NSMutableString *buffer, const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger end);
+	Staging buffer used while streaming to a sink. UTF-16 text is transcoded
+	into the buffer, which is passed to the sink function whenever it fills
+	up and when the writer is flushed. String sinks bypass the buffer.
+*/
+enum
+{
+	kJATSinkChunkSize			= 1024,	// Bytes of UTF-8 passed to a sink function at a time.
+	kJATSinkCharacterChunkSize	= 256	// Characters extracted from an NSString at a time.
+};
 
 
-/*
-	JATExpandInternal(characters, length, parameters, template)
-	
-	Parse a template string and substitute the parameters. In other words, do
-	the actual work after the faffing about parsing names and so forth.
-*/
-static NSString *JATExpandInternal(const unichar characters[], NSUInteger length, NSDictionary *parameters, NSString *template)
+typedef struct
 {
-	NSCParameterAssert(characters != NULL);
-	
-	// Nothing to expand in an empty string, and the length-1 thing below would be trouble.
-	if (length == 0)  return @"";
-	
-	@autoreleasepool
-	{
-		NSMutableString *result;
-		
-		/*	Beginning of current range of non-special characters. When we encounter
-			a substitution, we'll be copying from here forward.
-		*/
-		NSUInteger copyRangeStart = 0;
-		
-		/*	The iteration limit is length - 1 because every valid substitution is at
-			least 3 characters long. This way, characters[idx + 1] is always valid.
-		*/
-		for (NSUInteger idx = 0; idx < length - 1; idx++)
-		{
-			NSString *replacement = nil;
-			NSUInteger replaceLength = 0;
-			unichar thisChar = characters[idx];
-			
-			if (thisChar == '{')
-			{
-				replacement = JATExpandOneSub(characters, length, idx, &replaceLength, parameters);
-			}
-			else if (thisChar == '}')
-			{
-				// Detect }} as escape code for }
-				replaceLength = 2;
-				replacement = @"}";
-			}
-			// Other types of replacement can easily be chained here.
-			
-			if (replacement != nil)
-			{
-				NSCAssert(replaceLength != 0, @"Internal bug in JATemplate: substitution length is zero, which will lead to an infinite loop.");
-				
-				if (idx == 0 && replaceLength == length)
-				{
-					// Replacing entire template in one pop.
-					return replacement;
-				}
-				
-				if (result == nil)  result = [NSMutableString string];
-				
-				// Write the pending literal segment to result.
-				JATAppendCharacters(result, characters, length, copyRangeStart, idx);
-				[result appendString:replacement];
-				
-				// Skip over replaced part and start a new literal segment.
-				idx += replaceLength - 1;
-				copyRangeStart = idx + 1;
-			}
-		}
-		
-		if (copyRangeStart == 0)
-		{
-			// No substitutions made.
-			return template;
-		}
-		else
-		{
-			// Append any trailing literal segment.
-			JATAppendCharacters(result, characters, length, copyRangeStart, length);
-			return result;
-		}
-	}
-}
+	JATSink						*sink;
+	size_t						used;
+	char						buffer[kJATSinkChunkSize];
+} JATSinkWriter;
 
 
-static NSString *JATExpandOneSub(const unichar characters[], NSUInteger length, NSUInteger idx, NSUInteger *replaceLength, NSDictionary *parameters)
+static void JATSinkWriterFlush(JATSinkWriter *writer)
 {
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(idx < length - 1);
-	NSCParameterAssert(replaceLength != NULL);
-	NSCParameterAssert(characters[idx] == '{');
-	
-	// Detect {{ as escape code for {
-	if (characters[idx + 1] == '{')
+	JATSink *sink = writer->sink;
+	size_t used = writer->used;
+	writer->used = 0;
+
+	if (used == 0 || sink->failed)  return;
+
+	if (sink->function(sink, writer->buffer, used))
 	{
-		*replaceLength = 2;
-		return @"{";
+		sink->length += used;
 	}
-	
-	// Find the balancing close brace.
-	NSUInteger end, balanceCount = 1;
-	bool isIdentifier = IsIdentifierStartChar(characters[idx + 1]);
-	bool isPositional = IsPositionalChar(characters[idx + 1]);
-	
-	for (end = idx + 1; end < length && balanceCount > 0; end++)
+	else
 	{
-		if (characters[end] == '}')  balanceCount--;
-		if (characters[end] == '{')  balanceCount++;
-		if (balanceCount > 0)
-		{
-			isIdentifier = isIdentifier && IsIdentifierChar(characters[end]);
-			isPositional = isPositional && IsPositionalChar(characters[end]);
-		}
+		sink->failed = true;
 	}
-	
-	// Fail if no balancing bracket. (Not asserted since input is format string.)
-	if (balanceCount != 0)
+}
+
+
+static void JATSinkWriterAppendBytes(JATSinkWriter *writer, const char *bytes, size_t length)
+{
+	if (writer->used + length > kJATSinkChunkSize)
 	{
-		JATWarn(characters, length, @"Unbalanced braces in template string.");
-		return nil;
+		JATSinkWriterFlush(writer);
 	}
-	
-	*replaceLength = end - idx;
-	NSUInteger keyStart = idx + 1, keyLength = *replaceLength - 2;
-	if (keyLength == 0)
+
+	if (length > kJATSinkChunkSize)
 	{
-		JATWarn(characters, length, @"Empty substitution expression in template string. To silence this message, use {{{{}}}} instead of {{}}.");
-		return nil;
+		// Too big to be worth buffering.
+		JATSink *sink = writer->sink;
+		if (sink->failed)  return;
+		if (sink->function(sink, bytes, length))  sink->length += length;
+		else  sink->failed = true;
+		return;
 	}
-	
-	@autoreleasepool
+
+	memcpy(writer->buffer + writer->used, bytes, length);
+	writer->used += length;
+}
+
+
+/*	JATIsValidUTF8(bytes, length)
+
+	Check that bytes are well-formed UTF-8, with the same rules as
+	CFStringCreateWithBytes(): no overlong forms, surrogates or code points
+	above U+10FFFF.
+*/
+static bool JATIsValidUTF8(const char *bytes, size_t length)
+{
+	const unsigned char *next = (const unsigned char *)bytes;
+	const unsigned char *end = next + length;
+
+	while (next < end)
 	{
-		if (isIdentifier)
+		unsigned char lead = *next++;
+		if (lead < 0x80)  continue;
+
+		size_t trailCount;
+		unsigned char min = 0x80, max = 0xBF;	// Range of the first trail byte.
+		if (lead >= 0xC2 && lead <= 0xDF)  trailCount = 1;
+		else if (lead >= 0xE0 && lead <= 0xEF)
 		{
-			return JATExpandOneSimpleSub(characters, length, keyStart, keyLength, parameters);
+			trailCount = 2;
+			if (lead == 0xE0)  min = 0xA0;
+			else if (lead == 0xED)  max = 0x9F;
 		}
-		else if (isPositional)
+		else if (lead >= 0xF0 && lead <= 0xF4)
 		{
-			return JATExpandOnePositionalSub(characters, length, keyStart, keyLength, parameters);
+			trailCount = 3;
+			if (lead == 0xF0)  min = 0x90;
+			else if (lead == 0xF4)  max = 0x8F;
 		}
-		else
+		else  return false;
+
+		if ((size_t)(end - next) < trailCount)  return false;
+		if (next[0] < min || next[0] > max)  return false;
+		for (size_t idx = 1; idx < trailCount; idx++)
 		{
-			return JATExpandOneFancyPantsSub(characters, length, keyStart, keyLength, parameters);
+			if ((next[idx] & 0xC0) != 0x80)  return false;
 		}
+		next += trailCount;
 	}
+
+	return true;
 }
 
 
-/*
-	JATExpandOneSimpleSub()
-	
-	Handles cases where the substitution token is a simple identifier.
-*/
-static NSString *JATExpandOneSimpleSub(const unichar characters[], NSUInteger length, NSUInteger keyStart, NSUInteger keyLength, NSDictionary *parameters)
+static void JATSinkWriterAppendCharacters(JATSinkWriter *writer, const unichar characters[], NSUInteger length)
 {
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(keyStart < length);
-	NSCParameterAssert(keyStart + keyLength < length);
-	
-	NSString *identifier = [NSString stringWithCharacters:characters + keyStart length:keyLength];
-	id value = parameters[identifier];
-	if (value == nil)
+	JATSink *sink = writer->sink;
+	if (length == 0 || sink->failed)  return;
+
+	if (sink->string != nil)
 	{
-		JATWarn(characters, length, @"Template substitution uses unknown parameter \"{identifier}\".", identifier);
+		CFStringAppendCharacters((__bridge CFMutableStringRef)sink->string, characters, (CFIndex)length);
+		return;
 	}
-	return [value jatemplateCoerceToString];
-}
 
-
-/*
-	JATExpandOnePositionalSub()
-	
-	Handles cases where the substitution token is a simple positional reference.
-*/
-static NSString *JATExpandOnePositionalSub(const unichar characters[], NSUInteger length, NSUInteger keyStart, NSUInteger keyLength, NSDictionary *parameters)
-{
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(keyStart < length);
-	NSCParameterAssert(keyStart + keyLength < length);
-	
-	NSNumber *key = ReadPositional(characters, length, keyStart, NULL);
-	NSCAssert(key != nil, @"Failed to scan positional reference that has already been identified as valid.");
-	
-	id value = parameters[key];
-	if (value == nil)
+	for (NSUInteger idx = 0; idx < length; idx++)
 	{
-		JATWarn(characters, length, @"Template substitution uses out-of-range positional reference @{key}.", key);
-	}
-	return [value jatemplateCoerceToString];
-}
+		if (writer->used + 4 > kJATSinkChunkSize)
+		{
+			JATSinkWriterFlush(writer);
+			if (sink->failed)  return;
+		}
 
+		char *out = writer->buffer + writer->used;
+		uint32_t c = characters[idx];
 
-/*
-	JATExpandOneFancyPantsSub()
-	
-	Handles cases where the substitution token is something other than a simple
-	identifier. Length is guaranteed not to be zero.
-*/
-static NSString *JATExpandOneFancyPantsSub(const unichar characters[], NSUInteger length, NSUInteger keyStart, NSUInteger keyLength, NSDictionary *parameters)
-{
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(keyStart < length);
-	NSCParameterAssert(length > 0);
-	NSCParameterAssert(keyStart + keyLength < length);
-	
-	id value = nil;
-	NSUInteger cursor = keyStart;
-	
-	bool isIdentifier = ScanIdentifier(characters, length, cursor, &keyLength);
-	if (isIdentifier)
-	{
-		NSString *identifier = [NSString stringWithCharacters:characters + cursor length:keyLength];
-		value = parameters[identifier];
-		
-		if (value == nil)
+		if (c < 0x80)
 		{
-			JATWarn(characters, length, @"Template substitution uses unknown parameter \"{identifier}\".", identifier);
-			return nil;
+			out[0] = (char)c;
+			writer->used += 1;
+			continue;
 		}
-		
-		cursor += keyLength;
-	}
-	else if (IsPositionalChar(characters[cursor]))
-	{
-		NSNumber *positional = ReadPositional(characters, length, cursor, &keyLength);
-		if (positional != nil)
+
+		if (c >= 0xD800 && c <= 0xDBFF && idx + 1 < length && characters[idx + 1] >= 0xDC00 && characters[idx + 1] <= 0xDFFF)
 		{
-			value = parameters[positional];
-			
-			if (value == nil)
-			{
-				JATWarn(characters, length, @"Template substitution uses out-of-range positional reference @{positional}.", positional);
-				return nil;
-			}
-			
-			cursor += keyLength;
+			c = 0x10000 + ((c - 0xD800) << 10) + (characters[idx + 1] - 0xDC00u);
+			idx++;
+		}
+		else if (c >= 0xD800 && c <= 0xDFFF)
+		{
+			// Unpaired surrogate.
+			c = 0xFFFD;
+		}
+
+		if (c < 0x800)
+		{
+			out[0] = (char)(0xC0 | (c >> 6));
+			out[1] = (char)(0x80 | (c & 0x3F));
+			writer->used += 2;
+		}
+		else if (c < 0x10000)
+		{
+			out[0] = (char)(0xE0 | (c >> 12));
+			out[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+			out[2] = (char)(0x80 | (c & 0x3F));
+			writer->used += 3;
+		}
+		else
+		{
+			out[0] = (char)(0xF0 | (c >> 18));
+			out[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+			out[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+			out[3] = (char)(0x80 | (c & 0x3F));
+			writer->used += 4;
 		}
-		// else fall through to syntax error.
 	}
-	
-	if (value == nil)
+}
+
+
+static void JATSinkWriterAppendString(JATSinkWriter *writer, NSString *string)
+{
+	JATSink *sink = writer->sink;
+	if (sink->failed)  return;
+
+	if (sink->string != nil)
 	{
-		JATWarn(characters, length, @"Unknown template substitution syntax {{{0}}}.", [NSString stringWithCharacters:characters + keyStart length:keyLength]);
-		return nil;
+		[sink->string appendString:string];
+		return;
 	}
-	
-	// At this point, we expect one or more bars, each followed by an operator expression.
-	if (characters[cursor] != '|')
+
+	CFStringRef cfString = (__bridge CFStringRef)string;
+	// CF only hands out a UTF-8 pointer to eight-bit ASCII storage, so there is one byte per character. The length comes from the string, since it may contain NULs.
+	const char *utf8 = CFStringGetCStringPtr(cfString, kCFStringEncodingUTF8);
+	if (utf8 != NULL)
 	{
-		JATWarn(characters, length, @"Unexpected character '{0}' in template substitution {{{1}}}.", [NSString stringWithCharacters:characters + cursor length:1], [NSString stringWithCharacters:characters + keyStart length:keyLength]);
-		return nil;
+		JATSinkWriterAppendBytes(writer, utf8, (size_t)CFStringGetLength(cfString));
+		return;
 	}
-	
-	while (value != nil && characters[cursor] == '|')
+
+	NSUInteger length = string.length;
+	unichar characters[kJATSinkCharacterChunkSize];
+	for (NSUInteger start = 0; start < length && !sink->failed; )
 	{
-		cursor++;
-		NSUInteger opLength;
-		isIdentifier = ScanIdentifier(characters, length, cursor, &opLength);
-		if (!isIdentifier)
-		{
-			JATWarn(characters, length, @"Expected identifier after | in {{{0}}}.", [NSString stringWithCharacters:characters + keyStart length:keyLength]);
-			return nil;
-		}
-		
-		NSString *operator = [NSString stringWithCharacters:characters + cursor length:opLength];
-		cursor += opLength;
-		
-		NSString *argument = nil;
-		if (characters[cursor] == ':')
+		NSUInteger count = MIN(length - start, (NSUInteger)kJATSinkCharacterChunkSize);
+		CFStringGetCharacters(cfString, CFRangeMake((CFIndex)start, (CFIndex)count), characters);
+
+		// Don't split surrogate pairs between chunks.
+		if (start + count < length && count > 1 && characters[count - 1] >= 0xD800 && characters[count - 1] <= 0xDBFF)
 		{
-			// Everything up to the next | or } at nesting level 1 is the argument.
-			cursor++;
-			NSUInteger argStart = cursor;
-			NSUInteger balanceCount = 1;
-			for (; cursor < length; cursor++)
-			{
-				if (characters[cursor] == '{')  balanceCount++;
-				if (balanceCount == 1)
-				{
-					if (characters[cursor] == '|' || characters[cursor] == '}')
-					{
-						break;
-					}
-				}
-				
-				if (characters[cursor] == '}')  balanceCount--;
-			}
-			
-			argument = [NSString stringWithCharacters:characters + argStart length:cursor - argStart];
+			count--;
 		}
-		
-		value = [value jatemplatePerformOperator:operator withArgument:argument variables:parameters];
+
+		JATSinkWriterAppendCharacters(writer, characters, count);
+		start += count;
 	}
-	
-	return [value jatemplateCoerceToString];
 }
 
 
-#pragma mark - Utilities
+static bool JATSinkWriteToFile(JATSink *sink, const char *bytes, size_t length)
+{
+	return fwrite(bytes, 1, length, (FILE *)sink->context) == length;
+}
+
 
-NSArray *JATSplitStringInternal(NSString *string, unichar separator, unichar balanceStart, unichar balanceEnd, const unichar *stringBuffer, NSUInteger length, bool printWarnings)
+static bool JATSinkWriteToFileDescriptor(JATSink *sink, const char *bytes, size_t length)
 {
-	NSUInteger spanStart = 0;
-	NSMutableArray *result = [NSMutableArray array];
-	NSUInteger balanceCount = 0;
+	int fd = (int)(intptr_t)sink->context;
+	while (length > 0)
+	{
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)  continue;
+			return false;
+		}
+
+		bytes += written;
+		length -= (size_t)written;
+	}
+
+	return true;
+}
+
+
+static bool JATSinkWriteToBuffer(JATSink *sink, const char *bytes, size_t length)
+{
+	char *buffer = sink->context;
+	size_t available = sink->capacity - 1 - sink->length;
+	size_t count = MIN(length, available);
+
+	memcpy(buffer + sink->length, bytes, count);
+	buffer[sink->length + count] = '\0';
+
+	if (count < length)
+	{
+		// Truncated. Account for the part that fit, since we're about to fail.
+		sink->length += count;
+		return false;
+	}
+
+	return true;
+}
+
+
+JATSink JATSinkWithFunction(JATSinkFunction function, void *context)
+{
+	NSCParameterAssert(function != NULL);
+
+	return (JATSink){ .function = function, .context = context };
+}
+
+
+JATSink JATSinkWithFile(FILE *file)
+{
+	NSCParameterAssert(file != NULL);
+
+	return (JATSink){ .function = JATSinkWriteToFile, .context = file };
+}
+
+
+JATSink JATSinkWithFileDescriptor(int fd)
+{
+	return (JATSink){ .function = JATSinkWriteToFileDescriptor, .context = (void *)(intptr_t)fd };
+}
+
+
+JATSink JATSinkWithMutableString(NSMutableString *string)
+{
+	NSCParameterAssert(string != nil);
+
+	return (JATSink){ .string = string };
+}
+
+
+JATSink JATSinkWithBuffer(char *buffer, size_t size)
+{
+	NSCParameterAssert(buffer != NULL);
+	NSCParameterAssert(size > 0);
+
+	buffer[0] = '\0';
+	return (JATSink){ .function = JATSinkWriteToBuffer, .context = buffer, .capacity = size };
+}
+
+
+bool JATSinkWriteString(JATSink *sink, NSString *string)
+{
+	NSCParameterAssert(sink != NULL);
+
+	if (string != nil)
+	{
+		JATSinkWriter writer;
+		writer.sink = sink;
+		writer.used = 0;
+		JATSinkWriterAppendString(&writer, string);
+		JATSinkWriterFlush(&writer);
+	}
+
+	return !sink->failed;
+}
+
+
+#pragma mark - Log levels
+
+#ifdef NDEBUG
+JATLogLevel JAT_LogLevelThreshold = kJATLogLevelInfo;
+#else
+JATLogLevel JAT_LogLevelThreshold = kJATLogLevelDebug;
+#endif
+
+
+void JATSetLogLevel(JATLogLevel level)
+{
+	__atomic_store_n(&JAT_LogLevelThreshold, level, __ATOMIC_RELAXED);
+}
+
+
+JATLogLevel JATGetLogLevel(void)
+{
+	return JAT_LoadLogLevelThreshold();
+}
+
+
+#pragma mark - Asynchronous logging
+
+/*	Asynchronous JATLog() entries are kept in a bounded multiple-producer,
+	single-consumer ring buffer. Each slot has a sequence number: a slot at
+	position p is free for writing when its sequence is p, ready for reading
+	when it is p + 1, and is handed back to writers as position p + capacity
+	once read. Producers claim positions with a compare-and-swap, so entries
+	from any one thread are always consumed in the order they were logged.
 	
-	for (NSUInteger cursor = 0; cursor < length; cursor++)
+	Only one thread consumes at a time, either the background logging thread
+	or a thread calling JATFlushAsyncLog(); this is enforced with a mutex,
+	which producers never touch.
+	
+	With the Block policy, producers that find the queue full sleep on
+	sAsyncLogSpace, which the consumer signals for each slot it frees while
+	sAsyncLogSpaceWaiters is nonzero.
+*/
+enum
+{
+	kJATAsyncLogInlineValues		= 6		// Parameters stored in the entry itself; more are malloc()ed.
+};
+
+
+typedef struct
+{
+	NSUInteger							sequence;
+	__unsafe_unretained NSString		*templateString;	// Retained.
+	const JATParameterName				*names;				// Owned by the call site, which is never freed.
+	NSUInteger							count;
+	JATParameterValue					*values;			// Objects retained; points to inlineValues if count is small enough.
+	JATParameterValue					inlineValues[kJATAsyncLogInlineValues];
+} JATAsyncLogEntry;
+
+
+static JATAsyncLogEntry *sAsyncLogEntries;
+static NSUInteger sAsyncLogMask;
+static NSUInteger sAsyncLogEnqueuePosition;
+static NSUInteger sAsyncLogDequeuePosition;		// Protected by sAsyncLogConsumerLock.
+static pthread_mutex_t sAsyncLogConsumerLock = PTHREAD_MUTEX_INITIALIZER;
+static dispatch_semaphore_t sAsyncLogSignal;
+static dispatch_semaphore_t sAsyncLogSpace;
+static NSUInteger sAsyncLogSpaceWaiters;
+static bool sAsyncLogEnabled;
+static JATAsyncLogPolicy sAsyncLogPolicy;
+static NSUInteger sAsyncLogWritten;
+static NSUInteger sAsyncLogDropped;
+static __thread bool sIsAsyncLogConsumer;
+
+
+static void *JATAsyncLogThread(void *context);
+static bool JATAsyncLogEnqueue(NSString *template, const JATParsedNames *names, const JATParameterValue values[], NSUInteger count);
+static void JATAsyncLogDrain(void);
+
+
+void JAT_DoLogTemplateUsingCallSite(NSString *template, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count)
+{
+	NSCParameterAssert(template != nil);
+
+	/*	The consumer logs synchronously, so that operators which log can't
+		wait on themselves for space in the queue.
+	*/
+	if (__atomic_load_n(&sAsyncLogEnabled, __ATOMIC_ACQUIRE) && !sIsAsyncLogConsumer)
 	{
-		unichar curr = stringBuffer[cursor];
-		if (curr == balanceStart)  balanceCount++;
-		else if (curr == balanceEnd)
+		const JATParsedNames *parsedNames = JATCallSiteParsedNames(callSite, names, count);
+		if (parsedNames != NULL && JATAsyncLogEnqueue(template, parsedNames, values, count))  return;
+	}
+
+	NSLog(@"%@", JATExpandUsingCallSite(nil, template, callSite, names, values, count, NULL));
+}
+
+
+void JATStartAsyncLog(NSUInteger capacity, JATAsyncLogPolicy policy)
+{
+	__atomic_store_n(&sAsyncLogPolicy, policy, __ATOMIC_RELAXED);
+
+	static bool started;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		NSUInteger size = 2;
+		while (size < capacity)  size *= 2;
+
+		JATAsyncLogEntry *entries = calloc(size, sizeof *entries);
+		if (entries == NULL)  return;
+		for (NSUInteger idx = 0; idx < size; idx++)
 		{
-			if (balanceCount == 0)
+			entries[idx].sequence = idx;
+		}
+
+		sAsyncLogEntries = entries;
+		sAsyncLogMask = size - 1;
+		sAsyncLogSignal = dispatch_semaphore_create(0);
+		sAsyncLogSpace = dispatch_semaphore_create(0);
+
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+		pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+		pthread_t thread;
+		started = pthread_create(&thread, &attributes, JATAsyncLogThread, NULL) == 0;
+		pthread_attr_destroy(&attributes);
+
+		// Don't lose entries logged just before exit().
+		if (started)  atexit(JATFlushAsyncLog);
+	});
+
+	// If the queue couldn't be set up, JATLog() stays synchronous.
+	if (started)  __atomic_store_n(&sAsyncLogEnabled, true, __ATOMIC_RELEASE);
+}
+
+
+void JATStopAsyncLog(void)
+{
+	__atomic_store_n(&sAsyncLogEnabled, false, __ATOMIC_RELEASE);
+	JATFlushAsyncLog();
+}
+
+
+void JATSetAsyncLogPolicy(JATAsyncLogPolicy policy)
+{
+	__atomic_store_n(&sAsyncLogPolicy, policy, __ATOMIC_RELAXED);
+}
+
+
+void JATFlushAsyncLog(void)
+{
+	// Flushing from the consumer (for instance, in an operator) would deadlock.
+	if (sAsyncLogSignal == nil || sIsAsyncLogConsumer)  return;
+
+	pthread_mutex_lock(&sAsyncLogConsumerLock);
+	sIsAsyncLogConsumer = true;
+
+	JATAsyncLogDrain();
+
+	sIsAsyncLogConsumer = false;
+	pthread_mutex_unlock(&sAsyncLogConsumerLock);
+}
+
+
+JATAsyncLogStatistics JATGetAsyncLogStatistics(void)
+{
+	return (JATAsyncLogStatistics)
+	{
+		.written = __atomic_load_n(&sAsyncLogWritten, __ATOMIC_RELAXED),
+		.dropped = __atomic_load_n(&sAsyncLogDropped, __ATOMIC_RELAXED)
+	};
+}
+
+
+static void *JATAsyncLogThread(void *context)
+{
+#if __APPLE__
+	pthread_setname_np("se.ayton.jens.jatemplate.log");
+#endif
+
+	for (;;)
+	{
+		dispatch_semaphore_wait(sAsyncLogSignal, DISPATCH_TIME_FOREVER);
+		JATFlushAsyncLog();
+	}
+}
+
+
+/*	JATAsyncLogEnqueue(template, names, values, count)
+
+	Add an entry to the queue. Returns false if the entry should be logged
+	synchronously instead.
+*/
+static bool JATAsyncLogEnqueue(NSString *template, const JATParsedNames *names, const JATParameterValue values[], NSUInteger count)
+{
+	// Allocate before claiming a slot, since a claimed slot must be filled.
+	JATParameterValue *entryValues = NULL;
+	if (count > kJATAsyncLogInlineValues)
+	{
+		entryValues = calloc(count, sizeof *entryValues);
+		if (entryValues == NULL)  return false;
+	}
+
+	NSUInteger position = __atomic_load_n(&sAsyncLogEnqueuePosition, __ATOMIC_RELAXED);
+	JATAsyncLogEntry *entry;
+	for (;;)
+	{
+		entry = &sAsyncLogEntries[position & sAsyncLogMask];
+		NSUInteger sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+		NSInteger difference = (NSInteger)(sequence - position);
+
+		if (difference == 0)
+		{
+			// On failure, position is updated to the current value.
+			if (__atomic_compare_exchange_n(&sAsyncLogEnqueuePosition, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))  break;
+		}
+		else if (difference < 0)
+		{
+			// The queue is full.
+			JATAsyncLogPolicy policy = __atomic_load_n(&sAsyncLogPolicy, __ATOMIC_RELAXED);
+			if (policy != kJATAsyncLogBlock)
 			{
-				if (printWarnings)
-				{
-					JATWarn(NULL, 0, @"Unbalanced brace in template argument string \"{string}\".", string);
-					printWarnings = false;
-				}
+				free(entryValues);
+				if (policy == kJATAsyncLogSynchronous)  return false;
+
+				__atomic_add_fetch(&sAsyncLogDropped, 1, __ATOMIC_RELAXED);
+				return true;
 			}
-			else
+
+			/*	Register as a waiter before checking again, so that a slot
+				freed in between is either seen here or signalled by the
+				consumer. A signal left over from a waiter that didn't sleep
+				only causes another pass round the loop.
+			*/
+			__atomic_add_fetch(&sAsyncLogSpaceWaiters, 1, __ATOMIC_SEQ_CST);
+			if ((NSInteger)(__atomic_load_n(&entry->sequence, __ATOMIC_SEQ_CST) - position) < 0)
 			{
-				balanceCount--;
+				dispatch_semaphore_signal(sAsyncLogSignal);
+				dispatch_semaphore_wait(sAsyncLogSpace, DISPATCH_TIME_FOREVER);
 			}
+			__atomic_sub_fetch(&sAsyncLogSpaceWaiters, 1, __ATOMIC_SEQ_CST);
+			position = __atomic_load_n(&sAsyncLogEnqueuePosition, __ATOMIC_RELAXED);
 		}
-		else if (balanceCount == 0 && curr == separator)
+		else
 		{
-			NSRange range = { spanStart, cursor - spanStart };
-			NSString *subString = [string substringWithRange:range];
-			[result addObject:subString];
-			spanStart = cursor + 1;
+			// Another producer got here first.
+			position = __atomic_load_n(&sAsyncLogEnqueuePosition, __ATOMIC_RELAXED);
+		}
+	}
+
+	entry->templateString = (__bridge NSString *)CFBridgingRetain([template copy]);
+	entry->names = names->names;
+	entry->count = count;
+	entry->values = (entryValues != NULL) ? entryValues : entry->inlineValues;
+	for (NSUInteger idx = 0; idx < count; idx++)
+	{
+		JATParameterValue value = values[idx];
+		if (value.kind == kJATParameterUTF8)
+		{
+			// The caller's characters won't outlive the call, so convert them now.
+			CFTypeRef string = CFBridgingRetain(JATParameterValueObject(&value));
+			value.kind = kJATParameterObject;
+			value.value.object = (__bridge id)string;
+		}
+		else if (value.kind == kJATParameterObject && value.value.object != nil)
+		{
+			CFRetain((__bridge CFTypeRef)value.value.object);
+		}
+		entry->values[idx] = value;
+	}
+
+	__atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+	dispatch_semaphore_signal(sAsyncLogSignal);
+	return true;
+}
+
+
+/*	JATAsyncLogDrain()
+
+	Expand and log every entry which is ready. Must be called with
+	sAsyncLogConsumerLock held.
+*/
+static void JATAsyncLogDrain(void)
+{
+	for (;;)
+	{
+		NSUInteger position = sAsyncLogDequeuePosition;
+		JATAsyncLogEntry *entry = &sAsyncLogEntries[position & sAsyncLogMask];
+		if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != position + 1)  break;
+
+		@autoreleasepool
+		{
+			NSString *message = nil;
+			JATCompiledTemplate *compiled = [JATCompiledTemplate compiledTemplateWithString:entry->templateString];
+			if (compiled != nil)
+			{
+				JATParameterFrame frame =
+				{
+					.values = entry->values,
+					.names = entry->names,
+					.count = entry->count
+				};
+				message = JATExpandCompiledTemplate(compiled, entry->templateString, &frame);
+			}
+
+			NSLog(@"%@", message);
+		}
+
+		CFRelease((__bridge CFTypeRef)entry->templateString);
+		for (NSUInteger idx = 0; idx < entry->count; idx++)
+		{
+			const JATParameterValue *value = &entry->values[idx];
+			if (value->kind == kJATParameterObject && value->value.object != nil)  CFRelease((__bridge CFTypeRef)value->value.object);
 		}
+		if (entry->values != entry->inlineValues)  free(entry->values);
+
+		sAsyncLogDequeuePosition = position + 1;
+		__atomic_add_fetch(&sAsyncLogWritten, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->sequence, position + sAsyncLogMask + 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&sAsyncLogSpaceWaiters, __ATOMIC_SEQ_CST) != 0)  dispatch_semaphore_signal(sAsyncLogSpace);
+	}
+}
+
+
+#pragma mark - Instrumentation
+
+/*	Instrumentation counters are kept per thread, so recording only takes an
+	uncontended lock on the current thread's data. Each thread's data is
+	registered in sInstrumentationThreads; when a thread exits, its counters
+	are folded into sRetiredInstrumentation. Snapshots merge all of these by
+	template string, since there may be more than one compiled template for
+	a given string.
+	
+	Latencies are recorded in a log-linear histogram: values below 16 ns get
+	a bucket each, and each power of two above that is split into four
+	buckets, so percentiles are accurate to within 25%.
+*/
+#if JATEMPLATE_INSTRUMENTATION
+
+enum
+{
+	kJATHistogramLinearBuckets		= 16,
+	kJATHistogramSubBuckets			= 4,
+	kJATHistogramBucketCount		= kJATHistogramLinearBuckets + (64 - 4) * kJATHistogramSubBuckets
+};
+
+
+typedef struct
+{
+	uint64_t							count;
+	uint64_t							totalNanoseconds;
+	uint64_t							outputBytes;
+	uint64_t							warnings;
+	uint64_t							histogram[kJATHistogramBucketCount];
+} JATTemplateRecord;
+
+
+typedef struct
+{
+	uint64_t							count;
+	uint64_t							totalNanoseconds;
+} JATOperatorRecord;
+
+
+@interface JATInstrumentationData: NSObject
+{
+@public
+	pthread_mutex_t						_lock;
+	NSMutableDictionary					*_templates;	// Template string -> NSMutableData containing a JATTemplateRecord.
+	NSMutableDictionary					*_operators;	// Operator name -> NSMutableData containing a JATOperatorRecord.
+}
+@end
+
+
+static bool sInstrumentationEnabled;
+static pthread_key_t sInstrumentationKey;
+static pthread_mutex_t sInstrumentationLock = PTHREAD_MUTEX_INITIALIZER;
+static NSMutableArray *sInstrumentationThreads;
+static JATInstrumentationData *sRetiredInstrumentation;
+static __thread JATTemplateRecord *sCurrentTemplateRecord;
+
+
+@implementation JATInstrumentationData
+
+- (instancetype) init
+{
+	if ((self = [super init]))
+	{
+		pthread_mutex_init(&_lock, NULL);
+		_templates = [NSMutableDictionary new];
+		_operators = [NSMutableDictionary new];
+	}
+	return self;
+}
+
+
+- (void) dealloc
+{
+	pthread_mutex_destroy(&_lock);
+}
+
+@end
+
+
+/*	Records are keyed by template string rather than by compiled template, so
+	that instrumentation doesn't keep compiled templates alive after the
+	template cache has evicted them.
+*/
+static NSMutableData *JATInstrumentationTemplateRecord(JATInstrumentationData *data, NSString *templateString)
+{
+	NSMutableData *record = data->_templates[templateString];
+	if (record == nil)
+	{
+		record = [NSMutableData dataWithLength:sizeof (JATTemplateRecord)];
+		data->_templates[templateString] = record;
+	}
+	return record;
+}
+
+
+static JATOperatorRecord *JATInstrumentationOperatorRecord(JATInstrumentationData *data, NSString *operator)
+{
+	NSMutableData *record = data->_operators[operator];
+	if (record == nil)
+	{
+		record = [NSMutableData dataWithLength:sizeof (JATOperatorRecord)];
+		data->_operators[operator] = record;
+	}
+	return record.mutableBytes;
+}
+
+
+static void JATInstrumentationMergeTemplateRecord(JATTemplateRecord *into, const JATTemplateRecord *from)
+{
+	into->count += from->count;
+	into->totalNanoseconds += from->totalNanoseconds;
+	into->outputBytes += from->outputBytes;
+	into->warnings += from->warnings;
+	for (NSUInteger idx = 0; idx < kJATHistogramBucketCount; idx++)
+	{
+		into->histogram[idx] += from->histogram[idx];
+	}
+}
+
+
+static void JATInstrumentationMergeOperatorRecord(JATOperatorRecord *into, const JATOperatorRecord *from)
+{
+	into->count += from->count;
+	into->totalNanoseconds += from->totalNanoseconds;
+}
+
+
+/*	JATInstrumentationThreadExit(context)
+	
+	Fold an exiting thread's counters into sRetiredInstrumentation, so they
+	outlive the thread.
+*/
+static void JATInstrumentationThreadExit(void *context)
+{
+	JATInstrumentationData *data = CFBridgingRelease(context);
+
+	pthread_mutex_lock(&sInstrumentationLock);
+	pthread_mutex_lock(&data->_lock);
+
+	JATInstrumentationData *retired = sRetiredInstrumentation;
+	pthread_mutex_lock(&retired->_lock);
+
+	[data->_templates enumerateKeysAndObjectsUsingBlock:^(NSString *templateString, NSData *record, BOOL *stop)
+	{
+		JATInstrumentationMergeTemplateRecord(JATInstrumentationTemplateRecord(retired, templateString).mutableBytes, record.bytes);
+	}];
+	[data->_operators enumerateKeysAndObjectsUsingBlock:^(NSString *operator, NSData *record, BOOL *stop)
+	{
+		JATInstrumentationMergeOperatorRecord(JATInstrumentationOperatorRecord(retired, operator), record.bytes);
+	}];
+
+	pthread_mutex_unlock(&retired->_lock);
+	pthread_mutex_unlock(&data->_lock);
+
+	[sInstrumentationThreads removeObjectIdenticalTo:data];
+	pthread_mutex_unlock(&sInstrumentationLock);
+}
+
+
+static void JATInstrumentationSetUp(void)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		pthread_key_create(&sInstrumentationKey, JATInstrumentationThreadExit);
+		sInstrumentationThreads = [NSMutableArray new];
+		sRetiredInstrumentation = [JATInstrumentationData new];
+	});
+}
+
+
+static JATInstrumentationData *JATCurrentInstrumentationData(void)
+{
+	JATInstrumentationSetUp();
+
+	JATInstrumentationData *data = (__bridge JATInstrumentationData *)pthread_getspecific(sInstrumentationKey);
+	if (data == nil)
+	{
+		data = [JATInstrumentationData new];
+		pthread_mutex_lock(&sInstrumentationLock);
+		[sInstrumentationThreads addObject:data];
+		pthread_mutex_unlock(&sInstrumentationLock);
+		pthread_setspecific(sInstrumentationKey, CFBridgingRetain(data));
+	}
+
+	return data;
+}
+
+
+static NSUInteger JATHistogramBucket(uint64_t value)
+{
+	if (value < kJATHistogramLinearBuckets)  return (NSUInteger)value;
+
+	unsigned exponent = 63 - (unsigned)__builtin_clzll(value);
+	return kJATHistogramLinearBuckets + (exponent - 4) * kJATHistogramSubBuckets + (NSUInteger)((value >> (exponent - 2)) & 3);
+}
+
+
+// The largest value that falls in a bucket.
+static uint64_t JATHistogramBucketLimit(NSUInteger bucket)
+{
+	if (bucket < kJATHistogramLinearBuckets)  return bucket;
+
+	NSUInteger exponent = (bucket - kJATHistogramLinearBuckets) / kJATHistogramSubBuckets + 4;
+	uint64_t subBucket = (bucket - kJATHistogramLinearBuckets) % kJATHistogramSubBuckets;
+	uint64_t base = (4 + subBucket) << (exponent - 2);
+	return base + (1ULL << (exponent - 2)) - 1;
+}
+
+
+static uint64_t JATHistogramPercentile(const JATTemplateRecord *record, uint64_t percentile)
+{
+	if (record->count == 0)  return 0;
+
+	// Rank of the requested sample, rounding up.
+	uint64_t rank = (record->count * percentile + 99) / 100;
+	if (rank == 0)  rank = 1;
+
+	uint64_t seen = 0;
+	for (NSUInteger idx = 0; idx < kJATHistogramBucketCount; idx++)
+	{
+		seen += record->histogram[idx];
+		if (seen >= rank)  return JATHistogramBucketLimit(idx);
+	}
+	return JATHistogramBucketLimit(kJATHistogramBucketCount - 1);
+}
+
+
+/*	The caller keeps the returned record alive for the duration of the
+	expansion, since a reset may remove it from the table meanwhile. In that
+	case the expansion goes uncounted.
+*/
+static NSMutableData *JATInstrumentationBeginTemplate(JATCompiledTemplate *compiled, JATInstrumentationData **outData)
+{
+	JATInstrumentationData *data = JATCurrentInstrumentationData();
+	pthread_mutex_lock(&data->_lock);
+	NSMutableData *record = JATInstrumentationTemplateRecord(data, compiled.templateString);
+	pthread_mutex_unlock(&data->_lock);
+
+	*outData = data;
+	return record;
+}
+
+
+static void JATInstrumentationEndTemplate(JATInstrumentationData *data, NSMutableData *recordData, uint64_t nanoseconds, uint64_t outputBytes)
+{
+	pthread_mutex_lock(&data->_lock);
+	JATTemplateRecord *record = recordData.mutableBytes;
+	record->count++;
+	record->totalNanoseconds += nanoseconds;
+	record->outputBytes += outputBytes;
+	record->histogram[JATHistogramBucket(nanoseconds)]++;
+	pthread_mutex_unlock(&data->_lock);
+}
+
+
+static void JATInstrumentationRecordOperator(NSString *operator, uint64_t nanoseconds)
+{
+	JATInstrumentationData *data = JATCurrentInstrumentationData();
+	pthread_mutex_lock(&data->_lock);
+	JATOperatorRecord *record = JATInstrumentationOperatorRecord(data, operator);
+	record->count++;
+	record->totalNanoseconds += nanoseconds;
+	pthread_mutex_unlock(&data->_lock);
+}
+
+
+static void JATInstrumentationRecordWarning(void)
+{
+	JATTemplateRecord *record = sCurrentTemplateRecord;
+	if (record == NULL)  return;
+
+	JATInstrumentationData *data = (__bridge JATInstrumentationData *)pthread_getspecific(sInstrumentationKey);
+	pthread_mutex_lock(&data->_lock);
+	record->warnings++;
+	pthread_mutex_unlock(&data->_lock);
+}
+
+
+static void JATInstrumentationCollect(JATInstrumentationData *data, NSMutableDictionary *templates, NSMutableDictionary *operators, bool reset)
+{
+	pthread_mutex_lock(&data->_lock);
+
+	if (templates != nil)
+	{
+		[data->_templates enumerateKeysAndObjectsUsingBlock:^(NSString *templateString, NSData *record, BOOL *stop)
+		{
+			NSMutableData *merged = templates[templateString];
+			if (merged == nil)  templates[templateString] = [record mutableCopy];
+			else  JATInstrumentationMergeTemplateRecord(merged.mutableBytes, record.bytes);
+		}];
+	}
+
+	if (operators != nil)
+	{
+		[data->_operators enumerateKeysAndObjectsUsingBlock:^(NSString *operator, NSData *record, BOOL *stop)
+		{
+			NSMutableData *merged = operators[operator];
+			if (merged == nil)  operators[operator] = [record mutableCopy];
+			else  JATInstrumentationMergeOperatorRecord(merged.mutableBytes, record.bytes);
+		}];
+	}
+
+	// Dropping the records, rather than zeroing them, lets templates that are no longer used be forgotten.
+	if (reset)
+	{
+		[data->_templates removeAllObjects];
+		[data->_operators removeAllObjects];
+	}
+
+	pthread_mutex_unlock(&data->_lock);
+}
+
+
+static void JATInstrumentationCollectAll(NSMutableDictionary *templates, NSMutableDictionary *operators, bool reset)
+{
+	JATInstrumentationSetUp();
+
+	pthread_mutex_lock(&sInstrumentationLock);
+	JATInstrumentationCollect(sRetiredInstrumentation, templates, operators, reset);
+	for (JATInstrumentationData *data in sInstrumentationThreads)
+	{
+		JATInstrumentationCollect(data, templates, operators, reset);
+	}
+	pthread_mutex_unlock(&sInstrumentationLock);
+}
+
+#endif
+
+
+void JATSetInstrumentationEnabled(bool enabled)
+{
+#if JATEMPLATE_INSTRUMENTATION
+	__atomic_store_n(&sInstrumentationEnabled, enabled, __ATOMIC_RELAXED);
+#endif
+}
+
+
+bool JATGetInstrumentationEnabled(void)
+{
+#if JATEMPLATE_INSTRUMENTATION
+	return __atomic_load_n(&sInstrumentationEnabled, __ATOMIC_RELAXED);
+#else
+	return false;
+#endif
+}
+
+
+NSDictionary *JATGetInstrumentationSnapshot(bool reset)
+{
+	NSMutableArray *templateEntries = [NSMutableArray array];
+	NSMutableArray *operatorEntries = [NSMutableArray array];
+
+#if JATEMPLATE_INSTRUMENTATION
+	NSMutableDictionary *templates = [NSMutableDictionary dictionary];
+	NSMutableDictionary *operators = [NSMutableDictionary dictionary];
+	JATInstrumentationCollectAll(templates, operators, reset);
+
+	[templates enumerateKeysAndObjectsUsingBlock:^(NSString *templateString, NSData *data, BOOL *stop)
+	{
+		const JATTemplateRecord *record = data.bytes;
+		if (record->count == 0 && record->warnings == 0)  return;
+
+		[templateEntries addObject:@{
+			@"template": templateString,
+			@"count": @(record->count),
+			@"totalNanoseconds": @(record->totalNanoseconds),
+			@"p50Nanoseconds": @(JATHistogramPercentile(record, 50)),
+			@"p99Nanoseconds": @(JATHistogramPercentile(record, 99)),
+			@"outputBytes": @(record->outputBytes),
+			@"warnings": @(record->warnings)
+		}];
+	}];
+
+	[operators enumerateKeysAndObjectsUsingBlock:^(NSString *operator, NSData *data, BOOL *stop)
+	{
+		const JATOperatorRecord *record = data.bytes;
+		if (record->count == 0)  return;
+
+		[operatorEntries addObject:@{
+			@"operator": operator,
+			@"count": @(record->count),
+			@"totalNanoseconds": @(record->totalNanoseconds)
+		}];
+	}];
+
+	NSArray *byTime = @[[NSSortDescriptor sortDescriptorWithKey:@"totalNanoseconds" ascending:NO]];
+	[templateEntries sortUsingDescriptors:byTime];
+	[operatorEntries sortUsingDescriptors:byTime];
+#endif
+
+	return @{ @"templates": templateEntries, @"operators": operatorEntries };
+}
+
+
+void JATResetInstrumentation(void)
+{
+#if JATEMPLATE_INSTRUMENTATION
+	JATInstrumentationCollectAll(nil, nil, true);
+#endif
+}
+
+
+NSString *JATInstrumentationSnapshotJSON(NSDictionary *snapshot)
+{
+	if (snapshot == nil)  return nil;
+
+	NSData *data = [NSJSONSerialization dataWithJSONObject:snapshot options:NSJSONWritingPrettyPrinted error:NULL];
+	if (data == nil)  return nil;
+
+	return [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+}
+
+
+#pragma mark - Warnings
+
+/*	Warnings are rate-limited using a small open-addressed table keyed by
+	template and kind, where the kind is the unformatted message. The table
+	copies template characters, since the compiled template they came from
+	may be deallocated; when it fills up, it is emptied, at worst causing a
+	few warnings to be reported early.
+	
+	Repeats within the interval are recognised without taking sWarningLock:
+	the hash, time of the last report and suppressed count of each entry are
+	accessed atomically, and a matching hash is taken to be the same warning.
+	The lock is only taken when a warning may be due for reporting, which
+	also compares the template and kind. The kind and characters of an entry
+	are only accessed with the lock held.
+	
+	Warnings raised by operators don't know which template they came from,
+	so the template being expanded is tracked in sWarningContext.
+*/
+enum
+{
+	kJATWarningTableSize			= 256,	// Must be a power of two.
+	kJATWarningTableLimit			= 192
+};
+
+
+typedef struct
+{
+	NSUInteger							hash;			// Atomic; 0 for an empty slot.
+	uint64_t							lastReported;	// Atomic.
+	NSUInteger							suppressed;		// Atomic.
+	__unsafe_unretained NSString		*kind;			// Retained.
+	unichar								*characters;	// Copy of the template, or NULL.
+	NSUInteger							length;
+} JATWarningEntry;
+
+
+typedef struct JATWarningContext
+{
+	const unichar						*characters;
+	NSUInteger							length;
+	const struct JATWarningContext		*outer;
+} JATWarningContext;
+
+
+static pthread_mutex_t sWarningLock = PTHREAD_MUTEX_INITIALIZER;
+static JATWarningEntry sWarningTable[kJATWarningTableSize];
+static NSUInteger sWarningTableCount;
+static uint64_t sWarningInterval = 10 * NSEC_PER_SEC;
+static JATWarningStatistics sWarningStatistics;
+static __thread const JATWarningContext *sWarningContext;
+
+
+void JATSetWarningInterval(NSTimeInterval interval)
+{
+	uint64_t nanoseconds = UINT64_MAX;
+	if (!(interval > 0))  nanoseconds = 0;
+	else if (interval < (double)(UINT64_MAX / NSEC_PER_SEC))  nanoseconds = (uint64_t)(interval * NSEC_PER_SEC);
+
+	__atomic_store_n(&sWarningInterval, nanoseconds, __ATOMIC_RELAXED);
+}
+
+
+NSTimeInterval JATGetWarningInterval(void)
+{
+	uint64_t nanoseconds = __atomic_load_n(&sWarningInterval, __ATOMIC_RELAXED);
+	if (nanoseconds == UINT64_MAX)  return INFINITY;
+	return (NSTimeInterval)nanoseconds / NSEC_PER_SEC;
+}
+
+
+JATWarningStatistics JATGetWarningStatistics(void)
+{
+	return (JATWarningStatistics)
+	{
+		.occurrences = __atomic_load_n(&sWarningStatistics.occurrences, __ATOMIC_RELAXED),
+		.reported = __atomic_load_n(&sWarningStatistics.reported, __ATOMIC_RELAXED)
+	};
+}
+
+
+// Call with sWarningLock held.
+static void JATClearWarningTable(void)
+{
+	for (NSUInteger idx = 0; idx < kJATWarningTableSize; idx++)
+	{
+		JATWarningEntry *entry = &sWarningTable[idx];
+		if (entry->kind == nil)  continue;
+
+		// Unpublish the entry before releasing what the lock-free path never reads.
+		__atomic_store_n(&entry->hash, 0, __ATOMIC_RELEASE);
+		CFRelease((__bridge CFTypeRef)entry->kind);
+		free(entry->characters);
+		entry->kind = nil;
+		entry->characters = NULL;
+		entry->length = 0;
+	}
+	sWarningTableCount = 0;
+}
+
+
+void JATResetWarningRateLimits(void)
+{
+	pthread_mutex_lock(&sWarningLock);
+	JATClearWarningTable();
+	pthread_mutex_unlock(&sWarningLock);
+}
+
+
+#if JATEMPLATE_SYNTAX_WARNINGS
+static NSUInteger JATWarningHash(const unichar characters[], NSUInteger length, NSString *kind)
+{
+	// FNV-1a over the template, mixed with the kind's hash.
+	uint64_t hash = 14695981039346656037ULL;
+	for (NSUInteger idx = 0; idx < length; idx++)
+	{
+		hash = (hash ^ characters[idx]) * 1099511628211ULL;
+	}
+	NSUInteger result = (NSUInteger)(hash ^ kind.hash);
+	return (result != 0) ? result : 1;
+}
+
+
+static inline bool JATWarningIntervalElapsed(uint64_t now, uint64_t lastReported, uint64_t interval)
+{
+	if (interval == 0)  return true;
+	if (interval == UINT64_MAX)  return false;
+	// now may be earlier than a report made by another thread since it was read.
+	return now >= lastReported && now - lastReported >= interval;
+}
+
+
+/*	Count a repeat of a warning without locking, if it was reported less than
+	an interval ago. Returns false if the warning is unknown or due.
+*/
+static bool JATSuppressRepeatedWarning(NSUInteger hash, uint64_t now, uint64_t interval)
+{
+	NSUInteger idx = hash & (kJATWarningTableSize - 1);
+	for (NSUInteger probes = 0; probes < kJATWarningTableSize; probes++)
+	{
+		JATWarningEntry *entry = &sWarningTable[idx];
+		NSUInteger entryHash = __atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE);
+		if (entryHash == 0)  return false;
+		if (entryHash == hash)
+		{
+			uint64_t lastReported = __atomic_load_n(&entry->lastReported, __ATOMIC_RELAXED);
+			if (JATWarningIntervalElapsed(now, lastReported, interval))  return false;
+
+			__atomic_fetch_add(&entry->suppressed, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+		idx = (idx + 1) & (kJATWarningTableSize - 1);
+	}
+	return false;
+}
+#endif
+
+
+NSUInteger JATCountWarning(const unichar characters[], NSUInteger length, NSString *kind)
+{
+	NSCParameterAssert(kind != nil);
+
+#if JATEMPLATE_INSTRUMENTATION
+	JATInstrumentationRecordWarning();
+#endif
+
+	__atomic_fetch_add(&sWarningStatistics.occurrences, 1, __ATOMIC_RELAXED);
+
+#if JATEMPLATE_SYNTAX_WARNINGS
+	if (characters == NULL && sWarningContext != NULL)
+	{
+		characters = sWarningContext->characters;
+		length = sWarningContext->length;
+	}
+	if (characters == NULL)  length = 0;
+
+	uint64_t interval = __atomic_load_n(&sWarningInterval, __ATOMIC_RELAXED);
+	if (interval == 0)
+	{
+		// Every occurrence is reported, so there is nothing to remember.
+		__atomic_fetch_add(&sWarningStatistics.reported, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	NSUInteger hash = JATWarningHash(characters, length, kind);
+	uint64_t now = JATMonotonicNanoseconds();
+
+	if (JATSuppressRepeatedWarning(hash, now, interval))  return 0;
+
+	NSUInteger result = 0;
+	pthread_mutex_lock(&sWarningLock);
+
+	if (sWarningTableCount >= kJATWarningTableLimit)  JATClearWarningTable();
+
+	NSUInteger idx = hash & (kJATWarningTableSize - 1);
+	JATWarningEntry *entry;
+	for (;;)
+	{
+		entry = &sWarningTable[idx];
+		if (entry->kind == nil)  break;
+		if (entry->hash == hash &&
+			entry->length == length &&
+			(entry->kind == kind || [entry->kind isEqualToString:kind]) &&
+			(length == 0 || memcmp(entry->characters, characters, length * sizeof *characters) == 0))
+		{
+			break;
+		}
+		idx = (idx + 1) & (kJATWarningTableSize - 1);
+	}
+
+	if (entry->kind == nil)
+	{
+		// First occurrence.
+		unichar *copy = NULL;
+		if (length != 0)
+		{
+			copy = malloc(length * sizeof *copy);
+			if (copy != NULL)  memcpy(copy, characters, length * sizeof *copy);
+		}
+		if (length == 0 || copy != NULL)
+		{
+			entry->kind = (__bridge NSString *)CFBridgingRetain([kind copy]);
+			entry->characters = copy;
+			entry->length = length;
+			__atomic_store_n(&entry->suppressed, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry->lastReported, now, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry->hash, hash, __ATOMIC_RELEASE);
+			sWarningTableCount++;
+		}
+		result = 1;
+	}
+	else if (JATWarningIntervalElapsed(now, __atomic_load_n(&entry->lastReported, __ATOMIC_RELAXED), interval))
+	{
+		result = __atomic_exchange_n(&entry->suppressed, 0, __ATOMIC_RELAXED) + 1;
+		__atomic_store_n(&entry->lastReported, now, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_fetch_add(&entry->suppressed, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&sWarningLock);
+
+	if (result != 0)  __atomic_fetch_add(&sWarningStatistics.reported, 1, __ATOMIC_RELAXED);
+	return result;
+#else
+	// Count, but never report.
+	(void)characters;
+	(void)length;
+	return 0;
+#endif
+}
+
+
+void JATReportWarningOccurrences(const unichar characters[], NSUInteger length, NSString *message, NSUInteger occurrences)
+{
+#if JATEMPLATE_SYNTAX_WARNINGS
+	message = JATWarningMessage(characters, length, message);
+	if (occurrences > 1)
+	{
+		message = [NSString stringWithFormat:@"%@ (%lu occurrences since last reported)", message, (unsigned long)occurrences];
+	}
+	JATReportWarning(message);
+#endif
+}
+
+
+#pragma mark - Template compilation
+
+/*	A compiled template is a small program. Each instruction corresponds to a
+	brace in the template string which the scanner acts on: an escaped brace
+	({{ or }}), a syntax error, or a substitution. Literal text between
+	instructions is copied straight from the template's character buffer.
+
+	The program reproduces the behaviour of the original character-by-character
+	scanner exactly. In particular, when a substitution fails at expansion time
+	(for instance because a parameter is missing), the scanner resumes at the
+	character after the opening brace, so each substitution has a fallback
+	instruction which does the same. Each brace position gets at most one
+	instruction, so programs are never larger than the template.
+*/
+typedef enum
+{
+	kJATInstructionEnd,				// Copy the rest of the template and stop.
+	kJATInstructionEscape,			// Replace {{ or }} with a single brace.
+	kJATInstructionSyntaxError,		// Report a warning and leave the brace alone.
+	kJATInstructionSubstitution		// Perform a substitution.
+} JATInstructionKind;
+
+
+typedef struct
+{
+	JATInstructionKind		kind;
+	NSUInteger				position;		// Index of the brace in the template.
+	NSUInteger				replaceLength;	// Number of characters replaced on success.
+	NSUInteger				operand;		// Escaped character, constant index of warning, or substitution index.
+	NSUInteger				next;			// Instruction to continue with on success.
+	NSUInteger				fallback;		// Instruction to continue with on failure.
+} JATInstruction;
+
+
+typedef struct
+{
+	NSUInteger				key;			// Constant index of key (NSString for names, NSNumber for positionals).
+	bool					isPositional;
+	NSUInteger				index;			// Parameter index for positionals.
+	NSUInteger				nameStart;		// Range of the name in the template, for names.
+	NSUInteger				nameLength;
+	NSUInteger				firstOperation;
+	NSUInteger				operationCount;
+	NSUInteger				syntaxWarning;	// Constant index of warning to report after the operators, or NSNotFound.
+} JATSubstitution;
+
+
+typedef struct
+{
+	NSUInteger				name;			// Constant index of operator name.
+	NSUInteger				argument;		// Constant index of argument, or NSNotFound if there is no colon.
+} JATOperation;
+
+
+typedef struct
+{
+	const unichar			*characters;
+	NSUInteger				length;
+
+	NSUInteger				*instructionForPosition;
+	NSUInteger				*pendingPositions;
+	NSUInteger				pendingCount;
+
+	JATInstruction			*instructions;
+	NSUInteger				instructionCount;
+	JATSubstitution			*substitutions;
+	NSUInteger				substitutionCount;
+	JATOperation			*operations;
+	NSUInteger				operationCount;
+
+	__unsafe_unretained NSMutableArray *constants;
+} JATCompiler;
+
+
+static NSUInteger JATCompilerInstructionFrom(JATCompiler *compiler, NSUInteger start);
+static void JATCompileInstruction(JATCompiler *compiler, NSUInteger position);
+static NSUInteger JATCompileSubstitution(JATCompiler *compiler, NSUInteger idx, NSUInteger *outReplaceLength, NSUInteger *outSyntaxWarning);
+static NSUInteger JATCompilerAddConstant(JATCompiler *compiler, id constant);
+
+/*	JATOutputBuffer
+	
+	Expansion output is built in a per-thread scratch buffer, which is reused
+	from one expansion to the next, and the result is created from it with a
+	single allocation. Output is kept as Latin-1 for as long as the template
+	and every replacement fit, and widened to UTF-16 in place the first time
+	something doesn't; CFString stores Latin-1 results in eight-bit form.
+	
+	Operators may expand templates while an expansion is in progress. Such
+	nested expansions get a private buffer instead of the per-thread one.
+	Callers end buffers with JATOutputBufferCleanUp() in a @finally block, so
+	that an operator throwing doesn't leave the per-thread buffer marked busy.
+*/
+typedef struct JATExpansionArena JATExpansionArena;
+
+typedef struct
+{
+	JATExpansionArena		*arena;			// Owner of the storage, or NULL if it's private.
+	void					*storage;
+	size_t					capacity;		// In bytes.
+	NSUInteger				length;			// In characters.
+	bool					wide;			// Characters are UTF-16 if set, otherwise Latin-1.
+} JATOutputBuffer;
+
+static bool JATCharactersAreLatin1(const unichar characters[], NSUInteger length);
+static bool JATOutputBufferBegin(JATOutputBuffer *buffer, NSUInteger sizeHint, bool wide);
+static bool JATOutputBufferAppendLiteral(JATOutputBuffer *buffer, const unichar characters[], NSUInteger count);
+static bool JATOutputBufferAppendString(JATOutputBuffer *buffer, NSString *string);
+static NSString *JATOutputBufferFinish(JATOutputBuffer *buffer);
+static void JATOutputBufferEnd(JATOutputBuffer *buffer);
+static void JATOutputBufferCleanUp(JATOutputBuffer *buffer);
+static NSString *JATOutputBufferCopyRange(const JATOutputBuffer *buffer, NSRange range);
+
+
+/*	JATProgramTables
+	
+	The tables making up a compiled template, as stored in template catalogs.
+*/
+typedef struct
+{
+	const unichar			*characters;
+	NSUInteger				length;
+	const JATInstruction	*instructions;
+	NSUInteger				instructionCount;
+	const JATSubstitution	*substitutions;
+	NSUInteger				substitutionCount;
+	const JATOperation		*operations;
+	NSUInteger				operationCount;
+	__unsafe_unretained NSArray *constants;
+} JATProgramTables;
+
+
+@interface JATCompiledTemplate ()
+
+/*	Create a compiled template using tables owned by another object, which is
+	retained for the compiled template's lifetime.
+*/
+- (instancetype) initWithTemplateString:(NSString *)templateString tables:(const JATProgramTables *)tables owner:(id)owner;
+
+@end
+
+
+static JATProgramTables JATCompiledTemplateGetTables(JATCompiledTemplate *compiled);
+
+
+enum
+{
+	kJATDefaultTemplateCacheLimit	= 1000	// Number of compiled templates kept by default.
+};
+
+
+static NSCache *JATTemplateCache(void);
+static NSCache *JATLocalizationCache(void);
+static JATCompiledTemplate *JATLookUpLocalizedTemplate(NSString *key, NSString *table, NSBundle *bundle);
+static JATTemplateCatalog *JATBundleTemplateCatalog(NSBundle *bundle, NSString *table);
+static NSUInteger sTemplateCacheLimit = kJATDefaultTemplateCacheLimit;
+
+
+@implementation JATCompiledTemplate
+{
+	const unichar			*_characters;
+	NSUInteger				_length;
+	const JATInstruction	*_instructions;
+	const JATSubstitution	*_substitutions;
+	const JATOperation		*_operations;
+	NSUInteger				_instructionCount;
+	NSUInteger				_substitutionCount;
+	NSUInteger				_operationCount;
+	NSArray					*_constants;
+	id						_tableOwner;		// If not nil, the tables belong to it and must not be freed.
+	bool					_latin1;			// All characters of the template are below U+0100.
+	NSUInteger				_outputLengthHint;	// Length of the last expansion, used to size the next one. Accessed atomically.
+}
+
+
++ (instancetype) compiledTemplateWithString:(NSString *)templateString
+{
+	NSParameterAssert(templateString != nil);
+
+	if (__atomic_load_n(&sTemplateCacheLimit, __ATOMIC_RELAXED) == 0)
+	{
+		// Caching is disabled.
+		return [[self alloc] initWithString:templateString];
+	}
+
+	NSCache *cache = JATTemplateCache();
+	JATCompiledTemplate *result = [cache objectForKey:templateString];
+	if (result == nil)
+	{
+		result = [[self alloc] initWithString:templateString];
+		if (result != nil)
+		{
+			// Use the compiled template's immutable copy as key, since the template might be mutable.
+			[cache setObject:result forKey:result.templateString];
+		}
+	}
+
+	return result;
+}
+
+
+- (instancetype) initWithString:(NSString *)templateString
+{
+	NSParameterAssert(templateString != nil);
+
+	if ((self = [super init]))
+	{
+		_templateString = [templateString copy];
+		_length = _templateString.length;
+
+		unichar *characters = malloc(sizeof *characters * MAX(_length, (NSUInteger)1));
+		if (characters == NULL)  return nil;
+		[_templateString getCharacters:characters range:(NSRange){ 0, _length }];
+		_characters = characters;
+		_latin1 = JATCharactersAreLatin1(_characters, _length);
+
+		/*	Every instruction is anchored at a brace, substitutions start with
+			a { and operators start with a |, so counting those gives us upper
+			bounds for all the tables.
+		*/
+		NSUInteger braceCount = 0, openBraceCount = 0, barCount = 0;
+		for (NSUInteger idx = 0; idx < _length; idx++)
+		{
+			unichar c = _characters[idx];
+			if (c == '{')  { braceCount++; openBraceCount++; }
+			else if (c == '}')  braceCount++;
+			else if (c == '|')  barCount++;
+		}
+
+		JATCompiler compiler =
+		{
+			.characters = _characters,
+			.length = _length,
+			.instructionForPosition = malloc(sizeof (NSUInteger) * (_length + 1)),
+			.pendingPositions = malloc(sizeof (NSUInteger) * (braceCount + 1)),
+			.instructions = malloc(sizeof (JATInstruction) * (braceCount + 1)),
+			.substitutions = malloc(sizeof (JATSubstitution) * MAX(openBraceCount, (NSUInteger)1)),
+			.operations = malloc(sizeof (JATOperation) * MAX(barCount, (NSUInteger)1))
+		};
+		NSMutableArray *constants = [NSMutableArray array];
+		compiler.constants = constants;
+
+		bool OK = compiler.instructionForPosition != NULL &&
+				  compiler.pendingPositions != NULL &&
+				  compiler.instructions != NULL &&
+				  compiler.substitutions != NULL &&
+				  compiler.operations != NULL;
+
+		if (OK)
+		{
+			for (NSUInteger idx = 0; idx <= _length; idx++)
+			{
+				compiler.instructionForPosition[idx] = NSNotFound;
+			}
+
+			// Instruction 0 is the entry point.
+			(void)JATCompilerInstructionFrom(&compiler, 0);
+			while (compiler.pendingCount > 0)
+			{
+				JATCompileInstruction(&compiler, compiler.pendingPositions[--compiler.pendingCount]);
+			}
+		}
+
+		free(compiler.instructionForPosition);
+		free(compiler.pendingPositions);
+
+		_instructions = compiler.instructions;
+		_instructionCount = compiler.instructionCount;
+		_substitutions = compiler.substitutions;
+		_substitutionCount = compiler.substitutionCount;
+		_operations = compiler.operations;
+		_operationCount = compiler.operationCount;
+		_constants = [constants copy];
+
+		if (!OK)  return nil;
+	}
+
+	return self;
+}
+
+
+- (instancetype) initWithTemplateString:(NSString *)templateString tables:(const JATProgramTables *)tables owner:(id)owner
+{
+	NSParameterAssert(templateString != nil && tables != NULL && owner != nil);
+
+	if ((self = [super init]))
+	{
+		_templateString = [templateString copy];
+		_tableOwner = owner;
+
+		_characters = tables->characters;
+		_length = tables->length;
+		_latin1 = JATCharactersAreLatin1(_characters, _length);
+		_instructions = tables->instructions;
+		_instructionCount = tables->instructionCount;
+		_substitutions = tables->substitutions;
+		_substitutionCount = tables->substitutionCount;
+		_operations = tables->operations;
+		_operationCount = tables->operationCount;
+		_constants = [tables->constants copy];
+	}
+
+	return self;
+}
+
+
+static JATProgramTables JATCompiledTemplateGetTables(JATCompiledTemplate *compiled)
+{
+	return (JATProgramTables)
+	{
+		.characters = compiled->_characters,
+		.length = compiled->_length,
+		.instructions = compiled->_instructions,
+		.instructionCount = compiled->_instructionCount,
+		.substitutions = compiled->_substitutions,
+		.substitutionCount = compiled->_substitutionCount,
+		.operations = compiled->_operations,
+		.operationCount = compiled->_operationCount,
+		.constants = compiled->_constants
+	};
+}
+
+
+- (void) dealloc
+{
+	if (_tableOwner != nil)  return;
+
+	// The tables are only const so that owned and borrowed tables can share ivars.
+	free((void *)(uintptr_t)_characters);
+	free((void *)(uintptr_t)_instructions);
+	free((void *)(uintptr_t)_substitutions);
+	free((void *)(uintptr_t)_operations);
+}
+
+
+- (NSString *) description
+{
+	return [NSString stringWithFormat:@"<%@ %p>{\"%@\"}", self.class, self, _templateString];
+}
+
+
+- (NSString *) expandWithParameters:(NSDictionary *)parameters
+{
+	JATParameterFrame frame = JATParameterFrameWithDictionary(parameters);
+	return JATExpandCompiledTemplate(self, _templateString, &frame);
+}
+
+
+/*	JATFormatParameterValue()
+
+	Format an unboxed integer or boolean parameter the same way the NSNumber
+	it would be boxed as coerces to a string. Returns nil for other kinds of
+	value, or if the number can't be formatted natively.
+*/
+static NSString *JATFormatParameterValue(const JATParameterValue *value)
+{
+	switch (value->kind)
+	{
+		case kJATParameterSigned:
+		{
+			long long signedValue = value->value.signedValue;
+			bool negative = signedValue < 0;
+			return JATFormatInteger(negative ? 0ULL - (unsigned long long)signedValue : (unsigned long long)signedValue, negative, true);
+		}
+
+		case kJATParameterUnsigned:
+			return JATFormatInteger(value->value.unsignedValue, false, true);
+
+		case kJATParameterBool:
+			return JATFormatInteger(value->value.boolValue ? 1ULL : 0ULL, false, true);
+
+		case kJATParameterObject:
+		case kJATParameterDouble:
+		case kJATParameterUTF8:
+			break;
+	}
+
+	return nil;
+}
+
+
+/*	JATPerformSubstitution()
+
+	Look up the value for a substitution, apply its operators and coerce the
+	result to a string. Returns nil on failure.
+	
+	<variables> points to the variables dictionary passed to operators. For
+	frames without a dictionary, it's created the first time it's needed and
+	reused for the rest of the expansion, which must detach it at the end.
+*/
+static NSString *JATPerformSubstitution(JATCompiledTemplate *compiled, const JATSubstitution *substitution, const JATParameterFrame *frame, NSDictionary * __strong *variables)
+{
+	NSArray *constants = compiled->_constants;
+	id value = nil;
+
+	if (frame->usesDictionary)
+	{
+		value = frame->dictionary[constants[substitution->key]];
+	}
+	else
+	{
+		const JATParameterValue *parameter;
+		if (substitution->isPositional)
+		{
+			parameter = JATParameterFrameEntryAtIndex(frame, substitution->index);
+		}
+		else
+		{
+			parameter = JATParameterFrameEntryForName(frame, compiled->_characters + substitution->nameStart, substitution->nameLength);
+		}
+
+		if (parameter != NULL)
+		{
+			// Unboxed integers without operators don't need an NSNumber.
+			if (substitution->operationCount == 0 && substitution->syntaxWarning == NSNotFound)
+			{
+				NSString *result = JATFormatParameterValue(parameter);
+				if (result != nil)  return result;
+			}
+
+			value = JATParameterValueObject(parameter);
+		}
+	}
+
+	if (value == nil)
+	{
+		id key = constants[substitution->key];
+		if (substitution->isPositional)
+		{
+			JATWarn(compiled->_characters, compiled->_length, @"Template substitution uses out-of-range positional reference @{key}.", key);
+		}
+		else
+		{
+			JATWarn(compiled->_characters, compiled->_length, @"Template substitution uses unknown parameter \"{key}\".", key);
+		}
+		return nil;
+	}
+
+	const JATOperation *operation = compiled->_operations + substitution->firstOperation;
+	const JATOperation *endOperation = operation + substitution->operationCount;
+	for (; value != nil && operation < endOperation; operation++)
+	{
+		NSString *operator = constants[operation->name];
+		NSString *argument = nil;
+		if (operation->argument != NSNotFound)  argument = constants[operation->argument];
+
+		if (*variables == nil && !frame->usesDictionary)
+		{
+			*variables = frame->dictionary ?: [[JATParameterFrameDictionary alloc] initWithParameterFrame:frame];
+		}
+
+#if JATEMPLATE_INSTRUMENTATION
+		if (__atomic_load_n(&sInstrumentationEnabled, __ATOMIC_RELAXED))
+		{
+			uint64_t start = JATMonotonicNanoseconds();
+			value = [value jatemplatePerformOperator:operator withArgument:argument variables:*variables];
+			JATInstrumentationRecordOperator(operator, JATMonotonicNanoseconds() - start);
+			continue;
+		}
+#endif
+		value = [value jatemplatePerformOperator:operator withArgument:argument variables:*variables];
+	}
+
+	if (value == nil)  return nil;
+
+	if (substitution->syntaxWarning != NSNotFound)
+	{
+		JATReportPreparedWarning(constants[substitution->syntaxWarning]);
+		return nil;
+	}
+
+	return [value jatemplateCoerceToString];
+}
+
+
+/*	JATDirectUTF8Parameter(compiled, substitution, frame)
+
+	If a substitution's value is unboxed, valid UTF-8 and has no operators,
+	return it so its bytes can be written to a byte sink as they are.
+	Otherwise, return NULL and let JATPerformSubstitution() handle it.
+*/
+static const JATParameterValue *JATDirectUTF8Parameter(JATCompiledTemplate *compiled, const JATSubstitution *substitution, const JATParameterFrame *frame)
+{
+	if (frame->usesDictionary || substitution->operationCount != 0 || substitution->syntaxWarning != NSNotFound)  return NULL;
+
+	const JATParameterValue *parameter;
+	if (substitution->isPositional)
+	{
+		parameter = JATParameterFrameEntryAtIndex(frame, substitution->index);
+	}
+	else
+	{
+		parameter = JATParameterFrameEntryForName(frame, compiled->_characters + substitution->nameStart, substitution->nameLength);
+	}
+
+	if (parameter == NULL || parameter->kind != kJATParameterUTF8 || parameter->value.UTF8.bytes == NULL)  return NULL;
+	if (!JATIsValidUTF8(parameter->value.UTF8.bytes, parameter->value.UTF8.length))  return NULL;
+
+	return parameter;
+}
+
+
+/*	JATRunCompiledTemplate(compiled, template, frame, sink)
+
+	Run a compiled template. If <sink> is NULL, the result is built as a
+	string and returned. Otherwise, output is streamed to the sink and nil is
+	returned.
+*/
+static NSString *JATRunCompiledTemplate(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame, JATSink *sink);
+static NSString *JATRunProgram(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame, JATSink *sink);
+#if JATEMPLATE_INSTRUMENTATION
+static NSString *JATRunInstrumentedProgram(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame, JATSink *sink);
+#endif
+
+
+/*	JATExpandCompiledTemplate(compiled, template, frame)
+
+	Run a compiled template. <template> is returned as-is if no substitutions
+	are made, so callers can pass the (possibly mutable) string they were
+	given to preserve the old behaviour.
+*/
+NSString *JATExpandCompiledTemplate(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame)
+{
+	return JATRunCompiledTemplate(compiled, template, frame, NULL);
+}
+
+
+bool JATExpandCompiledTemplateToSink(JATCompiledTemplate *compiled, const JATParameterFrame *frame, JATSink *sink)
+{
+	NSCParameterAssert(sink != NULL);
+
+	JATRunCompiledTemplate(compiled, nil, frame, sink);
+	return !sink->failed;
+}
+
+
+static NSString *JATRunCompiledTemplate(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame, JATSink *sink)
+{
+	// Let warnings from operators find the template they came from.
+	JATWarningContext warningContext = { compiled->_characters, compiled->_length, sWarningContext };
+	sWarningContext = &warningContext;
+
+	@try
+	{
+#if JATEMPLATE_INSTRUMENTATION
+		return JATRunInstrumentedProgram(compiled, template, frame, sink);
+#else
+		return JATRunProgram(compiled, template, frame, sink);
+#endif
+	}
+	@finally
+	{
+		// An operator may throw; don't leave the context pointing into this frame.
+		sWarningContext = warningContext.outer;
+	}
+}
+
+
+#if JATEMPLATE_INSTRUMENTATION
+static NSString *JATRunInstrumentedProgram(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame, JATSink *sink)
+{
+	if (!__atomic_load_n(&sInstrumentationEnabled, __ATOMIC_RELAXED))
+	{
+		return JATRunProgram(compiled, template, frame, sink);
+	}
+
+	JATInstrumentationData *data;
+	NSMutableData *record = JATInstrumentationBeginTemplate(compiled, &data);
+	JATTemplateRecord *outerRecord = sCurrentTemplateRecord;
+	sCurrentTemplateRecord = record.mutableBytes;
+
+	size_t startBytes = 0;
+	if (sink != NULL)  startBytes = (sink->string != nil) ? sink->string.length * sizeof (unichar) : sink->length;
+	uint64_t start = JATMonotonicNanoseconds();
+
+	NSString *result = nil;
+	@try
+	{
+		result = JATRunProgram(compiled, template, frame, sink);
+	}
+	@finally
+	{
+		// Also reached if an operator throws, so later warnings aren't charged to this template.
+		uint64_t elapsed = JATMonotonicNanoseconds() - start;
+		size_t outputBytes = result.length * sizeof (unichar);
+		if (sink != NULL)  outputBytes = ((sink->string != nil) ? sink->string.length * sizeof (unichar) : sink->length) - startBytes;
+
+		sCurrentTemplateRecord = outerRecord;
+		JATInstrumentationEndTemplate(data, record, elapsed, outputBytes);
+	}
+	return result;
+}
+#endif
+
+
+/*	sKnownSubstitutions
+	
+	Results of substitutions which the lowered-template path has already
+	performed, keyed by the position of their opening brace, with NSNull for
+	a substitution that failed. It is set while that path falls back to the
+	scanner, and taken by the next JATRunProgram() on the thread so nested
+	expansions don't see it.
+*/
+static __thread __unsafe_unretained NSDictionary *sKnownSubstitutions;
+
+
+static NSString *JATRunProgram(JATCompiledTemplate *compiled, NSString *template, const JATParameterFrame *frame, JATSink *sink)
+{
+	NSCParameterAssert(compiled != nil);
+	NSCParameterAssert(frame != NULL);
+
+	NSDictionary *knownSubstitutions = sKnownSubstitutions;
+	if (knownSubstitutions != nil)  sKnownSubstitutions = nil;
+
+	const unichar *characters = compiled->_characters;
+	NSUInteger length = compiled->_length;
+	const JATInstruction *instructions = compiled->_instructions;
+
+	// Nothing to expand in an empty string.
+	if (length == 0)  return (sink == NULL) ? @"" : nil;
+
+	JATSinkWriter writer;
+	writer.sink = sink;
+	writer.used = 0;
+
+	// Started at the first replacement, if not writing to a sink.
+	JATOutputBuffer output = { .length = 0 };
+
+	// Variables dictionary for operators, created on demand.
+	NSDictionary *variables = frame->usesDictionary ? frame->dictionary : nil;
+
+	@try
+	{
+		@autoreleasepool
+		{
+
+			/*	Beginning of current range of non-special characters. When we encounter
+				a substitution, we'll be copying from here forward.
+			*/
+			NSUInteger copyRangeStart = 0;
+			bool replaced = false;
+
+			NSUInteger pc = 0;
+			for (;;)
+			{
+				const JATInstruction *instruction = &instructions[pc];
+				NSString *replacement = nil;
+				const JATParameterValue *directUTF8 = NULL;
+
+				switch (instruction->kind)
+				{
+					case kJATInstructionEnd:
+						break;
+
+					case kJATInstructionEscape:
+						replacement = (instruction->operand == '{') ? @"{" : @"}";
+						break;
+
+					case kJATInstructionSyntaxError:
+						if (instruction->operand != NSNotFound)
+						{
+							JATReportPreparedWarning(compiled->_constants[instruction->operand]);
+						}
+						break;
+
+					case kJATInstructionSubstitution:
+						if (sink != NULL && sink->string == nil)
+						{
+							directUTF8 = JATDirectUTF8Parameter(compiled, &compiled->_substitutions[instruction->operand], frame);
+							if (directUTF8 != NULL)  break;
+						}
+						if (knownSubstitutions != nil)
+						{
+							id known = knownSubstitutions[@(instruction->position)];
+							if (known != nil)
+							{
+								replacement = (known != NSNull.null) ? known : nil;
+								break;
+							}
+						}
+						@autoreleasepool
+						{
+							replacement = JATPerformSubstitution(compiled, &compiled->_substitutions[instruction->operand], frame, &variables);
+						}
+						break;
+				}
+
+				if (instruction->kind == kJATInstructionEnd)  break;
+
+				if (replacement != nil || directUTF8 != NULL)
+				{
+					NSUInteger idx = instruction->position;
+					if (sink != NULL)
+					{
+						// Stream the pending literal segment and the replacement.
+						JATSinkWriterAppendCharacters(&writer, characters + copyRangeStart, idx - copyRangeStart);
+						if (directUTF8 != NULL)  JATSinkWriterAppendBytes(&writer, directUTF8->value.UTF8.bytes, directUTF8->value.UTF8.length);
+						else  JATSinkWriterAppendString(&writer, replacement);
+						if (sink->failed)  return nil;
+					}
+					else
+					{
+						if (idx == 0 && instruction->replaceLength == length)
+						{
+							// Replacing entire template in one pop.
+							return replacement;
+						}
+
+						if (!replaced)
+						{
+							NSUInteger sizeHint = __atomic_load_n(&compiled->_outputLengthHint, __ATOMIC_RELAXED);
+							if (!JATOutputBufferBegin(&output, MAX(sizeHint, length), !compiled->_latin1))  return nil;
+						}
+
+						// Write the pending literal segment and the replacement.
+						if (!JATOutputBufferAppendLiteral(&output, characters + copyRangeStart, idx - copyRangeStart) ||
+							!JATOutputBufferAppendString(&output, replacement))
+						{
+							JATOutputBufferEnd(&output);
+							return nil;
+						}
+					}
+
+					// Skip over replaced part and start a new literal segment.
+					copyRangeStart = idx + instruction->replaceLength;
+					replaced = true;
+					pc = instruction->next;
+				}
+				else
+				{
+					pc = instruction->fallback;
+				}
+			}
+
+			if (sink != NULL)
+			{
+				// Stream any trailing literal segment (or the whole template, if nothing was replaced).
+				JATSinkWriterAppendCharacters(&writer, characters + copyRangeStart, length - copyRangeStart);
+				JATSinkWriterFlush(&writer);
+				return nil;
+			}
+			else if (!replaced)
+			{
+				// No substitutions made.
+				return template;
+			}
+			else
+			{
+				// Append any trailing literal segment.
+				if (!JATOutputBufferAppendLiteral(&output, characters + copyRangeStart, length - copyRangeStart))
+				{
+					JATOutputBufferEnd(&output);
+					return nil;
+				}
+
+				__atomic_store_n(&compiled->_outputLengthHint, output.length, __ATOMIC_RELAXED);
+				return JATOutputBufferFinish(&output);
+			}
+		}
+	}
+	@finally
+	{
+		// Release the per-thread buffer if an operator threw.
+		JATOutputBufferCleanUp(&output);
+		if (variables != frame->dictionary)  [(JATParameterFrameDictionary *)variables detachFromParameterFrame];
+	}
+}
+
+@end
+
+
+/*	JATCompilerInstructionFrom(compiler, start)
+
+	Returns the index of the instruction the scanner will reach if it starts
+	at <start>, allocating it if necessary. Instructions are filled in later
+	from the pending list, which avoids deep recursion for long templates.
+*/
+static NSUInteger JATCompilerInstructionFrom(JATCompiler *compiler, NSUInteger start)
+{
+	const unichar *characters = compiler->characters;
+	NSUInteger length = compiler->length;
+
+	/*	Find the next brace. As in the original scanner, a brace in the last
+		position is not special since every valid substitution is at least two
+		characters long.
+	*/
+	NSUInteger position = start;
+	if (position + 1 < length)  position = JATFindBrace(characters, start, length - 1);
+	if (position + 1 >= length)  position = length;
+
+	NSUInteger result = compiler->instructionForPosition[position];
+	if (result == NSNotFound)
+	{
+		result = compiler->instructionCount++;
+		compiler->instructionForPosition[position] = result;
+		compiler->pendingPositions[compiler->pendingCount++] = position;
+	}
+
+	return result;
+}
+
+
+static void JATCompileInstruction(JATCompiler *compiler, NSUInteger position)
+{
+	const unichar *characters = compiler->characters;
+	NSUInteger length = compiler->length;
+	NSUInteger instructionIndex = compiler->instructionForPosition[position];
+
+	JATInstruction instruction =
+	{
+		.kind = kJATInstructionEnd,
+		.position = position,
+		.replaceLength = 0,
+		.operand = NSNotFound,
+		.next = NSNotFound,
+		.fallback = NSNotFound
+	};
+
+	if (position < length)
+	{
+		if (characters[position] == '}' || characters[position + 1] == '{')
+		{
+			// Detect {{ and }} as escape codes for { and }.
+			instruction.kind = kJATInstructionEscape;
+			instruction.operand = characters[position];
+			instruction.replaceLength = 2;
+			instruction.next = JATCompilerInstructionFrom(compiler, position + 2);
+		}
+		else
+		{
+			NSUInteger replaceLength = 0, syntaxWarning = NSNotFound;
+			NSUInteger substitution = JATCompileSubstitution(compiler, position, &replaceLength, &syntaxWarning);
+			if (substitution != NSNotFound)
+			{
+				instruction.kind = kJATInstructionSubstitution;
+				instruction.operand = substitution;
+				instruction.replaceLength = replaceLength;
+				instruction.next = JATCompilerInstructionFrom(compiler, position + replaceLength);
+			}
+			else
+			{
+				instruction.kind = kJATInstructionSyntaxError;
+				instruction.operand = syntaxWarning;
+			}
+
+			// On failure, resume scanning after the opening brace.
+			instruction.fallback = JATCompilerInstructionFrom(compiler, position + 1);
+		}
+	}
+
+	compiler->instructions[instructionIndex] = instruction;
+}
+
+
+/*	JATCompileSubstitution()
+
+	Parse the substitution starting with the { at <idx>. On success, returns
+	the index of the new substitution. On syntax errors, returns NSNotFound
+	and sets *outSyntaxWarning to the constant index of the warning message
+	(or NSNotFound if warnings are disabled).
+*/
+static NSUInteger JATCompileSubstitution(JATCompiler *compiler, NSUInteger idx, NSUInteger *outReplaceLength, NSUInteger *outSyntaxWarning)
+{
+	const unichar *characters = compiler->characters;
+	NSUInteger length = compiler->length;
+
+	NSCParameterAssert(idx < length - 1);
+	NSCParameterAssert(characters[idx] == '{');
+
+	// Find the balancing close brace.
+	NSUInteger end, balanceCount = 1;
+	bool isIdentifier = IsIdentifierStartChar(characters[idx + 1]);
+	bool isPositional = IsPositionalChar(characters[idx + 1]);
+
+	for (end = idx + 1; end < length && balanceCount > 0; end++)
+	{
+		if (characters[end] == '}')  balanceCount--;
+		if (characters[end] == '{')  balanceCount++;
+		if (balanceCount > 0)
+		{
+			isIdentifier = isIdentifier && IsIdentifierChar(characters[end]);
+			isPositional = isPositional && IsPositionalChar(characters[end]);
+		}
+	}
+
+	// Fail if no balancing bracket. (Not asserted since input is format string.)
+	if (balanceCount != 0)
+	{
+		*outSyntaxWarning = JATCompilerAddConstant(compiler, JATPrepareWarning(characters, length, @"Unbalanced braces in template string."));
+		return NSNotFound;
+	}
+
+	NSUInteger replaceLength = end - idx;
+	NSUInteger keyStart = idx + 1, keyLength = replaceLength - 2;
+	if (keyLength == 0)
+	{
+		*outSyntaxWarning = JATCompilerAddConstant(compiler, JATPrepareWarning(characters, length, @"Empty substitution expression in template string. To silence this message, use {{{{}}}} instead of {{}}."));
+		return NSNotFound;
+	}
+
+	JATSubstitution substitution =
+	{
+		.key = NSNotFound,
+		.isPositional = false,
+		.index = NSNotFound,
+		.nameStart = keyStart,
+		.nameLength = keyLength,
+		.firstOperation = compiler->operationCount,
+		.operationCount = 0,
+		.syntaxWarning = NSNotFound
+	};
+
+	if (isIdentifier)
+	{
+		substitution.key = JATCompilerAddConstant(compiler, [NSString stringWithCharacters:characters + keyStart length:keyLength]);
+	}
+	else if (isPositional)
+	{
+		NSNumber *index = ReadPositional(characters, length, keyStart, NULL);
+		substitution.key = JATCompilerAddConstant(compiler, index);
+		substitution.index = index.unsignedIntegerValue;
+		substitution.isPositional = true;
+	}
+	else
+	{
+		// Fancy-pants substitution: a key followed by one or more operators.
+		NSUInteger cursor = keyStart, tokenLength;
+		NSString *expression = [NSString stringWithCharacters:characters + keyStart length:keyLength];
+
+		if (ScanIdentifier(characters, length, cursor, &tokenLength))
+		{
+			substitution.key = JATCompilerAddConstant(compiler, [NSString stringWithCharacters:characters + cursor length:tokenLength]);
+			substitution.nameLength = tokenLength;
+		}
+		else if (IsPositionalChar(characters[cursor]))
+		{
+			NSNumber *index = ReadPositional(characters, length, cursor, &tokenLength);
+			substitution.key = JATCompilerAddConstant(compiler, index);
+			substitution.index = index.unsignedIntegerValue;
+			substitution.isPositional = true;
+		}
+		else
+		{
+			*outSyntaxWarning = JATCompilerAddConstant(compiler, JATPrepareWarning(characters, length, @"Unknown template substitution syntax {{{expression}}}.", expression));
+			return NSNotFound;
+		}
+		cursor += tokenLength;
+
+		// At this point, we expect one or more bars, each followed by an operator expression.
+		if (characters[cursor] != '|')
+		{
+			substitution.syntaxWarning = JATCompilerAddConstant(compiler, JATPrepareWarning(characters, length, @"Unexpected character '{0}' in template substitution {{{1}}}.", [NSString stringWithCharacters:characters + cursor length:1], expression));
+		}
+
+		while (characters[cursor] == '|')
+		{
+			cursor++;
+			NSUInteger opLength;
+			if (!ScanIdentifier(characters, length, cursor, &opLength))
+			{
+				substitution.syntaxWarning = JATCompilerAddConstant(compiler, JATPrepareWarning(characters, length, @"Expected identifier after | in {{{expression}}}.", expression));
+				break;
+			}
+
+			JATOperation operation =
+			{
+				.name = JATCompilerAddConstant(compiler, [NSString stringWithCharacters:characters + cursor length:opLength]),
+				.argument = NSNotFound
+			};
+			cursor += opLength;
+
+			if (characters[cursor] == ':')
+			{
+				// Everything up to the next | or } at nesting level 1 is the argument.
+				cursor++;
+				NSUInteger argStart = cursor;
+				balanceCount = 1;
+				for (; cursor < length; cursor++)
+				{
+					if (characters[cursor] == '{')  balanceCount++;
+					if (balanceCount == 1)
+					{
+						if (characters[cursor] == '|' || characters[cursor] == '}')
+						{
+							break;
+						}
+					}
+
+					if (characters[cursor] == '}')  balanceCount--;
+				}
+
+				operation.argument = JATCompilerAddConstant(compiler, [NSString stringWithCharacters:characters + argStart length:cursor - argStart]);
+			}
+
+			compiler->operations[compiler->operationCount++] = operation;
+			substitution.operationCount++;
+		}
+	}
+
+	NSCAssert(substitution.key != NSNotFound, @"Internal bug in JATemplate: compiled substitution has no key.");
+
+	*outReplaceLength = replaceLength;
+	NSUInteger result = compiler->substitutionCount++;
+	compiler->substitutions[result] = substitution;
+	return result;
+}
+
+
+static NSUInteger JATCompilerAddConstant(JATCompiler *compiler, id constant)
+{
+	if (constant == nil)  return NSNotFound;
+
+	[compiler->constants addObject:constant];
+	return compiler->constants.count - 1;
+}
+
+
+#pragma mark - Lowered templates
+
+/*	Templates lowered at compile time by JATExpandLiteralChecked() are run
+	straight from their segment tables. The first expansion through a call
+	site copies the template's characters and makes strings for the operator
+	names and arguments; after that, nothing is parsed or looked up by name.
+	
+	When a substitution fails at run time (an operator returns nil), the
+	scanner's recovery is to rescan from the character after the opening
+	brace. Rather than reproduce that here, the expansion is redone by the
+	ordinary scanner, which gives the same result as JATExpandLiteral(). The
+	scanner is handed the results of the substitutions already performed
+	(see sKnownSubstitutions), so no operator runs or warns twice.
+*/
+@interface JATLoweredProgram: NSObject
+{
+@public
+	unichar					*_characters;
+	NSUInteger				_length;
+	bool					_latin1;
+	NSArray					*_operators;			// Name and argument (or NSNull) of each operation.
+	NSUInteger				_outputLengthHint;		// Accessed atomically.
+}
+
+- (instancetype) initWithTemplateString:(NSString *)templateString lowered:(const JATLoweredTemplate *)lowered;
+
+@end
+
+
+@implementation JATLoweredProgram
+
+- (instancetype) initWithTemplateString:(NSString *)templateString lowered:(const JATLoweredTemplate *)lowered
+{
+	NSParameterAssert(templateString != nil && lowered != NULL);
+
+	if ((self = [super init]))
+	{
+		_length = templateString.length;
+		_characters = malloc(sizeof *_characters * MAX(_length, (NSUInteger)1));
+		if (_characters == NULL)  return nil;
+		[templateString getCharacters:_characters range:(NSRange){ 0, _length }];
+		_latin1 = JATCharactersAreLatin1(_characters, _length);
+
+		for (NSUInteger idx = 0; idx < lowered->segmentCount; idx++)
+		{
+			const JATLoweredSegment *segment = &lowered->segments[idx];
+			NSAssert((NSUInteger)segment->start + segment->length <= _length &&
+					 (NSUInteger)segment->firstOperation + segment->operationCount <= lowered->operationCount,
+					 @"Internal bug in JATemplate: lowered template doesn't match its template string.");
+		}
+
+		NSMutableArray *operators = [NSMutableArray arrayWithCapacity:lowered->operationCount * 2];
+		for (NSUInteger idx = 0; idx < lowered->operationCount; idx++)
+		{
+			const JATLoweredOperation *operation = &lowered->operations[idx];
+			NSAssert((NSUInteger)operation->nameStart + operation->nameLength <= _length &&
+					 (NSUInteger)operation->argumentStart + operation->argumentLength <= _length,
+					 @"Internal bug in JATemplate: lowered template doesn't match its template string.");
+
+			[operators addObject:[NSString stringWithCharacters:_characters + operation->nameStart length:operation->nameLength]];
+			if (operation->hasArgument)
+			{
+				[operators addObject:[NSString stringWithCharacters:_characters + operation->argumentStart length:operation->argumentLength]];
+			}
+			else
+			{
+				[operators addObject:NSNull.null];
+			}
+		}
+		_operators = [operators copy];
+	}
+
+	return self;
+}
+
+
+- (void) dealloc
+{
+	free(_characters);
+}
+
+@end
+
+
+/*	JATLoweredCallSiteProgram(callSite, template, lowered)
+
+	Returns the program for a call site, creating it on first use. As with
+	parsed names, the program is kept for the lifetime of the process, and if
+	two threads race to create it the loser's is thrown away.
+*/
+static JATLoweredProgram *JATLoweredCallSiteProgram(JATLoweredCallSite *callSite, NSString *template, const JATLoweredTemplate *lowered)
+{
+	void *existing = __atomic_load_n(&callSite->program, __ATOMIC_ACQUIRE);
+	if (existing != NULL)  return (__bridge JATLoweredProgram *)existing;
+
+	JATLoweredProgram *program = [[JATLoweredProgram alloc] initWithTemplateString:template lowered:lowered];
+	if (program == nil)  return nil;
+
+	void *retained = (void *)(uintptr_t)CFBridgingRetain(program);
+	if (!__atomic_compare_exchange_n(&callSite->program, &existing, retained, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		CFRelease(retained);
+		return (__bridge JATLoweredProgram *)existing;
+	}
+
+	return program;
+}
+
+
+static NSString *JATPerformLoweredSubstitution(JATLoweredProgram *program, const JATLoweredSegment *segment, const JATParameterFrame *frame, NSDictionary * __strong *variables)
+{
+	const JATParameterValue *parameter = JATParameterFrameEntryAtIndex(frame, (NSUInteger)segment->parameter);
+	NSCAssert(parameter != NULL, @"Internal bug in JATemplate: lowered template refers to a missing parameter.");
+	if (parameter == NULL)  return nil;
+
+	// Unboxed integers without operators don't need an NSNumber.
+	if (segment->operationCount == 0)
+	{
+		NSString *result = JATFormatParameterValue(parameter);
+		if (result != nil)  return result;
+	}
+
+	id value = JATParameterValueObject(parameter);
+	NSArray *operators = program->_operators;
+	NSUInteger endOperation = (NSUInteger)segment->firstOperation + segment->operationCount;
+	for (NSUInteger operation = segment->firstOperation; value != nil && operation < endOperation; operation++)
+	{
+		NSString *operator = operators[operation * 2];
+		NSString *argument = operators[operation * 2 + 1];
+		if ((id)argument == NSNull.null)  argument = nil;
+
+		if (*variables == nil)  *variables = [[JATParameterFrameDictionary alloc] initWithParameterFrame:frame];
+
+#if JATEMPLATE_INSTRUMENTATION
+		if (__atomic_load_n(&sInstrumentationEnabled, __ATOMIC_RELAXED))
+		{
+			uint64_t start = JATMonotonicNanoseconds();
+			value = [value jatemplatePerformOperator:operator withArgument:argument variables:*variables];
+			JATInstrumentationRecordOperator(operator, JATMonotonicNanoseconds() - start);
+			continue;
+		}
+#endif
+		value = [value jatemplatePerformOperator:operator withArgument:argument variables:*variables];
+	}
+
+	return [value jatemplateCoerceToString];
+}
+
+
+/*	JATLoweredKnownSubstitutions(output, segments, failedSegment, replacementRanges)
+
+	Collect the results of the substitutions before <failedSegment> from the
+	output buffer. Only substitutions with operators are included, since the
+	others are cheap and have no side effects.
+*/
+static NSDictionary *JATLoweredKnownSubstitutions(const JATOutputBuffer *output, const JATLoweredSegment segments[], NSUInteger failedSegment, const NSRange replacementRanges[])
+{
+	NSMutableDictionary *result = [NSMutableDictionary dictionary];
+	for (NSUInteger idx = 0; idx < failedSegment; idx++)
+	{
+		if (segments[idx].parameter < 0 || segments[idx].operationCount == 0)  continue;
+		result[@(segments[idx].start)] = JATOutputBufferCopyRange(output, replacementRanges[idx]);
+	}
+	result[@(segments[failedSegment].start)] = NSNull.null;
+	return result;
+}
+
+
+/*	JATRunLoweredProgram(program, lowered, template, frame, outKnownSubstitutions)
+
+	Expand a lowered template. If a substitution fails, returns nil and sets
+	*outKnownSubstitutions to the results so far, for the scanner to reuse.
+*/
+static NSString *JATRunLoweredProgram(JATLoweredProgram *program, const JATLoweredTemplate *lowered, NSString *template, const JATParameterFrame *frame, NSDictionary * __autoreleasing *outKnownSubstitutions)
+{
+	const JATLoweredSegment *segments = lowered->segments;
+	NSUInteger segmentCount = lowered->segmentCount;
+
+	// No substitutions and no escapes.
+	if (segmentCount == 0)  return template;
+	if (segmentCount == 1 && segments[0].parameter < 0 && segments[0].length == program->_length)  return template;
+
+	NSDictionary *variables = nil;
+	JATOutputBuffer output = { .length = 0 };
+
+	@try
+	{
+		if (segmentCount == 1 && segments[0].parameter >= 0)
+		{
+			// Replacing entire template in one pop.
+			NSString *result = JATPerformLoweredSubstitution(program, &segments[0], frame, &variables);
+			if (result == nil)  *outKnownSubstitutions = @{ @(segments[0].start): NSNull.null };
+			return result;
+		}
+
+		NSUInteger sizeHint = __atomic_load_n(&program->_outputLengthHint, __ATOMIC_RELAXED);
+		if (!JATOutputBufferBegin(&output, MAX(sizeHint, program->_length), !program->_latin1))  return nil;
+
+		// Where each replacement went in the output, in case they're needed for falling back.
+		NSRange replacementRanges[segmentCount];
+
+		for (NSUInteger idx = 0; idx < segmentCount; idx++)
+		{
+			const JATLoweredSegment *segment = &segments[idx];
+			if (segment->parameter < 0)
+			{
+				if (!JATOutputBufferAppendLiteral(&output, program->_characters + segment->start, segment->length))  return nil;
+				continue;
+			}
+
+			NSString *replacement;
+			@autoreleasepool
+			{
+				replacement = JATPerformLoweredSubstitution(program, segment, frame, &variables);
+			}
+			if (replacement == nil)
+			{
+				*outKnownSubstitutions = JATLoweredKnownSubstitutions(&output, segments, idx, replacementRanges);
+				return nil;
+			}
+
+			NSUInteger start = output.length;
+			if (!JATOutputBufferAppendString(&output, replacement))  return nil;
+			replacementRanges[idx] = (NSRange){ start, output.length - start };
+		}
+
+		__atomic_store_n(&program->_outputLengthHint, output.length, __ATOMIC_RELAXED);
+		return JATOutputBufferFinish(&output);
+	}
+	@finally
+	{
+		JATOutputBufferCleanUp(&output);
+		[(JATParameterFrameDictionary *)variables detachFromParameterFrame];
+	}
+}
+
+
+/*
+	JAT_DoExpandLoweredTemplateUsingCallSite(template, lowered, callSite, names, values, count)
+
+	Like JAT_DoExpandTemplateUsingCallSite(), but with the template already
+	parsed into <lowered> at compile time. The names are still needed for
+	operators that look up variables, and for falling back to the scanner.
+*/
+NSString *JAT_DoExpandLoweredTemplateUsingCallSite(NSString *template, const JATLoweredTemplate *lowered, JATLoweredCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count)
+{
+	NSCParameterAssert(template != nil);
+	NSCParameterAssert(lowered != NULL);
+	NSCParameterAssert(callSite != NULL);
+	NSCParameterAssert(values != NULL || count == 0);
+
+	JATLoweredProgram *program = JATLoweredCallSiteProgram(callSite, template, lowered);
+	const JATParsedNames *parsedNames = JATCallSiteParsedNames(&callSite->names, names, count);
+	if (program == nil || parsedNames == NULL)  return nil;
+
+	NSCAssert(parsedNames->count == count, @"JATemplate call site used with different parameter lists.");
+
+	JATParameterFrame frame =
+	{
+		.values = values,
+		.names = parsedNames->names,
+		.count = count
+	};
+
+	// Let warnings from operators find the template they came from.
+	JATWarningContext warningContext = { program->_characters, program->_length, sWarningContext };
+	sWarningContext = &warningContext;
+
+	NSDictionary *knownSubstitutions = nil;
+	NSString *result;
+	@try
+	{
+		result = JATRunLoweredProgram(program, lowered, template, &frame, &knownSubstitutions);
+	}
+	@finally
+	{
+		// An operator may throw; don't leave the context pointing into this frame.
+		sWarningContext = warningContext.outer;
+	}
+
+	if (knownSubstitutions != nil)
+	{
+		sKnownSubstitutions = knownSubstitutions;
+		@try
+		{
+			result = JATExpandWithParsedNames(nil, template, parsedNames->names, values, count, NULL);
+		}
+		@finally
+		{
+			sKnownSubstitutions = nil;
+		}
+	}
+	return result;
+}
+
+
+#pragma mark - Template cache
+
+static NSCache *JATTemplateCache(void)
+{
+	static NSCache *cache;
+
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		cache = [NSCache new];
+		cache.name = @"se.ayton.jens.jatemplate.templates";
+		cache.countLimit = __atomic_load_n(&sTemplateCacheLimit, __ATOMIC_RELAXED);
+	});
+
+	return cache;
+}
+
+
+void JATSetTemplateCacheLimit(NSUInteger limit)
+{
+	__atomic_store_n(&sTemplateCacheLimit, limit, __ATOMIC_RELAXED);
+
+	NSCache *caches[] = { JATTemplateCache(), JATLocalizationCache() };
+	for (size_t idx = 0; idx < sizeof caches / sizeof *caches; idx++)
+	{
+		if (limit == 0)  [caches[idx] removeAllObjects];
+		else  caches[idx].countLimit = limit;
+	}
+}
+
+
+void JATFlushTemplateCache(void)
+{
+	[JATTemplateCache() removeAllObjects];
+	[JATLocalizationCache() removeAllObjects];
+}
+
+
+#pragma mark - Localization cache
+
+/*	Localized templates are cached by (bundle, table, key), together with
+	their compiled form, so that localized expansion doesn't have to go
+	through -[NSBundle localizedStringForKey:value:table:] every time. The
+	cache shares the template cache's limit, and is emptied when the current
+	locale changes.
+*/
+@interface JATLocalizationKey: NSObject <NSCopying>
+{
+@public
+	NSBundle					*_bundle;
+	NSString					*_table;
+	NSString					*_key;
+}
+@end
+
+
+@implementation JATLocalizationKey
+
+- (NSUInteger) hash
+{
+	return _key.hash ^ _table.hash ^ (NSUInteger)(__bridge void *)_bundle;
+}
+
+
+- (BOOL) isEqual:(id)other
+{
+	if (![other isKindOfClass:JATLocalizationKey.class])  return NO;
+
+	JATLocalizationKey *otherKey = other;
+	return _bundle == otherKey->_bundle &&
+		   (_table == otherKey->_table || [_table isEqualToString:otherKey->_table]) &&
+		   [_key isEqualToString:otherKey->_key];
+}
+
+
+- (id) copyWithZone:(NSZone *)zone
+{
+	// Keys are only stored after their strings have been copied, so they are immutable.
+	return self;
+}
+
+@end
+
+
+static NSUInteger sLocalizationCacheHits;
+static NSUInteger sLocalizationCacheMisses;
+
+
+static NSCache *JATLocalizationCache(void)
+{
+	static NSCache *cache;
+
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		cache = [NSCache new];
+		cache.name = @"se.ayton.jens.jatemplate.localizations";
+		cache.countLimit = __atomic_load_n(&sTemplateCacheLimit, __ATOMIC_RELAXED);
+
+		[NSNotificationCenter.defaultCenter addObserverForName:NSCurrentLocaleDidChangeNotification object:nil queue:nil usingBlock:^(NSNotification *notification)
+		{
+			[cache removeAllObjects];
+		}];
+	});
+
+	return cache;
+}
+
+
+/*	JATLocalizedTemplate(key, table, bundle)
+
+	Performs the equivalent of NSLocalizedStringFromTableInBundle() and
+	returns the compiled result.
+*/
+static JATCompiledTemplate *JATLocalizedTemplate(NSString *key, NSString *table, NSBundle *bundle)
+{
+	NSCParameterAssert(key != nil);
+
+	if (bundle == nil)  bundle = [NSBundle mainBundle];
+
+	if (__atomic_load_n(&sTemplateCacheLimit, __ATOMIC_RELAXED) == 0)
+	{
+		// Caching is disabled.
+		return JATLookUpLocalizedTemplate(key, table, bundle);
+	}
+
+	NSCache *cache = JATLocalizationCache();
+	JATLocalizationKey *lookupKey = [JATLocalizationKey new];
+	lookupKey->_bundle = bundle;
+	lookupKey->_table = table;
+	lookupKey->_key = key;
+
+	JATCompiledTemplate *result = [cache objectForKey:lookupKey];
+	if (result != nil)
+	{
+		__atomic_add_fetch(&sLocalizationCacheHits, 1, __ATOMIC_RELAXED);
+		return result;
+	}
+
+	__atomic_add_fetch(&sLocalizationCacheMisses, 1, __ATOMIC_RELAXED);
+
+	result = JATLookUpLocalizedTemplate(key, table, bundle);
+	if (result != nil)
+	{
+		// The key and table might be mutable.
+		lookupKey->_table = [table copy];
+		lookupKey->_key = [key copy];
+		[cache setObject:result forKey:lookupKey];
+	}
+
+	return result;
+}
+
+
+NSString *JATLocalizedString(NSString *key, NSString *table, NSBundle *bundle)
+{
+	if (key == nil)  return nil;
+	return JATLocalizedTemplate(key, table, bundle).templateString;
+}
+
+
+/*	JATLookUpLocalizedTemplate(key, table, bundle)
+
+	Find a localized template in the table's catalog if there is one, or
+	otherwise in the bundle, bypassing the localization cache.
+*/
+static JATCompiledTemplate *JATLookUpLocalizedTemplate(NSString *key, NSString *table, NSBundle *bundle)
+{
+	JATCompiledTemplate *result = [JATBundleTemplateCatalog(bundle, table) compiledTemplateForKey:key];
+	if (result == nil)
+	{
+		NSString *localized = [bundle localizedStringForKey:key value:@"" table:table];
+		result = [JATCompiledTemplate compiledTemplateWithString:localized];
+	}
+
+	return result;
+}
+
+
+JATLocalizationCacheStatistics JATGetLocalizationCacheStatistics(void)
+{
+	return (JATLocalizationCacheStatistics)
+	{
+		.hits = __atomic_load_n(&sLocalizationCacheHits, __ATOMIC_RELAXED),
+		.misses = __atomic_load_n(&sLocalizationCacheMisses, __ATOMIC_RELAXED)
+	};
+}
+
+
+#pragma mark - Template catalogs
+
+/*	A template catalog is a file of compiled templates, laid out so that the
+	program tables can be used in place once the file is mapped into memory.
+	All offsets are from the start of the file, every table is eight-byte
+	aligned, and strings are stored as native-endian UTF-16.
+	
+	The instruction, substitution and operation tables are stored exactly as
+	they are in memory, so a catalog can only be used by code with the same
+	word size, byte order and table layout as the code which wrote it. The
+	header records enough to check this; a catalog with the wrong byte order
+	fails the magic number check.
+	
+	Templates are found through an open-addressed hash table of template
+	indices plus one (so that zero means an empty bucket), using a hash of the
+	key's UTF-16 characters.
+*/
+enum
+{
+	kJATCatalogMagic			= 0x4A415443,	// 'JATC'
+	kJATCatalogVersion			= 1
+};
+
+
+typedef struct
+{
+	uint32_t				magic;
+	uint16_t				version;
+	uint16_t				wordSize;			// sizeof (NSUInteger) of the writer.
+	uint16_t				instructionSize;
+	uint16_t				substitutionSize;
+	uint16_t				operationSize;
+	uint16_t				reserved;
+	uint64_t				fileSize;
+	uint64_t				templateCount;
+	uint64_t				templatesOffset;	// JATCatalogTemplate[templateCount]
+	uint64_t				bucketCount;		// A power of two.
+	uint64_t				bucketsOffset;		// uint64_t[bucketCount]
+} JATCatalogHeader;
+
+
+typedef struct
+{
+	uint64_t				offset;
+	uint64_t				length;				// In UTF-16 code units.
+} JATCatalogString;
+
+
+typedef enum
+{
+	kJATCatalogConstantString,
+	kJATCatalogConstantNumber
+} JATCatalogConstantKind;
+
+
+typedef struct
+{
+	uint64_t				kind;				// JATCatalogConstantKind
+	uint64_t				value;				// Number value, or offset of string.
+	uint64_t				length;				// Length of string.
+} JATCatalogConstant;
+
+
+typedef struct
+{
+	JATCatalogString		key;
+	JATCatalogString		templateString;
+	uint64_t				instructionsOffset;
+	uint64_t				instructionCount;
+	uint64_t				substitutionsOffset;
+	uint64_t				substitutionCount;
+	uint64_t				operationsOffset;
+	uint64_t				operationCount;
+	uint64_t				constantsOffset;	// JATCatalogConstant[constantCount]
+	uint64_t				constantCount;
+} JATCatalogTemplate;
+
+
+static uint64_t JATCatalogHash(JATCharacterSpan key);
+static bool JATCatalogHeaderIsValid(const JATCatalogHeader *header, size_t size);
+static const JATCatalogTemplate *JATCatalogFindTemplate(const uint8_t *bytes, JATCharacterSpan key);
+static JATCompiledTemplate *JATCatalogLoadTemplate(JATTemplateCatalog *catalog, const uint8_t *bytes, size_t size, const JATCatalogTemplate *entry);
+static JATCatalogString JATCatalogAppendString(NSMutableData *data, NSString *string);
+static bool JATCatalogAppendTemplate(NSMutableData *data, JATCompiledTemplate *compiled, JATCatalogTemplate *entry);
+static void JATCatalogAlign(NSMutableData *data);
+static BOOL JATCatalogFail(NSError **error, NSString *domain, NSInteger code, NSString *path);
+
+
+@implementation JATTemplateCatalog
+{
+	const uint8_t			*_bytes;
+	size_t					_size;
+}
+
+
++ (instancetype) catalogWithContentsOfFile:(NSString *)path error:(NSError **)error
+{
+	return [[self alloc] initWithContentsOfFile:path error:error];
+}
+
+
+- (instancetype) initWithContentsOfFile:(NSString *)path error:(NSError **)error
+{
+	NSParameterAssert(path != nil);
+
+	if ((self = [super init]))
+	{
+		int fd = open(path.fileSystemRepresentation, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			JATCatalogFail(error, NSPOSIXErrorDomain, errno, path);
+			return nil;
+		}
+
+		struct stat info;
+		if (fstat(fd, &info) != 0)
+		{
+			JATCatalogFail(error, NSPOSIXErrorDomain, errno, path);
+			close(fd);
+			return nil;
+		}
+
+		if (info.st_size < (off_t)sizeof (JATCatalogHeader))
+		{
+			JATCatalogFail(error, NSCocoaErrorDomain, NSFileReadCorruptFileError, path);
+			close(fd);
+			return nil;
+		}
+
+		/*	The mapping is read-only and backed by the file, so its pages are
+			shared with every other process using the same catalog.
+		*/
+		size_t size = (size_t)info.st_size;
+		void *bytes = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		int mapError = errno;
+		close(fd);
+
+		if (bytes == MAP_FAILED)
+		{
+			JATCatalogFail(error, NSPOSIXErrorDomain, mapError, path);
+			return nil;
+		}
+
+		_bytes = bytes;
+		_size = size;
+
+		if (!JATCatalogHeaderIsValid(bytes, size))
+		{
+			// -dealloc unmaps the file.
+			JATCatalogFail(error, NSCocoaErrorDomain, NSFileReadCorruptFileError, path);
+			return nil;
+		}
+	}
+
+	return self;
+}
+
+
+- (void) dealloc
+{
+	if (_bytes != NULL)  munmap((void *)(uintptr_t)_bytes, _size);
+}
+
+
+- (NSUInteger) count
+{
+	return (NSUInteger)((const JATCatalogHeader *)(const void *)_bytes)->templateCount;
+}
+
+
+- (JATCompiledTemplate *) compiledTemplateForKey:(NSString *)key
+{
+	NSParameterAssert(key != nil);
+
+	const uint8_t *bytes = _bytes;
+	__block const JATCatalogTemplate *entry = NULL;
+	JATWithCharacterSpan(key, ^(JATCharacterSpan span)
+	{
+		entry = JATCatalogFindTemplate(bytes, span);
+	});
+
+	if (entry == NULL)  return nil;
+	return JATCatalogLoadTemplate(self, _bytes, _size, entry);
+}
+
+@end
+
+
+BOOL JATWriteTemplateCatalog(NSDictionary *templates, NSString *path, NSError **error)
+{
+	NSCParameterAssert(templates != nil);
+	NSCParameterAssert(path != nil);
+
+	for (id key in templates)
+	{
+		if (![key isKindOfClass:NSString.class] || ![templates[key] isKindOfClass:NSString.class])
+		{
+			return JATCatalogFail(error, NSCocoaErrorDomain, NSFileWriteUnknownError, path);
+		}
+	}
+
+	// Sort the keys so that the same table always produces the same catalog.
+	NSArray *keys = [templates.allKeys sortedArrayUsingSelector:@selector(compare:)];
+	NSUInteger count = keys.count;
+
+	// Keep the hash table at most half full.
+	uint64_t bucketCount = 1;
+	while (bucketCount < (uint64_t)count * 2)  bucketCount *= 2;
+
+	NSUInteger templatesOffset = sizeof (JATCatalogHeader);
+	NSUInteger bucketsOffset = templatesOffset + sizeof (JATCatalogTemplate) * count;
+	NSMutableData *data = [NSMutableData dataWithLength:bucketsOffset + sizeof (uint64_t) * bucketCount];
+
+	JATCatalogTemplate *entries = calloc(MAX(count, (NSUInteger)1), sizeof *entries);
+	uint64_t *buckets = calloc(bucketCount, sizeof *buckets);
+	if (data == nil || entries == NULL || buckets == NULL)
+	{
+		free(entries);
+		free(buckets);
+		return JATCatalogFail(error, NSPOSIXErrorDomain, ENOMEM, path);
+	}
+
+	BOOL OK = YES;
+	for (NSUInteger idx = 0; OK && idx < count; idx++)
+	{
+		@autoreleasepool
+		{
+			NSString *key = keys[idx];
+			JATCompiledTemplate *compiled = [[JATCompiledTemplate alloc] initWithString:templates[key]];
+			entries[idx].key = JATCatalogAppendString(data, key);
+			if (compiled == nil || !JATCatalogAppendTemplate(data, compiled, &entries[idx]))
+			{
+				OK = JATCatalogFail(error, NSPOSIXErrorDomain, ENOMEM, path);
+				break;
+			}
+
+			__block uint64_t hash;
+			JATWithCharacterSpan(key, ^(JATCharacterSpan span)
+			{
+				hash = JATCatalogHash(span);
+			});
+
+			uint64_t bucket = hash & (bucketCount - 1);
+			while (buckets[bucket] != 0)  bucket = (bucket + 1) & (bucketCount - 1);
+			buckets[bucket] = idx + 1;
+		}
+	}
+
+	if (OK)
+	{
+		JATCatalogHeader header =
+		{
+			.magic = kJATCatalogMagic,
+			.version = kJATCatalogVersion,
+			.wordSize = sizeof (NSUInteger),
+			.instructionSize = sizeof (JATInstruction),
+			.substitutionSize = sizeof (JATSubstitution),
+			.operationSize = sizeof (JATOperation),
+			.fileSize = data.length,
+			.templateCount = count,
+			.templatesOffset = templatesOffset,
+			.bucketCount = bucketCount,
+			.bucketsOffset = bucketsOffset
+		};
+
+		[data replaceBytesInRange:(NSRange){ 0, sizeof header } withBytes:&header];
+		[data replaceBytesInRange:(NSRange){ templatesOffset, sizeof *entries * count } withBytes:entries];
+		[data replaceBytesInRange:(NSRange){ bucketsOffset, sizeof *buckets * bucketCount } withBytes:buckets];
+
+		OK = [data writeToFile:path options:NSDataWritingAtomic error:error];
+	}
+
+	free(entries);
+	free(buckets);
+	return OK;
+}
+
+
+// Catalogs (or NSNull for tables without one) by table name, by bundle.
+static NSMapTable *JATCatalogsByBundle(void)
+{
+	static NSMapTable *catalogsByBundle;
+
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		catalogsByBundle = [NSMapTable strongToStrongObjectsMapTable];
+	});
+
+	return catalogsByBundle;
+}
+
+
+/*	JATBundleTemplateCatalog(bundle, table)
+
+	Returns the catalog for a table in a bundle, if it has one. Catalogs are
+	found with the normal localized resource lookup and kept until
+	JATFlushTemplateCatalogs(), as are failed lookups.
+*/
+static JATTemplateCatalog *JATBundleTemplateCatalog(NSBundle *bundle, NSString *table)
+{
+	NSCParameterAssert(bundle != nil);
+
+	NSMapTable *catalogsByBundle = JATCatalogsByBundle();
+
+	if (table.length == 0)  table = @"Localizable";
+
+	@synchronized (catalogsByBundle)
+	{
+		NSMutableDictionary *catalogs = [catalogsByBundle objectForKey:bundle];
+		if (catalogs == nil)
+		{
+			catalogs = [NSMutableDictionary dictionary];
+			[catalogsByBundle setObject:catalogs forKey:bundle];
+		}
+
+		id catalog = catalogs[table];
+		if (catalog == nil)
+		{
+			NSString *path = [bundle pathForResource:table ofType:@"jatcatalog"];
+			if (path != nil)
+			{
+				NSError *error;
+				catalog = [JATTemplateCatalog catalogWithContentsOfFile:path error:&error];
+#if JATEMPLATE_SYNTAX_WARNINGS
+				if (catalog == nil)
+				{
+					JATReportWarning(JATExpandLiteral(@"Could not load template catalog {path}; using the strings table instead. {error}", path, error.localizedDescription));
+				}
+#endif
+			}
+
+			if (catalog == nil)  catalog = NSNull.null;
+			catalogs[[table copy]] = catalog;
+		}
+
+		return (catalog != NSNull.null) ? catalog : nil;
+	}
+}
+
+
+void JATFlushTemplateCatalogs(void)
+{
+	NSMapTable *catalogsByBundle = JATCatalogsByBundle();
+	@synchronized (catalogsByBundle)
+	{
+		[catalogsByBundle removeAllObjects];
+	}
+	[JATLocalizationCache() removeAllObjects];
+}
+
+
+static uint64_t JATCatalogHash(JATCharacterSpan key)
+{
+	// FNV-1a over UTF-16 code units.
+	uint64_t hash = 14695981039346656037ULL;
+	for (NSUInteger idx = 0; idx < key.length; idx++)
+	{
+		hash = (hash ^ JATCharacterSpanAt(key, idx)) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+
+/*	JATCatalogRangeIsValid(size, offset, count, elementSize, alignment)
+
+	Check that an array of <count> elements at <offset> is aligned and lies
+	entirely within a file of <size> bytes.
+*/
+static bool JATCatalogRangeIsValid(size_t size, uint64_t offset, uint64_t count, size_t elementSize, size_t alignment)
+{
+	if (offset % alignment != 0 || offset > size)  return false;
+	return count <= (size - offset) / elementSize;
+}
+
+
+static bool JATCatalogStringIsValid(size_t size, JATCatalogString string)
+{
+	return JATCatalogRangeIsValid(size, string.offset, string.length, sizeof (unichar), sizeof (unichar));
+}
+
+
+static bool JATCatalogHeaderIsValid(const JATCatalogHeader *header, size_t size)
+{
+	return header->magic == kJATCatalogMagic &&
+		   header->version == kJATCatalogVersion &&
+		   header->wordSize == sizeof (NSUInteger) &&
+		   header->instructionSize == sizeof (JATInstruction) &&
+		   header->substitutionSize == sizeof (JATSubstitution) &&
+		   header->operationSize == sizeof (JATOperation) &&
+		   header->fileSize == size &&
+		   header->bucketCount != 0 &&
+		   (header->bucketCount & (header->bucketCount - 1)) == 0 &&
+		   JATCatalogRangeIsValid(size, header->templatesOffset, header->templateCount, sizeof (JATCatalogTemplate), 8) &&
+		   JATCatalogRangeIsValid(size, header->bucketsOffset, header->bucketCount, sizeof (uint64_t), 8);
+}
+
+
+static bool JATCatalogKeyEquals(const unichar stored[], JATCharacterSpan key)
+{
+	if (key.characters != NULL)  return memcmp(stored, key.characters, sizeof (unichar) * key.length) == 0;
+	
+	for (NSUInteger idx = 0; idx < key.length; idx++)
+	{
+		if (stored[idx] != key.bytes[idx])  return false;
+	}
+	return true;
+}
+
+
+static const JATCatalogTemplate *JATCatalogFindTemplate(const uint8_t *bytes, JATCharacterSpan key)
+{
+	const JATCatalogHeader *header = (const void *)bytes;
+	const JATCatalogTemplate *templates = (const void *)(bytes + header->templatesOffset);
+	const uint64_t *buckets = (const void *)(bytes + header->bucketsOffset);
+	uint64_t mask = header->bucketCount - 1;
+
+	uint64_t bucket = JATCatalogHash(key) & mask;
+	for (uint64_t probes = 0; probes < header->bucketCount; probes++)
+	{
+		uint64_t entry = buckets[bucket];
+		if (entry == 0 || entry > header->templateCount)  break;
+
+		const JATCatalogTemplate *candidate = &templates[entry - 1];
+		if (candidate->key.length == key.length &&
+			JATCatalogStringIsValid(header->fileSize, candidate->key) &&
+			JATCatalogKeyEquals((const unichar *)(const void *)(bytes + candidate->key.offset), key))
+		{
+			return candidate;
+		}
+
+		bucket = (bucket + 1) & mask;
+	}
+
+	return NULL;
+}
+
+
+/*	JATCatalogConstantIsValid(bytes, size, entry, index, requireString)
+
+	Check that <index> refers to a well-formed constant of the template. If
+	<allowNotFound> is set, NSNotFound is also accepted.
+*/
+static bool JATCatalogConstantIsValid(const uint8_t *bytes, size_t size, const JATCatalogTemplate *entry, NSUInteger index, bool requireString, bool allowNotFound)
+{
+	if (index == NSNotFound)  return allowNotFound;
+	if (index >= entry->constantCount)  return false;
+
+	const JATCatalogConstant *constant = (const JATCatalogConstant *)(const void *)(bytes + entry->constantsOffset) + index;
+	if (constant->kind == kJATCatalogConstantNumber)  return !requireString;
+	if (constant->kind != kJATCatalogConstantString)  return false;
+
+	return JATCatalogStringIsValid(size, (JATCatalogString){ constant->value, constant->length });
+}
+
+
+// An instruction may only continue with one at a later position in the template.
+static bool JATCatalogJumpIsValid(const JATInstruction instructions[], uint64_t instructionCount, const JATInstruction *from, NSUInteger target)
+{
+	return target < instructionCount && instructions[target].position > from->position;
+}
+
+
+/*	JATCatalogTemplateIsValid(bytes, size, entry)
+
+	Check that a template's tables lie within the catalog and only refer to
+	each other, its characters and its constants within bounds, and that
+	every instruction continues further on in the template, so that a
+	damaged catalog can't make the expander read outside the mapping or
+	loop forever.
+*/
+static bool JATCatalogTemplateIsValid(const uint8_t *bytes, size_t size, const JATCatalogTemplate *entry)
+{
+	if (!JATCatalogStringIsValid(size, entry->templateString) ||
+		!JATCatalogRangeIsValid(size, entry->instructionsOffset, entry->instructionCount, sizeof (JATInstruction), 8) ||
+		!JATCatalogRangeIsValid(size, entry->substitutionsOffset, entry->substitutionCount, sizeof (JATSubstitution), 8) ||
+		!JATCatalogRangeIsValid(size, entry->operationsOffset, entry->operationCount, sizeof (JATOperation), 8) ||
+		!JATCatalogRangeIsValid(size, entry->constantsOffset, entry->constantCount, sizeof (JATCatalogConstant), 8) ||
+		entry->instructionCount == 0)
+	{
+		return false;
+	}
+
+	uint64_t length = entry->templateString.length;
+
+	const JATOperation *operations = (const void *)(bytes + entry->operationsOffset);
+	for (uint64_t idx = 0; idx < entry->operationCount; idx++)
+	{
+		if (!JATCatalogConstantIsValid(bytes, size, entry, operations[idx].name, true, false) ||
+			!JATCatalogConstantIsValid(bytes, size, entry, operations[idx].argument, true, true))
+		{
+			return false;
+		}
+	}
+
+	const JATSubstitution *substitutions = (const void *)(bytes + entry->substitutionsOffset);
+	for (uint64_t idx = 0; idx < entry->substitutionCount; idx++)
+	{
+		const JATSubstitution *substitution = &substitutions[idx];
+		if (!JATCatalogConstantIsValid(bytes, size, entry, substitution->key, false, false) ||
+			!JATCatalogConstantIsValid(bytes, size, entry, substitution->syntaxWarning, true, true) ||
+			substitution->nameStart > length || substitution->nameLength > length - substitution->nameStart ||
+			substitution->firstOperation > entry->operationCount ||
+			substitution->operationCount > entry->operationCount - substitution->firstOperation)
+		{
+			return false;
+		}
+	}
+
+	const JATInstruction *instructions = (const void *)(bytes + entry->instructionsOffset);
+	for (uint64_t idx = 0; idx < entry->instructionCount; idx++)
+	{
+		const JATInstruction *instruction = &instructions[idx];
+		if (instruction->kind == kJATInstructionEnd)  continue;
+
+		if (instruction->position > length || instruction->replaceLength > length - instruction->position)  return false;
+
+		// Escapes have no fallback and syntax errors have no next instruction. Jumps must move forward through the template, or a crafted catalog could make expansion loop forever.
+		bool hasNext = instruction->kind == kJATInstructionEscape || instruction->kind == kJATInstructionSubstitution;
+		bool hasFallback = instruction->kind == kJATInstructionSubstitution || instruction->kind == kJATInstructionSyntaxError;
+		if ((hasNext && !JATCatalogJumpIsValid(instructions, entry->instructionCount, instruction, instruction->next)) ||
+			(hasFallback && !JATCatalogJumpIsValid(instructions, entry->instructionCount, instruction, instruction->fallback)))
+		{
+			return false;
+		}
+
+		bool operandOK;
+		switch (instruction->kind)
+		{
+			case kJATInstructionEscape:
+				operandOK = instruction->operand == '{' || instruction->operand == '}';
+				break;
+
+			case kJATInstructionSyntaxError:
+				operandOK = JATCatalogConstantIsValid(bytes, size, entry, instruction->operand, true, true);
+				break;
+
+			case kJATInstructionSubstitution:
+				operandOK = instruction->operand < entry->substitutionCount;
+				break;
+
+			default:
+				operandOK = false;
+		}
+
+		if (!operandOK)  return false;
+	}
+
+	return true;
+}
+
+
+static JATCompiledTemplate *JATCatalogLoadTemplate(JATTemplateCatalog *catalog, const uint8_t *bytes, size_t size, const JATCatalogTemplate *entry)
+{
+	if (!JATCatalogTemplateIsValid(bytes, size, entry))  return nil;
+
+	const JATCatalogConstant *constants = (const void *)(bytes + entry->constantsOffset);
+	NSMutableArray *constantObjects = [NSMutableArray arrayWithCapacity:(NSUInteger)entry->constantCount];
+	for (uint64_t idx = 0; idx < entry->constantCount; idx++)
+	{
+		if (constants[idx].kind == kJATCatalogConstantNumber)
+		{
+			[constantObjects addObject:@(constants[idx].value)];
+		}
+		else
+		{
+			const unichar *characters = (const void *)(bytes + constants[idx].value);
+			[constantObjects addObject:[NSString stringWithCharacters:characters length:(NSUInteger)constants[idx].length]];
+		}
+	}
+
+	const unichar *characters = (const void *)(bytes + entry->templateString.offset);
+	NSUInteger length = (NSUInteger)entry->templateString.length;
+
+	// Only the template string is copied; the program runs straight from the mapping.
+	JATProgramTables tables =
+	{
+		.characters = characters,
+		.length = length,
+		.instructions = (const void *)(bytes + entry->instructionsOffset),
+		.instructionCount = (NSUInteger)entry->instructionCount,
+		.substitutions = (const void *)(bytes + entry->substitutionsOffset),
+		.substitutionCount = (NSUInteger)entry->substitutionCount,
+		.operations = (const void *)(bytes + entry->operationsOffset),
+		.operationCount = (NSUInteger)entry->operationCount,
+		.constants = constantObjects
+	};
+
+	NSString *templateString = [NSString stringWithCharacters:characters length:length];
+	return [[JATCompiledTemplate alloc] initWithTemplateString:templateString tables:&tables owner:catalog];
+}
+
+
+static void JATCatalogAlign(NSMutableData *data)
+{
+	[data increaseLengthBy:(8 - data.length % 8) % 8];
+}
+
+
+static JATCatalogString JATCatalogAppendString(NSMutableData *data, NSString *string)
+{
+	JATCatalogAlign(data);
+
+	JATCatalogString result = { .offset = data.length, .length = string.length };
+	[data increaseLengthBy:sizeof (unichar) * string.length];
+	[string getCharacters:(unichar *)(void *)((uint8_t *)data.mutableBytes + result.offset) range:(NSRange){ 0, string.length }];
+
+	return result;
+}
+
+
+/*	JATCatalogAppendTemplate(data, compiled, entry)
+
+	Append a compiled template's tables to a catalog being written. Each
+	element is copied field by field into a zeroed struct, so that padding
+	bytes don't make the output vary between runs.
+*/
+static bool JATCatalogAppendTemplate(NSMutableData *data, JATCompiledTemplate *compiled, JATCatalogTemplate *entry)
+{
+	JATProgramTables tables = JATCompiledTemplateGetTables(compiled);
+	NSArray *constants = tables.constants;
+
+	entry->templateString = JATCatalogAppendString(data, compiled.templateString);
+
+	// Strings referred to by constants come first, so the constant table can be written in one go.
+	NSUInteger constantCount = constants.count;
+	JATCatalogConstant *catalogConstants = calloc(MAX(constantCount, (NSUInteger)1), sizeof *catalogConstants);
+	if (catalogConstants == NULL)  return false;
+
+	for (NSUInteger idx = 0; idx < constantCount; idx++)
+	{
+		id constant = constants[idx];
+		if ([constant isKindOfClass:NSNumber.class])
+		{
+			catalogConstants[idx].kind = kJATCatalogConstantNumber;
+			catalogConstants[idx].value = [constant unsignedLongLongValue];
+		}
+		else
+		{
+			JATCatalogString string = JATCatalogAppendString(data, constant);
+			catalogConstants[idx].kind = kJATCatalogConstantString;
+			catalogConstants[idx].value = string.offset;
+			catalogConstants[idx].length = string.length;
+		}
+	}
+
+	JATCatalogAlign(data);
+	entry->constantsOffset = data.length;
+	entry->constantCount = constantCount;
+	[data appendBytes:catalogConstants length:sizeof *catalogConstants * constantCount];
+	free(catalogConstants);
+
+	JATCatalogAlign(data);
+	entry->instructionsOffset = data.length;
+	entry->instructionCount = tables.instructionCount;
+	for (NSUInteger idx = 0; idx < tables.instructionCount; idx++)
+	{
+		const JATInstruction *source = &tables.instructions[idx];
+		JATInstruction instruction;
+		memset(&instruction, 0, sizeof instruction);
+		instruction.kind = source->kind;
+		instruction.position = source->position;
+		instruction.replaceLength = source->replaceLength;
+		instruction.operand = source->operand;
+		instruction.next = source->next;
+		instruction.fallback = source->fallback;
+		[data appendBytes:&instruction length:sizeof instruction];
+	}
+
+	JATCatalogAlign(data);
+	entry->substitutionsOffset = data.length;
+	entry->substitutionCount = tables.substitutionCount;
+	for (NSUInteger idx = 0; idx < tables.substitutionCount; idx++)
+	{
+		const JATSubstitution *source = &tables.substitutions[idx];
+		JATSubstitution substitution;
+		memset(&substitution, 0, sizeof substitution);
+		substitution.key = source->key;
+		substitution.isPositional = source->isPositional;
+		substitution.index = source->index;
+		substitution.nameStart = source->nameStart;
+		substitution.nameLength = source->nameLength;
+		substitution.firstOperation = source->firstOperation;
+		substitution.operationCount = source->operationCount;
+		substitution.syntaxWarning = source->syntaxWarning;
+		[data appendBytes:&substitution length:sizeof substitution];
+	}
+
+	// Operations have no padding.
+	JATCatalogAlign(data);
+	entry->operationsOffset = data.length;
+	entry->operationCount = tables.operationCount;
+	[data appendBytes:tables.operations length:sizeof (JATOperation) * tables.operationCount];
+
+	return true;
+}
+
+
+static BOOL JATCatalogFail(NSError **error, NSString *domain, NSInteger code, NSString *path)
+{
+	if (error != NULL)
+	{
+		*error = [NSError errorWithDomain:domain code:code userInfo:@{ NSFilePathErrorKey: path }];
+	}
+
+	return NO;
+}
+
+
+#pragma mark - Batch expansion
+
+/*	A batch is split into chunks of consecutive rows. Each round expands
+	enough chunks to keep every processor busy, each into its own string,
+	using dispatch_apply(), and then writes them to the sink in order. Small
+	batches are expanded directly into the sink on the calling thread.
+*/
+enum
+{
+	kJATBatchMinimumChunkRows		= 16,	// Smaller chunks aren't worth dispatching.
+	kJATBatchMaximumChunkRows		= 1024,	// Limits the amount of output buffered per chunk.
+	kJATBatchChunksPerProcessor		= 4		// More chunks than processors, to even out uneven rows.
+};
+
+
+typedef void (^JATBatchRowExpander)(NSUInteger row, JATSink *sink);
+
+
+static bool JATExpandBatch(NSUInteger rowCount, NSString *separator, JATSink *sink, JATBatchRowExpander expandRow)
+{
+	NSCParameterAssert(sink != NULL);
+
+	if (separator.length == 0)  separator = nil;
+
+	NSUInteger processorCount = NSProcessInfo.processInfo.activeProcessorCount;
+	NSUInteger chunksPerRound = MAX(processorCount, (NSUInteger)1) * kJATBatchChunksPerProcessor;
+	NSUInteger rowsPerChunk = rowCount / chunksPerRound;
+	rowsPerChunk = MIN(MAX(rowsPerChunk, (NSUInteger)kJATBatchMinimumChunkRows), (NSUInteger)kJATBatchMaximumChunkRows);
+
+	if (processorCount <= 1 || rowCount <= rowsPerChunk)
+	{
+		for (NSUInteger row = 0; row < rowCount && !sink->failed; row++)
+		{
+			@autoreleasepool
+			{
+				if (row != 0 && separator != nil)  JATSinkWriteString(sink, separator);
+				expandRow(row, sink);
+			}
+		}
+		return !sink->failed;
+	}
+
+	NSMutableArray *chunks = [NSMutableArray arrayWithCapacity:chunksPerRound];
+	for (NSUInteger idx = 0; idx < chunksPerRound; idx++)
+	{
+		[chunks addObject:[NSMutableString string]];
+	}
+
+	dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	for (NSUInteger roundStart = 0; roundStart < rowCount && !sink->failed; roundStart += chunksPerRound * rowsPerChunk)
+	{
+		NSUInteger roundRows = MIN(rowCount - roundStart, chunksPerRound * rowsPerChunk);
+		NSUInteger roundChunks = (roundRows + rowsPerChunk - 1) / rowsPerChunk;
+
+		dispatch_apply(roundChunks, queue, ^(size_t chunk)
+		{
+			NSMutableString *output = chunks[chunk];
+			[output setString:@""];
+			JATSink chunkSink = JATSinkWithMutableString(output);
+
+			NSUInteger start = roundStart + chunk * rowsPerChunk;
+			NSUInteger end = MIN(start + rowsPerChunk, rowCount);
+			for (NSUInteger row = start; row < end; row++)
+			{
+				@autoreleasepool
+				{
+					if (row != 0 && separator != nil)  JATSinkWriteString(&chunkSink, separator);
+					expandRow(row, &chunkSink);
+				}
+			}
+		});
+
+		for (NSUInteger chunk = 0; chunk < roundChunks && !sink->failed; chunk++)
+		{
+			JATSinkWriteString(sink, chunks[chunk]);
+		}
+	}
+
+	return !sink->failed;
+}
+
+
+static bool JATExpandRows(JATCompiledTemplate *compiled, NSArray *rows, NSString *separator, JATSink *sink)
+{
+	// Check up front: an exception raised by a worker inside dispatch_apply() can't reach the caller.
+	for (id row in rows)
+	{
+		if (![row isKindOfClass:NSDictionary.class])
+		{
+			[NSException raise:NSInvalidArgumentException format:@"Batch expansion rows must be dictionaries, not %@.", [row class]];
+		}
+	}
+
+	return JATExpandBatch(rows.count, separator, sink, ^(NSUInteger row, JATSink *rowSink)
+	{
+		JATParameterFrame frame = JATParameterFrameWithDictionary(rows[row]);
+		JATRunCompiledTemplate(compiled, nil, &frame, rowSink);
+	});
+}
+
+
+static bool JATExpandColumns(JATCompiledTemplate *compiled, NSDictionary *columns, NSString *separator, JATSink *sink)
+{
+	// Check up front: an exception raised by a worker inside dispatch_apply() can't reach the caller.
+	for (id key in columns)
+	{
+		if (![key isKindOfClass:NSString.class])
+		{
+			[NSException raise:NSInvalidArgumentException format:@"Batch expansion column names must be strings, not %@.", [key class]];
+		}
+		if (![columns[key] isKindOfClass:NSArray.class])
+		{
+			[NSException raise:NSInvalidArgumentException format:@"Batch expansion column \"%@\" must be an array, not %@.", key, [columns[key] class]];
+		}
+	}
+
+	// Sorted, so positional parameters don't depend on the dictionary's layout.
+	NSArray *keys = [columns.allKeys sortedArrayUsingSelector:@selector(compare:)];
+	NSUInteger columnCount = keys.count;
+	NSArray *values = [columns objectsForKeys:keys notFoundMarker:NSNull.null];
+
+	NSUInteger rowCount = (columnCount != 0) ? NSUIntegerMax : 0;
+	for (NSArray *column in values)
+	{
+		rowCount = MIN(rowCount, column.count);
+	}
+
+	/*	Parse the names once for all rows. As with JATParsedNames, the names'
+		characters follow the names in the same block.
+	*/
+	__unsafe_unretained NSString *keyArray[columnCount + 1];
+	[keys getObjects:keyArray range:(NSRange){ 0, columnCount }];
+	NSMutableData *nameData = [NSMutableData dataWithLength:sizeof (JATParameterName) * columnCount + sizeof (unichar) * JATTotalNameLength(keyArray, columnCount)];
+	JATParameterName *parsedNames = nameData.mutableBytes;
+	JATParseParameterNames(keyArray, columnCount, (unichar *)(parsedNames + columnCount), parsedNames);
+
+	return JATExpandBatch(rowCount, separator, sink, ^(NSUInteger row, JATSink *rowSink)
+	{
+		const JATParameterName *names = nameData.bytes;
+		JATParameterValue rowValues[columnCount + 1];
+		for (NSUInteger column = 0; column < columnCount; column++)
+		{
+			// The columns keep the values alive.
+			rowValues[column] = (JATParameterValue){ .kind = kJATParameterObject, .value.object = values[column][row] };
+		}
+
+		JATParameterFrame frame =
+		{
+			.values = rowValues,
+			.names = names,
+			.count = columnCount
+		};
+		JATRunCompiledTemplate(compiled, nil, &frame, rowSink);
+	});
+}
+
+
+@implementation JATCompiledTemplate (JATBatchExpansion)
+
+- (NSString *) expandRows:(NSArray *)rows separator:(NSString *)separator
+{
+	NSMutableString *result = [NSMutableString string];
+	JATSink sink = JATSinkWithMutableString(result);
+	if (!JATExpandRows(self, rows, separator, &sink))  return nil;
+	return result;
+}
+
+
+- (NSString *) expandColumns:(NSDictionary *)columns separator:(NSString *)separator
+{
+	NSMutableString *result = [NSMutableString string];
+	JATSink sink = JATSinkWithMutableString(result);
+	if (!JATExpandColumns(self, columns, separator, &sink))  return nil;
+	return result;
+}
+
+
+- (bool) writeRows:(NSArray *)rows separator:(NSString *)separator toSink:(JATSink *)sink
+{
+	NSParameterAssert(sink != NULL);
+	return JATExpandRows(self, rows, separator, sink);
+}
+
+
+- (bool) writeColumns:(NSDictionary *)columns separator:(NSString *)separator toSink:(JATSink *)sink
+{
+	NSParameterAssert(sink != NULL);
+	return JATExpandColumns(self, columns, separator, sink);
+}
+
+@end
+
+
+#pragma mark - Utilities
+
+NSArray *JATSplitStringInternal(NSString *string, unichar separator, unichar balanceStart, unichar balanceEnd, JATCharacterSpan span, bool printWarnings)
+{
+	NSUInteger spanStart = 0;
+	NSMutableArray *result = [NSMutableArray array];
+	NSUInteger balanceCount = 0;
+	NSUInteger length = span.length;
+	
+	for (NSUInteger cursor = 0; cursor < length; cursor++)
+	{
+		unichar curr = JATCharacterSpanAt(span, cursor);
+		if (curr == balanceStart)  balanceCount++;
+		else if (curr == balanceEnd)
+		{
+			if (balanceCount == 0)
+			{
+				if (printWarnings)
+				{
+					JATWarn(NULL, 0, @"Unbalanced brace in template argument string \"{string}\".", string);
+					printWarnings = false;
+				}
+			}
+			else
+			{
+				balanceCount--;
+			}
+		}
+		else if (balanceCount == 0 && curr == separator)
+		{
+			NSRange range = { spanStart, cursor - spanStart };
+			NSString *subString = [string substringWithRange:range];
+			[result addObject:subString];
+			spanStart = cursor + 1;
+		}
+	}
+	
+	if (spanStart == 0)  return @[string];	// No separators found.
+	
+	NSRange range = { spanStart, length - spanStart };
+	NSString *subString = [string substringWithRange:range];
+	[result addObject:subString];
+	
+	return result;
+}
+
+
+static bool JATCharactersAreLatin1(const unichar characters[], NSUInteger length)
+{
+	unichar combined = 0;
+	for (NSUInteger idx = 0; idx < length; idx++)
+	{
+		combined |= characters[idx];
+	}
+	return combined < 0x100;
+}
+
+
+enum
+{
+	kJATOutputMinimumCapacity	= 256,			// Bytes.
+	kJATArenaKeepLimit			= 64 * 1024		// Larger per-thread buffers are released after use.
+};
+
+
+struct JATExpansionArena
+{
+	void					*storage;
+	size_t					capacity;
+	bool					busy;
+};
+
+
+static pthread_key_t sExpansionArenaKey;
+
+
+static void JATExpansionArenaDestroy(void *value)
+{
+	JATExpansionArena *arena = value;
+	free(arena->storage);
+	free(arena);
+}
+
+
+static JATExpansionArena *JATCurrentExpansionArena(void)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		pthread_key_create(&sExpansionArenaKey, JATExpansionArenaDestroy);
+	});
+
+	JATExpansionArena *arena = pthread_getspecific(sExpansionArenaKey);
+	if (arena == NULL)
+	{
+		arena = calloc(1, sizeof *arena);
+		if (arena == NULL)  return NULL;
+		pthread_setspecific(sExpansionArenaKey, arena);
+	}
+
+	return arena;
+}
+
+
+static bool JATOutputBufferReserveBytes(JATOutputBuffer *buffer, size_t required)
+{
+	if (required <= buffer->capacity)  return true;
+
+	size_t capacity = MAX(buffer->capacity * 2, (size_t)kJATOutputMinimumCapacity);
+	capacity = MAX(capacity, required);
+
+	void *storage = realloc(buffer->storage, capacity);
+	if (storage == NULL)  return false;
+
+	buffer->storage = storage;
+	buffer->capacity = capacity;
+	if (buffer->arena != NULL)
+	{
+		buffer->arena->storage = storage;
+		buffer->arena->capacity = capacity;
+	}
+	return true;
+}
+
+
+static bool JATOutputBufferReserve(JATOutputBuffer *buffer, NSUInteger count)
+{
+	size_t characterSize = buffer->wide ? sizeof (unichar) : 1;
+	return JATOutputBufferReserveBytes(buffer, (buffer->length + count) * characterSize);
+}
+
+
+static bool JATOutputBufferBegin(JATOutputBuffer *buffer, NSUInteger sizeHint, bool wide)
+{
+	*buffer = (JATOutputBuffer){ .wide = wide };
+
+	JATExpansionArena *arena = JATCurrentExpansionArena();
+	if (arena != NULL && !arena->busy)
+	{
+		arena->busy = true;
+		buffer->arena = arena;
+		buffer->storage = arena->storage;
+		buffer->capacity = arena->capacity;
+	}
+
+	if (!JATOutputBufferReserve(buffer, sizeHint))
+	{
+		JATOutputBufferEnd(buffer);
+		return false;
+	}
+	return true;
+}
+
+
+static void JATOutputBufferEnd(JATOutputBuffer *buffer)
+{
+	JATExpansionArena *arena = buffer->arena;
+	if (arena == NULL)
+	{
+		free(buffer->storage);
+	}
+	else
+	{
+		if (arena->capacity > kJATArenaKeepLimit)
+		{
+			free(arena->storage);
+			arena->storage = NULL;
+			arena->capacity = 0;
+		}
+		arena->busy = false;
+	}
+
+	*buffer = (JATOutputBuffer){ .wide = false };
+}
+
+
+// End a buffer unless it has already been ended, or was never begun.
+static void JATOutputBufferCleanUp(JATOutputBuffer *buffer)
+{
+	if (buffer->arena != NULL || buffer->storage != NULL)  JATOutputBufferEnd(buffer);
+}
+
+
+// Convert the output so far to UTF-16, making room for <count> more characters.
+static bool JATOutputBufferWiden(JATOutputBuffer *buffer, NSUInteger count)
+{
+	NSCParameterAssert(!buffer->wide);
+
+	if (!JATOutputBufferReserveBytes(buffer, (buffer->length + count) * sizeof (unichar)))  return false;
+
+	const uint8_t *narrow = buffer->storage;
+	unichar *wide = buffer->storage;
+	for (NSUInteger idx = buffer->length; idx-- > 0;)
+	{
+		wide[idx] = narrow[idx];
+	}
+
+	buffer->wide = true;
+	return true;
+}
+
+
+/*	Append characters of the template. If the output is still Latin-1, the
+	template is too, so the characters can simply be narrowed.
+*/
+static bool JATOutputBufferAppendLiteral(JATOutputBuffer *buffer, const unichar characters[], NSUInteger count)
+{
+	if (count == 0)  return true;
+	if (!JATOutputBufferReserve(buffer, count))  return false;
+
+	if (buffer->wide)
+	{
+		memcpy((unichar *)buffer->storage + buffer->length, characters, count * sizeof (unichar));
+	}
+	else
+	{
+		uint8_t *cursor = (uint8_t *)buffer->storage + buffer->length;
+		for (NSUInteger idx = 0; idx < count; idx++)
+		{
+			cursor[idx] = (uint8_t)characters[idx];
+		}
+	}
+
+	buffer->length += count;
+	return true;
+}
+
+
+static bool JATOutputBufferAppendString(JATOutputBuffer *buffer, NSString *string)
+{
+	CFStringRef cfString = (__bridge CFStringRef)string;
+	CFIndex count = CFStringGetLength(cfString);
+	if (count == 0)  return true;
+	if (!JATOutputBufferReserve(buffer, (NSUInteger)count))  return false;
+
+	if (!buffer->wide)
+	{
+		uint8_t *cursor = (uint8_t *)buffer->storage + buffer->length;
+		const char *bytes = CFStringGetCStringPtr(cfString, kCFStringEncodingISOLatin1);
+		CFIndex used = 0;
+		if (bytes != NULL)
+		{
+			memcpy(cursor, bytes, (size_t)count);
+			used = count;
+		}
+		else if (CFStringGetBytes(cfString, CFRangeMake(0, count), kCFStringEncodingISOLatin1, 0, false, cursor, count, &used) != count)
+		{
+			used = 0;
+		}
+
+		if (used == count)
+		{
+			buffer->length += (NSUInteger)count;
+			return true;
+		}
+
+		if (!JATOutputBufferWiden(buffer, (NSUInteger)count))  return false;
+	}
+
+	CFStringGetCharacters(cfString, CFRangeMake(0, count), (UniChar *)buffer->storage + buffer->length);
+	buffer->length += (NSUInteger)count;
+	return true;
+}
+
+
+static NSString *JATOutputBufferCopyRange(const JATOutputBuffer *buffer, NSRange range)
+{
+	NSCParameterAssert(NSMaxRange(range) <= buffer->length);
+
+	if (buffer->wide)
+	{
+		return [NSString stringWithCharacters:(const unichar *)buffer->storage + range.location length:range.length];
+	}
+	return CFBridgingRelease(CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)buffer->storage + range.location, (CFIndex)range.length, kCFStringEncodingISOLatin1, false));
+}
+
+
+static NSString *JATOutputBufferFinish(JATOutputBuffer *buffer)
+{
+	if (buffer->length == 0)
+	{
+		JATOutputBufferEnd(buffer);
+		return @"";
+	}
+
+	CFStringRef result;
+	if (buffer->wide)
+	{
+		result = CFStringCreateWithCharacters(kCFAllocatorDefault, buffer->storage, (CFIndex)buffer->length);
+	}
+	else
+	{
+		result = CFStringCreateWithBytes(kCFAllocatorDefault, buffer->storage, (CFIndex)buffer->length, kCFStringEncodingISOLatin1, false);
+	}
+
+	JATOutputBufferEnd(buffer);
+	return CFBridgingRelease(result);
+}
+
+
+void JATWithCharacters(NSString *string, void(^block)(const unichar characters[], NSUInteger length))
+{
+	NSCAssert(sizeof(unichar) == sizeof(UniChar), @"This is a silly place.");
+	
+	if (string == nil)  return;
+	NSUInteger length = string.length;
+	
+	// Fast case: if the string is internally a single UTF-16 buffer, we can peek.
+	const unichar *stringBuffer = (const UniChar *)CFStringGetCharactersPtr((__bridge CFStringRef)string);
+	if (stringBuffer != NULL)
+	{
+		block(stringBuffer, length);
+		return;
+	}
+	
+	// If the string is small, convert it to UTF-16 on the stack.
+	unichar *mutableStringBuffer;
+	NSUInteger stackBufferSize = length;
+	bool useHeapAllocation = length > kStackStringLimit;
+	if (useHeapAllocation)  stackBufferSize = 1;
+	unichar stackBuffer[stackBufferSize];
+	if (useHeapAllocation)
+	{
+		// Otherwise, we need to do it on the heap.
+		mutableStringBuffer = malloc(sizeof *stringBuffer * length);
+		if (mutableStringBuffer == NULL)  return;
+	}
+	else
+	{
+		mutableStringBuffer = stackBuffer;
+	}
+	
+	@try
+	{
+		[string getCharacters:mutableStringBuffer];
+		block(mutableStringBuffer, length);
+	}
+	@finally
+	{
+		if (useHeapAllocation)  free(mutableStringBuffer);
+	}
+}
+
+
+void JATWithCharacterSpan(NSString *string, void(^block)(JATCharacterSpan span))
+{
+	if (string == nil)  return;
+	
+	/*	CFString keeps strings that fit in eight bits (in practice, ASCII) in
+		that form, and will hand out the buffer if asked for a compatible
+		encoding.
+	*/
+	CFStringRef cfString = (__bridge CFStringRef)string;
+	const uint8_t *bytes = (const uint8_t *)CFStringGetCStringPtr(cfString, kCFStringEncodingISOLatin1);
+	if (bytes != NULL)
+	{
+		block((JATCharacterSpan){ .bytes = bytes, .length = (NSUInteger)CFStringGetLength(cfString) });
+		return;
+	}
+	
+	JATWithCharacters(string, ^(const unichar characters[], NSUInteger length)
+	{
+		block((JATCharacterSpan){ .characters = characters, .length = length });
+	});
+}
+
+
+/*	Character classification for the parser. Only ASCII characters can be
+	part of identifiers or positional references, so a 128-entry table covers
+	everything.
+*/
+enum
+{
+	kJATCharIdentifierStart		= 1 << 0,
+	kJATCharIdentifier			= 1 << 1,
+	kJATCharPositional			= 1 << 2
+};
+
+static const uint8_t kJATCharacterClasses[128] =
+{
+	['$']			= kJATCharIdentifierStart | kJATCharIdentifier,
+	['_']			= kJATCharIdentifierStart | kJATCharIdentifier,
+	['A' ... 'Z']	= kJATCharIdentifierStart | kJATCharIdentifier,
+	['a' ... 'z']	= kJATCharIdentifierStart | kJATCharIdentifier,
+	['0' ... '9']	= kJATCharIdentifier | kJATCharPositional
+};
+
+
+static inline bool JATCharacterHasClass(unichar value, uint8_t charClass)
+{
+	return value < 128 && (kJATCharacterClasses[value] & charClass) != 0;
+}
+
+
+static inline bool IsIdentifierStartChar(unichar value)
+{
+	return JATCharacterHasClass(value, kJATCharIdentifierStart);
+}
+
+
+static inline bool IsIdentifierChar(unichar value)
+{
+	return JATCharacterHasClass(value, kJATCharIdentifier);
+}
+
+
+static inline bool IsPositionalChar(unichar value)
+{
+	return JATCharacterHasClass(value, kJATCharPositional);
+}
+
+
+bool JATIsValidIdentifier(NSString *candidate)
+{
+	NSCParameterAssert(candidate != nil);
+
+	__block bool result = false;
+	JATWithCharacters(candidate, ^(const unichar characters[], NSUInteger length) {
+		NSUInteger identifierLength;
+		result = length > 0 &&
+				 ScanIdentifier(characters, length, 0, &identifierLength) &&
+				 identifierLength == length;
+	});
+
+	return result;
+}
+
+
+/*	JATFindBrace(characters, start, end)
+
+	Returns the index of the first { or } in the range [start, end), or <end>
+	if there is none. Templates are mostly literal text, so this checks eight
+	characters at a time where SSE2 or NEON is available.
+*/
+static NSUInteger JATFindBrace(const unichar characters[], NSUInteger start, NSUInteger end)
+{
+	NSCParameterAssert(characters != NULL || start >= end);
+
+	NSUInteger idx = start;
+
+#if JATEMPLATE_SCAN_SSE2
+	const __m128i openBraces = _mm_set1_epi16('{');
+	const __m128i closeBraces = _mm_set1_epi16('}');
+	for (; idx + 8 <= end; idx += 8)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(characters + idx));
+		__m128i matches = _mm_or_si128(_mm_cmpeq_epi16(chunk, openBraces), _mm_cmpeq_epi16(chunk, closeBraces));
+		unsigned mask = (unsigned)_mm_movemask_epi8(matches);
+		if (mask != 0)  return idx + (NSUInteger)(__builtin_ctz(mask) / 2);
+	}
+#elif JATEMPLATE_SCAN_NEON
+	const uint16x8_t openBraces = vdupq_n_u16('{');
+	const uint16x8_t closeBraces = vdupq_n_u16('}');
+	for (; idx + 8 <= end; idx += 8)
+	{
+		uint16x8_t chunk = vld1q_u16(characters + idx);
+		uint16x8_t matches = vorrq_u16(vceqq_u16(chunk, openBraces), vceqq_u16(chunk, closeBraces));
+		if (vmaxvq_u16(matches) != 0)  break;	// Found one; let the scalar loop pin it down.
+	}
+#endif
+
+	for (; idx < end; idx++)
+	{
+		if (characters[idx] == '{' || characters[idx] == '}')  break;
+	}
+
+	return idx;
+}
+
+
+static bool ScanIdentifier(const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger *outIdentifierLength)
+{
+	NSCParameterAssert(characters != NULL);
+	NSCParameterAssert(start < length);
+	NSCParameterAssert(outIdentifierLength != NULL);
+	
+	if (!IsIdentifierStartChar(characters[start]))  return false;
+	
+	NSUInteger end;
+	for (end = start + 1; end < length; end++)
+	{
+		if (!IsIdentifierChar(characters[end]))  break;
+	}
+	
+	*outIdentifierLength = end - start;
+	return true;
+}
+
+
+static NSNumber *ReadPositional(const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger *outLength)
+{
+	NSCParameterAssert(characters != NULL);
+	NSCParameterAssert(start < length);
+	
+	NSUInteger value = 0;
+	NSUInteger end;
+	for (end = start; end < length; end++)
+	{
+		if (!IsPositionalChar(characters[end]))  break;
+		value = value * 10 + characters[end] - '0';
+	}
+	
+	if (end == start)  return nil;
+	
+	if (outLength != NULL)  *outLength = end - start;
+	return @(value);
+}
+
+
+void JATWrapWarning(const unichar characters[], NSUInteger length, NSString *message)
+{
+	/*	Warnings raised with a preformatted message are deduplicated by the
+		message itself.
+	*/
+	NSUInteger occurrences = JATCountWarning(characters, length, message);
+	if (occurrences != 0)  JATReportWarningOccurrences(characters, length, message, occurrences);
+}
+
+
+#if JATEMPLATE_SYNTAX_WARNINGS || JATEMPLATE_INSTRUMENTATION
+static uint64_t JATMonotonicNanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+#endif
+
+
+NSString *JATWarningMessage(const unichar characters[], NSUInteger length, NSString *message)
+{
+	if (characters != NULL)
+	{
+		message = [NSString stringWithFormat:@"%@ (Template: \"%@\")", message, [NSString stringWithCharacters:characters length:length]];
+	}
+	
+	return message;
+}
+
+
+void JATReportPreparedWarning(NSString *message)
+{
+	if (message == nil)  return;
+
+	// Prepared messages already include the template.
+	NSUInteger occurrences = JATCountWarning(NULL, 0, message);
+	if (occurrences != 0)  JATReportWarningOccurrences(NULL, 0, message, occurrences);
+}
+
+
+#pragma mark - Parameter frames
+
+/*	JATParseParameterNames(names, count, buffer, outNames)
+
+	<names> is an array of (at least) <count> strings.
+
+	For each name which is a plain C identifier or an identifier wrapped in
+	boxing syntax, the identifier's characters are copied into <buffer> and
+	referenced from the corresponding entry of <outNames>. Other names get a
+	NULL entry. <buffer> must be large enough to hold all the names.
+*/
+static void JATParseParameterNames(JATNameArray names, NSUInteger count, unichar *buffer, JATParameterName *outNames)
+{
+	for (NSUInteger idx = 0; idx < count; idx++)
+	{
+		NSString *name = names[idx];
+		NSUInteger length = name.length;
+		[name getCharacters:buffer range:(NSRange){ 0, length }];
+
+		outNames[idx] = JATParseOneName(buffer, length);
+		buffer += length;
+	}
+}
+
+
+static JATParameterName JATParseOneName(const unichar *characters, NSUInteger length)
+{
+	/*	Handle boxing expressions: "@(foo)" -> "foo".
+		Syntax note: @ (foo) is invalid, so we can treat @( as one token.
+		However, we need to strip out whitespace inside the parentheses.
+	*/
+	if (length > 3 &&
+		characters[0] == '@' &&
+		characters[1] == '(' &&
+		characters[length - 1] == ')')
+	{
+		NSCharacterSet *whiteSpace = NSCharacterSet.whitespaceAndNewlineCharacterSet;
+
+		characters += 2;
+		length -= 3;
+		while (length > 0 && [whiteSpace characterIsMember:characters[0]])
+		{
+			characters++;
+			length--;
+		}
+		while (length > 0 && [whiteSpace characterIsMember:characters[length - 1]])
+		{
+			length--;
+		}
+	}
+
+	bool valid = length > 0 && IsIdentifierStartChar(characters[0]);
+	for (NSUInteger idx = 1; valid && idx < length; idx++)
+	{
+		valid = IsIdentifierChar(characters[idx]);
+	}
+
+	if (!valid)  return (JATParameterName){ NULL, 0 };
+	return (JATParameterName){ characters, length };
+}
+
+
+static NSUInteger JATTotalNameLength(JATNameArray names, NSUInteger count)
+{
+	NSUInteger result = 0;
+	for (NSUInteger idx = 0; idx < count; idx++)
+	{
+		result += names[idx].length;
+	}
+	return result;
+}
+
+
+/*	JATCallSiteParsedNames(callSite, names, count)
+
+	Returns the parsed names for a call site, parsing them on first use. The
+	table is allocated in one block and never freed, since call sites are
+	static. If two threads race to fill in the same call site, the loser's
+	table is thrown away.
+*/
+static const JATParsedNames *JATCallSiteParsedNames(JATCallSite *callSite, JATNameArray names, NSUInteger count)
+{
+	JATParsedNames *result = __atomic_load_n((JATParsedNames **)&callSite->parsedNames, __ATOMIC_ACQUIRE);
+	if (result != NULL)  return result;
+
+	NSUInteger nameLength = JATTotalNameLength(names, count);
+	size_t size = sizeof (JATParsedNames) + sizeof (JATParameterName) * count + sizeof (unichar) * nameLength;
+	result = malloc(size);
+	if (result == NULL)  return NULL;
+
+	result->count = count;
+	JATParseParameterNames(names, count, (unichar *)(result->names + count), result->names);
+
+	JATParsedNames *existing = NULL;
+	if (!__atomic_compare_exchange_n((JATParsedNames **)&callSite->parsedNames, &existing, result, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free(result);
+		result = existing;
+	}
+
+	return result;
+}
+
+
+/*	JATExpandUsingCallSite(compiled, template, callSite, names, values, count, sink)
+
+	Common implementation of the call site based entry points. <compiled>
+	may be nil, in which case <template> is compiled (or looked up in the
+	template cache).
+*/
+static NSString *JATExpandUsingCallSite(JATCompiledTemplate *compiled, NSString *template, JATCallSite *callSite, JATNameArray names, const JATParameterValue values[], NSUInteger count, JATSink *sink)
+{
+	NSCParameterAssert(callSite != NULL);
+	NSCParameterAssert(names != nil);
+	NSCParameterAssert(values != NULL || count == 0);
+
+	const JATParsedNames *parsedNames = JATCallSiteParsedNames(callSite, names, count);
+	if (parsedNames == NULL)
+	{
+		if (sink != NULL)  sink->failed = true;
+		return nil;
+	}
+
+	NSCAssert(parsedNames->count == count, @"JATemplate call site used with different parameter lists.");
+
+	return JATExpandWithParsedNames(compiled, template, parsedNames->names, values, count, sink);
+}
+
+
+/*	JATExpandWithParsedNames(compiled, template, names, values, count, sink)
+
+	Expand a template with the parameters from a JATExpand() or JATWrite()
+	macro, after the names have been parsed. If <compiled> is nil, <template>
+	is compiled. If <sink> is not NULL, the result is streamed to it and nil
+	is returned.
+*/
+static NSString *JATExpandWithParsedNames(JATCompiledTemplate *compiled, NSString *template, const JATParameterName *names, const JATParameterValue values[], NSUInteger count, JATSink *sink)
+{
+	/*	Non-optimization: it's tempting to short-circuit here if there are no
+		parameters, but that breaks if there are {{/}} escapes.
+	*/
+
+	if (compiled == nil)  compiled = [JATCompiledTemplate compiledTemplateWithString:template];
+	if (compiled == nil)
+	{
+		if (sink != NULL)  sink->failed = true;
+		return nil;
+	}
+
+	/*	The frame refers to the macro's value array directly. No dictionary is
+		built unless an operator asks for one.
+	*/
+	JATParameterFrame frame =
+	{
+		.values = values,
+		.names = names,
+		.count = count
+	};
+
+	return JATRunCompiledTemplate(compiled, template, &frame, sink);
+}
+
+
+JATParameterFrame JATParameterFrameWithDictionary(NSDictionary *parameters)
+{
+	if ([parameters isKindOfClass:JATParameterFrameDictionary.class])
+	{
+		// Nested expansion from an operator; use the original parameters directly.
+		JATParameterFrame frame;
+		[(JATParameterFrameDictionary *)parameters getParameterFrame:&frame];
+		return frame;
+	}
+
+	return (JATParameterFrame)
+	{
+		.usesDictionary = true,
+		.dictionary = parameters
+	};
+}
+
+
+const JATParameterValue *JATParameterFrameEntryAtIndex(const JATParameterFrame *frame, NSUInteger index)
+{
+	if (index >= frame->count)  return NULL;
+
+	return &frame->values[index];
+}
+
+
+const JATParameterValue *JATParameterFrameEntryForName(const JATParameterFrame *frame, const unichar *characters, NSUInteger length)
+{
+	// Search backwards, so the last of several parameters with the same name wins.
+	for (NSUInteger idx = frame->count; idx-- > 0; )
+	{
+		const JATParameterName *name = &frame->names[idx];
+		if (name->length == length &&
+			name->characters != NULL &&
+			memcmp(name->characters, characters, length * sizeof *characters) == 0)
+		{
+			return &frame->values[idx];
+		}
+	}
+
+	return NULL;
+}
+
+
+id JATParameterFrameValueAtIndex(const JATParameterFrame *frame, NSUInteger index)
+{
+	const JATParameterValue *value = JATParameterFrameEntryAtIndex(frame, index);
+	return value != NULL ? JATParameterValueObject(value) : nil;
+}
+
+
+id JATParameterFrameValueForName(const JATParameterFrame *frame, const unichar *characters, NSUInteger length)
+{
+	const JATParameterValue *value = JATParameterFrameEntryForName(frame, characters, length);
+	return value != NULL ? JATParameterValueObject(value) : nil;
+}
+
+
+id JATParameterValueObject(const JATParameterValue *value)
+{
+	NSCParameterAssert(value != NULL);
+
+	switch (value->kind)
+	{
+		case kJATParameterObject:
+			if (value->value.object != nil)  return value->value.object;
+			break;
+
+		case kJATParameterSigned:
+			return @(value->value.signedValue);
+
+		case kJATParameterUnsigned:
+			return @(value->value.unsignedValue);
+
+		case kJATParameterDouble:
+			return @(value->value.doubleValue);
+
+		case kJATParameterBool:
+			return value->value.boolValue ? @YES : @NO;
+
+		case kJATParameterUTF8:
+			if (value->value.UTF8.bytes != NULL)
+			{
+				NSString *string = CFBridgingRelease(CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)value->value.UTF8.bytes, (CFIndex)value->value.UTF8.length, kCFStringEncodingUTF8, false));
+				if (string != nil)  return string;
+			}
+			break;
+	}
+
+	return [NSNull null];
+}
+
+
+/*	JATParameterFrameDictionary
+
+	The variables dictionary handed to operators for expansions whose
+	parameters come from the JATExpand() macros. Most operators never look at
+	it, so creating one only records the expansion's frame. The frame is
+	copied the first time a key is looked up, and positional lookups are then
+	answered from the copy; anything else builds a real dictionary the first
+	time it's needed. Nested expansions started by operators use the frame
+	directly, without copying it.
+	
+	When the expansion finishes, it calls -detachFromParameterFrame. If
+	anything else still holds the dictionary at that point, the frame is
+	copied so the dictionary stays usable.
+*/
+@implementation JATParameterFrameDictionary
+{
+	const JATParameterFrame	*_frame;		// Borrowed from the expansion; NULL once copied or detached.
+	bool					_copied;		// Set atomically once the fields below are filled in.
+	NSArray					*_values;
+	JATParameterValue		*_parameterValues;
+	JATParameterName		*_names;
+	unichar					*_nameCharacters;
+	NSUInteger				_count;
+	NSDictionary			*_dictionary;
+}
+
+
+- (instancetype) initWithParameterFrame:(const JATParameterFrame *)frame
+{
+	NSParameterAssert(frame != NULL && !frame->usesDictionary);
+
+	if ((self = [super init]))
+	{
+		_frame = frame;
 	}
-	
-	if (spanStart == 0)  return @[string];	// No separators found.
-	
-	NSRange range = { spanStart, length - spanStart };
-	NSString *subString = [string substringWithRange:range];
-	[result addObject:subString];
-	
-	return result;
+
+	return self;
 }
 
 
-static void JATAppendCharacters(NSMutableString *buffer, const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger end)
+- (void) dealloc
 {
-	NSCParameterAssert(buffer != nil);
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(start <= end);
-	NSCParameterAssert(start <= length);
-	NSCParameterAssert(end <= length);
-	if (start == end)  return;
-	
-	CFStringAppendCharacters((__bridge CFMutableStringRef)buffer, characters + start, end - start);
+	free(_parameterValues);
+	free(_names);
+	free(_nameCharacters);
 }
 
 
-void JATWithCharacters(NSString *string, void(^block)(const unichar characters[], NSUInteger length))
+// Call inside @synchronized (self).
+- (void) copyParameterFrame
 {
-	NSCAssert(sizeof(unichar) == sizeof(UniChar), @"This is a silly place.");
-	
-	if (string == nil)  return;
-	NSUInteger length = string.length;
-	
-	// Fast case: if the string is internally a single UTF-16 buffer, we can peek.
-	const unichar *stringBuffer = (const UniChar *)CFStringGetCharactersPtr((__bridge CFStringRef)string);
-	if (stringBuffer != NULL)
+	const JATParameterFrame *frame = _frame;
+	if (_copied || frame == NULL)  return;
+
+	NSUInteger count = frame->count;
+	NSUInteger nameLength = 0;
+	NSMutableArray *values = [NSMutableArray arrayWithCapacity:count];
+	for (NSUInteger idx = 0; idx < count; idx++)
 	{
-		block(stringBuffer, length);
+		[values addObject:JATParameterFrameValueAtIndex(frame, idx)];
+		nameLength += frame->names[idx].length;
+	}
+
+	JATParameterValue *parameterValues = calloc(MAX(count, (NSUInteger)1), sizeof *parameterValues);
+	JATParameterName *names = calloc(MAX(count, (NSUInteger)1), sizeof *names);
+	unichar *nameCharacters = malloc(MAX(nameLength, (NSUInteger)1) * sizeof *nameCharacters);
+	if (parameterValues == NULL || names == NULL || nameCharacters == NULL)
+	{
+		free(parameterValues);
+		free(names);
+		free(nameCharacters);
 		return;
 	}
-	
-	// If the string is small, convert it to UTF-16 on the stack.
-	unichar *mutableStringBuffer;
-	NSUInteger stackBufferSize = length;
-	bool useHeapAllocation = length > kStackStringLimit;
-	if (useHeapAllocation)  stackBufferSize = 1;
-	unichar stackBuffer[stackBufferSize];
-	if (useHeapAllocation)
+
+	// The copied frame refers to the boxed values, which _values keeps alive.
+	for (NSUInteger idx = 0; idx < count; idx++)
 	{
-		// Otherwise, we need to do it on the heap.
-		mutableStringBuffer = malloc(sizeof *stringBuffer * length);
-		if (mutableStringBuffer == NULL)  return;
+		parameterValues[idx] = (JATParameterValue){ .kind = kJATParameterObject, .value.object = values[idx] };
 	}
-	else
+
+	unichar *next = nameCharacters;
+	for (NSUInteger idx = 0; idx < count; idx++)
 	{
-		mutableStringBuffer = stackBuffer;
+		JATParameterName name = frame->names[idx];
+		if (name.characters != NULL)
+		{
+			memcpy(next, name.characters, name.length * sizeof *next);
+			names[idx] = (JATParameterName){ next, name.length };
+			next += name.length;
+		}
 	}
-	
-	@try
+
+	_values = [values copy];
+	_parameterValues = parameterValues;
+	_names = names;
+	_nameCharacters = nameCharacters;
+	_count = count;
+	_frame = NULL;
+	__atomic_store_n(&_copied, true, __ATOMIC_RELEASE);
+}
+
+
+// Returns false if the frame couldn't be copied, in which case the dictionary is empty.
+- (bool) ensureCopied
+{
+	if (__atomic_load_n(&_copied, __ATOMIC_ACQUIRE))  return true;
+
+	@synchronized (self)
 	{
-		[string getCharacters:mutableStringBuffer];
-		block(mutableStringBuffer, length);
+		[self copyParameterFrame];
+		return _copied;
 	}
-	@finally
+}
+
+
+- (void) detachFromParameterFrame
+{
+	// CFGetRetainCount() can only overstate how many owners there are, which just causes an unneeded copy.
+	bool shared = CFGetRetainCount((__bridge CFTypeRef)self) > 1;
+
+	@synchronized (self)
 	{
-		if (useHeapAllocation)  free(mutableStringBuffer);
+		if (shared)  [self copyParameterFrame];
+		_frame = NULL;
 	}
 }
 
 
-static NSString * const kIdentifierChars = @"qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM_$0123456789";
-static NSString * const kIdentifierStartChars = @"qwertyuiopasdfghjklzxcvbnmQWERTYUIOPASDFGHJKLZXCVBNM_$";
+- (void) getParameterFrame:(JATParameterFrame *)outFrame
+{
+	if (!__atomic_load_n(&_copied, __ATOMIC_ACQUIRE))
+	{
+		@synchronized (self)
+		{
+			if (_frame != NULL)
+			{
+				// Still inside the expansion, so its frame can be used as-is.
+				*outFrame = *_frame;
+				outFrame->dictionary = self;
+				return;
+			}
+		}
+	}
+
+	[self ensureCopied];
+	*outFrame = (JATParameterFrame)
+	{
+		.values = _parameterValues,
+		.names = _names,
+		.count = _count,
+		.dictionary = self
+	};
+}
 
 
-static bool IsIdentifierStartChar(unichar value)
+- (NSDictionary *) fullDictionary
 {
-	static NSCharacterSet *initialChars;
-	
-	static dispatch_once_t onceToken;
-	dispatch_once(&onceToken, ^{
-		initialChars = [NSCharacterSet characterSetWithCharactersInString:kIdentifierStartChars];
-	});
-	
-	return [initialChars characterIsMember:value];
+	if (![self ensureCopied])  return @{};
+
+	@synchronized (self)
+	{
+		if (_dictionary == nil)
+		{
+			NSMutableDictionary *dictionary = [NSMutableDictionary dictionaryWithCapacity:_count * 2];
+
+			for (NSUInteger idx = 0; idx < _count; idx++)
+			{
+				dictionary[@(idx)] = _values[idx];
+
+				if (_names[idx].characters != NULL)
+				{
+					NSString *name = [NSString stringWithCharacters:_names[idx].characters length:_names[idx].length];
+					dictionary[name] = _values[idx];
+				}
+			}
+
+			_dictionary = [dictionary copy];
+		}
+
+		return _dictionary;
+	}
 }
 
 
-static bool IsIdentifierChar(unichar value)
+- (NSUInteger) count
 {
-	static NSCharacterSet *identifierChars;
-	
-	static dispatch_once_t onceToken;
-	dispatch_once(&onceToken, ^{
-		identifierChars = [NSCharacterSet characterSetWithCharactersInString:kIdentifierChars];
-	});
-	
-	return [identifierChars characterIsMember:value];
+	return self.fullDictionary.count;
 }
 
 
-static bool IsPositionalChar(unichar value)
+- (id) objectForKey:(id)key
 {
-	return isdigit(value);
+	if ([key isKindOfClass:NSNumber.class])
+	{
+		if (![self ensureCopied])  return nil;
+
+		NSUInteger index = [key unsignedIntegerValue];
+		if (index < _count && [key doubleValue] == (double)index)  return _values[index];
+		return nil;
+	}
+
+	return [self.fullDictionary objectForKey:key];
 }
 
 
-bool JATIsValidIdentifier(NSString *candidate)
+- (NSEnumerator *) keyEnumerator
 {
-	NSCParameterAssert(candidate != nil);
+	return [self.fullDictionary keyEnumerator];
+}
+
+@end
+
+
+#pragma mark - Formatter cache
+
+/*	Creating and configuring an NSNumberFormatter is far more expensive than
+	using one, and the class convenience methods create a new formatter every
+	time. Configured formatters are therefore cached per thread, so they can
+	be used without locking. Each thread's cache is stamped with a generation
+	number which is bumped when the current locale changes, at which point
+	the cache is emptied on next use.
 	
-	static NSCharacterSet *nonIdentifierChars;
+	Custom number formats come from templates, so there may be arbitrarily
+	many of them; the per-thread table of those is cleared when it grows
+	past kJATFormatCacheLimit.
 	
+	Split operator arguments are kept in the same cache. They don't depend on
+	the locale, so they survive a generation change.
+*/
+enum
+{
+	kJATFormatCacheLimit		= 64,
+	kJATArgumentCacheLimit		= 256,
+	kJATSmallIntegerCacheSize	= 256,	// Number of preformatted non-negative integers kept per thread.
+	kJATIntegerStyleStringLimit	= 4,	// Longest grouping separator or minus sign supported by native integer formatting.
+	kJATIntegerBufferSize		= 128	// Large enough for 20 digits with separators and a minus sign.
+};
+
+static const unsigned long long kJATMaxExactInteger = 1ULL << 53;
+
+
+typedef struct
+{
+	unichar						groupingSeparator[kJATIntegerStyleStringLimit];
+	NSUInteger					groupingSeparatorLength;
+	NSUInteger					primaryGroupSize;		// 0 for no grouping.
+	NSUInteger					secondaryGroupSize;		// 0 to repeat the primary group size.
+	unichar						minusSign[kJATIntegerStyleStringLimit];
+	NSUInteger					minusSignLength;
+} JATIntegerStyle;
+
+
+@interface JATFormatterCache: NSObject
+{
+@public
+	NSUInteger					_generation;
+	NSMutableDictionary			*_numberFormatters;		// Keyed by @(NSNumberFormatterStyle).
+	NSMutableDictionary			*_formatFormatters;		// Keyed by format string.
+	NSMutableDictionary			*_byteCountFormatters;	// Keyed by @(NSByteCountFormatterCountStyle).
+	NSMutableDictionary			*_argumentComponents;	// Keyed by operator argument.
+
+	bool						_integerStyleReady;
+	bool						_integerStyleUsable;
+	JATIntegerStyle				_integerStyle;
+	NSArray						*_smallIntegers;
+}
+@end
+
+
+@implementation JATFormatterCache
+
+- (instancetype) init
+{
+	if ((self = [super init]))
+	{
+		_numberFormatters = [NSMutableDictionary new];
+		_formatFormatters = [NSMutableDictionary new];
+		_byteCountFormatters = [NSMutableDictionary new];
+		_argumentComponents = [NSMutableDictionary new];
+	}
+	return self;
+}
+
+@end
+
+
+static pthread_key_t sFormatterCacheKey;
+static NSUInteger sFormatterCacheGeneration = 1;
+
+
+static void JATFormatterCacheDestroy(void *cache)
+{
+	CFRelease(cache);
+}
+
+
+static JATFormatterCache *JATCurrentFormatterCache(void)
+{
 	static dispatch_once_t onceToken;
 	dispatch_once(&onceToken, ^{
-		nonIdentifierChars = [[NSCharacterSet characterSetWithCharactersInString:kIdentifierChars] invertedSet];
+		pthread_key_create(&sFormatterCacheKey, JATFormatterCacheDestroy);
+		[NSNotificationCenter.defaultCenter addObserverForName:NSCurrentLocaleDidChangeNotification object:nil queue:nil usingBlock:^(NSNotification *notification)
+		{
+			JATFlushFormatterCache();
+		}];
 	});
-	
-	return IsIdentifierStartChar([candidate characterAtIndex:0]) &&
-		   [candidate rangeOfCharacterFromSet:nonIdentifierChars].location == NSNotFound;
+
+	JATFormatterCache *cache = (__bridge JATFormatterCache *)pthread_getspecific(sFormatterCacheKey);
+	if (cache == nil)
+	{
+		cache = [JATFormatterCache new];
+		pthread_setspecific(sFormatterCacheKey, CFBridgingRetain(cache));
+	}
+
+	NSUInteger generation = __atomic_load_n(&sFormatterCacheGeneration, __ATOMIC_ACQUIRE);
+	if (cache->_generation != generation)
+	{
+		[cache->_numberFormatters removeAllObjects];
+		[cache->_formatFormatters removeAllObjects];
+		[cache->_byteCountFormatters removeAllObjects];
+		cache->_integerStyleReady = false;
+		cache->_smallIntegers = nil;
+		cache->_generation = generation;
+	}
+
+	return cache;
 }
 
 
-static bool ScanIdentifier(const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger *outIdentifierLength)
+NSNumberFormatter *JATCachedNumberFormatter(NSNumberFormatterStyle style)
 {
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(start < length);
-	NSCParameterAssert(outIdentifierLength != NULL);
-	
-	if (!IsIdentifierStartChar(characters[start]))  return false;
-	
-	NSUInteger end;
-	for (end = start + 1; end < length; end++)
+	JATFormatterCache *cache = JATCurrentFormatterCache();
+	NSNumber *key = @(style);
+
+	NSNumberFormatter *formatter = cache->_numberFormatters[key];
+	if (formatter == nil)
 	{
-		if (!IsIdentifierChar(characters[end]))  break;
+		// Equivalent to +[NSNumberFormatter localizedStringFromNumber:numberStyle:].
+		formatter = [NSNumberFormatter new];
+		formatter.formatterBehavior = NSNumberFormatterBehavior10_4;
+		formatter.numberStyle = style;
+		cache->_numberFormatters[key] = formatter;
 	}
-	
-	*outIdentifierLength = end - start;
-	return true;
+
+	return formatter;
 }
 
 
-static NSNumber *ReadPositional(const unichar characters[], NSUInteger length, NSUInteger start, NSUInteger *outLength)
+NSNumberFormatter *JATCachedNumberFormatterWithFormat(NSString *format)
 {
-	NSCParameterAssert(characters != NULL);
-	NSCParameterAssert(start < length);
-	
-	NSUInteger value = 0;
-	NSUInteger end;
-	for (end = start; end < length; end++)
+	NSCParameterAssert(format != nil);
+
+	JATFormatterCache *cache = JATCurrentFormatterCache();
+
+	NSNumberFormatter *formatter = cache->_formatFormatters[format];
+	if (formatter == nil)
 	{
-		if (!IsPositionalChar(characters[end]))  break;
-		value = value * 10 + characters[end] - '0';
+		formatter = [NSNumberFormatter new];
+		formatter.formatterBehavior = NSNumberFormatterBehavior10_4;
+		formatter.format = format;
+
+		if (cache->_formatFormatters.count >= kJATFormatCacheLimit)  [cache->_formatFormatters removeAllObjects];
+		cache->_formatFormatters[[format copy]] = formatter;
 	}
-	
-	if (end == start)  return nil;
-	
-	if (outLength != NULL)  *outLength = end - start;
-	return @(value);
+
+	return formatter;
 }
 
 
-void JATWrapWarning(const unichar characters[], NSUInteger length, NSString *message)
+NSByteCountFormatter *JATCachedByteCountFormatter(NSByteCountFormatterCountStyle style)
 {
-	/*	Function exists even if JATEMPLATE_SYNTAX_WARNINGS is off so it can be
-		called from JATemplateDefaultOperators without duplicating macro logic
-		or moving it to a header.
-	*/
-#if JATEMPLATE_SYNTAX_WARNINGS
-	if (characters != NULL)
+	JATFormatterCache *cache = JATCurrentFormatterCache();
+	NSNumber *key = @(style);
+
+	NSByteCountFormatter *formatter = cache->_byteCountFormatters[key];
+	if (formatter == nil)
 	{
-		message = [NSString stringWithFormat:@"%@ (Template: \"%@\")", message, [NSString stringWithCharacters:characters length:length]];
+		formatter = [NSByteCountFormatter new];
+		formatter.countStyle = style;
+		cache->_byteCountFormatters[key] = formatter;
+	}
+
+	return formatter;
+}
+
+
+NSArray *JATCachedArgumentComponents(NSString *argument)
+{
+	NSCParameterAssert(argument != nil);
+
+	JATFormatterCache *cache = JATCurrentFormatterCache();
+
+	NSArray *components = cache->_argumentComponents[argument];
+	if (components == nil)
+	{
+		components = JATSplitArgumentString(argument, ';');
+
+		if (cache->_argumentComponents.count >= kJATArgumentCacheLimit)  [cache->_argumentComponents removeAllObjects];
+		cache->_argumentComponents[[argument copy]] = components;
 	}
+
+	return components;
+}
+
+
+void JATFlushFormatterCache(void)
+{
+	__atomic_add_fetch(&sFormatterCacheGeneration, 1, __ATOMIC_RELEASE);
+}
+
+
+#pragma mark - Integer formatting
+
+/*	Integers are by far the most common numbers in templates, and formatting
+	them through NSNumberFormatter is slow. Instead, the grouping rules and
+	minus sign of the current locale's decimal style are read from the
+	formatter once per thread, and digits are written straight into a buffer.
 	
-	JATReportWarning(message);
-#endif
+	To guarantee identical output, the native style is checked against the
+	formatter for a handful of sample values before use. Locales which don't
+	match (for instance, ones using non-ASCII digits or suppressing grouping
+	for four-digit numbers) keep using the formatter. Only values which can
+	be represented exactly as doubles are formatted natively.
+*/
+static void JATPrepareIntegerStyle(JATFormatterCache *cache);
+static NSUInteger JATWriteInteger(unichar *bufferEnd, unsigned long long magnitude, bool negative, const JATIntegerStyle *style);
+
+static const JATIntegerStyle kJATUnlocalizedIntegerStyle =
+{
+	.minusSign = { '-' },
+	.minusSignLength = 1
+};
+
+
+bool JATNumberIsFloatingPoint(NSNumber *number)
+{
+	// NSDecimalNumber reports "d", but check explicitly since its values aren't doubles either way.
+	if ([number isKindOfClass:NSDecimalNumber.class])  return true;
+
+	char type = number.objCType[0];
+	return type == 'f' || type == 'd';
+}
+
+
+NSString *JATFormatIntegerNumber(NSNumber *number, bool localized)
+{
+	NSCParameterAssert(number != nil);
+
+	if (JATNumberIsFloatingPoint(number))  return nil;
+
+	bool negative = false;
+	unsigned long long magnitude;
+	char type = number.objCType[0];
+	if (type == 'Q' || type == 'L')
+	{
+		magnitude = number.unsignedLongLongValue;
+	}
+	else
+	{
+		long long value = number.longLongValue;
+		negative = value < 0;
+		magnitude = negative ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+	}
+
+	return JATFormatInteger(magnitude, negative, localized);
+}
+
+
+NSString *JATFormatInteger(unsigned long long magnitude, bool negative, bool localized)
+{
+	const JATIntegerStyle *style = &kJATUnlocalizedIntegerStyle;
+	if (localized)
+	{
+		if (magnitude > kJATMaxExactInteger)  return nil;
+
+		JATFormatterCache *cache = JATCurrentFormatterCache();
+		JATPrepareIntegerStyle(cache);
+		if (!cache->_integerStyleUsable)  return nil;
+
+		if (!negative && magnitude < kJATSmallIntegerCacheSize)  return cache->_smallIntegers[magnitude];
+		style = &cache->_integerStyle;
+	}
+
+	unichar buffer[kJATIntegerBufferSize];
+	NSUInteger length = JATWriteInteger(buffer + kJATIntegerBufferSize, magnitude, negative, style);
+	return [NSString stringWithCharacters:buffer + kJATIntegerBufferSize - length length:length];
+}
+
+
+static bool JATCopyStyleString(NSString *string, unichar *buffer, NSUInteger *outLength)
+{
+	NSUInteger length = string.length;
+	if (length > kJATIntegerStyleStringLimit)  return false;
+
+	[string getCharacters:buffer range:(NSRange){ 0, length }];
+	*outLength = length;
+	return true;
 }
 
 
-#pragma mark - Name string parsing
+static void JATPrepareIntegerStyle(JATFormatterCache *cache)
+{
+	if (cache->_integerStyleReady)  return;
+	cache->_integerStyleReady = true;
+	cache->_integerStyleUsable = false;
+
+	NSNumberFormatter *formatter = JATCachedNumberFormatter(NSNumberFormatterDecimalStyle);
+	JATIntegerStyle style = { .primaryGroupSize = 0 };
+
+	if (!JATCopyStyleString(formatter.minusSign, style.minusSign, &style.minusSignLength))  return;
+	if (formatter.usesGroupingSeparator && formatter.groupingSize > 0)
+	{
+		if (!JATCopyStyleString(formatter.groupingSeparator, style.groupingSeparator, &style.groupingSeparatorLength))  return;
+		style.primaryGroupSize = formatter.groupingSize;
+		style.secondaryGroupSize = formatter.secondaryGroupingSize;
+	}
+
+	static const long long probes[] = { 0, 7, 1234, 12345, 1234567, 123456789012, -1, -1234567 };
+	unichar buffer[kJATIntegerBufferSize];
+	for (size_t idx = 0; idx < sizeof probes / sizeof *probes; idx++)
+	{
+		long long value = probes[idx];
+		bool negative = value < 0;
+		NSUInteger length = JATWriteInteger(buffer + kJATIntegerBufferSize, negative ? 0ULL - (unsigned long long)value : (unsigned long long)value, negative, &style);
+		NSString *native = [NSString stringWithCharacters:buffer + kJATIntegerBufferSize - length length:length];
+
+		if (![native isEqualToString:[formatter stringFromNumber:@(value)]])  return;
+	}
 
-static NSString *JATemplateParseOneName(NSString *name);
+	NSMutableArray *smallIntegers = [NSMutableArray arrayWithCapacity:kJATSmallIntegerCacheSize];
+	for (unsigned long long value = 0; value < kJATSmallIntegerCacheSize; value++)
+	{
+		NSUInteger length = JATWriteInteger(buffer + kJATIntegerBufferSize, value, false, &style);
+		[smallIntegers addObject:[NSString stringWithCharacters:buffer + kJATIntegerBufferSize - length length:length]];
+	}
 
+	cache->_integerStyle = style;
+	cache->_smallIntegers = [smallIntegers copy];
+	cache->_integerStyleUsable = true;
+}
 
-/*	JATBuildParameterDictionary(names, objects, expectedCount)
 
-	<names> is an array of (at least) <expectedCount> strings.
-	<objects> is an array of <expectedCount> objects (may contain nils).
+/*	JATWriteInteger(bufferEnd, magnitude, negative, style)
 
-	Given these, we construct a dictionary mapping each index from 0 to
-	<expectedCount> to the appropriate object, and each name to an object if
-	the name is a plain C identifier or an identifier wrapped in boxing syntax.
-	Nils are replaced with NSNull.
+	Write a formatted integer backwards, ending at <bufferEnd>, and return the
+	number of characters written. The buffer must hold at least
+	kJATIntegerBufferSize characters.
 */
-static NSDictionary *JATBuildParameterDictionary(JATNameArray names, JATParameterArray objects, NSUInteger expectedCount)
+static NSUInteger JATWriteInteger(unichar *bufferEnd, unsigned long long magnitude, bool negative, const JATIntegerStyle *style)
 {
-	if (expectedCount == 0)  return @{};
+	unichar *cursor = bufferEnd;
+	NSUInteger groupSize = style->primaryGroupSize;
+	NSUInteger digitsInGroup = 0;
 
-	__strong id keys[expectedCount * 2];
-	__strong id values[expectedCount * 2];
-	NSUInteger mapIndex = 0;
-
-	for (NSUInteger arrayIndex = 0; arrayIndex < expectedCount; arrayIndex++)
+	do
 	{
-		// Insert NSNumber keys for positional parameters.
-		id value = objects[arrayIndex];
-		keys[mapIndex] = @(arrayIndex);
-		if (value == nil)  value = [NSNull null];
-		values[mapIndex] = value;
-		mapIndex++;
-
-		// Insert NSString keys for name parameters which are identifiers or boxed identifiers.
-		NSString *name1 = names[arrayIndex];
-		NSString *name = JATemplateParseOneName(name1);
-		if (name != nil)
+		if (groupSize != 0 && digitsInGroup == groupSize)
 		{
-			keys[mapIndex] = name;
-			values[mapIndex] = value;
-			mapIndex++;
+			cursor -= style->groupingSeparatorLength;
+			memcpy(cursor, style->groupingSeparator, style->groupingSeparatorLength * sizeof *cursor);
+			digitsInGroup = 0;
+			if (style->secondaryGroupSize != 0)  groupSize = style->secondaryGroupSize;
 		}
-	}
-
-	// Build dictionary of parameters.
-	return [NSDictionary dictionaryWithObjects:values forKeys:keys count:mapIndex];
-}
-
 
-static NSString *JATemplateParseOneName(NSString *name)
-{
-	NSCharacterSet *whiteSpace = NSCharacterSet.whitespaceAndNewlineCharacterSet;
+		*--cursor = (unichar)('0' + magnitude % 10);
+		magnitude /= 10;
+		digitsInGroup++;
+	}
+	while (magnitude != 0);
 
-	/*	Handle boxing expressions: "@(foo)" -> "foo".
-		Syntax note: @ (foo) is invalid, so we can treat @( as one token.
-		However, we need to strip out whitespace inside the parentheses.
-	*/
-	NSUInteger length = name.length;
-	if (length > 3 &&
-		[name characterAtIndex:0] == '@' &&
-		[name characterAtIndex:1] == '(' &&
-		[name characterAtIndex:length - 1] == ')')
+	if (negative)
 	{
-		name = [name substringWithRange:(NSRange){2, length - 3}];
-		name = [name stringByTrimmingCharactersInSet:whiteSpace];
+		cursor -= style->minusSignLength;
+		memcpy(cursor, style->minusSign, style->minusSignLength * sizeof *cursor);
 	}
 
-	if (!JATIsValidIdentifier(name))  name = nil;
-
-	return name;
+	return (NSUInteger)(bufferEnd - cursor);
 }
 
 
@@ -761,23 +5408,281 @@ static NSString *JATemplateParseOneName(NSString *name)
 @end
 
 
+#pragma mark - Operator dispatch cache
+
+/*	Resolving an operator means building a selector name from the operator
+	name, registering the selector and asking the runtime for the method.
+	To avoid doing that for every operator in every expansion, resolved
+	implementations are kept in a small direct-mapped cache keyed by
+	(receiver class, operator name). Unknown operators are cached as negative
+	entries with a NULL implementation.
+	
+	Each thread has its own cache, like the formatter cache, so lookups don't
+	take a lock. sOperatorCacheLock only guards the list of caches, which is
+	used to total the statistics, and is taken when a thread's cache is
+	created or destroyed and when statistics are read.
+	
+	Entries are stamped with a generation number. Bumping the generation
+	invalidates every entry at once, which happens whenever an image or bundle
+	is loaded since it may contain categories with new operators.
+*/
+typedef id<JATCoercible> (*JATOperatorIMP)(id, SEL, NSString *, NSDictionary *);
+
+enum
+{
+	kJATOperatorCacheSize		= 256	// Must be a power of two.
+};
+
+typedef struct
+{
+	__unsafe_unretained Class	class;
+	CFStringRef					operatorName;	// Retained.
+	SEL							selector;
+	JATOperatorIMP				implementation;	// NULL for unknown operators.
+	bool						usesMessaging;	// Class answers through -respondsToSelector: or forwarding; implementation is not used.
+	NSUInteger					generation;		// Entry is valid only if this matches sOperatorCacheGeneration.
+} JATOperatorCacheEntry;
+
+typedef struct JATOperatorCache
+{
+	JATOperatorCacheEntry		entries[kJATOperatorCacheSize];
+	NSUInteger					hits;			// Written by the owning thread only; read atomically.
+	NSUInteger					misses;
+	struct JATOperatorCache		*next;			// List of all threads' caches, guarded by sOperatorCacheLock.
+	struct JATOperatorCache		*previous;
+} JATOperatorCache;
+
+static pthread_key_t sOperatorCacheKey;
+static pthread_mutex_t sOperatorCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static JATOperatorCache *sOperatorCaches;
+static NSUInteger sOperatorCacheGeneration = 1;
+static NSUInteger sRetiredOperatorCacheHits;		// Counts from exited threads, guarded by sOperatorCacheLock.
+static NSUInteger sRetiredOperatorCacheMisses;
+
+
+#if __APPLE__
+static void JATOperatorCacheImageAdded(const struct mach_header *header, intptr_t slide)
+{
+	JATInvalidateOperatorCache();
+}
+#endif
+
+
+static void JATOperatorCacheDestroy(void *value)
+{
+	JATOperatorCache *cache = value;
+
+	pthread_mutex_lock(&sOperatorCacheLock);
+	sRetiredOperatorCacheHits += cache->hits;
+	sRetiredOperatorCacheMisses += cache->misses;
+	if (cache->previous != NULL)  cache->previous->next = cache->next;
+	else  sOperatorCaches = cache->next;
+	if (cache->next != NULL)  cache->next->previous = cache->previous;
+	pthread_mutex_unlock(&sOperatorCacheLock);
+
+	for (NSUInteger idx = 0; idx < kJATOperatorCacheSize; idx++)
+	{
+		if (cache->entries[idx].operatorName != NULL)  CFRelease(cache->entries[idx].operatorName);
+	}
+	free(cache);
+}
+
+
+static void JATOperatorCacheInit(void)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		pthread_key_create(&sOperatorCacheKey, JATOperatorCacheDestroy);
+#if __APPLE__
+		_dyld_register_func_for_add_image(JATOperatorCacheImageAdded);
+#endif
+		// Bundle loading is also reported by dyld on Apple platforms, but the notification arrives after categories are attached.
+		[NSNotificationCenter.defaultCenter addObserverForName:NSBundleDidLoadNotification object:nil queue:nil usingBlock:^(NSNotification *notification)
+		{
+			JATInvalidateOperatorCache();
+		}];
+	});
+}
+
+
+static JATOperatorCache *JATCurrentOperatorCache(void)
+{
+	JATOperatorCacheInit();
+
+	JATOperatorCache *cache = pthread_getspecific(sOperatorCacheKey);
+	if (cache == NULL)
+	{
+		cache = calloc(1, sizeof *cache);
+		if (cache == NULL)  return NULL;
+		pthread_setspecific(sOperatorCacheKey, cache);
+
+		pthread_mutex_lock(&sOperatorCacheLock);
+		cache->next = sOperatorCaches;
+		if (sOperatorCaches != NULL)  sOperatorCaches->previous = cache;
+		sOperatorCaches = cache;
+		pthread_mutex_unlock(&sOperatorCacheLock);
+	}
+
+	return cache;
+}
+
+
+static SEL JATOperatorSelector(NSString *operator)
+{
+	// Dogfood note: this used to be a template expansion, but only runs on cache misses now anyway.
+	return NSSelectorFromString([NSString stringWithFormat:@"jatemplatePerform_%@_withArgument:variables:", operator]);
+}
+
+
+/*	JATClassUsesMessaging(class)
+	
+	True if instances of <class> may answer operators that aren't methods of
+	the class itself, by overriding -respondsToSelector: or by forwarding, or
+	if the class isn't an NSObject subclass. Operators on such receivers are
+	looked up and called by sending messages rather than through the runtime
+	functions, so the class can't be used to cache the result.
+*/
+static bool JATClassUsesMessaging(Class class)
+{
+	Class root = class;
+	while (class_getSuperclass(root) != Nil)  root = class_getSuperclass(root);
+	if (root != NSObject.class)  return true;
+	
+	SEL overridable[] = { @selector(respondsToSelector:), @selector(forwardingTargetForSelector:), @selector(forwardInvocation:) };
+	for (size_t idx = 0; idx < sizeof overridable / sizeof *overridable; idx++)
+	{
+		if (class_getMethodImplementation(class, overridable[idx]) != class_getMethodImplementation(NSObject.class, overridable[idx]))  return true;
+	}
+	return false;
+}
+
+
+/*	JATLookUpOperator(class, operator, outSelector, outUsesMessaging)
+	
+	Find the implementation of <operator> for instances of <class>, or NULL
+	if there is none. If *outUsesMessaging is set, the result is always NULL
+	and the operator must be performed with JATPerformOperatorByMessaging().
+*/
+static JATOperatorIMP JATLookUpOperator(Class class, NSString *operator, SEL *outSelector, bool *outUsesMessaging)
+{
+	JATOperatorCache *cache = JATCurrentOperatorCache();
+	NSUInteger generation = __atomic_load_n(&sOperatorCacheGeneration, __ATOMIC_ACQUIRE);
+	CFStringRef operatorName = (__bridge CFStringRef)operator;
+	JATOperatorCacheEntry *entry = NULL;
+	
+	if (cache != NULL)
+	{
+		NSUInteger hash = ((uintptr_t)class >> 4) ^ operator.hash;
+		entry = &cache->entries[hash & (kJATOperatorCacheSize - 1)];
+		
+		if (entry->generation == generation &&
+			entry->class == class &&
+			(entry->operatorName == operatorName || CFEqual(entry->operatorName, operatorName)))
+		{
+			__atomic_store_n(&cache->hits, cache->hits + 1, __ATOMIC_RELAXED);
+			*outSelector = entry->selector;
+			*outUsesMessaging = entry->usesMessaging;
+			return entry->implementation;
+		}
+		__atomic_store_n(&cache->misses, cache->misses + 1, __ATOMIC_RELAXED);
+	}
+	
+	SEL selector = JATOperatorSelector(operator);
+	bool usesMessaging = JATClassUsesMessaging(class);
+	JATOperatorIMP implementation = NULL;
+	if (!usesMessaging && class_respondsToSelector(class, selector))
+	{
+		implementation = (JATOperatorIMP)class_getMethodImplementation(class, selector);
+	}
+	
+	if (entry != NULL)
+	{
+		/*	The generation was read before resolving, so a result that may
+			predate an invalidation is already stale.
+		*/
+		CFStringRef oldName = entry->operatorName;
+		entry->class = class;
+		entry->operatorName = CFBridgingRetain([operator copy]);
+		entry->selector = selector;
+		entry->implementation = implementation;
+		entry->usesMessaging = usesMessaging;
+		entry->generation = generation;
+		if (oldName != NULL)  CFRelease(oldName);
+	}
+	
+	*outSelector = selector;
+	*outUsesMessaging = usesMessaging;
+	return implementation;
+}
+
+
+static void JATWarnUnknownOperator(NSString *operator)
+{
+	JATWarn(NULL, 0, @"Unknown operator \"{operator}\" in template expansion.", operator);
+}
+
+
+/*	JATPerformOperatorByMessaging(receiver, selector, operator, argument, variables)
+	
+	Perform an operator the way the uncached implementation did, asking the
+	receiver itself whether it responds. The class is checked as well so that
+	proxies which forward -respondsToSelector: can still implement operators
+	themselves.
+*/
+static id<JATCoercible> JATPerformOperatorByMessaging(id receiver, SEL selector, NSString *operator, NSString *argument, NSDictionary *variables)
+{
+	if (class_respondsToSelector(object_getClass(receiver), selector) || [receiver respondsToSelector:selector])
+	{
+		return ((JATOperatorIMP)objc_msgSend)(receiver, selector, argument, variables);
+	}
+	else
+	{
+		JATWarnUnknownOperator(operator);
+		return nil;
+	}
+}
+
+
+void JATInvalidateOperatorCache(void)
+{
+	__atomic_add_fetch(&sOperatorCacheGeneration, 1, __ATOMIC_RELEASE);
+}
+
+
+JATOperatorCacheStatistics JATGetOperatorCacheStatistics(void)
+{
+	pthread_mutex_lock(&sOperatorCacheLock);
+	JATOperatorCacheStatistics result = { .hits = sRetiredOperatorCacheHits, .misses = sRetiredOperatorCacheMisses };
+	for (JATOperatorCache *cache = sOperatorCaches; cache != NULL; cache = cache->next)
+	{
+		result.hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+		result.misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&sOperatorCacheLock);
+	
+	return result;
+}
+
+
 @implementation NSObject (JATOperatorSupport)
 
 - (id<JATCoercible>) jatemplatePerformOperator:(NSString *)operator withArgument:(NSString *)argument variables:(NSDictionary *)variables
 {
-	// Dogfood note: it would be a bad idea to use an operator in this template.
-	NSString *opImplementationName = JATExpandLiteral(@"jatemplatePerform_{operator}_withArgument:variables:", operator);
-	SEL selector = NSSelectorFromString(opImplementationName);
+	SEL selector;
+	bool usesMessaging;
+	JATOperatorIMP imp = JATLookUpOperator(object_getClass(self), operator, &selector, &usesMessaging);
 	
-	if ([self respondsToSelector:selector])
+	if (usesMessaging)
+	{
+		return JATPerformOperatorByMessaging(self, selector, operator, argument, variables);
+	}
+	else if (imp != NULL)
 	{
-		typedef id<JATCoercible> (*OperatorIMP)(id, SEL, NSString *, NSDictionary *);
-		OperatorIMP imp = (OperatorIMP)[self methodForSelector:selector];
 		return imp(self, selector, argument, variables);
 	}
 	else
 	{
-		JATWarn(NULL, 0, @"Unknown operator \"{operator}\" in template expansion.", operator);
+		JATWarnUnknownOperator(operator);
 		return nil;
 	}
 }
@@ -785,6 +5690,16 @@ static NSString *JATemplateParseOneName(NSString *name)
 @end
 
 
+@implementation NSProxy (JATOperatorSupport)
+
+- (id<JATCoercible>) jatemplatePerformOperator:(NSString *)operator withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	return JATPerformOperatorByMessaging(self, JATOperatorSelector(operator), operator, argument, variables);
+}
+
+@end
+
+
 @implementation NSString (JATCoercible)
 
 - (NSString *) jatemplateCoerceToString
@@ -815,7 +5730,10 @@ static NSString *JATemplateParseOneName(NSString *name)
 
 - (NSString *) jatemplateCoerceToString
 {
-	return [NSNumberFormatter localizedStringFromNumber:self numberStyle:NSNumberFormatterDecimalStyle];
+	NSString *result = JATFormatIntegerNumber(self, true);
+	if (result != nil)  return result;
+
+	return [JATCachedNumberFormatter(NSNumberFormatterDecimalStyle) stringFromNumber:self];
 }
 
 
@@ -831,18 +5749,245 @@ static NSString *JATemplateParseOneName(NSString *name)
 
 - (NSString *) jatemplateCoerceToString
 {
-	bool first = true;
+	return JATCoerceToStringWithOutputLimit(self, JATGetCollectionOutputLimit());
+}
+
+@end
+
+
+@implementation NSOrderedSet (JATCoercible)
+
+- (NSString *) jatemplateCoerceToString
+{
+	return JATCoerceToStringWithOutputLimit(self, JATGetCollectionOutputLimit());
+}
+
+@end
+
+
+@implementation NSSet (JATCoercible)
+
+- (NSString *) jatemplateCoerceToString
+{
+	return JATCoerceToStringWithOutputLimit(self, JATGetCollectionOutputLimit());
+}
+
+@end
+
+
+@implementation NSDictionary (JATCoercible)
+
+- (NSString *) jatemplateCoerceToString
+{
+	return JATCoerceToStringWithOutputLimit(self, JATGetCollectionOutputLimit());
+}
+
+@end
+
+
+#pragma mark - Collection formatting
+
+static NSUInteger sCollectionOutputLimit = NSUIntegerMax;
+
+
+void JATSetCollectionOutputLimit(NSUInteger length)
+{
+	__atomic_store_n(&sCollectionOutputLimit, length, __ATOMIC_RELAXED);
+}
+
+
+NSUInteger JATGetCollectionOutputLimit(void)
+{
+	return __atomic_load_n(&sCollectionOutputLimit, __ATOMIC_RELAXED);
+}
+
+
+NSString *JATCoerceToStringWithOutputLimit(id value, NSUInteger outputLimit)
+{
+	JATCollectionView *view = [JATCollectionView viewWithValue:value];
+	if (view != nil)  return [view stringWithOutputLimit:outputLimit];
+
+	return [value jatemplateCoerceToString];
+}
+
+
+/*	Views are immutable; each operator makes a new one sharing the collection,
+	so building a view is O(1) however large the collection is. Formatting
+	enumerates the collection and stops at the element limit or the output
+	limit, and nested collections are given whatever is left of the output
+	limit, so the work done is bounded by what ends up in the result.
+*/
+@implementation JATCollectionView
+{
+	id						_collection;
+	bool					_isDictionary;
+	NSUInteger				_limit;
+	NSString				*_separator;
+	NSArray					*_elementTemplates;		// Applied in order, each to the result of the last.
+	NSDictionary			*_variables;
+}
+
+
++ (instancetype) viewWithValue:(id)value
+{
+	if ([value isKindOfClass:JATCollectionView.class])  return value;
+
+	bool isDictionary = [value isKindOfClass:NSDictionary.class];
+	if (!isDictionary &&
+		![value isKindOfClass:NSArray.class] &&
+		![value isKindOfClass:NSOrderedSet.class] &&
+		![value isKindOfClass:NSSet.class])
+	{
+		return nil;
+	}
+
+	JATCollectionView *result = [self new];
+	result->_collection = value;
+	result->_isDictionary = isDictionary;
+	result->_limit = NSUIntegerMax;
+	result->_separator = @", ";
+	result->_elementTemplates = @[];
+	return result;
+}
+
+
+- (instancetype) derivedView
+{
+	JATCollectionView *result = [JATCollectionView new];
+	result->_collection = _collection;
+	result->_isDictionary = _isDictionary;
+	result->_limit = _limit;
+	result->_separator = _separator;
+	result->_elementTemplates = _elementTemplates;
+	result->_variables = _variables;
+	return result;
+}
+
+
+- (instancetype) viewWithLimit:(NSUInteger)limit
+{
+	JATCollectionView *result = [self derivedView];
+	result->_limit = MIN(limit, _limit);
+	return result;
+}
+
+
+- (instancetype) viewWithSeparator:(NSString *)separator
+{
+	NSParameterAssert(separator != nil);
+
+	JATCollectionView *result = [self derivedView];
+	result->_separator = [separator copy];
+	return result;
+}
+
+
+- (instancetype) viewWithElementTemplate:(NSString *)elementTemplate variables:(NSDictionary *)variables
+{
+	NSParameterAssert(elementTemplate != nil);
+
+	JATCollectionView *result = [self derivedView];
+	result->_elementTemplates = [_elementTemplates arrayByAddingObject:[elementTemplate copy]];
+	// Copied once here, since the variables may be a view of a parameter frame which doesn't outlive the expansion.
+	result->_variables = [NSDictionary dictionaryWithDictionary:variables ?: @{}];
+	return result;
+}
+
+
+- (NSString *) formattedElement:(id)element index:(NSUInteger)index outputLimit:(NSUInteger)outputLimit
+{
+	id key = nil, value = element;
+	if (_isDictionary)
+	{
+		key = element;
+		value = ((NSDictionary *)_collection)[key];
+	}
+
+	if (_elementTemplates.count == 0)
+	{
+		NSString *valueString = JATCoerceToStringWithOutputLimit(value, outputLimit);
+		if (key == nil || valueString == nil)  return valueString;
+
+		NSString *keyString = JATCoerceToStringWithOutputLimit(key, outputLimit);
+		if (keyString == nil)  return nil;
+		return [NSString stringWithFormat:@"%@: %@", keyString, valueString];
+	}
+
+	NSMutableDictionary *parameters = [_variables mutableCopy];
+	parameters[@"index"] = @(index);
+	if (key != nil)  parameters[@"key"] = key;
+
+	for (NSString *elementTemplate in _elementTemplates)
+	{
+		parameters[@"item"] = value ?: [NSNull null];
+		value = JATExpandLiteralWithParameters(elementTemplate, parameters);
+		if (value == nil)  return nil;
+	}
+
+	return value;
+}
+
+
+- (NSString *) stringWithOutputLimit:(NSUInteger)outputLimit
+{
+	NSUInteger count = [(NSArray *)_collection count];
+	NSUInteger limit = MIN(_limit, count);
+	bool elementsLeftOut = limit < count;
+
 	NSMutableString *result = [NSMutableString string];
-	
-	for (id value in self)
+	NSUInteger index = 0;
+	NSUInteger separatorStart = 0, elementStart = 0;
+	bool cutInsideElement = false;
+	for (id element in _collection)
 	{
-		if (!first)  [result appendString:@", "];
-		else  first = false;
-		
-		[result appendString:[value jatemplateCoerceToString]];
+		if (index == limit)  break;
+		if (result.length >= outputLimit)
+		{
+			elementsLeftOut = true;
+			break;
+		}
+
+		@autoreleasepool
+		{
+			separatorStart = result.length;
+			if (index != 0)  [result appendString:_separator];
+			elementStart = result.length;
+
+			NSString *formatted = [self formattedElement:element index:index outputLimit:outputLimit - MIN(result.length, outputLimit)];
+			if (formatted == nil)  return nil;
+			[result appendString:formatted];
+		}
+		index++;
 	}
-	
+
+	if (result.length > outputLimit)
+	{
+		// Don't split a surrogate pair or composed character sequence.
+		NSUInteger cut = [result rangeOfComposedCharacterSequenceAtIndex:outputLimit].location;
+		if (cut <= elementStart)
+		{
+			// Nothing of the last element survives; end the way an element limit does.
+			cut = separatorStart;
+			index--;
+			elementsLeftOut = true;
+		}
+		else
+		{
+			cutInsideElement = true;
+		}
+		[result deleteCharactersInRange:(NSRange){ cut, result.length - cut }];
+	}
+
+	if (cutInsideElement)  [result appendString:@"…"];
+	else if (elementsLeftOut)  [result appendFormat:@"%@…", (index > 0) ? _separator : @""];
+
 	return result;
 }
 
+
+- (NSString *) jatemplateCoerceToString
+{
+	return [self stringWithOutputLimit:JATGetCollectionOutputLimit()];
+}
+
 @end
@@ -31,7 +31,7 @@ SOFTWARE.
 #endif
 
 
-#define OpWarn(TEMPLATE, ...)  JATWrapWarning(NULL, 0, JATExpand(TEMPLATE, __VA_ARGS__))
+#define OpWarn(TEMPLATE, ...)  JATWarn(NULL, 0, TEMPLATE, __VA_ARGS__)
 
 
 /*	Core pluralization logic used by plur: and plural: operators.
@@ -92,6 +92,31 @@ enum
 };
 
 
+/*	CLDR plural rules used by the plurals: operator.
+*/
+typedef enum
+{
+	kJATPluralCategoryZero,
+	kJATPluralCategoryOne,
+	kJATPluralCategoryTwo,
+	kJATPluralCategoryFew,
+	kJATPluralCategoryMany,
+	kJATPluralCategoryOther
+} JATPluralCategory;
+
+typedef struct JATPluralRuleSet JATPluralRuleSet;
+
+static const JATPluralRuleSet *CurrentPluralRules(void);
+static unsigned PluralCategoryMask(const JATPluralRuleSet *rules);
+static JATPluralCategory SelectPluralCategory(const JATPluralRuleSet *rules, NSNumber *value);
+
+
+/*	Helpers for num:hex and num:HEX.
+*/
+static NSString *FormatHex(unsigned long long value, int precision, bool uppercase);
+static int ParseHexPrecision(NSString *argument);
+
+
 @implementation NSObject (JATDefaultOperators)
 
 - (id<JATCoercible>) jatemplatePerform_num_withArgument:(NSString *)argument variables:(NSDictionary *)variables
@@ -101,68 +126,66 @@ enum
 	
 	if ([argument isEqual:@"decimal"] || [argument isEqual:@"dec"])
 	{
-		return [NSNumberFormatter localizedStringFromNumber:value numberStyle:NSNumberFormatterDecimalStyle];
+		NSString *result = JATFormatIntegerNumber(value, true);
+		if (result != nil)  return result;
+		return [JATCachedNumberFormatter(NSNumberFormatterDecimalStyle) stringFromNumber:value];
 	}
 	if ([argument isEqual:@"noloc"])
 	{
+		NSString *result = JATFormatIntegerNumber(value, false);
+		if (result != nil)  return result;
 		return [value description];
 	}
 	if ([argument isEqualToString:@"hex"])
 	{
-		return [NSString stringWithFormat:@"%llx", (unsigned long long)value.longLongValue];
+		return FormatHex((unsigned long long)value.longLongValue, 1, false);
 	}
 	if ([argument hasPrefix:@"hex;"])
 	{
-		int length = [[argument componentsSeparatedByString:@";"][1] intValue];
-		return [NSString stringWithFormat:@"%.*llx", length, (unsigned long long)value.longLongValue];
+		return FormatHex((unsigned long long)value.longLongValue, ParseHexPrecision(argument), false);
 	}
 	if ([argument isEqualToString:@"HEX"])
 	{
-		return [NSString stringWithFormat:@"%llX", (unsigned long long)value.longLongValue];
+		return FormatHex((unsigned long long)value.longLongValue, 1, true);
 	}
 	if ([argument hasPrefix:@"HEX;"])
 	{
-		int length = [[argument componentsSeparatedByString:@";"][1] intValue];
-		return [NSString stringWithFormat:@"%.*llX", length, (unsigned long long)value.longLongValue];
+		return FormatHex((unsigned long long)value.longLongValue, ParseHexPrecision(argument), true);
 	}
 	if ([argument isEqual:@"currency"] || [argument isEqual:@"cur"])
 	{
-		return [NSNumberFormatter localizedStringFromNumber:value numberStyle:NSNumberFormatterCurrencyStyle];
+		return [JATCachedNumberFormatter(NSNumberFormatterCurrencyStyle) stringFromNumber:value];
 	}
 	if ([argument isEqual:@"percent"] || [argument isEqual:@"pct"])
 	{
-		return [NSNumberFormatter localizedStringFromNumber:value numberStyle:NSNumberFormatterPercentStyle];
+		return [JATCachedNumberFormatter(NSNumberFormatterPercentStyle) stringFromNumber:value];
 	}
 	if ([argument isEqual:@"scientific"] || [argument isEqual:@"sci"])
 	{
-		return [NSNumberFormatter localizedStringFromNumber:value numberStyle:NSNumberFormatterScientificStyle];
+		return [JATCachedNumberFormatter(NSNumberFormatterScientificStyle) stringFromNumber:value];
 	}
 	if ([argument isEqual:@"spellout"])
 	{
-		return [NSNumberFormatter localizedStringFromNumber:value numberStyle:NSNumberFormatterSpellOutStyle];
+		return [JATCachedNumberFormatter(NSNumberFormatterSpellOutStyle) stringFromNumber:value];
 	}
 	if ([argument isEqual:@"filebytes"] || [argument isEqual:@"file"] || [argument isEqual:@"bytes"])
 	{
-		return [NSByteCountFormatter stringFromByteCount:value.longLongValue countStyle:NSByteCountFormatterCountStyleFile];
+		return [JATCachedByteCountFormatter(NSByteCountFormatterCountStyleFile) stringFromByteCount:value.longLongValue];
 	}
 	if ([argument isEqual:@"memorybytes"] || [argument isEqual:@"memory"])
 	{
-		return [NSByteCountFormatter stringFromByteCount:value.longLongValue countStyle:NSByteCountFormatterCountStyleMemory];
+		return [JATCachedByteCountFormatter(NSByteCountFormatterCountStyleMemory) stringFromByteCount:value.longLongValue];
 	}
 	if ([argument isEqual:@"decimalbytes"])
 	{
-		return [NSByteCountFormatter stringFromByteCount:value.longLongValue countStyle:NSByteCountFormatterCountStyleDecimal];
+		return [JATCachedByteCountFormatter(NSByteCountFormatterCountStyleDecimal) stringFromByteCount:value.longLongValue];
 	}
 	if ([argument isEqual:@"binarybytes"])
 	{
-		return [NSByteCountFormatter stringFromByteCount:value.longLongValue countStyle:NSByteCountFormatterCountStyleBinary];
+		return [JATCachedByteCountFormatter(NSByteCountFormatterCountStyleBinary) stringFromByteCount:value.longLongValue];
 	}
 	
-	NSNumberFormatter *formatter = [NSNumberFormatter new];
-	formatter.formatterBehavior = NSNumberFormatterBehavior10_4;
-	formatter.format = argument;
-	
-	return [formatter stringFromNumber:value];
+	return [JATCachedNumberFormatterWithFormat(argument) stringFromNumber:value];
 }
 
 
@@ -188,7 +211,7 @@ enum
 		return nil;
 	}
 	
-	NSArray *components = JATSplitArgumentString(argument, ';');
+	NSArray *components = JATCachedArgumentComponents(argument);
 	
 	NSInteger ruleID = [components[0] integerValue];
 	PluralizationRule rule = NULL;
@@ -227,7 +250,7 @@ enum
 		return nil;
 	}
 	
-	NSArray *components = JATSplitArgumentString(argument, ';');
+	NSArray *components = JATCachedArgumentComponents(argument);
 	
 	if (components.count == 1)
 	{
@@ -260,7 +283,7 @@ enum
 		return nil;
 	}
 	
-	NSArray *components = JATSplitArgumentString(argument, ';');
+	NSArray *components = JATCachedArgumentComponents(argument);
 	
 	if (components.count == 1)
 	{
@@ -282,6 +305,37 @@ enum
 }
 
 
+- (id<JATCoercible>) jatemplatePerform_plurals_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	NSNumber *value = [self jatemplateCoerceToNumber];
+	if (value == nil)  return nil;
+	
+	if (argument == nil)
+	{
+		OpWarn(@"Template operator plurals: used with no argument.");
+		return nil;
+	}
+	
+	NSArray *forms = JATCachedArgumentComponents(argument);
+	const JATPluralRuleSet *rules = CurrentPluralRules();
+	unsigned categories = PluralCategoryMask(rules);
+	NSUInteger requiredCount = (NSUInteger)__builtin_popcount(categories);
+	
+	if (forms.count != requiredCount)
+	{
+		NSString *locale = JATGetPluralLocale();
+		OpWarn(@"Template operator plurals: requires {requiredCount} forms for locale {locale} (got plurals:{argument}).", @(requiredCount), locale, argument);
+		return nil;
+	}
+	
+	// Forms are given in the order zero, one, two, few, many, other, skipping categories the language doesn't use.
+	JATPluralCategory category = SelectPluralCategory(rules, value);
+	NSUInteger index = (NSUInteger)__builtin_popcount(categories & ((1U << category) - 1));
+	
+	return JATExpandLiteralWithParameters(forms[index], variables);
+}
+
+
 - (id<JATCoercible>) jatemplatePerform_if_withArgument:(NSString *)argument variables:(NSDictionary *)variables
 {
 	NSNumber *value = [self jatemplateCoerceToBoolean];
@@ -477,6 +531,103 @@ static JATAlignMode InterpretAlignMode(NSString *string, JATAlignMode defaultVal
 }
 
 
+/*	Strings for the fit:, trunc: and padding operators are assembled
+	directly in a UTF-16 buffer, rather than by expanding templates. Padding
+	is copied from a fixed run of spaces, and short padding strings are
+	cached.
+*/
+enum
+{
+	kSpaceRunLength				= 64
+};
+
+static const unichar kSpaceRun[kSpaceRunLength] =
+{
+	[0 ... kSpaceRunLength - 1] = ' '
+};
+
+
+static unichar *AppendSpaces(unichar *cursor, NSUInteger count)
+{
+	while (count > 0)
+	{
+		NSUInteger chunk = MIN(count, (NSUInteger)kSpaceRunLength);
+		memcpy(cursor, kSpaceRun, chunk * sizeof *cursor);
+		cursor += chunk;
+		count -= chunk;
+	}
+	return cursor;
+}
+
+
+static NSString *SpaceString(NSUInteger count)
+{
+	static NSString *cache[kSpaceRunLength + 1];
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		for (NSUInteger idx = 0; idx <= kSpaceRunLength; idx++)
+		{
+			cache[idx] = [[NSString alloc] initWithCharacters:kSpaceRun length:idx];
+		}
+	});
+
+	if (count <= kSpaceRunLength)  return cache[count];
+
+	unichar *buffer = malloc(count * sizeof *buffer);
+	if (buffer == NULL)  return nil;
+	AppendSpaces(buffer, count);
+	return [[NSString alloc] initWithCharactersNoCopy:buffer length:count freeWhenDone:YES];
+}
+
+
+/*	ComposeFitString(value, padBefore, head, insert, tail, padAfter)
+	
+	Returns <padBefore> spaces, the characters of <value> in <head>,
+	<insert>, the characters of <value> in <tail>, and <padAfter> spaces.
+*/
+static NSString *ComposeFitString(NSString *value, NSUInteger padBefore, NSRange head, NSString *insert, NSRange tail, NSUInteger padAfter)
+{
+	NSUInteger insertLength = insert.length;
+	NSUInteger length = padBefore + head.length + insertLength + tail.length + padAfter;
+	if (length == 0)  return @"";
+
+	unichar *buffer = malloc(length * sizeof *buffer);
+	if (buffer == NULL)  return nil;
+
+	unichar *cursor = AppendSpaces(buffer, padBefore);
+	[value getCharacters:cursor range:head];
+	cursor += head.length;
+	[insert getCharacters:cursor range:(NSRange){ 0, insertLength }];
+	cursor += insertLength;
+	[value getCharacters:cursor range:tail];
+	cursor += tail.length;
+	AppendSpaces(cursor, padAfter);
+
+	return [[NSString alloc] initWithCharactersNoCopy:buffer length:length freeWhenDone:YES];
+}
+
+
+/*	ExpandOperatorArgument(argument, variables)
+	
+	Arguments to fit: and trunc: are localized and expanded like
+	JATExpandWithParameters(). Most are plain numbers or mode names, which
+	have no substitutions once localized and are used as they are, so they
+	only cost a localization cache lookup.
+*/
+static NSString *ExpandOperatorArgument(NSString *argument, NSDictionary *variables)
+{
+	static NSCharacterSet *braces;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		braces = [NSCharacterSet characterSetWithCharactersInString:@"{}"];
+	});
+
+	NSString *localized = JATLocalizedString(argument, nil, nil);
+	if ([localized rangeOfCharacterFromSet:braces].location == NSNotFound)  return localized;
+	return JATExpandLiteralWithParameters(localized, variables);
+}
+
+
 static NSString *TruncateString(NSString *value, NSUInteger keepLength, JATAlignMode mode)
 {
 	NSUInteger stringLength = value.length;
@@ -491,9 +642,7 @@ static NSString *TruncateString(NSString *value, NSUInteger keepLength, JATAlign
 		{
 			NSUInteger keepAfter = keepLength / 2;
 			NSUInteger keepBefore = keepLength - keepAfter;
-			NSString *before = [value substringToIndex:keepBefore];
-			NSString *after = [value substringFromIndex:stringLength - keepAfter];
-			return JATExpand(@"{before}{after}", before, after);
+			return ComposeFitString(value, 0, (NSRange){ 0, keepBefore }, nil, (NSRange){ stringLength - keepAfter, keepAfter }, 0);
 		}
 		
 		case kJATAlignModeEnd:
@@ -510,11 +659,23 @@ static NSString *TruncateString(NSString *value, NSUInteger keepLength, JATAlign
 }
 
 
-- (id<JATCoercible>) jatemplatePerform_trunc_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+/*	CoerceForTruncation(value, length, mode)
+	
+	Coerce <value> to a string which is about to be truncated to <length>
+	characters. When truncating at the end, only the start survives, so
+	collections are formatted one character past it, which is enough to tell
+	that truncation is needed.
+*/
+static NSString *CoerceForTruncation(id value, NSUInteger length, JATAlignMode mode)
 {
-	NSString *value = [self jatemplateCoerceToString];
-	if (value == nil)  return nil;
+	if (mode != kJATAlignModeEnd || length == NSUIntegerMax)  return [value jatemplateCoerceToString];
 	
+	return JATCoerceToStringWithOutputLimit(value, length + 1);
+}
+
+
+- (id<JATCoercible>) jatemplatePerform_trunc_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
 	NSArray *arguments = JATSplitArgumentString(argument, ';');
 	if (arguments.count < 1)
 	{
@@ -523,7 +684,7 @@ static NSString *TruncateString(NSString *value, NSUInteger keepLength, JATAlign
 	}
 	
 	NSString *modeString = nil;
-	if (arguments.count > 1)  modeString = JATExpandWithParameters(arguments[1], variables);
+	if (arguments.count > 1)  modeString = ExpandOperatorArgument(arguments[1], variables);
 	JATAlignMode mode = InterpretAlignMode(modeString, kJATAlignModeEnd);
 	if (mode == kJATAlignModeInvalid)
 	{
@@ -531,7 +692,10 @@ static NSString *TruncateString(NSString *value, NSUInteger keepLength, JATAlign
 		return nil;
 	}
 	
-	NSUInteger truncLength = [JATExpandWithParameters(arguments[0], variables) integerValue];
+	NSUInteger truncLength = [ExpandOperatorArgument(arguments[0], variables) integerValue];
+	
+	NSString *value = CoerceForTruncation(self, truncLength, mode);
+	if (value == nil)  return nil;
 	
 	return TruncateString(value, truncLength, mode);
 }
@@ -541,23 +705,24 @@ static NSString *PadFitString(NSString *value, NSArray *arguments, NSUInteger st
 {
 	NSUInteger padCount = fitLength - stringLength;
 	NSString *modeString = nil;
-	if (arguments.count >= 2)  modeString = JATExpandWithParameters(arguments[1], variables);
+	if (arguments.count >= 2)  modeString = ExpandOperatorArgument(arguments[1], variables);
 	JATAlignMode padMode = InterpretAlignMode(modeString, kJATAlignModeEnd);
+	NSRange whole = { 0, stringLength };
 	
 	switch (padMode)
 	{
 		case kJATAlignModeStart:
-			return JATExpand(@"{padCount|padding}{value}", value, @(padCount));
+			return ComposeFitString(value, padCount, whole, nil, (NSRange){ 0, 0 }, 0);
 			
 		case kJATAlignModeCenter:
 		{
 			NSUInteger padBefore = padCount / 2;
 			NSUInteger padAfter = padCount - padBefore;
-			return JATExpand(@"{padBefore|padding}{value}{padAfter|padding}", value, @(padBefore), @(padAfter));
+			return ComposeFitString(value, padBefore, whole, nil, (NSRange){ 0, 0 }, padAfter);
 		}
 			
 		case kJATAlignModeEnd:
-			return JATExpand(@"{value}{padCount|padding}", value, @(padCount));
+			return ComposeFitString(value, 0, whole, nil, (NSRange){ 0, 0 }, padCount);
 			
 		case kJATAlignModeNone:
 			return value;
@@ -570,7 +735,7 @@ static NSString *PadFitString(NSString *value, NSArray *arguments, NSUInteger st
 }
 
 
-static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteger stringLength, NSUInteger fitLength, NSDictionary *variables)
+static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteger stringLength, NSUInteger fitLength, JATAlignMode truncMode, NSString *modeString)
 {
 	NSString *truncString = @"…";
 	NSUInteger truncLength = 1;
@@ -581,26 +746,21 @@ static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteg
 	}
 	if (truncLength >= fitLength)  return truncString;
 	
-	NSString *modeString = nil;
-	if (arguments.count >= 3)  modeString = JATExpandWithParameters(arguments[2], variables);
-	JATAlignMode truncMode = InterpretAlignMode(modeString, kJATAlignModeEnd);
-	
 	NSUInteger keepLength = fitLength - truncLength;
 	switch (truncMode)
 	{
 		case kJATAlignModeStart:
-			return JATExpand(@"{truncString}{value|trunc:{keepLength};start}", value, truncString, @(keepLength));
+			return ComposeFitString(value, 0, (NSRange){ 0, 0 }, truncString, (NSRange){ stringLength - keepLength, keepLength }, 0);
 			
 		case kJATAlignModeCenter:
 		{
 			NSUInteger keepAfter = keepLength / 2;
 			NSUInteger keepBefore = keepLength - keepAfter;
-			return JATExpand(@"{value|trunc:{keepBefore}}{truncString}{value|trunc:{keepAfter};start}", value, truncString, @(keepBefore), @(keepAfter));
+			return ComposeFitString(value, 0, (NSRange){ 0, keepBefore }, truncString, (NSRange){ stringLength - keepAfter, keepAfter }, 0);
 		}
 			
 		case kJATAlignModeEnd:
-			value = [value substringToIndex:keepLength];
-			return JATExpand(@"{value|trunc:{keepLength}}{truncString}", value, truncString, @(keepLength));
+			return ComposeFitString(value, 0, (NSRange){ 0, keepLength }, truncString, (NSRange){ 0, 0 }, 0);
 			
 		case kJATAlignModeNone:
 			return value;
@@ -616,9 +776,6 @@ static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteg
 
 - (id<JATCoercible>) jatemplatePerform_fit_withArgument:(NSString *)argument variables:(NSDictionary *)variables
 {
-	NSString *value = [self jatemplateCoerceToString];
-	if (value == nil)  return nil;
-	
 	NSArray *arguments = JATSplitArgumentString(argument, ';');
 	if (arguments.count < 1)
 	{
@@ -626,11 +783,18 @@ static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteg
 		return nil;
 	}
 	
+	NSUInteger fitLength = [ExpandOperatorArgument(arguments[0], variables) integerValue];
+	NSString *truncModeString = nil;
+	if (arguments.count >= 3)  truncModeString = ExpandOperatorArgument(arguments[2], variables);
+	JATAlignMode truncMode = InterpretAlignMode(truncModeString, kJATAlignModeEnd);
+	
+	NSString *value = CoerceForTruncation(self, fitLength, truncMode);
+	if (value == nil)  return nil;
+	
 	NSUInteger stringLength = value.length;
-	NSUInteger fitLength = [JATExpandWithParameters(arguments[0], variables) integerValue];
 	
 	if (stringLength < fitLength)  return PadFitString(value, arguments, stringLength, fitLength, variables);
-	if (stringLength > fitLength)  return TruncateFitString(value, arguments, stringLength, fitLength, variables);
+	if (stringLength > fitLength)  return TruncateFitString(value, arguments, stringLength, fitLength, truncMode, truncModeString);
 	return value;
 }
 
@@ -643,11 +807,7 @@ static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteg
 	NSInteger count = value.integerValue;
 	if (count <= 0)  return @"";
 	
-	char *buffer = malloc(count);
-	if (buffer == NULL)  return nil;
-	
-	memset(buffer, ' ', count);
-	return [[NSString alloc] initWithBytesNoCopy:buffer length:count encoding:NSASCIIStringEncoding freeWhenDone:true];
+	return SpaceString((NSUInteger)count);
 }
 
 
@@ -664,9 +824,8 @@ static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteg
 {
 	id value = self;
 	if (self == [NSNull null])  return [self jatemplateCoerceToString];
-	id class = [value class];
 	
-	return JATExpand(@"<{class}: {value|pointer}>", class, value);
+	return [NSString stringWithFormat:@"<%@: %p>", [value class], (void *)value];
 }
 
 
@@ -682,9 +841,121 @@ static NSString *TruncateFitString(NSString *value, NSArray *arguments, NSUInteg
 	}
 }
 
+
+- (id<JATCoercible>) jatemplatePerform_limit_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	if (argument == nil)
+	{
+		OpWarn(@"Template operator limit: used with no argument.");
+		return nil;
+	}
+	
+	JATCollectionView *view = [JATCollectionView viewWithValue:self];
+	if (view == nil)  return self;
+	
+	NSInteger limit = [ExpandOperatorArgument(argument, variables) integerValue];
+	return [view viewWithLimit:(NSUInteger)MAX(limit, (NSInteger)0)];
+}
+
+
+- (id<JATCoercible>) jatemplatePerform_join_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	JATCollectionView *view = [JATCollectionView viewWithValue:self];
+	if (view == nil)  return self;
+	
+	return [view viewWithSeparator:argument ?: @""];
+}
+
+
+- (id<JATCoercible>) jatemplatePerform_each_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	if (argument == nil)
+	{
+		OpWarn(@"Template operator each: used with no argument.");
+		return nil;
+	}
+	
+	JATCollectionView *view = [JATCollectionView viewWithValue:self] ?: [JATCollectionView viewWithValue:@[ self ]];
+	return [view viewWithElementTemplate:argument variables:variables];
+}
+
 @end
 
 
+#pragma mark - Hexadecimal formatting
+
+/*	FormatHex(value, precision, uppercase)
+
+	Equivalent to [NSString stringWithFormat:@"%.*llx", precision, value] (or
+	%.*llX), without the format string parsing.
+*/
+static NSString *FormatHex(unsigned long long value, int precision, bool uppercase)
+{
+	enum
+	{
+		kMaxNativePrecision = 64
+	};
+
+	// As with printf, a negative precision is ignored.
+	if (precision < 0)  precision = 1;
+	if (precision > kMaxNativePrecision)
+	{
+		return [NSString stringWithFormat:uppercase ? @"%.*llX" : @"%.*llx", precision, value];
+	}
+
+	const char *digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+	unichar buffer[kMaxNativePrecision];
+	unichar *end = buffer + kMaxNativePrecision;
+	unichar *cursor = end;
+
+	while (value != 0)
+	{
+		*--cursor = (unichar)digits[value & 0xF];
+		value >>= 4;
+	}
+	while (end - cursor < precision)
+	{
+		*--cursor = '0';
+	}
+
+	return [NSString stringWithCharacters:cursor length:(NSUInteger)(end - cursor)];
+}
+
+
+/*	ParseHexPrecision(argument)
+
+	Read the precision from an argument of the form "hex;<precision>", with
+	the same rules as [[argument componentsSeparatedByString:@";"][1] intValue].
+*/
+static int ParseHexPrecision(NSString *argument)
+{
+	NSUInteger length = argument.length;
+	NSUInteger idx = 4;		// Skip "hex;".
+
+	while (idx < length && [NSCharacterSet.whitespaceCharacterSet characterIsMember:[argument characterAtIndex:idx]])  idx++;
+
+	bool negative = false;
+	if (idx < length && ([argument characterAtIndex:idx] == '-' || [argument characterAtIndex:idx] == '+'))
+	{
+		negative = [argument characterAtIndex:idx] == '-';
+		idx++;
+	}
+
+	long long result = 0;
+	for (; idx < length; idx++)
+	{
+		unichar c = [argument characterAtIndex:idx];
+		if (c < '0' || c > '9')  break;
+		if (result <= INT_MAX)  result = result * 10 + (c - '0');
+	}
+
+	if (negative)  result = -result;
+	if (result > INT_MAX)  return INT_MAX;
+	if (result < INT_MIN)  return INT_MIN;
+	return (int)result;
+}
+
+
 #pragma mark - Pluralization rules
 // These are based on https://developer.mozilla.org/en-US/docs/Localization_and_Plurals
 
@@ -873,3 +1144,429 @@ static NSString *PluralizationRule16(NSUInteger value, NSArray *components)
 	if (value != 0 && (value % 1000000) == 0)  return components[5];
 	return components[6];
 }
+
+
+#pragma mark - CLDR plural rules
+/*	Integer subsets of the rules in CLDR's plurals.xml. Each rule set is a
+	list of clauses, tried in order, ending with an unconditional clause for
+	the category other. A clause applies if all of its conditions hold; "or"
+	in a CLDR rule becomes several clauses with the same category.
+	
+	The operands are n (the absolute value, which must be an integer for
+	any range to match), i (its integer part) and v (here 0 for integers and
+	1 otherwise). The CLDR operands f, t and e are not available. Conditions
+	that depend on them are left out, which only affects non-integer values
+	and compact notation.
+*/
+enum
+{
+	kJATPluralConditionLimit		= 4
+};
+
+
+typedef enum
+{
+	kJATPluralOperandNone,			// Terminates a condition list.
+	kJATPluralOperandN,
+	kJATPluralOperandI,
+	kJATPluralOperandV
+} JATPluralOperand;
+
+
+typedef struct
+{
+	uint8_t							operand;
+	bool							negate;
+	uint32_t						modulus;		// 0 for none.
+	uint32_t						low;
+	uint32_t						high;
+} JATPluralCondition;
+
+
+typedef struct
+{
+	uint8_t							category;
+	JATPluralCondition				conditions[kJATPluralConditionLimit];
+} JATPluralClause;
+
+
+struct JATPluralRuleSet
+{
+	const char						*locales;		// Space-separated language codes or locale identifiers.
+	const JATPluralClause			*clauses;
+};
+
+
+#define IS(OPERAND, MODULUS, LOW, HIGH)			{ kJATPluralOperand##OPERAND, false, MODULUS, LOW, HIGH }
+#define NOT(OPERAND, MODULUS, LOW, HIGH)		{ kJATPluralOperand##OPERAND, true, MODULUS, LOW, HIGH }
+#define WHEN(CATEGORY, ...)						{ kJATPluralCategory##CATEGORY, { __VA_ARGS__ } }
+#define RULES(...)								(const JATPluralClause[]){ __VA_ARGS__, { kJATPluralCategoryOther } }
+#define OTHER_ONLY								(const JATPluralClause[]){ { kJATPluralCategoryOther } }
+
+// e = 0 and i != 0 and i % 1000000 = 0 and v = 0
+#define MILLIONS_ARE_MANY						WHEN(Many, NOT(I, 0, 0, 0), IS(I, 1000000, 0, 0), IS(V, 0, 0, 0))
+
+static const JATPluralRuleSet sPluralRuleSets[] =
+{
+	{
+		"bo dz id ig ii ja jbo jv jw kde kea km ko lkt lo ms my nqo osa sah ses sg su th to tpi vi wo yo yue zh",
+		OTHER_ONLY
+	},
+	{
+		"ast de en et fi fy gl ia io ji lij nl sc scn sv sw ur yi",
+		RULES(WHEN(One, IS(I, 0, 1, 1), IS(V, 0, 0, 0)))
+	},
+	{
+		"af an asa az bal bem bez bg brx ce cgg chr ckb dv ee el eo eu fo fur gsw ha haw hu jgo jmc ka kaj kcg "
+		"kk kkj kl ks ksb ku ky lb lg mas mgo ml mn mr nah nb nd ne nn nnh no nr ny nyn om or os pap ps rm rof "
+		"rwk saq sd sdh seh sn so sq ss ssy st syr ta te teo tig tk tn tr ts ug uz ve vo vun wae xh xog",
+		RULES(WHEN(One, IS(N, 0, 1, 1)))
+	},
+	{
+		"ff hy kab",
+		RULES(WHEN(One, IS(I, 0, 0, 1)))
+	},
+	{
+		"am as bn doi fa gu hi kn pcm zu",
+		RULES(WHEN(One, IS(I, 0, 0, 0)),
+			  WHEN(One, IS(N, 0, 1, 1)))
+	},
+	{
+		"ak bho guw ln mg nso pa ti wa",
+		RULES(WHEN(One, IS(N, 0, 0, 1)))
+	},
+	{
+		"fr pt",
+		RULES(WHEN(One, IS(I, 0, 0, 1)),
+			  MILLIONS_ARE_MANY)
+	},
+	{
+		"pt_PT ca it vec",
+		RULES(WHEN(One, IS(I, 0, 1, 1), IS(V, 0, 0, 0)),
+			  MILLIONS_ARE_MANY)
+	},
+	{
+		"es",
+		RULES(WHEN(One, IS(N, 0, 1, 1)),
+			  MILLIONS_ARE_MANY)
+	},
+	{
+		"da",
+		RULES(WHEN(One, IS(N, 0, 1, 1)),
+			  WHEN(One, IS(V, 0, 1, 1), IS(I, 0, 0, 1)))
+	},
+	{
+		"is",
+		RULES(WHEN(One, IS(V, 0, 0, 0), IS(I, 10, 1, 1), NOT(I, 100, 11, 11)),
+			  WHEN(One, IS(V, 0, 1, 1)))
+	},
+	{
+		"mk",
+		RULES(WHEN(One, IS(V, 0, 0, 0), IS(I, 10, 1, 1), NOT(I, 100, 11, 11)))
+	},
+	{
+		"ceb fil tl",
+		RULES(WHEN(One, IS(V, 0, 0, 0), IS(I, 0, 1, 3)),
+			  WHEN(One, IS(V, 0, 0, 0), NOT(I, 10, 4, 4), NOT(I, 10, 6, 6), NOT(I, 10, 9, 9)))
+	},
+	{
+		"ru uk",
+		RULES(WHEN(One, IS(V, 0, 0, 0), IS(I, 10, 1, 1), NOT(I, 100, 11, 11)),
+			  WHEN(Few, IS(V, 0, 0, 0), IS(I, 10, 2, 4), NOT(I, 100, 12, 14)),
+			  WHEN(Many, IS(V, 0, 0, 0), IS(I, 10, 0, 0)),
+			  WHEN(Many, IS(V, 0, 0, 0), IS(I, 10, 5, 9)),
+			  WHEN(Many, IS(V, 0, 0, 0), IS(I, 100, 11, 14)))
+	},
+	{
+		"be",
+		RULES(WHEN(One, IS(N, 10, 1, 1), NOT(N, 100, 11, 11)),
+			  WHEN(Few, IS(N, 10, 2, 4), NOT(N, 100, 12, 14)),
+			  WHEN(Many, IS(N, 10, 0, 0)),
+			  WHEN(Many, IS(N, 10, 5, 9)),
+			  WHEN(Many, IS(N, 100, 11, 14)))
+	},
+	{
+		"pl",
+		RULES(WHEN(One, IS(I, 0, 1, 1), IS(V, 0, 0, 0)),
+			  WHEN(Few, IS(V, 0, 0, 0), IS(I, 10, 2, 4), NOT(I, 100, 12, 14)),
+			  WHEN(Many, IS(V, 0, 0, 0), NOT(I, 0, 1, 1), IS(I, 10, 0, 1)),
+			  WHEN(Many, IS(V, 0, 0, 0), IS(I, 10, 5, 9)),
+			  WHEN(Many, IS(V, 0, 0, 0), IS(I, 100, 12, 14)))
+	},
+	{
+		"cs sk",
+		RULES(WHEN(One, IS(I, 0, 1, 1), IS(V, 0, 0, 0)),
+			  WHEN(Few, IS(I, 0, 2, 4), IS(V, 0, 0, 0)),
+			  WHEN(Many, IS(V, 0, 1, 1)))
+	},
+	{
+		"bs hr sh sr",
+		RULES(WHEN(One, IS(V, 0, 0, 0), IS(I, 10, 1, 1), NOT(I, 100, 11, 11)),
+			  WHEN(Few, IS(V, 0, 0, 0), IS(I, 10, 2, 4), NOT(I, 100, 12, 14)))
+	},
+	{
+		"sl",
+		RULES(WHEN(One, IS(V, 0, 0, 0), IS(I, 100, 1, 1)),
+			  WHEN(Two, IS(V, 0, 0, 0), IS(I, 100, 2, 2)),
+			  WHEN(Few, IS(V, 0, 0, 0), IS(I, 100, 3, 4)),
+			  WHEN(Few, IS(V, 0, 1, 1)))
+	},
+	{
+		"mo ro",
+		RULES(WHEN(One, IS(I, 0, 1, 1), IS(V, 0, 0, 0)),
+			  WHEN(Few, IS(V, 0, 1, 1)),
+			  WHEN(Few, IS(N, 0, 0, 0)),
+			  WHEN(Few, NOT(N, 0, 1, 1), IS(N, 100, 1, 19)))
+	},
+	{
+		"lt",
+		RULES(WHEN(One, IS(N, 10, 1, 1), NOT(N, 100, 11, 19)),
+			  WHEN(Few, IS(N, 10, 2, 9), NOT(N, 100, 11, 19)),
+			  WHEN(Many, IS(V, 0, 1, 1)))
+	},
+	{
+		"lv prg",
+		RULES(WHEN(Zero, IS(N, 10, 0, 0)),
+			  WHEN(Zero, IS(N, 100, 11, 19)),
+			  WHEN(One, IS(N, 10, 1, 1), NOT(N, 100, 11, 11)))
+	},
+	{
+		"he",
+		RULES(WHEN(One, IS(I, 0, 1, 1), IS(V, 0, 0, 0)),
+			  WHEN(One, IS(I, 0, 0, 0), IS(V, 0, 1, 1)),
+			  WHEN(Two, IS(I, 0, 2, 2), IS(V, 0, 0, 0)))
+	},
+	{
+		"ar ars",
+		RULES(WHEN(Zero, IS(N, 0, 0, 0)),
+			  WHEN(One, IS(N, 0, 1, 1)),
+			  WHEN(Two, IS(N, 0, 2, 2)),
+			  WHEN(Few, IS(N, 100, 3, 10)),
+			  WHEN(Many, IS(N, 100, 11, 99)))
+	},
+	{
+		"ga",
+		RULES(WHEN(One, IS(N, 0, 1, 1)),
+			  WHEN(Two, IS(N, 0, 2, 2)),
+			  WHEN(Few, IS(N, 0, 3, 6)),
+			  WHEN(Many, IS(N, 0, 7, 10)))
+	},
+	{
+		"gd",
+		RULES(WHEN(One, IS(N, 0, 1, 1)),
+			  WHEN(One, IS(N, 0, 11, 11)),
+			  WHEN(Two, IS(N, 0, 2, 2)),
+			  WHEN(Two, IS(N, 0, 12, 12)),
+			  WHEN(Few, IS(N, 0, 3, 10)),
+			  WHEN(Few, IS(N, 0, 13, 19)))
+	},
+	{
+		"mt",
+		RULES(WHEN(One, IS(N, 0, 1, 1)),
+			  WHEN(Two, IS(N, 0, 2, 2)),
+			  WHEN(Few, IS(N, 0, 0, 0)),
+			  WHEN(Few, IS(N, 100, 3, 10)),
+			  WHEN(Many, IS(N, 100, 11, 19)))
+	},
+	{
+		"cy",
+		RULES(WHEN(Zero, IS(N, 0, 0, 0)),
+			  WHEN(One, IS(N, 0, 1, 1)),
+			  WHEN(Two, IS(N, 0, 2, 2)),
+			  WHEN(Few, IS(N, 0, 3, 3)),
+			  WHEN(Many, IS(N, 0, 6, 6)))
+	}
+};
+
+#undef IS
+#undef NOT
+#undef WHEN
+#undef RULES
+#undef OTHER_ONLY
+#undef MILLIONS_ARE_MANY
+
+
+// Languages without an entry use the CLDR root rules, which only have other.
+static const JATPluralRuleSet *const kJATRootPluralRules = &sPluralRuleSets[0];
+
+
+static bool LocaleListContains(const char *list, const char *locale, size_t length)
+{
+	while (*list != '\0')
+	{
+		size_t entryLength = strcspn(list, " ");
+		if (entryLength == length && strncmp(list, locale, length) == 0)  return true;
+		list += entryLength;
+		while (*list == ' ')  list++;
+	}
+	return false;
+}
+
+
+static const JATPluralRuleSet *FindPluralRules(const char *locale, size_t length)
+{
+	for (size_t idx = 0; idx < sizeof sPluralRuleSets / sizeof *sPluralRuleSets; idx++)
+	{
+		if (LocaleListContains(sPluralRuleSets[idx].locales, locale, length))  return &sPluralRuleSets[idx];
+	}
+	return NULL;
+}
+
+
+/*	Look up a locale identifier such as "pt-PT" or "sr_Latn_RS" by the full
+	identifier, then by language code.
+*/
+static const JATPluralRuleSet *PluralRulesForLocale(NSString *localeIdentifier)
+{
+	NSString *canonical = [NSLocale canonicalLocaleIdentifierFromString:localeIdentifier];
+	const char *locale = canonical.UTF8String;
+	if (locale == NULL)  return kJATRootPluralRules;
+
+	const JATPluralRuleSet *rules = FindPluralRules(locale, strlen(locale));
+	if (rules == NULL)  rules = FindPluralRules(locale, strcspn(locale, "_-@"));
+	if (rules == NULL)  rules = kJATRootPluralRules;
+	return rules;
+}
+
+
+static NSString *DefaultPluralLocale(void)
+{
+	NSString *localization = NSBundle.mainBundle.preferredLocalizations.firstObject;
+	if (localization == nil || [localization isEqualToString:@"Base"])
+	{
+		localization = NSLocale.preferredLanguages.firstObject;
+	}
+	return localization ?: @"en";
+}
+
+
+static pthread_mutex_t sPluralLocaleLock = PTHREAD_MUTEX_INITIALIZER;
+static NSString *sPluralLocaleOverride;
+static NSString *sPluralLocale;
+static const JATPluralRuleSet *sPluralRules;	// NULL until selected for the current locale.
+
+
+void JATSetPluralLocale(NSString *localeIdentifier)
+{
+	localeIdentifier = [localeIdentifier copy];
+
+	pthread_mutex_lock(&sPluralLocaleLock);
+	sPluralLocaleOverride = localeIdentifier;
+	sPluralLocale = nil;
+	__atomic_store_n(&sPluralRules, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sPluralLocaleLock);
+}
+
+
+// Call with sPluralLocaleLock held.
+static void SelectPluralRules(void)
+{
+	if (sPluralLocale != nil)  return;
+
+	sPluralLocale = sPluralLocaleOverride ?: DefaultPluralLocale();
+	__atomic_store_n(&sPluralRules, PluralRulesForLocale(sPluralLocale), __ATOMIC_RELEASE);
+}
+
+
+NSString *JATGetPluralLocale(void)
+{
+	pthread_mutex_lock(&sPluralLocaleLock);
+	SelectPluralRules();
+	NSString *result = sPluralLocale;
+	pthread_mutex_unlock(&sPluralLocaleLock);
+
+	return result;
+}
+
+
+static const JATPluralRuleSet *CurrentPluralRules(void)
+{
+	const JATPluralRuleSet *rules = __atomic_load_n(&sPluralRules, __ATOMIC_ACQUIRE);
+	if (rules != NULL)  return rules;
+
+	pthread_mutex_lock(&sPluralLocaleLock);
+	SelectPluralRules();
+	rules = sPluralRules;
+	pthread_mutex_unlock(&sPluralLocaleLock);
+
+	return rules;
+}
+
+
+static unsigned PluralCategoryMask(const JATPluralRuleSet *rules)
+{
+	unsigned mask = 0;
+	const JATPluralClause *clause = rules->clauses;
+	for (;; clause++)
+	{
+		mask |= 1U << clause->category;
+		if (clause->category == kJATPluralCategoryOther)  break;
+	}
+	return mask;
+}
+
+
+static JATPluralCategory SelectPluralCategory(const JATPluralRuleSet *rules, NSNumber *value)
+{
+	unsigned long long integerPart;
+	bool fractional = false;
+
+	if ([value isKindOfClass:NSDecimalNumber.class])
+	{
+		// Split decimals exactly, rather than through a double.
+		NSDecimalNumber *number = (NSDecimalNumber *)value;
+		if ([number isEqualToNumber:NSDecimalNumber.notANumber])  return kJATPluralCategoryOther;
+		if ([number compare:NSDecimalNumber.zero] == NSOrderedAscending)  number = [NSDecimalNumber.zero decimalNumberBySubtracting:number];
+
+		NSDecimalNumberHandler *truncate = [NSDecimalNumberHandler decimalNumberHandlerWithRoundingMode:NSRoundDown scale:0 raiseOnExactness:NO raiseOnOverflow:NO raiseOnUnderflow:NO raiseOnDivideByZero:NO];
+		NSDecimalNumber *wholePart = [number decimalNumberByRoundingAccordingToBehavior:truncate];
+		fractional = [number compare:wholePart] != NSOrderedSame;
+
+		NSDecimalNumber *limit = [NSDecimalNumber decimalNumberWithMantissa:ULLONG_MAX exponent:0 isNegative:NO];
+		integerPart = ([wholePart compare:limit] == NSOrderedAscending) ? wholePart.unsignedLongLongValue : ULLONG_MAX;
+	}
+	else if (JATNumberIsFloatingPoint(value))
+	{
+		double number = fabs(value.doubleValue);
+		if (!isfinite(number))  return kJATPluralCategoryOther;
+
+		double wholePart = floor(number);
+		fractional = number - wholePart > 0.0;
+		integerPart = wholePart < 0x1p64 ? (unsigned long long)wholePart : ULLONG_MAX;
+	}
+	else
+	{
+		char type = value.objCType[0];
+		if (type == 'Q' || type == 'L')
+		{
+			integerPart = value.unsignedLongLongValue;
+		}
+		else
+		{
+			long long number = value.longLongValue;
+			integerPart = number < 0 ? 0ULL - (unsigned long long)number : (unsigned long long)number;
+		}
+	}
+
+	for (const JATPluralClause *clause = rules->clauses;; clause++)
+	{
+		bool matches = true;
+		for (NSUInteger idx = 0; matches && idx < kJATPluralConditionLimit; idx++)
+		{
+			const JATPluralCondition *condition = &clause->conditions[idx];
+			if (condition->operand == kJATPluralOperandNone)  break;
+
+			unsigned long long operand = integerPart;
+			if (condition->operand == kJATPluralOperandV)  operand = fractional ? 1 : 0;
+			if (condition->modulus != 0)  operand %= condition->modulus;
+
+			// A non-integer n is never in a range, since ranges only contain integers.
+			bool inRange = condition->low <= operand && operand <= condition->high;
+			if (condition->operand == kJATPluralOperandN && fractional)  inRange = false;
+
+			matches = inRange != condition->negate;
+		}
+
+		if (matches || clause->category == kJATPluralCategoryOther)  return (JATPluralCategory)clause->category;
+	}
+}
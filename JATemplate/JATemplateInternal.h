@@ -37,18 +37,227 @@ SOFTWARE.
 #endif
 #endif
 
+// Enable or disable instrumentation support. See JATSetInstrumentationEnabled().
+
+#ifndef JATEMPLATE_INSTRUMENTATION
+#define JATEMPLATE_INSTRUMENTATION 0
+#endif
+
 #if JATEMPLATE_SYNTAX_WARNINGS
 #ifndef JATReportWarning
 #define JATReportWarning(message)  NSLog(@"JATemplate warning: %@", message)
 #endif
 
-#define JATWarn(CHARACTERS, LENGTH, TEMPLATE, ...)  JATWrapWarning(CHARACTERS, LENGTH, JATExpand(TEMPLATE, __VA_ARGS__))
+#define JATPrepareWarning(CHARACTERS, LENGTH, TEMPLATE, ...)  JATWarningMessage(CHARACTERS, LENGTH, JATExpand(TEMPLATE, __VA_ARGS__))
 #else
-#define JATWarn(CHARACTERS, LENGTH, TEMPLATE, ...) do {} while (0)
+#define JATPrepareWarning(CHARACTERS, LENGTH, TEMPLATE, ...)  ((NSString *)nil)
 #endif
 
+/*	JATWarn() is rate-limited by JATCountWarning(), and only formats its
+	message when it is going to be reported. Without JATEMPLATE_SYNTAX_WARNINGS,
+	occurrences are counted but never reported.
+*/
+#define JATWarn(CHARACTERS, LENGTH, TEMPLATE, ...)  do { \
+	NSUInteger jat_occurrences_ = JATCountWarning(CHARACTERS, LENGTH, TEMPLATE); \
+	if (jat_occurrences_ != 0)  JATReportWarningOccurrences(CHARACTERS, LENGTH, JATExpand(TEMPLATE, __VA_ARGS__), jat_occurrences_); \
+} while (0)
+
 void JATWrapWarning(const unichar characters[], NSUInteger length, NSString *message);
 
+/*	JATCountWarning()
+	JATReportWarningOccurrences()
+	
+	JATCountWarning() records an occurrence of a warning identified by
+	<characters> (the template, or NULL for the template currently being
+	expanded) and <kind> (the unformatted message), and returns the number
+	of occurrences to report: 0 if the warning was reported recently, and
+	otherwise 1 plus the number of repeats suppressed since it was last
+	reported. JATWarn() only formats its message if this is non-zero.
+*/
+NSUInteger JATCountWarning(const unichar characters[], NSUInteger length, NSString *kind);
+void JATReportWarningOccurrences(const unichar characters[], NSUInteger length, NSString *message, NSUInteger occurrences);
+
+/*	JATWarningMessage()
+	JATReportPreparedWarning()
+	
+	JATPrepareWarning() builds a warning message without reporting it, so that
+	syntax warnings found while compiling a template can be reported each time
+	the template is expanded. JATReportPreparedWarning() does nothing if the
+	message is nil.
+*/
+NSString *JATWarningMessage(const unichar characters[], NSUInteger length, NSString *message);
+void JATReportPreparedWarning(NSString *message);
+
+/*	JATParameterFrame
+	
+	The parameters for one expansion. Parameters passed through the JATExpand()
+	family of macros are looked up directly in the macro's name and value
+	arrays, so that no dictionary needs to be built unless an operator asks for
+	one. Parameters passed as a dictionary use it as-is.
+	
+	A name's characters are NULL if it isn't an identifier (for example, a
+	literal or a function call), in which case it can only be referred to
+	positionally.
+*/
+typedef struct
+{
+	const unichar							*characters;
+	NSUInteger								length;
+} JATParameterName;
+
+typedef struct
+{
+	const JATParameterValue					*values;
+	const JATParameterName					*names;
+	NSUInteger								count;
+	bool									usesDictionary;
+	__unsafe_unretained NSDictionary		*dictionary;	// Parameters if usesDictionary, otherwise an existing variables dictionary or nil.
+} JATParameterFrame;
+
+JATParameterFrame JATParameterFrameWithDictionary(NSDictionary *parameters);
+
+/*	JATParameterFrameEntryAtIndex()
+	JATParameterFrameEntryForName()
+	
+	Look up an unboxed value in a non-dictionary frame. Returns NULL if the
+	parameter doesn't exist.
+	
+	JATParameterFrameValueAtIndex()
+	JATParameterFrameValueForName()
+	
+	Look up a value in a non-dictionary frame and box it. nil values are
+	returned as NSNull, and nil is returned if the parameter doesn't exist.
+	
+	JATParameterValueObject()
+	
+	Box a parameter value. Never returns nil; nil objects and NULL or invalid
+	C strings are returned as NSNull.
+*/
+const JATParameterValue *JATParameterFrameEntryAtIndex(const JATParameterFrame *frame, NSUInteger index);
+const JATParameterValue *JATParameterFrameEntryForName(const JATParameterFrame *frame, const unichar *characters, NSUInteger length);
+id JATParameterFrameValueAtIndex(const JATParameterFrame *frame, NSUInteger index);
+id JATParameterFrameValueForName(const JATParameterFrame *frame, const unichar *characters, NSUInteger length);
+id JATParameterValueObject(const JATParameterValue *value);
+
+/*	JATParameterFrameDictionary
+	
+	Dictionary view of a non-dictionary frame, used as the variables
+	dictionary for operators. It refers to <frame> until the first lookup,
+	so the expansion that creates one must call -detachFromParameterFrame
+	before the frame goes away.
+*/
+@interface JATParameterFrameDictionary: NSDictionary
+
+- (instancetype) initWithParameterFrame:(const JATParameterFrame *)frame;
+- (void) detachFromParameterFrame;
+- (void) getParameterFrame:(JATParameterFrame *)outFrame;
+
+@end
+
+/*	JATExpandCompiledTemplate()
+	
+	Run a compiled template. <templateString> is returned unchanged if no
+	substitutions are made.
+*/
+NSString *JATExpandCompiledTemplate(JATCompiledTemplate *compiled, NSString *templateString, const JATParameterFrame *frame);
+
+/*	JATExpandCompiledTemplateToSink()
+	
+	Run a compiled template, streaming the output to <sink>. Returns false if
+	the sink failed.
+*/
+bool JATExpandCompiledTemplateToSink(JATCompiledTemplate *compiled, const JATParameterFrame *frame, JATSink *sink);
+
+/*	JATCachedNumberFormatter()
+	JATCachedNumberFormatterWithFormat()
+	JATCachedByteCountFormatter()
+	
+	Return configured formatters for the current locale from a per-thread
+	cache. The results must not be modified, and must not be used on other
+	threads.
+	
+	JATFlushFormatterCache()
+	
+	Discard all cached formatters. This happens automatically when the current
+	locale changes.
+*/
+NSNumberFormatter *JATCachedNumberFormatter(NSNumberFormatterStyle style);
+NSNumberFormatter *JATCachedNumberFormatterWithFormat(NSString *format);
+NSByteCountFormatter *JATCachedByteCountFormatter(NSByteCountFormatterCountStyle style);
+void JATFlushFormatterCache(void);
+
+/*	JATCachedArgumentComponents()
+	
+	Equivalent to JATSplitArgumentString(argument, ';'), but the result is
+	cached per thread. Operator arguments come from templates, so the same
+	few are split over and over.
+*/
+NSArray *JATCachedArgumentComponents(NSString *argument);
+
+/*	JATNumberIsFloatingPoint()
+	
+	True if <number> holds a float, a double or a decimal, judged by its
+	type encoding rather than CFNumberIsFloatType(), which doesn't know about
+	NSDecimalNumber and is unavailable without toll-free bridging.
+*/
+bool JATNumberIsFloatingPoint(NSNumber *number);
+
+/*	JATFormatIntegerNumber()
+	
+	Format an integral NSNumber without using NSNumberFormatter. If
+	<localized> is true, the result is identical to NSNumberFormatter's
+	decimal style for the current locale; otherwise, it's identical to
+	-description. Returns nil if <number> can't be formatted natively, in
+	which case the caller should fall back to a formatter.
+*/
+NSString *JATFormatIntegerNumber(NSNumber *number, bool localized);
+
+/*	JATFormatInteger()
+	
+	Like JATFormatIntegerNumber(), for an unboxed integer.
+*/
+NSString *JATFormatInteger(unsigned long long magnitude, bool negative, bool localized);
+
+/*	JATCollectionView
+	
+	A lazily formatted view of an array, ordered set, set or dictionary, as
+	produced by the limit:, join: and each: operators. Nothing is formatted
+	until the view is coerced to a string, and then only as many elements as
+	fit within its limits.
+	
+	+viewWithValue: returns <value> if it's already a view, a new view if it's
+	a supported collection, and nil otherwise.
+*/
+@interface JATCollectionView: NSObject <JATCoercible>
+
++ (instancetype) viewWithValue:(id)value;
+
+- (instancetype) viewWithLimit:(NSUInteger)limit;
+- (instancetype) viewWithSeparator:(NSString *)separator;
+- (instancetype) viewWithElementTemplate:(NSString *)elementTemplate variables:(NSDictionary *)variables;
+
+/*	Format the view, stopping once the result reaches <outputLimit>
+	characters. If elements are left out, the result ends with an ellipsis.
+*/
+- (NSString *) stringWithOutputLimit:(NSUInteger)outputLimit;
+
+@end
+
+/*	JATCoerceToStringWithOutputLimit()
+	
+	Like -jatemplateCoerceToString, but collections stop formatting once the
+	result reaches <outputLimit> characters. Operators which only keep the
+	start of a string can use this to avoid formatting all of a collection.
+*/
+NSString *JATCoerceToStringWithOutputLimit(id value, NSUInteger outputLimit);
+
+/*	JATLocalizedString()
+	
+	Equivalent to NSLocalizedStringFromTableInBundle(), but served from the
+	localization cache used by the localizing JATExpand*() functions.
+*/
+NSString *JATLocalizedString(NSString *key, NSString *table, NSBundle *bundle);
+
 bool JATIsValidIdentifier(NSString *candidate);
 
 /*	JATWithCharacters()
@@ -59,8 +268,34 @@ bool JATIsValidIdentifier(NSString *candidate);
 */
 void JATWithCharacters(NSString *string, void(^block)(const unichar characters[], NSUInteger length));
 
+/*	JATCharacterSpan
+	
+	The characters of a string, either as UTF-16 or, for strings stored in
+	eight-bit form, as Latin-1 bytes. Exactly one of <characters> and <bytes>
+	is set. Since each Latin-1 byte is one character, indices are the same
+	either way.
+	
+	JATWithCharacterSpan()
+	
+	Like JATWithCharacters(), but ASCII and Latin-1 strings are passed as
+	they are stored instead of being widened to UTF-16.
+*/
+typedef struct
+{
+	const unichar		*characters;
+	const uint8_t		*bytes;
+	NSUInteger			length;
+} JATCharacterSpan;
+
+static inline unichar JATCharacterSpanAt(JATCharacterSpan span, NSUInteger idx)
+{
+	return (span.bytes != NULL) ? span.bytes[idx] : span.characters[idx];
+}
+
+void JATWithCharacterSpan(NSString *string, void(^block)(JATCharacterSpan span));
+
 /*	JATSplitStringInternal()
 	
 	Core logic of JATSplitArgumentString().
 */
-NSArray *JATSplitStringInternal(NSString *string, unichar separator, unichar balanceStart, unichar balanceEnd, const unichar *stringBuffer, NSUInteger length, bool printWarnings);
+NSArray *JATSplitStringInternal(NSString *string, unichar separator, unichar balanceStart, unichar balanceEnd, JATCharacterSpan span, bool printWarnings);
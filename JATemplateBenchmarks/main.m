@@ -0,0 +1,524 @@
+/*	JATemplateBenchmarks: measure expansion speed and allocations, so that
+	changes to JATemplate can be compared against a baseline.
+
+	Usage: JATemplateBenchmarks [--json] [--time <seconds>] [--samples <count>] [<filter> ...]
+
+	Each benchmark is calibrated to run for about <time> seconds per sample
+	(default 0.2), and <count> samples are taken (default 5). The median
+	sample is reported as nanoseconds and allocations per operation. If any
+	filters are given, only benchmarks whose names contain one of them are
+	run.
+
+	With --json, the results are written to stdout as a single JSON object
+	for regression tracking; otherwise, a table is printed.
+
+	Allocations are counted by interposing malloc(), calloc() and realloc(),
+	which works with glibc. On other platforms, the allocation columns are
+	reported as unavailable (null in JSON).
+
+	The tool only depends on Foundation, CoreFoundation and the JATemplate
+	sources, so it can be built on Linux with GNUstep (gnustep-base and
+	gnustep-corebase) and libdispatch as well as with the Xcode target, for
+	instance:
+		clang `gnustep-config --objc-flags` -fobjc-arc -fblocks -O2 -IJATemplate \
+			JATemplate/*.m JATemplateBenchmarks/main.m \
+			`gnustep-config --base-libs` -lgnustep-corebase -ldispatch -o JATemplateBenchmarks
+*/
+
+#include <stdlib.h>
+#include <time.h>
+#import <Foundation/Foundation.h>
+#import "JATemplate.h"
+
+
+#pragma mark - Allocation accounting
+
+#if defined(__GLIBC__)
+
+#define JATBENCHMARK_COUNT_ALLOCATIONS	1
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wreserved-identifier"
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+#pragma clang diagnostic pop
+
+static bool sCountingAllocations;
+static uint64_t sAllocationCount;
+static uint64_t sAllocationBytes;
+
+
+static inline void JATCountAllocation(size_t size)
+{
+	if (!__atomic_load_n(&sCountingAllocations, __ATOMIC_RELAXED))  return;
+
+	__atomic_add_fetch(&sAllocationCount, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sAllocationBytes, size, __ATOMIC_RELAXED);
+}
+
+
+void *malloc(size_t size)
+{
+	JATCountAllocation(size);
+	return __libc_malloc(size);
+}
+
+
+void *calloc(size_t count, size_t size)
+{
+	JATCountAllocation(count * size);
+	return __libc_calloc(count, size);
+}
+
+
+void *realloc(void *pointer, size_t size)
+{
+	JATCountAllocation(size);
+	return __libc_realloc(pointer, size);
+}
+
+#else
+
+#define JATBENCHMARK_COUNT_ALLOCATIONS	0
+
+#endif
+
+
+static void JATStartCountingAllocations(void)
+{
+#if JATBENCHMARK_COUNT_ALLOCATIONS
+	__atomic_store_n(&sAllocationCount, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&sAllocationBytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&sCountingAllocations, true, __ATOMIC_RELAXED);
+#endif
+}
+
+
+static void JATStopCountingAllocations(uint64_t *outCount, uint64_t *outBytes)
+{
+#if JATBENCHMARK_COUNT_ALLOCATIONS
+	__atomic_store_n(&sCountingAllocations, false, __ATOMIC_RELAXED);
+	*outCount = __atomic_load_n(&sAllocationCount, __ATOMIC_RELAXED);
+	*outBytes = __atomic_load_n(&sAllocationBytes, __ATOMIC_RELAXED);
+#else
+	*outCount = 0;
+	*outBytes = 0;
+#endif
+}
+
+
+#pragma mark - Benchmarks
+
+typedef void (^JATBenchmarkBody)(NSUInteger iterations);
+
+@interface JATBenchmark: NSObject
+
+@property (nonatomic, copy) NSString *name;
+@property (nonatomic, copy) JATBenchmarkBody body;
+
+@end
+
+
+typedef struct
+{
+	NSUInteger				iterations;		// Per sample.
+	double					nanosecondsPerOperation;
+	double					minimumNanosecondsPerOperation;
+	double					allocationsPerOperation;
+	double					bytesPerOperation;
+} JATBenchmarkResult;
+
+
+// Results are summed into this so the work can't be optimized away.
+static NSUInteger sChecksum;
+
+/*	JATBENCHMARK_LOOP(...) makes a benchmark body which runs its arguments
+	<iterations> times, each in its own autorelease pool.
+*/
+#define JATBENCHMARK_LOOP(...) \
+	^(NSUInteger iterations) { for (NSUInteger jatIteration = 0; jatIteration < iterations; jatIteration++) { @autoreleasepool { __VA_ARGS__ } } }
+
+
+static NSBundle *JATMakeLocalizationBundle(NSString *template);
+
+
+static NSArray *JATMakeBenchmarks(void)
+{
+	NSMutableArray *benchmarks = [NSMutableArray array];
+	void (^add)(NSString *, JATBenchmarkBody) = ^(NSString *name, JATBenchmarkBody body) {
+		JATBenchmark *benchmark = [JATBenchmark new];
+		benchmark.name = name;
+		benchmark.body = body;
+		[benchmarks addObject:benchmark];
+	};
+
+	NSString *name = @"Winston";
+	NSString *surname = @"Smith";
+	NSString *email = @"wsmith@minitrue.gov.oc";
+	NSString *role = @"editor";
+	NSString *title = @"Ministry of Truth";
+	NSUInteger count = 42;
+	bool flag = true;
+	NSUInteger day = 3;
+	double ratio = 0.375;
+	long long bytes = 123456789;
+
+	add(@"sub.identifier", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"Hello, {name}!", name).length;
+	));
+
+	add(@"sub.identifiers4", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{name} {surname} <{email}> ({role})", name, surname, email, role).length;
+	));
+
+	add(@"sub.positional", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{0}, {1} and {2}", name, surname, role).length;
+	));
+
+	add(@"sub.integer", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{count} items", count).length;
+	));
+
+	NSString *paragraph = [@"" stringByPaddingToLength:400 withString:@"It was a bright cold day in April. " startingAtIndex:0];
+	add(@"sub.long", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{name} {surname} wrote: {paragraph} ({role}, {title})", name, surname, paragraph, role, title).length;
+	));
+
+	NSString *place = @"Airstrip One → Oceania";
+	add(@"sub.wide", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{name} {surname} lives in {place}.", name, surname, place).length;
+	));
+
+	add(@"op.chain", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"[{title|uppercase|trunc:8|fit:12;center}]", title).length;
+	));
+
+	add(@"op.nested", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{count|plur:1;{count} file;{count} files} {flag|if:{day|select:Mon;Tue;Wed;Thu;Fri;Sat;Sun};off}", count, flag, day).length;
+	));
+
+	add(@"op.fit", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"[{name|fit:12}] [{title|fit:10;;center}] [{title|trunc:6;start}]", name, title).length;
+	));
+
+	add(@"op.num", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{bytes|num:dec} {bytes|num:hex} {bytes|num:noloc} {ratio|num:pct} {bytes|num:file}", bytes, ratio).length;
+	));
+
+	NSMutableArray *manyItems = [NSMutableArray arrayWithCapacity:100000];
+	for (NSUInteger idx = 0; idx < 100000; idx++)
+	{
+		[manyItems addObject:@(idx)];
+	}
+	add(@"op.limit", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{manyItems|limit:5|each:#{item}|join: }", manyItems).length;
+	));
+
+	add(@"op.truncCollection", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"{manyItems|trunc:40}", manyItems).length;
+	));
+
+	NSString *greeting = @"Hello, {name}! You have {count} {count|plural:message;messages}.";
+	add(@"lookup.literal", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(greeting, name, count).length;
+	));
+
+	NSBundle *bundle = JATMakeLocalizationBundle(greeting);
+	if (bundle != nil)
+	{
+		add(@"lookup.localized", JATBENCHMARK_LOOP(
+			sChecksum += JATExpandFromTableInBundle(@"greeting", @"Benchmarks", bundle, name, count).length;
+		));
+	}
+	else
+	{
+		JATErrorPrintLiteral(@"Skipping lookup.localized: the temporary localization bundle could not be set up.\n");
+	}
+
+	add(@"format.stringWithFormat", JATBENCHMARK_LOOP(
+		sChecksum += [NSString stringWithFormat:@"Hello, %@! You have %lu messages.", name, (unsigned long)count].length;
+	));
+
+	add(@"format.expand", JATBENCHMARK_LOOP(
+		sChecksum += JATExpandLiteral(@"Hello, {name}! You have {count} messages.", name, count).length;
+	));
+
+	add(@"format.writeBuffer", JATBENCHMARK_LOOP(
+		char buffer[128];
+		JATSink sink = JATSinkWithBuffer(buffer, sizeof buffer);
+		JATWriteLiteral(&sink, @"Hello, {name}! You have {count} messages.", name, count);
+		sChecksum += sink.length;
+	));
+
+	NSMutableArray *rows = [NSMutableArray array];
+	for (NSUInteger idx = 0; idx < 1000; idx++)
+	{
+		[rows addObject:@{ @"name": name, @"title": title, @"count": @(idx) }];
+	}
+	JATCompiledTemplate *rowTemplate = [JATCompiledTemplate compiledTemplateWithString:@"{name|fit:12} {title|fit:20;;center} {count|num:noloc|fit:6;start}"];
+
+	add(@"batch.rows1000.serial", JATBENCHMARK_LOOP(
+		NSMutableString *report = [NSMutableString string];
+		for (NSDictionary *row in rows)
+		{
+			[report appendString:[rowTemplate expandWithParameters:row]];
+			[report appendString:@"\n"];
+		}
+		sChecksum += report.length;
+	));
+
+	add(@"batch.rows1000", JATBENCHMARK_LOOP(
+		sChecksum += [rowTemplate expandRows:rows separator:@"\n"].length;
+	));
+
+	return benchmarks;
+}
+
+
+/*	JATMakeLocalizationBundle(template)
+
+	Create a bundle in a temporary directory with a Benchmarks.strings table
+	mapping "greeting" to <template>. Returns nil if the table can't be
+	found through the bundle afterwards.
+*/
+static NSBundle *JATMakeLocalizationBundle(NSString *template)
+{
+	NSString *bundlePath = [NSTemporaryDirectory() stringByAppendingPathComponent:JATExpandLiteral(@"JATemplateBenchmarks-{0}.bundle", @(getpid()))];
+	NSString *lprojPath = [bundlePath stringByAppendingPathComponent:@"en.lproj"];
+	if (![NSFileManager.defaultManager createDirectoryAtPath:lprojPath withIntermediateDirectories:YES attributes:nil error:NULL])  return nil;
+
+	// .strings files can be property lists in any format.
+	NSString *tablePath = [lprojPath stringByAppendingPathComponent:@"Benchmarks.strings"];
+	if (![@{ @"greeting": template } writeToFile:tablePath atomically:YES])  return nil;
+
+	NSBundle *bundle = [NSBundle bundleWithPath:bundlePath];
+	if (![[bundle localizedStringForKey:@"greeting" value:@"" table:@"Benchmarks"] isEqualToString:template])  return nil;
+
+	return bundle;
+}
+
+
+#pragma mark - Running
+
+static uint64_t JATNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+static int JATCompareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+static double JATMedian(double *values, NSUInteger count)
+{
+	qsort(values, count, sizeof *values, JATCompareDoubles);
+	return (count % 2 != 0) ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+
+static JATBenchmarkResult JATRunBenchmark(JATBenchmark *benchmark, double sampleTime, NSUInteger sampleCount)
+{
+	JATBenchmarkBody body = benchmark.body;
+	uint64_t targetTime = (uint64_t)(sampleTime * 1e9);
+
+	// Warm up caches, then double the iteration count until a run takes a tenth of the sample time.
+	body(1);
+	NSUInteger iterations = 1;
+	for (;;)
+	{
+		uint64_t start = JATNow();
+		body(iterations);
+		uint64_t elapsed = JATNow() - start;
+
+		if (elapsed >= targetTime / 10 || iterations >= NSUIntegerMax / 4)
+		{
+			double scale = (double)targetTime / (double)MAX(elapsed, (uint64_t)1);
+			iterations = MAX((NSUInteger)((double)iterations * scale), (NSUInteger)1);
+			break;
+		}
+		iterations *= 2;
+	}
+
+	double times[sampleCount], allocations[sampleCount], bytes[sampleCount];
+	for (NSUInteger sample = 0; sample < sampleCount; sample++)
+	{
+		JATStartCountingAllocations();
+		uint64_t start = JATNow();
+		body(iterations);
+		uint64_t elapsed = JATNow() - start;
+		uint64_t allocationCount, allocationBytes;
+		JATStopCountingAllocations(&allocationCount, &allocationBytes);
+
+		times[sample] = (double)elapsed / (double)iterations;
+		allocations[sample] = (double)allocationCount / (double)iterations;
+		bytes[sample] = (double)allocationBytes / (double)iterations;
+	}
+
+	JATBenchmarkResult result = { .iterations = iterations };
+	result.nanosecondsPerOperation = JATMedian(times, sampleCount);
+	result.minimumNanosecondsPerOperation = times[0];	// Sorted by JATMedian().
+	result.allocationsPerOperation = JATMedian(allocations, sampleCount);
+	result.bytesPerOperation = JATMedian(bytes, sampleCount);
+	return result;
+}
+
+
+static bool JATBenchmarkMatchesFilters(JATBenchmark *benchmark, NSArray *filters)
+{
+	if (filters.count == 0)  return true;
+
+	for (NSString *filter in filters)
+	{
+		if ([benchmark.name rangeOfString:filter].location != NSNotFound)  return true;
+	}
+	return false;
+}
+
+
+#pragma mark - Output
+
+static void JATPrintTableHeader(void)
+{
+	printf("%-26s %12s %12s %14s %10s %12s\n", "benchmark", "ns/op", "min ns/op", "ops/s", "allocs/op", "bytes/op");
+}
+
+
+static void JATPrintTableRow(JATBenchmark *benchmark, JATBenchmarkResult result)
+{
+	printf("%-26s %12.1f %12.1f %14.0f ", benchmark.name.UTF8String, result.nanosecondsPerOperation, result.minimumNanosecondsPerOperation, 1e9 / result.nanosecondsPerOperation);
+#if JATBENCHMARK_COUNT_ALLOCATIONS
+	printf("%10.2f %12.1f\n", result.allocationsPerOperation, result.bytesPerOperation);
+#else
+	printf("%10s %12s\n", "n/a", "n/a");
+#endif
+}
+
+
+static void JATPrintJSONString(NSString *string)
+{
+	// Benchmark names and platform strings only need quotes, backslashes and control characters escaped.
+	putchar('"');
+	for (const char *next = string.UTF8String; *next != '\0'; next++)
+	{
+		unsigned char c = (unsigned char)*next;
+		if (c == '"' || c == '\\')  printf("\\%c", c);
+		else if (c < 0x20)  printf("\\u%04x", c);
+		else  putchar(c);
+	}
+	putchar('"');
+}
+
+
+static void JATPrintJSON(NSArray *benchmarks, const JATBenchmarkResult *results, double sampleTime, NSUInteger sampleCount)
+{
+	printf("{\n\t\"tool\": \"JATemplateBenchmarks\",\n\t\"formatVersion\": 1,\n\t\"platform\": ");
+	JATPrintJSONString(NSProcessInfo.processInfo.operatingSystemVersionString);
+	printf(",\n\t\"sampleTime\": %g,\n\t\"samples\": %lu,\n\t\"countsAllocations\": %s,\n\t\"results\":\n\t[\n", sampleTime, (unsigned long)sampleCount, JATBENCHMARK_COUNT_ALLOCATIONS ? "true" : "false");
+
+	NSUInteger count = benchmarks.count;
+	for (NSUInteger idx = 0; idx < count; idx++)
+	{
+		JATBenchmark *benchmark = benchmarks[idx];
+		JATBenchmarkResult result = results[idx];
+
+		printf("\t\t{ \"name\": ");
+		JATPrintJSONString(benchmark.name);
+		printf(", \"iterations\": %lu, \"nsPerOp\": %.3f, \"minNsPerOp\": %.3f, \"opsPerSecond\": %.1f, ", (unsigned long)result.iterations, result.nanosecondsPerOperation, result.minimumNanosecondsPerOperation, 1e9 / result.nanosecondsPerOperation);
+#if JATBENCHMARK_COUNT_ALLOCATIONS
+		printf("\"allocationsPerOp\": %.3f, \"bytesPerOp\": %.1f }", result.allocationsPerOperation, result.bytesPerOperation);
+#else
+		printf("\"allocationsPerOp\": null, \"bytesPerOp\": null }");
+#endif
+		printf("%s\n", (idx + 1 < count) ? "," : "");
+	}
+
+	printf("\t]\n}\n");
+}
+
+
+#pragma mark - Main
+
+int main(int argc, const char * argv[])
+{
+	@autoreleasepool
+	{
+		bool JSON = false;
+		double sampleTime = 0.2;
+		NSUInteger sampleCount = 5;
+		NSMutableArray *filters = [NSMutableArray array];
+
+		for (int idx = 1; idx < argc; idx++)
+		{
+			const char *argument = argv[idx];
+			if (strcmp(argument, "--json") == 0)
+			{
+				JSON = true;
+			}
+			else if (strcmp(argument, "--time") == 0 && idx + 1 < argc)
+			{
+				sampleTime = atof(argv[++idx]);
+			}
+			else if (strcmp(argument, "--samples") == 0 && idx + 1 < argc)
+			{
+				sampleCount = (NSUInteger)MAX(atol(argv[++idx]), 1L);
+			}
+			else if (argument[0] == '-')
+			{
+				NSString *toolName = @(argv[0]).lastPathComponent;
+				JATErrorPrintLiteral(@"Usage: {toolName} [--json] [--time <seconds>] [--samples <count>] [<filter> ...]\n", toolName);
+				return EXIT_FAILURE;
+			}
+			else
+			{
+				[filters addObject:@(argument)];
+			}
+		}
+
+		if (!(sampleTime > 0.0))
+		{
+			JATErrorPrintLiteral(@"The sample time must be positive.\n");
+			return EXIT_FAILURE;
+		}
+
+		NSMutableArray *benchmarks = [NSMutableArray array];
+		for (JATBenchmark *benchmark in JATMakeBenchmarks())
+		{
+			if (JATBenchmarkMatchesFilters(benchmark, filters))  [benchmarks addObject:benchmark];
+		}
+
+		NSUInteger count = benchmarks.count;
+		JATBenchmarkResult results[MAX(count, (NSUInteger)1)];
+
+		if (!JSON)  JATPrintTableHeader();
+		for (NSUInteger idx = 0; idx < count; idx++)
+		{
+			@autoreleasepool
+			{
+				results[idx] = JATRunBenchmark(benchmarks[idx], sampleTime, sampleCount);
+				if (!JSON)
+				{
+					JATPrintTableRow(benchmarks[idx], results[idx]);
+					fflush(stdout);
+				}
+			}
+		}
+
+		if (JSON)  JATPrintJSON(benchmarks, results, sampleTime, sampleCount);
+
+		// Keep the checksum alive; it's never actually interesting.
+		if (sChecksum == 0)  JATErrorPrintLiteral(@"No output was produced.\n");
+	}
+
+	return EXIT_SUCCESS;
+}
+
+
+@implementation JATBenchmark
+@end
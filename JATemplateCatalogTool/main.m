@@ -0,0 +1,43 @@
+/*	jatcatalog: compile a .strings table into a JATemplate catalog. See
+	JATTemplateCatalog in JATemplate.h.
+*/
+
+#import <Foundation/Foundation.h>
+#import "JATemplate.h"
+
+
+int main(int argc, const char * argv[])
+{
+	@autoreleasepool
+	{
+		if (argc != 3)
+		{
+			NSString *toolName = @(argv[0]).lastPathComponent;
+			JATErrorPrintLiteral(@"Usage: {toolName} <input.strings> <output.jatcatalog>\n", toolName);
+			return EXIT_FAILURE;
+		}
+
+		NSString *inputPath = @(argv[1]);
+		NSString *outputPath = @(argv[2]);
+
+		// .strings files are property lists, in either the old-style or XML format.
+		NSDictionary *templates = [NSDictionary dictionaryWithContentsOfFile:inputPath];
+		if (templates == nil)
+		{
+			JATErrorPrintLiteral(@"Could not read strings table {inputPath}.\n", inputPath);
+			return EXIT_FAILURE;
+		}
+
+		NSError *error;
+		if (!JATWriteTemplateCatalog(templates, outputPath, &error))
+		{
+			JATErrorPrintLiteral(@"Could not write template catalog {outputPath}: {error}\n", outputPath, error.localizedDescription);
+			return EXIT_FAILURE;
+		}
+
+		NSUInteger count = templates.count;
+		JATPrintLiteral(@"Compiled {count} {count|plural:template;templates} into {outputPath}.\n", count, outputPath);
+	}
+
+	return EXIT_SUCCESS;
+}
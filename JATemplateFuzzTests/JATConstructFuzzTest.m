@@ -1,5 +1,5 @@
 #import "JATConstructFuzzTest.h"
-#import "JAtemplate.h"
+#import "JATemplate.h"
 
 
 // Create a random parameter dictionary.
@@ -262,9 +262,10 @@ static NSString *BasicOperatorTestConstruct(const char *name, NSArray *paramKeys
 
 static NSString *NumOperatorTestConstruct(const char *name, NSArray *paramKeys)
 {
+	// May be called from several threads by JATemplateFuzzTarget.
 	static NSArray *arguments;
-	if (arguments == nil)
-	{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
 		arguments = @[
 			@"$#,##0.00",	// No point constructing random format strings since we’re not testing NSNumberFormatter.
 			@"decimal",
@@ -285,7 +286,7 @@ static NSString *NumOperatorTestConstruct(const char *name, NSArray *paramKeys)
 			@"decimalbytes",
 			@"binarybytes"
 		];
-	}
+	});
 	
 	return JATExpand(@"num:{0}", AnyObject(arguments));
 }
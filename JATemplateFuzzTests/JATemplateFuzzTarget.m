@@ -0,0 +1,456 @@
+/*	JATemplateFuzzTarget: a libFuzzer-style target for JATemplate's parsers,
+	with a multi-threaded stand-alone driver.
+
+	Each input is a selector byte followed by text. Depending on the
+	selector, the text is used as a template for JATExpandLiteralWithParameters()
+	with a fixed set of parameters, or split with JATSplitArgumentString().
+	Every input is run on several threads at once, with a small template
+	cache, to stress the shared caches; the threads must all get the same
+	result.
+
+	Besides crashes and exceptions, an input fails if it takes longer or
+	allocates more than its budget. Budgets grow linearly with the input
+	size, so super-linear behaviour (deep brace nesting, recursive if: and
+	or: arguments) is reported like a crash. The budgets can be changed with
+	the environment variables JATFUZZ_TIME_BUDGET_MS and
+	JATFUZZ_ALLOCATION_BUDGET_MB, which give the budget for an empty input;
+	each input byte adds 1/1000 of that.
+
+	Allocations are counted with AddressSanitizer's allocator hooks when it
+	is enabled, as in the libFuzzer build below, and otherwise by
+	interposing malloc(), calloc() and realloc() on glibc. Elsewhere, the
+	allocation budget isn't enforced.
+
+	To build for libFuzzer on Linux, define JATFUZZ_LIBFUZZER. JATemplate
+	uses CoreFoundation, which GNUstep provides in gnustep-corebase:
+		clang `gnustep-config --objc-flags` -fobjc-arc -fblocks -g -O1 \
+			-fsanitize=fuzzer,address -DJATFUZZ_LIBFUZZER=1 -IJATemplate \
+			JATemplate/*.m JATemplateFuzzTests/JATemplateFuzzTarget.m \
+			`gnustep-config --base-libs` -lgnustep-corebase -ldispatch -o JATemplateFuzzTarget
+		./JATemplateFuzzTarget -dict=JATemplateFuzzTests/JATemplate.dict corpus/
+
+	Without JATFUZZ_LIBFUZZER, the same sources plus JATConstructFuzzTest.m
+	build a stand-alone driver (the JATemplateFuzzTarget Xcode target):
+		JATemplateFuzzTarget [--threads <count>] [--seconds <seconds>] [<input file> ...]
+	Given files, it runs each of them once, which is useful for reproducing
+	failures. Otherwise, it runs test cases from JATConstructFuzzTest(), with
+	random corruption, on <count> threads (default: one per processor) for
+	<seconds> seconds (default: until a failure).
+*/
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#import <Foundation/Foundation.h>
+#import "JATemplate.h"
+#import "JATConstructFuzzTest.h"
+
+
+#ifndef JATFUZZ_LIBFUZZER
+#define JATFUZZ_LIBFUZZER			0
+#endif
+
+
+enum
+{
+	kJATFuzzThreadCount				= 4,	// Threads expanding each input.
+	kJATFuzzTemplateCacheLimit		= 16,	// Small, so templates are evicted while in use.
+	kJATFuzzDefaultTimeBudgetMS		= 250,
+	kJATFuzzDefaultAllocationBudgetMB	= 64
+};
+
+
+typedef enum
+{
+	kJATFuzzModeExpand,
+	kJATFuzzModeSplit
+} JATFuzzMode;
+
+
+#pragma mark - Allocation accounting
+
+#if __has_feature(address_sanitizer)
+
+#include <sanitizer/allocator_interface.h>
+
+#define JATFUZZ_COUNT_ALLOCATIONS	1
+#define JATFUZZ_ALLOCATION_HOOKS	1
+
+// Each thread counts its own allocations, so concurrent expansions have separate budgets.
+static __thread uint64_t sAllocationBytes;
+
+
+// ASan's malloc() can't be interposed, but it calls these for every allocation and free.
+static void JATFuzzMallocHook(const volatile void *pointer, size_t size)
+{
+	(void)pointer;
+	sAllocationBytes += size;
+}
+
+
+static void JATFuzzFreeHook(const volatile void *pointer)
+{
+	(void)pointer;
+}
+
+#elif defined(__GLIBC__)
+
+#define JATFUZZ_COUNT_ALLOCATIONS	1
+#define JATFUZZ_ALLOCATION_HOOKS	0
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wreserved-identifier"
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+#pragma clang diagnostic pop
+
+// Each thread counts its own allocations, so concurrent expansions have separate budgets.
+static __thread uint64_t sAllocationBytes;
+
+
+void *malloc(size_t size)
+{
+	sAllocationBytes += size;
+	return __libc_malloc(size);
+}
+
+
+void *calloc(size_t count, size_t size)
+{
+	sAllocationBytes += count * size;
+	return __libc_calloc(count, size);
+}
+
+
+void *realloc(void *pointer, size_t size)
+{
+	sAllocationBytes += size;
+	return __libc_realloc(pointer, size);
+}
+
+#else
+
+#define JATFUZZ_COUNT_ALLOCATIONS	0
+#define JATFUZZ_ALLOCATION_HOOKS	0
+
+#endif
+
+
+static uint64_t JATFuzzAllocatedBytes(void)
+{
+#if JATFUZZ_COUNT_ALLOCATIONS
+	return sAllocationBytes;
+#else
+	return 0;
+#endif
+}
+
+
+#pragma mark - Running inputs
+
+static NSDictionary *sParameters;
+static uint64_t sTimeBudget;			// Nanoseconds for an empty input.
+static uint64_t sAllocationBudget;		// Bytes for an empty input.
+
+
+static uint64_t JATFuzzNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+
+static uint64_t JATFuzzBudgetFromEnvironment(const char *name, uint64_t defaultValue, uint64_t unit)
+{
+	const char *value = getenv(name);
+	if (value == NULL || atol(value) <= 0)  return defaultValue * unit;
+	return (uint64_t)atol(value) * unit;
+}
+
+
+static void JATFuzzSetUp(void)
+{
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		sTimeBudget = JATFuzzBudgetFromEnvironment("JATFUZZ_TIME_BUDGET_MS", kJATFuzzDefaultTimeBudgetMS, 1000000);
+		sAllocationBudget = JATFuzzBudgetFromEnvironment("JATFUZZ_ALLOCATION_BUDGET_MB", kJATFuzzDefaultAllocationBudgetMB, 1 << 20);
+#if JATFUZZ_ALLOCATION_HOOKS
+		__sanitizer_install_malloc_and_free_hooks(JATFuzzMallocHook, JATFuzzFreeHook);
+#endif
+
+		JATSetTemplateCacheLimit(kJATFuzzTemplateCacheLimit);
+		// Malformed templates are expected; count their warnings, but don't log each one.
+		JATSetWarningInterval(INFINITY);
+
+		// Keys like those made by JATConstructFuzzTest(), and values of each coercible kind.
+		sParameters = @{
+			@0: @0,
+			@1: @1,
+			@2: @42,
+			@3: @"text",
+			@"key_0": @-7,
+			@"key_1": @3.5,
+			@"key_2": @"Ünïcödé \U0001F600",
+			@"key_3": @YES,
+			@"key_4": NSNull.null,
+			@"key_5": @[ @1, @"two", @3 ],
+			@"key_6": @{ @"a": @1 },
+			@"key_7": @"{0}|{1}"
+		};
+	});
+}
+
+
+static NSString *JATFuzzDescribeInput(JATFuzzMode mode, NSString *text, unichar separator)
+{
+	NSString *modeName = (mode == kJATFuzzModeExpand) ? @"expand" : @"split";
+	NSData *textData = [NSJSONSerialization dataWithJSONObject:@[ text ] options:0 error:NULL];
+	NSString *quoted = [[NSString alloc] initWithData:textData encoding:NSUTF8StringEncoding];
+	if (mode == kJATFuzzModeExpand)  return JATExpandLiteral(@"mode: {modeName}\ninput: {quoted}", modeName, quoted);
+	return JATExpandLiteral(@"mode: {modeName}\nseparator: {0}\ninput: {quoted}", @(separator), modeName, quoted);
+}
+
+
+/*	JATFuzzFail(...)
+
+	Report a failed input and abort, so that libFuzzer saves the input (or
+	the stand-alone driver stops).
+*/
+#define JATFuzzFail(TEMPLATE, ...)  do { JATErrorPrintLiteral(TEMPLATE, ##__VA_ARGS__); fflush(stderr); abort(); } while (0)
+
+
+static NSString *JATFuzzRunOnce(JATFuzzMode mode, NSString *text, unichar separator, NSUInteger inputSize)
+{
+	uint64_t timeBudget = sTimeBudget + sTimeBudget / 1000 * inputSize;
+	uint64_t allocationBudget = sAllocationBudget + sAllocationBudget / 1000 * inputSize;
+
+	NSString *result;
+	uint64_t startBytes = JATFuzzAllocatedBytes();
+	uint64_t start = JATFuzzNow();
+
+	@try
+	{
+		@autoreleasepool
+		{
+			if (mode == kJATFuzzModeExpand)
+			{
+				result = JATExpandLiteralWithParameters(text, sParameters);
+			}
+			else
+			{
+				result = [JATSplitArgumentString(text, separator) componentsJoinedByString:@" "];
+			}
+		}
+	}
+	@catch (NSException *exception)
+	{
+		NSString *name = exception.name;
+		NSString *reason = exception.reason;
+		NSString *input = JATFuzzDescribeInput(mode, text, separator);
+		JATFuzzFail(@"JATemplateFuzzTarget: exception {name}: {reason}\n{input}\n", name, reason, input);
+	}
+
+	uint64_t elapsed = JATFuzzNow() - start;
+	uint64_t allocated = JATFuzzAllocatedBytes() - startBytes;
+
+	if (elapsed > timeBudget)
+	{
+		NSString *input = JATFuzzDescribeInput(mode, text, separator);
+		JATFuzzFail(@"JATemplateFuzzTarget: time budget exceeded: {0} ms (budget {1} ms for {2} bytes)\n{input}\n", @(elapsed / 1000000), @(timeBudget / 1000000), @(inputSize), input);
+	}
+	if (allocated > allocationBudget)
+	{
+		NSString *input = JATFuzzDescribeInput(mode, text, separator);
+		JATFuzzFail(@"JATemplateFuzzTarget: allocation budget exceeded: {0|num:file} (budget {1|num:file} for {2} bytes)\n{input}\n", @(allocated), @(allocationBudget), @(inputSize), input);
+	}
+
+	return result;
+}
+
+
+/*	JATFuzzOneInput(data, size)
+
+	Run one input on kJATFuzzThreadCount threads at once, and check that
+	they agree.
+*/
+static void JATFuzzOneInput(const uint8_t *data, size_t size)
+{
+	if (size < 2)  return;
+
+	JATFuzzSetUp();
+
+	@autoreleasepool
+	{
+		JATFuzzMode mode = (data[0] & 1) ? kJATFuzzModeSplit : kJATFuzzModeExpand;
+		unichar separator = data[1];
+		NSUInteger textOffset = (mode == kJATFuzzModeSplit) ? 2 : 1;
+
+		// Invalid UTF-8 is read as Latin-1, so that every input is used.
+		NSString *text = [[NSString alloc] initWithBytes:data + textOffset length:size - textOffset encoding:NSUTF8StringEncoding];
+		if (text == nil)  text = [[NSString alloc] initWithBytes:data + textOffset length:size - textOffset encoding:NSISOLatin1StringEncoding];
+		if (text == nil)  return;
+
+		NSMutableArray *results = [NSMutableArray array];
+		for (NSUInteger idx = 0; idx < kJATFuzzThreadCount; idx++)
+		{
+			[results addObject:NSNull.null];
+		}
+		NSLock *resultsLock = [NSLock new];
+
+		dispatch_apply(kJATFuzzThreadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t idx)
+		{
+			NSString *result = JATFuzzRunOnce(mode, text, separator, size);
+			[resultsLock lock];
+			results[idx] = result ?: NSNull.null;
+			[resultsLock unlock];
+		});
+
+		for (NSUInteger idx = 1; idx < kJATFuzzThreadCount; idx++)
+		{
+			if (![results[idx] isEqual:results[0]])
+			{
+				NSString *first = [results[0] description];
+				NSString *other = [results[idx] description];
+				NSString *input = JATFuzzDescribeInput(mode, text, separator);
+				JATFuzzFail(@"JATemplateFuzzTarget: concurrent expansions disagree:\n  {first}\n  {other}\n{input}\n", first, other, input);
+			}
+		}
+	}
+}
+
+
+#pragma mark - libFuzzer entry points
+
+#if JATFUZZ_LIBFUZZER
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wmissing-prototypes"
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	JATFuzzSetUp();
+	return 0;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	JATFuzzOneInput(data, size);
+	return 0;
+}
+
+#pragma clang diagnostic pop
+
+#else
+
+
+#pragma mark - Stand-alone driver
+
+static NSData *JATFuzzMakeInput(void)
+{
+	NSString *template;
+	NSDictionary *parameters;
+	if (!JATConstructFuzzTest(&template, &parameters))  return nil;
+
+	NSMutableData *input = [NSMutableData data];
+	uint8_t header[2] = { (uint8_t)random(), (uint8_t)random() };
+	// Mostly expansion, since that's where the interesting code is.
+	if (random() % 4 != 0)  header[0] = (uint8_t)(header[0] & ~1u);
+	[input appendBytes:header length:sizeof header];
+	[input appendData:[template dataUsingEncoding:NSUTF8StringEncoding]];
+
+	// Corrupt about half of the inputs, like MalignFuzzer.
+	if (random() % 2 == 0 && input.length > sizeof header)
+	{
+		uint8_t *bytes = input.mutableBytes;
+		NSUInteger length = input.length;
+		NSUInteger changeCount = (NSUInteger)random() % (length / 20 + 1) + 1;
+		while (changeCount--)
+		{
+			bytes[sizeof header + (NSUInteger)random() % (length - sizeof header)] = (uint8_t)("{}|;:\\"[random() % 6]);
+		}
+	}
+
+	return input;
+}
+
+
+int main(int argc, const char * argv[])
+{
+	@autoreleasepool
+	{
+		NSUInteger threadCount = NSProcessInfo.processInfo.activeProcessorCount;
+		double seconds = 0;
+		NSMutableArray *files = [NSMutableArray array];
+
+		for (int idx = 1; idx < argc; idx++)
+		{
+			const char *argument = argv[idx];
+			if (strcmp(argument, "--threads") == 0 && idx + 1 < argc)
+			{
+				threadCount = (NSUInteger)MAX(atol(argv[++idx]), 1L);
+			}
+			else if (strcmp(argument, "--seconds") == 0 && idx + 1 < argc)
+			{
+				seconds = atof(argv[++idx]);
+			}
+			else if (argument[0] == '-')
+			{
+				NSString *toolName = @(argv[0]).lastPathComponent;
+				JATErrorPrintLiteral(@"Usage: {toolName} [--threads <count>] [--seconds <seconds>] [<input file> ...]\n", toolName);
+				return EXIT_FAILURE;
+			}
+			else
+			{
+				[files addObject:@(argument)];
+			}
+		}
+
+		JATFuzzSetUp();
+
+		if (files.count != 0)
+		{
+			for (NSString *path in files)
+			{
+				NSData *input = [NSData dataWithContentsOfFile:path];
+				if (input == nil)
+				{
+					JATErrorPrintLiteral(@"Could not read {path}.\n", path);
+					return EXIT_FAILURE;
+				}
+				JATFuzzOneInput(input.bytes, input.length);
+				JATPrintLiteral(@"{path}: OK\n", path);
+			}
+			return EXIT_SUCCESS;
+		}
+
+		srandom((unsigned)JATFuzzNow() ^ (unsigned)getpid());
+		uint64_t deadline = (seconds > 0) ? JATFuzzNow() + (uint64_t)(seconds * 1e9) : UINT64_MAX;
+		__block NSUInteger count = 0;
+
+		JATPrintLiteral(@"Starting fuzz testing on {threadCount} threads...\n", threadCount);
+		dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread)
+		{
+			while (JATFuzzNow() < deadline)
+			{
+				@autoreleasepool
+				{
+					NSData *input = JATFuzzMakeInput();
+					if (input == nil)  JATFuzzFail(@"JATemplateFuzzTarget: failed to construct a test case.\n");
+					JATFuzzOneInput(input.bytes, input.length);
+
+					NSUInteger served = __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+					if ((served % 1000) == 0)  JATPrintLiteral(@"{served} inputs served.\n", served);
+				}
+			}
+		});
+
+		NSUInteger warnings = JATGetWarningStatistics().occurrences;
+		JATPrintLiteral(@"Done: {count} inputs, {warnings} template warnings.\n", count, warnings);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif
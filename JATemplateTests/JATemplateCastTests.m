@@ -151,6 +151,26 @@
 	
 	XCTAssertEqualObjects(expansion, @"stability. No civilization without social stability. No social stability without individual stability.", @"parameter cast from [std::string] failed.");
 }
+
+
+- (void) testExpandUTF8
+{
+	std::string value = "Ce n’est pas une pipe";
+	std::string expansion = JATExpandLiteralUTF8(@"«{value}» — {0|uppercase}", value);
+	
+	XCTAssertTrue(expansion == "«Ce n’est pas une pipe» — CE N’EST PAS UNE PIPE", @"UTF-8 expansion to std::string failed.");
+}
+#endif
+
+
+#if JATEMPLATE_CPP17
+- (void) testCastCppStringView
+{
+	std::string_view value = std::string_view("War is peace. Freedom is slavery.").substr(0, 13);
+	NSString *expansion = JATExpand(@"{value}", value);
+	
+	XCTAssertEqualObjects(expansion, @"War is peace.", @"parameter cast from [std::string_view] failed.");
+}
 #endif
 
 
@@ -8,3 +8,93 @@
 
 #define JATemplateCastTests JATemplateCastTestsCpp
 #import "JATemplateCastTests.m"
+#import "JATemplateTests.h"
+
+
+#if JATEMPLATE_CPP17
+/*	Templates that don't pass the compile-time checks can't be expanded, so
+	the checker itself is tested here.
+*/
+static constexpr std::string_view kCheckedNames[] = { "name", "@( count )", "self.value" };
+
+static_assert(JATCheckTemplate("{name} {count} {2}", kCheckedNames, 3).status == kJATCheckedTemplateOK, "Checked template rejected valid template.");
+static_assert(JATCheckTemplate("{value}", kCheckedNames, 3).status == kJATCheckedTemplateUnknownName, "Checked template accepted unknown name.");
+static_assert(JATCheckTemplate("{3}", kCheckedNames, 3).status == kJATCheckedTemplatePositionalOutOfRange, "Checked template accepted out-of-range positional.");
+static_assert(JATCheckTemplate("{name", kCheckedNames, 3).status == kJATCheckedTemplateSyntaxError, "Checked template accepted unbalanced braces.");
+static_assert(JATCheckTemplate("{name|}", kCheckedNames, 3).status == kJATCheckedTemplateSyntaxError, "Checked template accepted missing operator.");
+static_assert(JATCheckTemplate("a}b", kCheckedNames, 3).status == kJATCheckedTemplateSyntaxError, "Checked template accepted lone close brace.");
+
+
+@interface JATemplateCheckedTests: XCTestCase
+@end
+
+
+@implementation JATemplateCheckedTests
+
+- (void) setUp
+{
+	JATResetWarnings();
+	// Tests count warnings, so report every occurrence.
+	JATSetWarningInterval(0);
+	JATResetWarningRateLimits();
+}
+
+
+- (void) testExpandLiteralChecked
+{
+	NSString *name = @"Jens";
+	int count = 3;
+	NSString *expansion = JATExpandLiteralChecked("{name|uppercase} has {count} {{things}}, {0}.", name, count);
+	
+	XCTAssertEqualObjects(expansion, @"JENS has 3 {things}, Jens.", @"Checked template expansion failed.");
+}
+
+
+- (void) testExpandLiteralCheckedNonASCII
+{
+	NSString *name = @"Jens";
+	NSString *expansion = JATExpandLiteralChecked("Grüße, {name}! 😀 {{{name}}}", name);
+	
+	XCTAssertEqualObjects(expansion, @"Grüße, Jens! 😀 {Jens}", @"Checked template expansion with non-ASCII literal text failed.");
+}
+
+
+- (void) testExpandLiteralCheckedMatchesScanner
+{
+	NSString *name = @"Jens";
+	NSNumber *count = @(2);
+	
+	XCTAssertEqualObjects(JATExpandLiteralChecked("", name), @"", @"Checked template expansion of empty template failed.");
+	XCTAssertEqualObjects(JATExpandLiteralChecked("{{}}", name), @"{}", @"Checked template expansion of escapes failed.");
+	int total = 5;
+	XCTAssertEqualObjects(JATExpandLiteralChecked("{total}", @(total)), @"5", @"Checked template expansion of boxed parameter failed.");
+	
+	// Operator failures are recovered from by rescanning, as at run time.
+	XCTAssertEqualObjects(JATExpandLiteralChecked("{name|notARealOperator} {count}", name, count),
+						  JATExpandLiteral(@"{name|notARealOperator} {count}", name, count),
+						  @"Checked template expansion doesn't recover from operator failure like the scanner.");
+}
+
+
+- (void) testExpandLiteralCheckedFallbackWarnings
+{
+	NSString *name = @"Jens";
+	
+	// Falling back to the scanner reuses the fold: result, so each operator warns once.
+	NSString *expansion = JATExpandLiteralChecked("{name|fold:bogus} {name|notARealOperator}", name);
+	
+	XCTAssertEqualObjects(expansion, @"Jens {name|notARealOperator}", @"Checked template expansion doesn't recover from operator failure like the scanner.");
+	XCTAssertEqual(JATGetWarnings().count, (NSUInteger)2, @"Operators should not run again when a checked template falls back to the scanner.");
+}
+
+
+- (void) testExpandChecked
+{
+	NSString *name = @"Jens";
+	NSString *expansion = JATExpandChecked("Hello, {name}.", name);
+	
+	XCTAssertEqualObjects(expansion, @"Hello, Jens.", @"Checked localized template expansion failed.");
+}
+
+@end
+#endif
@@ -2,12 +2,113 @@
 
 #import "JATemplateTests.h"
 #import "JATemplate.h"
+#import <objc/runtime.h>
 
 
 @interface JATemplateOperatorTests: XCTestCase
 @end
 
 
+// Counts coercions, to check that collection formatting stops early.
+static NSUInteger sCountingElementCoercions;
+
+@interface JATCountingElement: NSObject
+@end
+
+
+@implementation JATCountingElement
+
+- (NSString *) jatemplateCoerceToString
+{
+	sCountingElementCoercions++;
+	return @"x";
+}
+
+@end
+
+
+// Answers an operator by forwarding it, which the class itself doesn't implement.
+@interface JATForwardedOperatorTarget: NSObject
+@end
+
+
+@implementation JATForwardedOperatorTarget
+
+- (id<JATCoercible>) jatemplatePerform_jatemplate_test_forwarded_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	return @"forwarded";
+}
+
+@end
+
+
+@interface JATForwardingOperatorReceiver: NSObject
+@end
+
+
+@implementation JATForwardingOperatorReceiver
+
+- (id) forwardingTargetForSelector:(SEL)selector
+{
+	if ([JATForwardedOperatorTarget instancesRespondToSelector:selector])  return [JATForwardedOperatorTarget new];
+	return [super forwardingTargetForSelector:selector];
+}
+
+
+- (BOOL) respondsToSelector:(SEL)selector
+{
+	return [super respondsToSelector:selector] || [JATForwardedOperatorTarget instancesRespondToSelector:selector];
+}
+
+@end
+
+
+// Implements one operator itself and forwards everything else to its target.
+@interface JATOperatorProxy: NSProxy
+
+- (instancetype) initWithTarget:(id)target;
+
+@end
+
+
+@implementation JATOperatorProxy
+{
+	id _target;
+}
+
+- (instancetype) initWithTarget:(id)target
+{
+	_target = target;
+	return self;
+}
+
+
+- (id<JATCoercible>) jatemplatePerform_jatemplate_test_proxied_withArgument:(NSString *)argument variables:(NSDictionary *)variables
+{
+	return @"proxied";
+}
+
+
+- (BOOL) respondsToSelector:(SEL)selector
+{
+	return [_target respondsToSelector:selector];
+}
+
+
+- (NSMethodSignature *) methodSignatureForSelector:(SEL)selector
+{
+	return [_target methodSignatureForSelector:selector];
+}
+
+
+- (void) forwardInvocation:(NSInvocation *)invocation
+{
+	[invocation invokeWithTarget:_target];
+}
+
+@end
+
+
 @implementation JATemplateOperatorTests
 
 - (void) setUp
@@ -24,6 +125,9 @@
 		}
 	});
 	JATResetWarnings();
+	// Tests count warnings, so report every occurrence.
+	JATSetWarningInterval(0);
+	JATResetWarningRateLimits();
 }
 
 
@@ -36,6 +140,24 @@
 }
 
 
+- (void) testImplicitIntegerDecimal
+{
+	NSString *expansion = JATExpand(@"{0} {1} {2}", 7, 1234567, -20480);
+	
+	XCTAssertEqualObjects(expansion, @"7 1,234,567 -20,480", @"integer-to-string coersion failed.");
+}
+
+
+- (void) testImplicitDecimalNumber
+{
+	NSDecimalNumber *fraction = [NSDecimalNumber decimalNumberWithString:@"12345.67"];
+	NSDecimalNumber *whole = [NSDecimalNumber decimalNumberWithString:@"1234"];
+	NSString *expansion = JATExpand(@"{fraction} {whole}", fraction, whole);
+	
+	XCTAssertEqualObjects(expansion, @"12,345.67 1,234", @"decimal-number-to-string coersion failed.");
+}
+
+
 - (void) testOperatorRound
 {
 	double foo = 10723.056;
@@ -99,6 +221,22 @@
 }
 
 
+- (void) testOperatorNumHexEdgeCases
+{
+	NSString *expansion = JATExpand(@"[{0|num:hex;0}] [{1|num:HEX;-3}] [{2|num:hex}]", 0, 255, -1);
+	
+	XCTAssertEqualObjects(expansion, @"[] [FF] [ffffffffffffffff]", @"num:hex edge cases failed.");
+}
+
+
+- (void) testOperatorNumNolocInteger
+{
+	NSString *expansion = JATExpand(@"{0|num:noloc} {1|num:noloc}", -1234567, 18446744073709551615ULL);
+	
+	XCTAssertEqualObjects(expansion, @"-1234567 18446744073709551615", @"num:noloc with integers failed.");
+}
+
+
 - (void) testOperatorNumCurrency
 {
 	double foo = 723.056;
@@ -153,7 +291,22 @@
 }
 
 
-// TODO: a few tests of num: with NSNumberFormatter format strings.
+- (void) testOperatorNumFormat
+{
+	double foo = 723.056;
+	NSString *expansion = JATExpand(@"{foo|num:#,##0.0}", @(foo));
+	
+	XCTAssertEqualObjects(expansion, @"723.1", @"num: with format string failed.");
+}
+
+
+- (void) testOperatorNumRepeatedFormats
+{
+	double foo = 1723.056;
+	NSString *expansion = JATExpand(@"{foo|num:#,##0.0} {foo|num:0.00} {foo|num:#,##0.0} {foo|num:dec}", @(foo));
+	
+	XCTAssertEqualObjects(expansion, @"1,723.1 1723.06 1,723.1 1,723.056", @"num: with several format strings failed.");
+}
 
 
 - (void) testOperatorPlural
@@ -178,6 +331,34 @@
 }
 
 
+- (void) testOperatorPlurals
+{
+	JATSetPluralLocale(@"en");
+	NSString *expansion = JATExpand(@"{0} {0|plurals:minute;minutes}, {1} {1|plurals:minute;minutes}, {2} {2|plurals:minute;minutes}", @1, @5, @1.5);
+	XCTAssertEqualObjects(expansion, @"1 minute, 5 minutes, 1.5 minutes", @"plurals: operator failed for English.");
+	
+	NSDecimalNumber *one = [NSDecimalNumber decimalNumberWithString:@"1"];
+	NSDecimalNumber *oneAndAHalf = [NSDecimalNumber decimalNumberWithString:@"1.5"];
+	NSDecimalNumber *minusOne = [NSDecimalNumber decimalNumberWithString:@"-1"];
+	expansion = JATExpand(@"{one|plurals:minute;minutes} {oneAndAHalf|plurals:minute;minutes} {minusOne|plurals:minute;minutes}", one, oneAndAHalf, minusOne);
+	XCTAssertEqualObjects(expansion, @"minute minutes minute", @"plurals: operator failed for decimal numbers.");
+	
+	JATSetPluralLocale(@"pl");
+	expansion = JATExpand(@"{0|plurals:minuta;minuty;minut;minuty} {1|plurals:minuta;minuty;minut;minuty} {2|plurals:minuta;minuty;minut;minuty} {3|plurals:minuta;minuty;minut;minuty} {4|plurals:minuta;minuty;minut;minuty}", @1, @22, @12, @25, @2.5);
+	XCTAssertEqualObjects(expansion, @"minuta minuty minut minut minuty", @"plurals: operator failed for Polish.");
+	
+	JATSetPluralLocale(@"ar_EG");
+	expansion = JATExpand(@"{0|plurals:z;o;t;f;m;x}{1|plurals:z;o;t;f;m;x}{2|plurals:z;o;t;f;m;x}{3|plurals:z;o;t;f;m;x}{4|plurals:z;o;t;f;m;x}{5|plurals:z;o;t;f;m;x}", @0, @1, @2, @103, @111, @100);
+	XCTAssertEqualObjects(expansion, @"zotfmx", @"plurals: operator failed for Arabic.");
+	
+	JATSetPluralLocale(@"ja");
+	expansion = JATExpand(@"{0|plurals:分}", @1);
+	XCTAssertEqualObjects(expansion, @"分", @"plurals: operator failed for Japanese.");
+	
+	JATSetPluralLocale(nil);
+}
+
+
 - (void) testOperatorIf
 {
 	NSNumber *yes = @YES;
@@ -326,6 +507,109 @@
 }
 
 
+- (void) testOperatorCache
+{
+	NSString *foo = @"frob";
+	JATOperatorCacheStatistics before = JATGetOperatorCacheStatistics();
+	NSString *expansion = JATExpand(@"{foo|uppercase} {foo|uppercase} {foo|uppercase}", foo);
+	JATOperatorCacheStatistics after = JATGetOperatorCacheStatistics();
+	
+	XCTAssertEqualObjects(expansion, @"FROB FROB FROB", @"Repeated operator failed.");
+	XCTAssertTrue(after.hits >= before.hits + 2, @"Repeated operator lookups should hit the operator cache.");
+}
+
+
+- (void) testOperatorMessaging
+{
+	// Repeated to check that the first lookup isn't cached as an unknown operator.
+	JATForwardingOperatorReceiver *forwarding = [JATForwardingOperatorReceiver new];
+	NSString *expansion = JATExpand(@"{forwarding|jatemplate_test_forwarded} {forwarding|jatemplate_test_forwarded}", forwarding);
+	XCTAssertEqualObjects(expansion, @"forwarded forwarded", @"Operator answered by forwarding failed.");
+	
+	id proxy = [[JATOperatorProxy alloc] initWithTarget:@"frob"];
+	expansion = JATExpand(@"{proxy|jatemplate_test_proxied} {proxy|uppercase} {proxy|jatemplate_test_proxied}", proxy);
+	XCTAssertEqualObjects(expansion, @"proxied FROB proxied", @"Operator on proxy receiver failed.");
+	XCTAssertEqual(JATGetWarnings().count, (NSUInteger)0, @"Operators on forwarding receivers should not warn.");
+}
+
+
+static id<JATCoercible> AddedOperator(id self, SEL _cmd, NSString *argument, NSDictionary *variables)
+{
+	return @"added";
+}
+
+
+- (void) testOperatorCacheInvalidation
+{
+	NSString *foo = @"frob";
+	NSString *expansion = JATExpand(@"{foo|jatemplate_test_added}", foo);
+	XCTAssertEqualObjects(expansion, @"{foo|jatemplate_test_added}", @"Unknown operator should fail.");
+	XCTAssertEqual(JATGetWarnings().count, (NSUInteger)1, @"Expected one warning for unknown operator.");
+	
+	class_addMethod(NSObject.class, NSSelectorFromString(@"jatemplatePerform_jatemplate_test_added_withArgument:variables:"), (IMP)AddedOperator, "@@:@@");
+	JATInvalidateOperatorCache();
+	
+	expansion = JATExpand(@"{foo|jatemplate_test_added}", foo);
+	XCTAssertEqualObjects(expansion, @"added", @"Operator added at runtime should be found after invalidating the operator cache.");
+}
+
+
+static id<JATCoercible> ThrowingOperator(id self, SEL _cmd, NSString *argument, NSDictionary *variables)
+{
+	[NSException raise:NSInternalInconsistencyException format:@"Operator test exception."];
+	return nil;
+}
+
+
+- (void) testThrowingOperator
+{
+	class_addMethod(NSObject.class, NSSelectorFromString(@"jatemplatePerform_jatemplate_test_throw_withArgument:variables:"), (IMP)ThrowingOperator, "@@:@@");
+	JATInvalidateOperatorCache();
+	
+	// The exception is raised after the output buffer has been started.
+	NSString *foo = @"frob";
+	XCTAssertThrows(JATExpand(@"{foo} {foo|jatemplate_test_throw}", foo), @"Exception from operator should propagate.");
+	
+	NSString *expansion = JATExpand(@"{foo} {foo|uppercase}", foo);
+	XCTAssertEqualObjects(expansion, @"frob FROB", @"Expansion after an operator threw failed.");
+
+	// The same, after Latin-1 output has been widened to UTF-16.
+	NSString *wide = @"日本";
+	XCTAssertThrows(JATExpand(@"{foo} {wide} {foo|jatemplate_test_throw}", foo, wide), @"Exception from operator should propagate.");
+
+	expansion = JATExpand(@"{foo} {wide} {foo|uppercase}", foo, wide);
+	XCTAssertEqualObjects(expansion, @"frob 日本 FROB", @"Expansion after an operator threw from widened output failed.");
+}
+
+
+static NSDictionary *sStashedVariables;
+
+static id<JATCoercible> StashVariablesOperator(id self, SEL _cmd, NSString *argument, NSDictionary *variables)
+{
+	sStashedVariables = variables;
+	return self;
+}
+
+
+- (void) testVariablesOutliveExpansion
+{
+	class_addMethod(NSObject.class, NSSelectorFromString(@"jatemplatePerform_jatemplate_test_stash_withArgument:variables:"), (IMP)StashVariablesOperator, "@@:@@");
+	JATInvalidateOperatorCache();
+	
+	// The variables dictionary refers to the expansion's parameters until it is used, and must be copied if an operator keeps it.
+	NSString *foo = @"frob";
+	NSNumber *count = @42;
+	NSString *expansion = JATExpand(@"{foo|jatemplate_test_stash} {count}", foo, count);
+	XCTAssertEqualObjects(expansion, @"frob 42", @"Expansion with variable-stashing operator failed.");
+	
+	NSDictionary *variables = sStashedVariables;
+	sStashedVariables = nil;
+	XCTAssertEqualObjects(variables[@"foo"], foo, @"Variables kept by an operator should outlive the expansion.");
+	XCTAssertEqualObjects(variables[@1], @42, @"Variables kept by an operator should outlive the expansion.");
+	XCTAssertEqual(variables.count, (NSUInteger)4, @"Variables kept by an operator have the wrong number of entries.");
+}
+
+
 #pragma mark fit: and trunc: operators
 
 - (void) testOperatorFitPadEnd
@@ -358,6 +642,19 @@
 }
 
 
+- (void) testOperatorFitArgumentsLocalized
+{
+	NSString *foo = @"test";
+	JATLocalizationCacheStatistics before = JATGetLocalizationCacheStatistics();
+	NSString *expansion = JATExpand(@"{foo|fit:10;center}", foo);
+	JATLocalizationCacheStatistics after = JATGetLocalizationCacheStatistics();
+
+	XCTAssertEqualObjects(expansion, @"   test   ", @"fit: operator failed at center padding.");
+	// The width and the mode are each looked up, as is the template unless the call site has it.
+	XCTAssertTrue((after.hits + after.misses) - (before.hits + before.misses) >= 2, @"fit: operator arguments should be localized.");
+}
+
+
 - (void) testOperatorFitExactFit
 {
 	NSString *foo = @"test string";
@@ -447,4 +744,116 @@
 	XCTAssertEqualObjects(expansion, @"string", @"trunc: operator failed at start truncation.");
 }
 
+
+- (void) testOperatorFitPadWide
+{
+	NSString *foo = @"test";
+	NSString *expansion = JATExpand(@"{foo|fit:150;center}", foo);
+	NSString *padding = [@"" stringByPaddingToLength:73 withString:@" " startingAtIndex:0];
+	NSString *expected = [NSString stringWithFormat:@"%@test%@", padding, padding];
+	
+	XCTAssertEqualObjects(expansion, expected, @"fit: operator failed with padding wider than the cached space run.");
+}
+
+
+- (void) testOperatorPadding
+{
+	NSString *expansion = JATExpand(@"[{0|padding}|{1|padding}|{2|padding}]", @0, @3, @(-2));
+	XCTAssertEqualObjects(expansion, @"[|   |]", @"padding operator failed.");
+	
+	expansion = JATExpand(@"{0|padding}", @100);
+	XCTAssertEqualObjects(expansion, [@"" stringByPaddingToLength:100 withString:@" " startingAtIndex:0], @"padding operator failed with a long run.");
+}
+
+
+#pragma mark Collection operators
+
+- (void) testOperatorLimit
+{
+	NSArray *values = @[@1, @2, @3, @4];
+	
+	NSString *expansion = JATExpand(@"{values|limit:2}", values);
+	XCTAssertEqualObjects(expansion, @"1, 2, …", @"limit: operator failed.");
+	
+	expansion = JATExpand(@"{values|limit:10}", values);
+	XCTAssertEqualObjects(expansion, @"1, 2, 3, 4", @"limit: operator failed with a limit larger than the collection.");
+	
+	expansion = JATExpand(@"{values|limit:0}", values);
+	XCTAssertEqualObjects(expansion, @"…", @"limit: operator failed with a limit of zero.");
+	
+	NSString *single = @"single";
+	expansion = JATExpand(@"{single|limit:0}", single);
+	XCTAssertEqualObjects(expansion, @"single", @"limit: operator should pass non-collections through.");
+}
+
+
+- (void) testOperatorJoin
+{
+	NSArray *path = @[@"usr", @"local", @"bin"];
+	
+	NSString *expansion = JATExpand(@"/{path|join:/}", path);
+	XCTAssertEqualObjects(expansion, @"/usr/local/bin", @"join: operator failed.");
+	
+	expansion = JATExpand(@"{path|join}", path);
+	XCTAssertEqualObjects(expansion, @"usrlocalbin", @"join operator failed with no argument.");
+	
+	expansion = JATExpand(@"{path|join:/|limit:2}", path);
+	XCTAssertEqualObjects(expansion, @"usr/local/…", @"join: operator failed when combined with limit:.");
+}
+
+
+- (void) testOperatorEach
+{
+	NSArray *tags = @[@"a", @"b", @"c"];
+	
+	NSString *expansion = JATExpand(@"{tags|limit:2|each:#{item}|join: }", tags);
+	XCTAssertEqualObjects(expansion, @"#a #b …", @"each: operator failed.");
+	
+	expansion = JATExpand(@"{tags|each:{index}={item|uppercase}}", tags);
+	XCTAssertEqualObjects(expansion, @"0=A, 1=B, 2=C", @"each: operator failed with index.");
+	
+	NSDictionary *dictionary = @{ @"key": @"value" };
+	expansion = JATExpand(@"{dictionary|each:{key}={item}}", dictionary);
+	XCTAssertEqualObjects(expansion, @"key=value", @"each: operator failed with a dictionary.");
+}
+
+
+- (void) testCollectionCoercion
+{
+	NSDictionary *dictionary = @{ @"key": @"value" };
+	NSSet *set = [NSSet setWithObject:@"member"];
+	NSOrderedSet *orderedSet = [NSOrderedSet orderedSetWithArray:@[@"a", @"b"]];
+	
+	NSString *expansion = JATExpand(@"{dictionary}; {set}; {orderedSet}", dictionary, set, orderedSet);
+	XCTAssertEqualObjects(expansion, @"key: value; member; a, b", @"Collection coercion failed.");
+}
+
+
+- (void) testCollectionFormattingIsBounded
+{
+	JATCountingElement *element = [JATCountingElement new];
+	NSMutableArray *elements = [NSMutableArray arrayWithCapacity:10000];
+	for (NSUInteger idx = 0; idx < 10000; idx++)
+	{
+		[elements addObject:element];
+	}
+	
+	sCountingElementCoercions = 0;
+	NSString *expansion = JATExpand(@"{elements|limit:3}", elements);
+	XCTAssertEqualObjects(expansion, @"x, x, x, …", @"limit: operator failed on a large collection.");
+	XCTAssertEqual(sCountingElementCoercions, (NSUInteger)3, @"limit: operator should only format the elements it keeps.");
+	
+	sCountingElementCoercions = 0;
+	expansion = JATExpand(@"{elements|trunc:10}", elements);
+	XCTAssertEqualObjects(expansion, @"x, x, x, x", @"trunc: operator failed on a large collection.");
+	XCTAssertTrue(sCountingElementCoercions <= 5, @"trunc: operator should stop formatting a collection past the truncation point.");
+	
+	JATSetCollectionOutputLimit(8);
+	sCountingElementCoercions = 0;
+	expansion = JATExpand(@"{elements}", elements);
+	JATSetCollectionOutputLimit(NSUIntegerMax);
+	XCTAssertEqualObjects(expansion, @"x, x, x, …", @"Collection output limit failed.");
+	XCTAssertTrue(sCountingElementCoercions <= 4, @"Collection output limit should stop formatting early.");
+}
+
 @end
@@ -13,6 +13,9 @@
 - (void) setUp
 {
 	JATResetWarnings();
+	// Tests count warnings, so report every occurrence.
+	JATSetWarningInterval(0);
+	JATResetWarningRateLimits();
 }
 
 
@@ -152,6 +155,26 @@
 }
 
 
+- (void) testLocalizationCache
+{
+	NSString *localizationFile = @"Localizable.strings";
+	NSBundle *bundle = [NSBundle bundleForClass:self.class];
+	NSString *expected = @"This is a template from Localizable.strings, not the one in the source code.";
+	
+	JATFlushTemplateCache();
+	JATLocalizationCacheStatistics before = JATGetLocalizationCacheStatistics();
+	for (NSUInteger idx = 0; idx < 3; idx++)
+	{
+		NSString *expansion = JATExpandFromTableInBundle(@"This is a template in the source code, not from {localizationFile}.", nil, bundle, localizationFile);
+		XCTAssertEqualObjects(expansion, expected, @"Cached localized template lookup failed.");
+	}
+	JATLocalizationCacheStatistics after = JATGetLocalizationCacheStatistics();
+	
+	XCTAssertEqual(after.misses - before.misses, (NSUInteger)1, @"Expected one localization cache miss.");
+	XCTAssertEqual(after.hits - before.hits, (NSUInteger)2, @"Expected two localization cache hits.");
+}
+
+
 - (void) testAppend
 {
 	NSString *foo = @"frob";
@@ -165,6 +188,445 @@
 }
 
 
+- (void) testBufferSink
+{
+	NSString *foo = @"g\u00e5s";
+	char buffer[64];
+	JATSink sink = JATSinkWithBuffer(buffer, sizeof buffer);
+	
+	XCTAssertTrue(JATWriteLiteral(&sink, @"{foo} \U0001F600 {{", foo), @"Writing to buffer sink failed.");
+	XCTAssertTrue(JATWriteLiteral(&sink, @"!"), @"Writing to buffer sink failed.");
+	XCTAssertEqual(strcmp(buffer, "g\xc3\xa5s \xf0\x9f\x98\x80 {!"), 0, @"Buffer sink produced incorrect UTF-8.");
+	XCTAssertEqual(sink.length, strlen(buffer), @"Buffer sink length is incorrect.");
+}
+
+
+- (void) testTruncatingBufferSink
+{
+	NSString *foo = @"banana";
+	char buffer[5];
+	JATSink sink = JATSinkWithBuffer(buffer, sizeof buffer);
+	
+	XCTAssertFalse(JATWriteLiteral(&sink, @"{foo}!", foo), @"Overflowing buffer sink should fail.");
+	XCTAssertEqual(strcmp(buffer, "bana"), 0, @"Buffer sink should be truncated and terminated.");
+}
+
+
+static bool CollectBytes(JATSink *sink, const char *bytes, size_t length)
+{
+	[(__bridge NSMutableData *)sink->context appendBytes:bytes length:length];
+	return true;
+}
+
+
+- (void) testFunctionSink
+{
+	NSMutableData *data = [NSMutableData data];
+	NSMutableString *template = [NSMutableString string];
+	for (NSUInteger idx = 0; idx < 500; idx++)
+	{
+		[template appendString:@"\u00e5{0}"];
+	}
+	
+	JATSink sink = JATSinkWithFunction(CollectBytes, (__bridge void *)data);
+	XCTAssertTrue(JATWriteLiteral(&sink, template, @"x"), @"Writing to function sink failed.");
+	
+	NSString *expected = [template stringByReplacingOccurrencesOfString:@"{0}" withString:@"x"];
+	NSString *result = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+	XCTAssertEqualObjects(result, expected, @"Function sink received incorrect UTF-8.");
+}
+
+
+- (void) testSinkEmbeddedNUL
+{
+	NSMutableData *data = [NSMutableData data];
+	NSString *value = [NSString stringWithFormat:@"a%Cb", (unichar)0];
+
+	JATSink sink = JATSinkWithFunction(CollectBytes, (__bridge void *)data);
+	XCTAssertTrue(JATWriteLiteral(&sink, @"[{value}]", value), @"Writing to function sink failed.");
+
+	XCTAssertEqualObjects(data, [NSData dataWithBytes:"[a\0b]" length:5], @"Sink output was cut short at an embedded NUL.");
+}
+
+
+- (void) testAsyncLog
+{
+	JATStartAsyncLog(16, kJATAsyncLogBlock);
+	JATAsyncLogStatistics before = JATGetAsyncLogStatistics();
+	
+	// More entries than the queue holds, so some of them have to wait.
+	for (NSUInteger idx = 0; idx < 40; idx++)
+	{
+		JATLog(@"Asynchronous log test {idx}.", idx);
+	}
+	JATFlushAsyncLog();
+	
+	JATAsyncLogStatistics after = JATGetAsyncLogStatistics();
+	JATStopAsyncLog();
+	
+	XCTAssertEqual(after.written - before.written, (NSUInteger)40, @"Expected all asynchronous log entries to be written after flushing.");
+	XCTAssertEqual(after.dropped, before.dropped, @"Asynchronous log entries should not be dropped with kJATAsyncLogBlock.");
+}
+
+
+- (void) testLogLevels
+{
+	JATLogLevel savedLevel = JATGetLogLevel();
+	NSUInteger evaluations = 0;
+	
+	JATSetLogLevel(kJATLogLevelWarning);
+	JATLogDebug(@"Disabled log level test {0}.", ++evaluations);
+	JATLogInfo(@"Disabled log level test {0}.", ++evaluations);
+	JATLogWarning(@"Enabled log level test {0}.", ++evaluations);
+	JATDebugAssert(++evaluations == 0, @"Disabled debug assertion.");
+	JATSetLogLevel(savedLevel);
+	
+	XCTAssertEqual(evaluations, (NSUInteger)1, @"Parameters of disabled log levels should not be evaluated.");
+}
+
+
+- (void) testBatchExpansion
+{
+	JATCompiledTemplate *compiled = [JATCompiledTemplate compiledTemplateWithString:@"[{name|fit:6}|{count|num:noloc}]"];
+	
+	// Enough rows to be expanded in parallel.
+	NSMutableArray *rows = [NSMutableArray array];
+	NSMutableArray *names = [NSMutableArray array];
+	NSMutableArray *counts = [NSMutableArray array];
+	NSMutableArray *expected = [NSMutableArray array];
+	for (NSUInteger idx = 0; idx < 1000; idx++)
+	{
+		NSString *name = [NSString stringWithFormat:@"r%lu", (unsigned long)idx];
+		[rows addObject:@{ @"name": name, @"count": @(idx * 3) }];
+		[names addObject:name];
+		[counts addObject:@(idx * 3)];
+		[expected addObject:[compiled expandWithParameters:rows.lastObject]];
+	}
+	NSString *expectedString = [expected componentsJoinedByString:@"\n"];
+	
+	XCTAssertEqualObjects([compiled expandRows:rows separator:@"\n"], expectedString, @"Batch row expansion failed.");
+	XCTAssertEqualObjects([compiled expandColumns:@{ @"name": names, @"count": counts } separator:@"\n"], expectedString, @"Batch column expansion failed.");
+	XCTAssertEqualObjects([compiled expandRows:[rows subarrayWithRange:(NSRange){ 0, 2 }] separator:nil], @"[r0    |0][r1    |3]", @"Small batch expansion failed.");
+	
+	char buffer[64];
+	JATSink sink = JATSinkWithBuffer(buffer, sizeof buffer);
+	XCTAssertFalse([compiled writeRows:rows separator:@"\n" toSink:&sink], @"Batch expansion to an overflowing sink should fail.");
+}
+
+
+- (void) testBatchExpansionArguments
+{
+	JATCompiledTemplate *compiled = [JATCompiledTemplate compiledTemplateWithString:@"{0}/{1}"];
+	NSDictionary *columns = @{ @"name": @[@"a", @"b"], @"count": @[@1, @2] };
+	XCTAssertEqualObjects([compiled expandColumns:columns separator:@" "], @"1/a 2/b", @"Positional parameters should refer to columns in name order.");
+
+	NSArray *rows = @[ @{ @"name": @"a" }, @"not a row" ];
+	XCTAssertThrowsSpecificNamed([compiled expandRows:rows separator:nil], NSException, NSInvalidArgumentException, @"Batch expansion should reject rows which aren't dictionaries.");
+	XCTAssertThrowsSpecificNamed([compiled expandColumns:@{ @0: @[@"a"] } separator:nil], NSException, NSInvalidArgumentException, @"Batch expansion should reject column names which aren't strings.");
+	XCTAssertThrowsSpecificNamed([compiled expandColumns:@{ @"name": @"a" } separator:nil], NSException, NSInvalidArgumentException, @"Batch expansion should reject columns which aren't arrays.");
+}
+
+
+- (void) testInstrumentation
+{
+	// The test target is built with JATEMPLATE_INSTRUMENTATION=1.
+	JATResetInstrumentation();
+	JATSetInstrumentationEnabled(true);
+	XCTAssertTrue(JATGetInstrumentationEnabled(), @"Instrumentation should be compiled into the test target.");
+	
+	NSString *template = @"Instrumentation test {0|uppercase}.";
+	for (NSUInteger idx = 0; idx < 3; idx++)
+	{
+		JATExpand(template, @"abc");
+	}
+	JATExpand(@"Instrumentation warning test {missing}.");
+	
+	// Records must not keep compiled templates alive.
+	__weak JATCompiledTemplate *weakCompiled;
+	@autoreleasepool
+	{
+		JATCompiledTemplate *compiled = [[JATCompiledTemplate alloc] initWithString:@"Instrumentation lifetime test {foo}."];
+		weakCompiled = compiled;
+		[compiled expandWithParameters:@{ @"foo": @"bar" }];
+	}
+	
+	JATSetInstrumentationEnabled(false);
+	NSDictionary *snapshot = JATGetInstrumentationSnapshot(true);
+	NSArray *templates = snapshot[@"templates"];
+	NSArray *operators = snapshot[@"operators"];
+	
+	XCTAssertNotNil(JATInstrumentationSnapshotJSON(snapshot), @"Instrumentation snapshot JSON failed.");
+	XCTAssertNil(weakCompiled, @"Instrumentation should not retain compiled templates.");
+	
+	NSDictionary *entry = [templates filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"template == %@", template]].firstObject;
+	XCTAssertEqualObjects(entry[@"count"], @3, @"Instrumentation template count failed.");
+	XCTAssertEqualObjects(entry[@"outputBytes"], @(3 * @"Instrumentation test ABC.".length * sizeof (unichar)), @"Instrumentation output bytes failed.");
+	XCTAssertEqualObjects(entry[@"warnings"], @0, @"Instrumentation warning count failed.");
+	XCTAssertGreaterThan([entry[@"totalNanoseconds"] unsignedLongLongValue], 0ULL, @"Instrumentation template time failed.");
+	XCTAssertLessThanOrEqual([entry[@"p50Nanoseconds"] unsignedLongLongValue], [entry[@"p99Nanoseconds"] unsignedLongLongValue], @"Instrumentation percentiles are out of order.");
+	
+	NSDictionary *warningEntry = [templates filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"template == %@", @"Instrumentation warning test {missing}."]].firstObject;
+	XCTAssertEqualObjects(warningEntry[@"count"], @1, @"Instrumentation template count failed for template with warning.");
+	XCTAssertEqualObjects(warningEntry[@"warnings"], @1, @"Instrumentation warning count failed for template with warning.");
+	
+	NSDictionary *operator = [operators filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"operator == %@", @"uppercase"]].firstObject;
+	XCTAssertEqualObjects(operator[@"count"], @3, @"Instrumentation operator count failed.");
+	XCTAssertGreaterThan([operator[@"totalNanoseconds"] unsignedLongLongValue], 0ULL, @"Instrumentation operator time failed.");
+	XCTAssertLessThanOrEqual([operator[@"totalNanoseconds"] unsignedLongLongValue], [entry[@"totalNanoseconds"] unsignedLongLongValue], @"Operator time should be included in template time.");
+	
+	NSDictionary *after = JATGetInstrumentationSnapshot(false);
+	XCTAssertEqual([after[@"templates"] count] + [after[@"operators"] count], (NSUInteger)0, @"Instrumentation snapshot should be empty after reset.");
+}
+
+
+- (void) testWarningRateLimit
+{
+	JATSetWarningInterval(0.25);
+	JATWarningStatistics before = JATGetWarningStatistics();
+	
+	for (NSUInteger idx = 0; idx < 5; idx++)
+	{
+		JATExpand(@"Warning rate limit test {missing}.", idx);
+	}
+	
+	JATWarningStatistics after = JATGetWarningStatistics();
+	XCTAssertEqual(after.occurrences - before.occurrences, (NSUInteger)5, @"Warning occurrence count failed.");
+	XCTAssertEqual(after.reported - before.reported, (NSUInteger)1, @"Repeated warnings should be reported once per interval.");
+	XCTAssertEqual(JATGetWarnings().count, (NSUInteger)1, @"Repeated warnings should be reported once per interval.");
+	
+	// Once the interval has passed, the next report counts the suppressed repeats.
+	[NSThread sleepForTimeInterval:0.3];
+	JATExpand(@"Warning rate limit test {missing}.", 5);
+	JATSetWarningInterval(0);
+	
+	NSArray *warnings = JATGetWarnings();
+	XCTAssertEqual(warnings.count, (NSUInteger)2, @"Warning should be reported again after the interval.");
+	XCTAssertTrue([warnings.lastObject hasSuffix:@"(5 occurrences since last reported)"], @"Report after the interval should count the suppressed repeats.");
+}
+
+
+- (void) testCompiledTemplate
+{
+	JATCompiledTemplate *compiled = [JATCompiledTemplate compiledTemplateWithString:@"{foo} and {1|uppercase}"];
+	NSString *expansion1 = [compiled expandWithParameters:@{ @"foo": @"frob", @1: @"banana" }];
+	NSString *expansion2 = [compiled expandWithParameters:@{ @"foo": @"bar", @1: @"split" }];
+	
+	XCTAssertEqualObjects(expansion1, @"frob and BANANA", @"Compiled template expansion failed.");
+	XCTAssertEqualObjects(expansion2, @"bar and SPLIT", @"Repeated compiled template expansion failed.");
+}
+
+
+- (void) testTemplateCache
+{
+	JATCompiledTemplate *compiled1 = [JATCompiledTemplate compiledTemplateWithString:@"Cached {foo}"];
+	JATCompiledTemplate *compiled2 = [JATCompiledTemplate compiledTemplateWithString:[NSMutableString stringWithString:@"Cached {foo}"]];
+	
+	XCTAssertEqual(compiled1, compiled2, @"Template cache should return the same compiled template for equal strings.");
+}
+
+
+- (void) testTemplateCatalog
+{
+	NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"JATemplateTests.jatcatalog"];
+	NSDictionary *templates = @{ @"greeting": @"Hello, {name|uppercase}! {{{0}}}", @"broken": @"Unbalanced {name" };
+	NSError *error;
+	
+	XCTAssertTrue(JATWriteTemplateCatalog(templates, path, &error), @"Writing template catalog failed.");
+	JATTemplateCatalog *catalog = [JATTemplateCatalog catalogWithContentsOfFile:path error:&error];
+	[NSFileManager.defaultManager removeItemAtPath:path error:NULL];
+	
+	XCTAssertNotNil(catalog, @"Loading template catalog failed.");
+	XCTAssertEqual(catalog.count, (NSUInteger)2, @"Template catalog has the wrong number of templates.");
+	XCTAssertNil([catalog compiledTemplateForKey:@"missing"], @"Template catalog lookup of missing key should fail.");
+	
+	NSString *expansion = [[catalog compiledTemplateForKey:@"greeting"] expandWithParameters:@{ @"name": @"catalog", @0: @"x" }];
+	XCTAssertEqualObjects(expansion, @"Hello, CATALOG! {x}", @"Expansion of catalog template failed.");
+	
+	expansion = [[catalog compiledTemplateForKey:@"broken"] expandWithParameters:@{ @"name": @"catalog" }];
+	XCTAssertEqualObjects(expansion, @"Unbalanced {name", @"Catalog template with unbalanced braces should be unchanged after expansion.");
+	XCTAssertEqual(JATGetWarnings().count, (NSUInteger)1, @"Expected the catalog to preserve the syntax warning for unbalanced braces.");
+}
+
+
+- (void) testBundleTemplateCatalog
+{
+	// JATemplateTestsCatalog.jatcatalog is compiled into the test bundle from JATemplateTestsCatalog.strings at build time.
+	NSBundle *bundle = [NSBundle bundleForClass:self.class];
+	NSString *path = [bundle pathForResource:@"JATemplateTestsCatalog" ofType:@"jatcatalog"];
+	XCTAssertNotNil(path, @"Test bundle is missing its template catalog.");
+
+	NSError *error;
+	JATTemplateCatalog *catalog = [JATTemplateCatalog catalogWithContentsOfFile:path error:&error];
+	XCTAssertNotNil(catalog, @"Loading template catalog from test bundle failed: %@", error);
+	XCTAssertEqual(catalog.count, (NSUInteger)3, @"Test bundle template catalog has the wrong number of templates.");
+	XCTAssertNotNil([catalog compiledTemplateForKey:@"catalog.escapes"], @"Catalog template with escapes and syntax errors failed validation.");
+
+	NSString *name = @"tests";
+	NSUInteger count = 3;
+	NSString *expansion = JATExpandFromTableInBundle(@"catalog.greeting", @"JATemplateTestsCatalog", bundle, name);
+	XCTAssertEqualObjects(expansion, @"Hello from the catalog, TESTS!", @"Localized expansion from bundle template catalog failed.");
+
+	expansion = JATExpandFromTableInBundle(@"catalog.count", @"JATemplateTestsCatalog", bundle, count);
+	XCTAssertEqualObjects(expansion, @"3 templates", @"Localized expansion from bundle template catalog failed.");
+
+	expansion = JATExpandFromTableInBundle(@"catalog.escapes", @"JATemplateTestsCatalog", bundle, name);
+	XCTAssertEqualObjects(expansion, @"{tests} {broken", @"Localized expansion of bundle catalog template with escapes failed.");
+
+	// Keys which aren't in the catalog fall back to the (missing) strings table, which returns the key.
+	expansion = JATExpandFromTableInBundle(@"catalog.missing {name}", @"JATemplateTestsCatalog", bundle, name);
+	XCTAssertEqualObjects(expansion, @"catalog.missing tests", @"Localized expansion of key missing from bundle template catalog failed.");
+
+	JATFlushTemplateCatalogs();
+	expansion = JATExpandFromTableInBundle(@"catalog.greeting", @"JATemplateTestsCatalog", bundle, name);
+	XCTAssertEqualObjects(expansion, @"Hello from the catalog, TESTS!", @"Localized expansion after flushing template catalogs failed.");
+}
+
+
+- (void) testMutableTemplate
+{
+	NSString *foo = @"frob";
+	NSMutableString *template = [NSMutableString stringWithString:@"{foo} once"];
+	NSString *expansion1 = JATExpandLiteral(template, foo);
+	[template setString:@"{foo} twice"];
+	NSString *expansion2 = JATExpandLiteral(template, foo);
+	
+	XCTAssertEqualObjects(expansion1, @"frob once", @"Expansion of mutable template failed.");
+	XCTAssertEqualObjects(expansion2, @"frob twice", @"Compiled template cache was confused by mutated template.");
+}
+
+
+- (void) testRepeatedSyntaxWarning
+{
+	NSString *expansion1 = JATExpandLiteral(@"{foo");
+	NSString *expansion2 = JATExpandLiteral(@"{foo");
+	
+	XCTAssertEqual(JATGetWarnings().count, (NSUInteger)2, @"Expected a syntax warning each time a cached template with unbalanced braces is expanded.");
+	XCTAssertEqualObjects(expansion1, @"{foo", @"Template with unbalanced braces should be unchanged after expansion.");
+	XCTAssertEqualObjects(expansion2, @"{foo", @"Template with unbalanced braces should be unchanged after expansion.");
+}
+
+
+- (void) testFailedSubstitutionFallback
+{
+	NSString *bar = @"banana";
+	NSString *expansion = JATExpandLiteral(@"{foo|if:{bar}}", bar);
+	
+	XCTAssertEqualObjects(expansion, @"{foo|if:banana}", @"Nested substitution inside a failed substitution should still be expanded.");
+}
+
+
+- (void) testOperatorVariables
+{
+	NSNumber *flag = @YES;
+	NSString *name = @"banana";
+	NSString *expansion = JATExpand(@"{flag|if:{name}/{1}}", flag, name);
+	
+	XCTAssertEqualObjects(expansion, @"banana/banana", @"Operator variables lookup failed.");
+}
+
+
+- (void) testNonIdentifierParameter
+{
+	NSString *expansion = JATExpand(@"{0}, {1}", @"foo".uppercaseString, @( 3 ));
+	
+	XCTAssertEqualObjects(expansion, @"FOO, 3", @"Positional substitution of non-identifier parameters failed.");
+}
+
+
+- (void) testCallSiteReuse
+{
+	NSArray *fruits = @[@"apple", @"banana", @"cherry"];
+	NSMutableArray *expansions = [NSMutableArray array];
+	for (NSString *fruit in fruits)
+	{
+		[expansions addObject:JATExpand(@"{fruit}/{0}", fruit)];
+	}
+	
+	NSArray *expected = @[@"apple/apple", @"banana/banana", @"cherry/cherry"];
+	XCTAssertEqualObjects(expansions, expected, @"Repeated expansion from the same call site failed.");
+}
+
+
+- (void) testOldEntryPoint
+{
+	NSString *foo = @"banana";
+	NSString *expansion = JAT_DoExpandTemplateUsingMacroKeysAndValues(@"{foo}", (JATNameArray){ @"@( foo )" }, (JATParameterArray){ foo }, 1);
+	
+	XCTAssertEqualObjects(expansion, @"banana", @"Expansion without a call site failed.");
+}
+
+
+- (void) testUnboxedParameters
+{
+	const char *missing = NULL;
+	NSString *expansion = JATExpand(@"{0} {1} {2|if:yes;no} {3} {4|uppercase} {5|num:noloc}", -42, 42u, false, missing, "abc", 2.5);
+	
+	XCTAssertEqualObjects(expansion, @"-42 42 no (null) ABC 2.5", @"Expansion with unboxed parameters failed.");
+}
+
+
+- (void) testLongLiteralRuns
+{
+	NSString *foo = @"X";
+	NSMutableString *template = [NSMutableString string];
+	NSMutableString *expected = [NSMutableString string];
+	for (NSUInteger idx = 0; idx < 40; idx++)
+	{
+		NSString *padding = [@"" stringByPaddingToLength:idx withString:@"abcdefg" startingAtIndex:0];
+		[template appendFormat:@"%@{foo}%@{{", padding, padding];
+		[expected appendFormat:@"%@X%@{", padding, padding];
+	}
+	
+	NSString *expansion = JATExpandLiteral(template, foo);
+	
+	XCTAssertEqualObjects(expansion, expected, @"Substitution after long literal runs failed.");
+}
+
+
+- (void) testEightBitOutput
+{
+	NSString *latin1 = @"café";
+	NSString *wide = @"日本";
+	
+	NSString *expansion = JATExpand(@"[{latin1}] [{latin1|uppercase}]", latin1);
+	XCTAssertEqualObjects(expansion, @"[café] [CAFÉ]", @"Expansion with Latin-1 replacements failed.");
+	
+	expansion = JATExpand(@"[{latin1}] [{wide}] [{latin1}]", latin1, wide);
+	XCTAssertEqualObjects(expansion, @"[café] [日本] [café]", @"Expansion switching from Latin-1 to UTF-16 output failed.");
+	
+	NSString *empty = @"";
+	expansion = JATExpand(@"{empty}{empty}", empty);
+	XCTAssertEqualObjects(expansion, @"", @"Expansion with empty Latin-1 output failed.");
+	
+	expansion = JATExpand(@"→ {latin1} ←", latin1);
+	XCTAssertEqualObjects(expansion, @"→ café ←", @"Expansion of a non-Latin-1 template failed.");
+	
+	NSArray *split = JATSplitArgumentString([NSString stringWithUTF8String:"foo;{bar;baz};qux"], ';');
+	XCTAssertEqualObjects(split, (@[@"foo", @"{bar;baz}", @"qux"]), @"JATSplitArgumentString() failed with an eight-bit string.");
+}
+
+
+- (void) testExpansionBuffer
+{
+	// Operators expand templates of their own while the outer expansion is being built.
+	NSString *arrow = @"→";
+	NSString *expansion = JATExpand(@"<{0|plural:{arrow} one;{arrow} many}> <{1|plural:{arrow} one;{arrow} many}>", @1, @2, arrow);
+	XCTAssertEqualObjects(expansion, @"<→ one> <→ many>", @"Expansion with nested expansions failed.");
+	
+	// Larger than the per-thread buffer is allowed to stay.
+	NSString *large = [@"" stringByPaddingToLength:100000 withString:@"abc" startingAtIndex:0];
+	for (NSUInteger idx = 0; idx < 2; idx++)
+	{
+		expansion = JATExpand(@"[{large}]", large);
+		XCTAssertEqual(expansion.length, large.length + 2, @"Expansion with large output failed.");
+		XCTAssertTrue([expansion hasPrefix:@"[abcabc"] && [expansion hasSuffix:@"]"], @"Expansion with large output failed.");
+	}
+	
+	expansion = JATExpand(@"[{large}] [{arrow}]", large, arrow);
+	XCTAssertTrue([expansion hasSuffix:@"] [→]"], @"Expansion widening large output failed.");
+}
+
+
 - (void) testSplitBasic
 {
 	NSArray *split = JATSplitArgumentString(@"foo;bar", ';');